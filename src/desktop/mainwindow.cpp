@@ -48,6 +48,7 @@
 
 #ifndef NDEBUG
 #include "core/tile.h"
+#include "core/tilepool.h"
 #endif
 
 #ifdef Q_OS_OSX
@@ -235,7 +236,12 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 		QLabel *tilemem = new QLabel(this);
 		QTimer *tilememtimer = new QTimer(this);
 		connect(tilememtimer, &QTimer::timeout, [tilemem]() {
-			tilemem->setText(QStringLiteral("Tiles: %1 Mb").arg(paintcore::TileData::megabytesUsed(), 0, 'f', 2));
+			const paintcore::TilePool::Stats pool = paintcore::TilePool::stats();
+			tilemem->setText(QStringLiteral("Tiles: %1 Mb (pooled: %2 Mb, %3 refs/tile)")
+				.arg(paintcore::TileData::megabytesUsed(), 0, 'f', 2)
+				.arg(pool.bytes() / float(1024*1024), 0, 'f', 2)
+				.arg(pool.ratio(), 0, 'f', 2)
+			);
 		});
 		tilememtimer->setInterval(1000);
 		tilememtimer->start(1000);
@@ -355,6 +361,7 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 
 	connect(m_doc->client(), &net::Client::serverMessage, m_netstatus, &widgets::NetStatus::alertMessage);
 	connect(m_doc, &Document::catchupProgress, m_netstatus, &widgets::NetStatus::setCatchupProgress);
+	connect(m_doc, &Document::snapshotProgress, m_netstatus, &widgets::NetStatus::setCatchupProgress);
 
 	connect(m_doc->client(), &net::Client::serverStatusUpdate, sessionHistorySize, [sessionHistorySize](int size) {
 		sessionHistorySize->setText(QString("%1 MB").arg(size / float(1024*1024), 0, 'f', 2));
@@ -24,6 +24,8 @@
 #include <QCache>
 #include <QtMath>
 
+#include <cstring>
+
 namespace brushes {
 
 namespace {
@@ -32,7 +34,29 @@ template<typename T> T square(T x) { return x*x; }
 
 typedef QVector<float> LUT;
 static const int LUT_RADIUS = 128;
-static QCache<int, LUT> LUT_CACHE;
+
+// The caches are per-thread, since dabs can be drawn in several threads at once
+// (e.g. when building a recording index while the canvas is in use)
+static thread_local QCache<int, LUT> LUT_CACHE;
+
+// Maximum total size (in bytes) of the cached dab masks (per thread)
+static const int MASK_CACHE_SIZE = 4 * 1024 * 1024;
+
+//! A brush mask in the per-thread scratch buffer
+struct ScratchMask {
+	int offset;
+	int diameter;
+	const uchar *data;
+};
+
+//! Get a per-thread scratch buffer of at least the given size
+static uchar *scratchBuffer(int size)
+{
+	static thread_local QVector<uchar> buffer;
+	if(buffer.size() < size)
+		buffer.resize(size);
+	return buffer.data();
+}
 
 // Generate a lookup table for Gimp style exponential brush shape
 // The value at r² (where r is distance from brush center, scaled to LUT_RADIUS) is
@@ -62,13 +86,13 @@ static LUT cachedGimpStyleBrushLUT(float hardness)
 	return *LUT_CACHE[h];
 }
 
-static paintcore::BrushStamp makeMask(qreal r, qreal hardness, qreal opacity)
+static ScratchMask makeMask(qreal r, qreal hardness, qreal opacity)
 {
 	r /= 2.0;
 	opacity = opacity * 255;
 
 	// generate mask
-	QVector<uchar> data;
+	uchar *data;
 	int diameter;
 	int stampOffset;
 
@@ -76,8 +100,8 @@ static paintcore::BrushStamp makeMask(qreal r, qreal hardness, qreal opacity)
 		// special case for single pixel brush
 		diameter=3;
 		stampOffset = -1;
-		data.resize(3*3);
-		data.fill(0);
+		data = scratchBuffer(3*3);
+		memset(data, 0, 3*3);
 		data[4] = opacity;
 
 	} else {
@@ -106,8 +130,8 @@ static paintcore::BrushStamp makeMask(qreal r, qreal hardness, qreal opacity)
 		else if(r<4)
 			fudge=0.8;
 
-		data.resize(square(diameter));
-		uchar *ptr = data.data();
+		data = scratchBuffer(square(diameter));
+		uchar *ptr = data;
 
 		for(int y=0;y<diameter;++y) {
 			const qreal yy = square(y-r+offset);
@@ -118,10 +142,10 @@ static paintcore::BrushStamp makeMask(qreal r, qreal hardness, qreal opacity)
 		}
 	}
 
-	return paintcore::BrushStamp { stampOffset, stampOffset, paintcore::BrushMask(diameter, data) };
+	return ScratchMask { stampOffset, diameter, data };
 }
 
-static paintcore::BrushStamp makeHighresMask(qreal r, qreal hardness, qreal opacity)
+static ScratchMask makeHighresMask(qreal r, qreal hardness, qreal opacity)
 {
 	// we calculate a double sized brush and downsample
 	opacity = opacity * (255 / 4); // opacity of each subsample
@@ -140,8 +164,8 @@ static paintcore::BrushStamp makeHighresMask(qreal r, qreal hardness, qreal opac
 	const LUT lut = cachedGimpStyleBrushLUT(hardness);
 	const float lut_scale = square((LUT_RADIUS-1) / r);
 
-	QVector<uchar> data(square(diameter));
-	uchar *ptr = data.data();
+	uchar *data = scratchBuffer(square(diameter));
+	uchar *ptr = data;
 
 	for(int y=0;y<diameter;++y) {
 		const qreal yy0 = square(y*2-r+offset);
@@ -166,17 +190,17 @@ static paintcore::BrushStamp makeHighresMask(qreal r, qreal hardness, qreal opac
 		}
 	}
 
-	return paintcore::BrushStamp { stampOffset, stampOffset, paintcore::BrushMask(diameter, data) };
+	return ScratchMask { stampOffset, diameter, data };
 }
 
-static paintcore::BrushMask offsetMask(const paintcore::BrushMask &mask, float xfrac, float yfrac)
+static paintcore::BrushMask offsetMask(const ScratchMask &mask, float xfrac, float yfrac)
 {
 #ifndef NDEBUG
 	if(xfrac<0 || xfrac>1 || yfrac<0 || yfrac>1)
 		qWarning("offsetMask(mask, %f, %f): offset out of bounds!", xfrac, yfrac);
 #endif
 
-	const int diameter = mask.diameter();
+	const int diameter = mask.diameter;
 
 	const qreal kernel[] = {
 		xfrac*yfrac,
@@ -190,7 +214,7 @@ static paintcore::BrushMask offsetMask(const paintcore::BrushMask &mask, float x
 		qWarning("offset kernel sum error=%f", kernelsum);
 #endif
 
-	const uchar *src = mask.data();
+	const uchar *src = mask.data;
 
 	QVector<uchar> data(square(diameter));
 	uchar *ptr = data.data();
@@ -226,11 +250,13 @@ static paintcore::BrushMask offsetMask(const paintcore::BrushMask &mask, float x
 
 paintcore::BrushStamp makeGimpStyleBrushStamp(const QPointF &point, qreal radius, qreal hardness, qreal opacity)
 {
-	paintcore::BrushStamp s;
+	ScratchMask mask;
 	if(radius < 8) // optimization: don't bother with a high resolution mask for large brushes
-		s = makeHighresMask(radius, hardness, opacity);
+		mask = makeHighresMask(radius, hardness, opacity);
 	else
-		s = makeMask(radius, hardness, opacity);
+		mask = makeMask(radius, hardness, opacity);
+
+	paintcore::BrushStamp s { mask.offset, mask.offset, paintcore::BrushMask() };
 
 	const float fx = floor(point.x());
 	const float fy = floor(point.y());
@@ -252,11 +278,59 @@ paintcore::BrushStamp makeGimpStyleBrushStamp(const QPointF &point, qreal radius
 	} else
 		yfrac -= 0.5;
 
-	s.mask = offsetMask(s.mask, xfrac, yfrac);
+	s.mask = offsetMask(mask, xfrac, yfrac);
 
 	return s;
 }
 
+namespace {
+
+/**
+ * @brief Get a (possibly cached) brush stamp for a classic dab
+ *
+ * Since dab coordinates are in quarter pixels, the mask depends only on the dab's
+ * size, hardness, opacity and the subpixel offset. The stamps are generated
+ * for the subpixel offset and then moved into place, so the result is
+ * identical to calling makeGimpStyleBrushStamp with the full coordinates.
+ *
+ * @param x dab x coordinate (multiplied by 4)
+ * @param y dab y coordinate (multiplied by 4)
+ * @param dab the dab parameters
+ */
+paintcore::BrushStamp cachedClassicBrushStamp(int x, int y, const protocol::ClassicBrushDab &dab)
+{
+	static thread_local QCache<quint64, paintcore::BrushStamp> cache(MASK_CACHE_SIZE);
+
+	const int subX = x & 3;
+	const int subY = y & 3;
+	const quint64 key =
+		quint64(dab.size) << 20 |
+		quint64(dab.hardness) << 12 |
+		quint64(dab.opacity) << 4 |
+		quint64(subX) << 2 |
+		quint64(subY);
+
+	paintcore::BrushStamp s;
+	const paintcore::BrushStamp *cached = cache.object(key);
+	if(cached) {
+		s = *cached;
+	} else {
+		s = makeGimpStyleBrushStamp(
+			QPointF(subX/4.0, subY/4.0),
+			dab.size/256.0,
+			dab.hardness/255.0,
+			dab.opacity/255.0
+		);
+		cache.insert(key, new paintcore::BrushStamp(s), square(s.mask.diameter()));
+	}
+
+	s.left += (x - subX) / 4;
+	s.top += (y - subY) / 4;
+	return s;
+}
+
+}
+
 void drawClassicBrushDabs(const protocol::DrawDabsClassic &dabs, paintcore::EditableLayer layer, int sublayer)
 {
 	if(dabs.dabs().isEmpty()) {
@@ -276,21 +350,18 @@ void drawClassicBrushDabs(const protocol::DrawDabsClassic &dabs, paintcore::Edit
 		blendmode = paintcore::BlendMode::MODE_NORMAL;
 	}
 
+	QRect dirty;
 	int lastX = dabs.originX();
 	int lastY = dabs.originY();
 	for(const protocol::ClassicBrushDab &d : dabs.dabs()) {
 		const int nextX = lastX + d.x;
 		const int nextY = lastY + d.y;
-		const paintcore::BrushStamp bs = makeGimpStyleBrushStamp(
-			QPointF(nextX/4.0, nextY/4.0),
-			d.size/256.0,
-			d.hardness/255.0,
-			d.opacity/255.0
-		);
-		layer.putBrushStamp(bs, color, blendmode);
+		dirty |= layer.drawBrushStamp(cachedClassicBrushStamp(nextX, nextY, d), color, blendmode);
 		lastX = nextX;
 		lastY = nextY;
 	}
+
+	layer.markDirty(dirty);
 }
 
 }
@@ -72,6 +72,7 @@ void drawPixelBrushDabs(const protocol::DrawDabsPixel &dabs, paintcore::Editable
 
 	paintcore::BrushMask mask;
 	int lastSize = -1, lastOpacity = 0;
+	QRect dirty;
 
 	int lastX = dabs.originX();
 	int lastY = dabs.originY();
@@ -87,7 +88,7 @@ void drawPixelBrushDabs(const protocol::DrawDabsPixel &dabs, paintcore::Editable
 		}
 
 		const int offset = d.size/2;
-		layer.putBrushStamp(
+		dirty |= layer.drawBrushStamp(
 			paintcore::BrushStamp { nextX-offset, nextY-offset, mask },
 			color,
 			blendmode
@@ -96,6 +97,8 @@ void drawPixelBrushDabs(const protocol::DrawDabsPixel &dabs, paintcore::Editable
 		lastX = nextX;
 		lastY = nextY;
 	}
+
+	layer.markDirty(dirty);
 }
 
 }
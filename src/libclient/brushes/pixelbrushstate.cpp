@@ -201,12 +201,12 @@ void PixelBrushState::addDab(int x, int y, qreal pressure, const paintcore::Laye
 		m_lastDabY = y;
 	}
 
-	m_lastDab->dabs() << protocol::PixelBrushDab {
+	m_lastDab->appendDab(protocol::PixelBrushDab {
 		static_cast<decltype(protocol::PixelBrushDab::x)>(x - m_lastDabX),
 		static_cast<decltype(protocol::PixelBrushDab::y)>(y - m_lastDabY),
 		static_cast<decltype(protocol::PixelBrushDab::size)>(brushSize),
 		static_cast<decltype(protocol::PixelBrushDab::opacity)>(opacity)
-	};
+	});
 
 	m_lastDabX = x;
 	m_lastDabY = y;
@@ -343,14 +343,12 @@ QImage CanvasModel::selectionToImage(int layerId) const
 	}
 
 	const paintcore::Layer *layer = m_layerstack->getLayer(layerId);
-	if(layer)
-		img = layer->toImage();
-	else
-		img = toImage(layerId==0);
-
-
 	if(m_selection) {
-		img = img.copy(m_selection->boundingRect().intersected(QRect(0, 0, img.width(), img.height())));
+		const QRect rect = m_selection->boundingRect().intersected(QRect(QPoint(), m_layerstack->size()));
+		if(layer)
+			img = layer->toImage(rect);
+		else
+			img = toImage(layerId==0).copy(rect);
 
 		if(!m_selection->isAxisAlignedRectangle()) {
 			// Mask out pixels outside the selection
@@ -362,6 +360,12 @@ QImage CanvasModel::selectionToImage(int layerId) const
 
 			mp.drawImage(qMin(0, maskBounds.left()), qMin(0, maskBounds.top()), mask);
 		}
+
+	} else if(layer) {
+		img = layer->toImage();
+
+	} else {
+		img = toImage(layerId==0);
 	}
 
 	return img;
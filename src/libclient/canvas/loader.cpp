@@ -31,6 +31,7 @@
 #include "../libshared/net/meta.h"
 #include "../libshared/net/meta2.h"
 #include "../libshared/net/image.h"
+#include "../libshared/net/pixelcodec.h"
 
 #include <QDebug>
 #include <QGuiApplication>
@@ -207,7 +208,7 @@ MessageList SnapshotLoader::loadInitCommands()
 	else
 		msgs.append(MessagePtr(new protocol::CanvasBackground(
 			m_contextId,
-			qCompress(reinterpret_cast<const uchar*>(m_layers->background().constData()), paintcore::Tile::BYTES)
+			protocol::compressPixels(reinterpret_cast<const uchar*>(m_layers->background().constData()), paintcore::Tile::BYTES, 4)
 			)));
 
 	// Preset default layer
@@ -269,6 +270,9 @@ MessageList SnapshotLoader::loadInitCommands()
 			if(acl.locked || acl.tier != canvas::Tier::Guest || !acl.exclusive.isEmpty())
 				msgs << MessagePtr(new protocol::LayerACL(m_contextId, layer->id(), acl.locked, int(acl.tier), acl.exclusive));
 		}
+
+		if(m_progressCallback)
+			m_progressCallback((i+1) * 100 / m_layers->layerCount());
 	}
 
 	// Create annotations
@@ -26,6 +26,8 @@
 
 #include "../libshared/net/message.h"
 
+#include <functional>
+
 namespace paintcore {
 	class LayerStack;
 }
@@ -171,6 +173,14 @@ public:
 	//! Include a pinned chat message
 	void setPinnedMessage(const QString &message) { m_pinnedMessage = message; }
 
+	/**
+	 * @brief Set a function to call with the progress percentage
+	 *
+	 * The function is called from the thread loadInitCommands runs in
+	 * after each layer has been processed.
+	 */
+	void setProgressCallback(const std::function<void(int)> &callback) { m_progressCallback = callback; }
+
 	protocol::MessageList loadInitCommands() override;
 	QString filename() const override { return QString(); }
 	QString errorMessage() const override { return QString(); }
@@ -182,6 +192,7 @@ private:
 
 	QString m_pinnedMessage;
 	int m_defaultLayer;
+	std::function<void(int)> m_progressCallback;
 
 	uint8_t m_contextId;
 
@@ -0,0 +1,259 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "payloaddecoder.h"
+
+#include "../libshared/net/image.h"
+#include "../libshared/net/pixelcodec.h"
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QRunnable>
+#include <QThreadPool>
+
+namespace canvas {
+
+struct PayloadDecoder::Job {
+	enum State { Pending, Running, Done, Cancelled };
+
+	// Input (copied in the owner thread)
+	QByteArray compressed;
+	int expectedLength;
+	int contextId;
+	bool isTile;
+
+	// Output
+	QByteArray pixels;
+	paintcore::Tile tile;
+	bool ok = false;
+
+	State state = Pending;
+
+	void decode()
+	{
+		// Oversized payloads are rejected before anything is allocated
+		const QByteArray data = protocol::decompressPixels(compressed, expectedLength);
+		compressed = QByteArray();
+
+		if(data.length() != expectedLength)
+			return;
+
+		if(isTile) {
+			tile = paintcore::Tile(data, contextId);
+			// Prime the metadata cache so interning the tile is cheap
+			tile.contentHash();
+		} else {
+			pixels = data;
+		}
+		ok = true;
+	}
+};
+
+struct PayloadDecoder::Queue {
+	QMutex mutex;
+	QWaitCondition done;
+	QQueue<QSharedPointer<Job>> pending;
+	int workers = 0;
+};
+
+/**
+ * A worker keeps decoding jobs until the queue is empty.
+ *
+ * The queue is shared with the decoder, so workers may safely finish
+ * after the decoder itself has been deleted.
+ */
+class PayloadDecoder::Worker : public QRunnable
+{
+public:
+	explicit Worker(const QSharedPointer<Queue> &queue) : m_queue(queue) { }
+
+	void run() override
+	{
+		QMutexLocker lock(&m_queue->mutex);
+		while(!m_queue->pending.isEmpty()) {
+			QSharedPointer<Job> job = m_queue->pending.dequeue();
+			if(job->state != Job::Pending)
+				continue;
+
+			job->state = Job::Running;
+			lock.unlock();
+
+			job->decode();
+
+			lock.relock();
+			job->state = Job::Done;
+			m_queue->done.wakeAll();
+		}
+		--m_queue->workers;
+	}
+
+private:
+	QSharedPointer<Queue> m_queue;
+};
+
+static int maxWorkers()
+{
+	// Leave one thread for the GUI
+	return qMax(1, QThreadPool::globalInstance()->maxThreadCount() - 1);
+}
+
+PayloadDecoder::PayloadDecoder()
+	: m_queue(new Queue), m_outstandingBytes(0)
+{
+}
+
+PayloadDecoder::~PayloadDecoder()
+{
+	clear();
+}
+
+bool PayloadDecoder::prefetch(const protocol::MessagePtr &msg)
+{
+	if(m_entries.contains(&(*msg)))
+		return true;
+
+	QSharedPointer<Job> job;
+
+	if(msg->type() == protocol::MSG_PUTTILE) {
+		const auto &cmd = msg.cast<protocol::PutTile>();
+		if(cmd.isSolidColor())
+			return true;
+
+		job.reset(new Job);
+		job->compressed = cmd.image();
+		job->expectedLength = paintcore::Tile::BYTES;
+		job->isTile = true;
+
+	} else if(msg->type() == protocol::MSG_PUTIMAGE) {
+		const auto &cmd = msg.cast<protocol::PutImage>();
+
+		job.reset(new Job);
+		job->compressed = cmd.image();
+		job->expectedLength = cmd.width() * cmd.height() * 4;
+		job->isTile = false;
+
+	} else {
+		return true;
+	}
+
+	if(m_entries.size() >= MAX_OUTSTANDING || m_outstandingBytes + job->expectedLength > MAX_OUTSTANDING_BYTES) {
+		// A single oversized image is still accepted when nothing else is waiting
+		if(!m_entries.isEmpty())
+			return false;
+	}
+
+	job->contextId = msg->contextId();
+
+	m_entries[&(*msg)] = Entry { msg, job };
+	m_outstandingBytes += job->expectedLength;
+
+	QMutexLocker lock(&m_queue->mutex);
+	m_queue->pending.enqueue(job);
+	if(m_queue->workers < maxWorkers()) {
+		++m_queue->workers;
+		QThreadPool::globalInstance()->start(new Worker(m_queue));
+	}
+
+	return true;
+}
+
+QSharedPointer<PayloadDecoder::Job> PayloadDecoder::takeJob(const protocol::Message *msg)
+{
+	const auto i = m_entries.find(msg);
+	if(i == m_entries.end())
+		return QSharedPointer<Job>();
+
+	QSharedPointer<Job> job = i->job;
+	m_entries.erase(i);
+	m_outstandingBytes -= job->expectedLength;
+
+	QMutexLocker lock(&m_queue->mutex);
+	switch(job->state) {
+	case Job::Pending:
+		// Not started yet: decoding it here is faster than waiting
+		job->state = Job::Cancelled;
+		return QSharedPointer<Job>();
+
+	case Job::Running:
+		while(job->state != Job::Done)
+			m_queue->done.wait(&m_queue->mutex);
+		break;
+
+	case Job::Done:
+	case Job::Cancelled:
+		break;
+	}
+
+	if(!job->ok)
+		return QSharedPointer<Job>();
+
+	return job;
+}
+
+bool PayloadDecoder::takeTile(const protocol::Message *msg, paintcore::Tile &tile)
+{
+	const QSharedPointer<Job> job = takeJob(msg);
+	if(job.isNull() || !job->isTile)
+		return false;
+
+	tile = job->tile;
+	return true;
+}
+
+QByteArray PayloadDecoder::takePixels(const protocol::Message *msg)
+{
+	const QSharedPointer<Job> job = takeJob(msg);
+	if(job.isNull() || job->isTile)
+		return QByteArray();
+
+	return job->pixels;
+}
+
+void PayloadDecoder::discard(const protocol::Message *msg)
+{
+	const auto i = m_entries.find(msg);
+	if(i == m_entries.end())
+		return;
+
+	m_outstandingBytes -= i->job->expectedLength;
+
+	QMutexLocker lock(&m_queue->mutex);
+	if(i->job->state == Job::Pending)
+		i->job->state = Job::Cancelled;
+	lock.unlock();
+
+	m_entries.erase(i);
+}
+
+void PayloadDecoder::clear()
+{
+	QMutexLocker lock(&m_queue->mutex);
+	for(const Entry &e : m_entries) {
+		if(e.job->state == Job::Pending)
+			e.job->state = Job::Cancelled;
+	}
+	m_queue->pending.clear();
+	lock.unlock();
+
+	m_entries.clear();
+	m_outstandingBytes = 0;
+}
+
+}
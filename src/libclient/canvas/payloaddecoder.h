@@ -0,0 +1,115 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAYLOADDECODER_H
+#define PAYLOADDECODER_H
+
+#include "core/tile.h"
+#include "../libshared/net/message.h"
+
+#include <QHash>
+#include <QSharedPointer>
+
+namespace canvas {
+
+/**
+ * @brief Decompresses queued image payloads ahead of time in worker threads
+ *
+ * During session catch-up, the state tracker applies queued messages in
+ * short time slices on the GUI thread. Decompressing PutTile and PutImage
+ * payloads takes a large share of that time, but does not depend on the
+ * canvas state at all, so it can be done in parallel before the
+ * messages are actually applied.
+ *
+ * Messages are handed to the decoder with prefetch() and their decoded
+ * content is picked up with takeTile() or takePixels() when the message is
+ * handled. If the payload is not yet being decoded, the caller should just
+ * decode it inline. This means the results are always the same, regardless
+ * of whether the message was prefetched or not.
+ *
+ * This class itself is not thread safe: all functions must be called
+ * from the thread that owns the state tracker.
+ */
+class PayloadDecoder
+{
+public:
+	//! Max. number of prefetched messages waiting to be handled
+	static const int MAX_OUTSTANDING = 256;
+
+	//! Max. decoded size of the prefetched messages
+	static const int MAX_OUTSTANDING_BYTES = 64 * 1024 * 1024;
+
+	PayloadDecoder();
+	PayloadDecoder(const PayloadDecoder&) = delete;
+	PayloadDecoder &operator=(const PayloadDecoder&) = delete;
+	~PayloadDecoder();
+
+	/**
+	 * @brief Start decoding the message's payload, if it has one
+	 *
+	 * Messages without a compressed image payload are ignored.
+	 *
+	 * @return false if the outstanding message limit has been reached and the message was not accepted
+	 */
+	bool prefetch(const protocol::MessagePtr &msg);
+
+	/**
+	 * @brief Get the decoded tile of a prefetched PutTile message
+	 *
+	 * If the message is currently being decoded, this waits until it is done.
+	 *
+	 * @return false if the message was not prefetched or the payload was invalid
+	 */
+	bool takeTile(const protocol::Message *msg, paintcore::Tile &tile);
+
+	/**
+	 * @brief Get the decompressed pixel data of a prefetched PutImage message
+	 *
+	 * @return null bytearray if the message was not prefetched or the payload was invalid
+	 */
+	QByteArray takePixels(const protocol::Message *msg);
+
+	//! Forget a message, if it was prefetched but not taken
+	void discard(const protocol::Message *msg);
+
+	//! Forget all prefetched messages
+	void clear();
+
+	//! Number of prefetched messages that have not been taken yet
+	int outstanding() const { return m_entries.size(); }
+
+private:
+	struct Job;
+	struct Queue;
+	class Worker;
+
+	struct Entry {
+		protocol::NullableMessageRef msg;
+		QSharedPointer<Job> job;
+	};
+
+	QSharedPointer<Job> takeJob(const protocol::Message *msg);
+
+	QSharedPointer<Queue> m_queue;
+	QHash<const protocol::Message*, Entry> m_entries;
+	qint64 m_outstandingBytes;
+};
+
+}
+
+#endif
@@ -23,6 +23,7 @@
 
 #include "../libshared/net/undo.h"
 #include "../libshared/net/image.h"
+#include "../libshared/net/pixelcodec.h"
 
 #include <QPainter>
 #include <QtMath>
@@ -502,9 +503,9 @@ protocol::MessageList Selection::pasteOrMoveToCanvas(uint8_t contextId, int laye
 		if(!canvas::isAxisAlignedRectangle(m_moveRegion.toPolygon())) {
 			QImage maskimg = tools::SelectionTool::shapeMask(Qt::white, m_moveRegion, &moveBounds, true);
 #if QT_VERSION < QT_VERSION_CHECK(5, 10, 0)
-			mask = qCompress(maskimg.constBits(), maskimg.byteCount());
+			mask = protocol::compressPixels(maskimg.constBits(), maskimg.byteCount(), 1);
 #else
-			mask = qCompress(maskimg.constBits(), maskimg.sizeInBytes());
+			mask = protocol::compressPixels(maskimg.constBits(), int(maskimg.sizeInBytes()), 1);
 #endif
 		} else {
 			moveBounds = m_moveRegion.boundingRect().toRect();
@@ -0,0 +1,66 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "snapshotrunnable.h"
+#include "canvasmodel.h"
+#include "aclfilter.h"
+#include "layerlist.h"
+#include "loader.h"
+#include "core/layerstack.h"
+
+namespace canvas {
+
+SnapshotRunnable::SnapshotRunnable(uint8_t contextId, const CanvasModel *canvas, int generation, QObject *parent)
+	: QObject(parent),
+	  m_layerstack(canvas->layerStack()->clone(this)),
+	  m_aclfilter(canvas->aclFilter()->clone(this)),
+	  m_pinnedMessage(canvas->pinnedMessage()),
+	  m_defaultLayer(canvas->layerlist()->defaultLayer()),
+	  m_contextId(contextId),
+	  m_generation(generation)
+{
+	setAutoDelete(false);
+}
+
+void SnapshotRunnable::run()
+{
+	{
+		SnapshotLoader loader(m_contextId, m_layerstack, m_aclfilter);
+		loader.setDefaultLayer(m_defaultLayer);
+		loader.setPinnedMessage(m_pinnedMessage);
+		loader.setProgressCallback([this](int percent) {
+			emit progress(percent);
+		});
+
+		m_snapshot = loader.loadInitCommands();
+	}
+
+	// Message reference counts are not thread safe. The loader is gone by now,
+	// so m_snapshot holds the only references to the generated messages.
+	emit snapshotReady();
+}
+
+protocol::MessageList SnapshotRunnable::takeSnapshot()
+{
+	const protocol::MessageList snapshot = m_snapshot;
+	m_snapshot = protocol::MessageList();
+	return snapshot;
+}
+
+}
@@ -0,0 +1,90 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SNAPSHOTRUNNABLE_H
+#define SNAPSHOTRUNNABLE_H
+
+#include "../libshared/net/message.h"
+
+#include <QObject>
+#include <QRunnable>
+
+namespace paintcore {
+	class LayerStack;
+}
+
+namespace canvas {
+
+class CanvasModel;
+class AclFilter;
+
+/**
+ * @brief A runnable for generating a session snapshot in a background thread
+ *
+ * When constructed, a copy of the layerstack and access controls is made.
+ *
+ * The runnable is not deleted automatically. Once snapshotReady has been
+ * emitted, the owner thread takes the result with takeSnapshot() and
+ * deletes the runnable. This way, all references to the generated messages
+ * are released in the owner thread.
+ */
+class SnapshotRunnable : public QObject, public QRunnable
+{
+	Q_OBJECT
+public:
+	/**
+	 * @brief Construct a snapshot generator
+	 *
+	 * @param contextId the context ID to use for the generated commands
+	 * @param canvas the canvas to snapshot
+	 * @param generation a tag passed back with the result, so stale snapshots can be recognized
+	 */
+	SnapshotRunnable(uint8_t contextId, const CanvasModel *canvas, int generation, QObject *parent = nullptr);
+
+	void run() override;
+
+	//! Get the generation tag passed to the constructor
+	int generation() const { return m_generation; }
+
+	/**
+	 * @brief Take the generated snapshot
+	 *
+	 * Call this in the owner thread after snapshotReady has been emitted.
+	 */
+	protocol::MessageList takeSnapshot();
+
+signals:
+	//! Snapshot generation progress (0-100)
+	void progress(int percent);
+
+	//! Emitted once the snapshot is ready to be taken
+	void snapshotReady();
+
+private:
+	paintcore::LayerStack *m_layerstack;
+	AclFilter *m_aclfilter;
+	QString m_pinnedMessage;
+	int m_defaultLayer;
+	uint8_t m_contextId;
+	int m_generation;
+	protocol::MessageList m_snapshot;
+};
+
+}
+
+#endif
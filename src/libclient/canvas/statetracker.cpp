@@ -24,6 +24,7 @@
 
 #include "core/layerstack.h"
 #include "core/layer.h"
+#include "core/tilepool.h"
 #include "brushes/brushpainter.h"
 #include "net/commands.h"
 #include "net/internalmsg.h"
@@ -32,6 +33,7 @@
 #include "../libshared/net/brushes.h"
 #include "../libshared/net/layer.h"
 #include "../libshared/net/image.h"
+#include "../libshared/net/pixelcodec.h"
 #include "../libshared/net/annotation.h"
 #include "../libshared/net/undo.h"
 
@@ -120,7 +122,7 @@ StateSavepoint StateSavepoint::fromCanvasSavepoint(const paintcore::Savepoint &s
 	d->timestamp = QDateTime::currentMSecsSinceEpoch();
 	d->canvas = savepoint;
 
-	for(const paintcore::Layer *l : savepoint.layers) {
+	for(const QSharedPointer<const paintcore::Layer> &l : savepoint.layers) {
 		d->layermodel << LayerListItem {
 			uint16_t(l->id()),
 			l->title(),
@@ -151,7 +153,8 @@ StateTracker::StateTracker(paintcore::LayerStack *image, LayerListModel *layerli
 		_showallmarkers(false),
 		m_hasParticipated(false),
 		m_localPenDown(false),
-		m_isQueued(false)
+		m_isQueued(false),
+		m_prefetched(0)
 {
 	connect(m_layerlist, &LayerListModel::layerOpacityPreview, this, &StateTracker::previewLayerOpacity);
 
@@ -179,8 +182,11 @@ void StateTracker::reset()
 	m_hasParticipated = false;
 	m_localPenDown = false;
 	m_msgqueue.clear();
+	m_payloads.clear();
+	m_prefetched = 0;
 	m_localfork.clear();
 	m_layerlist->clear();
+	paintcore::TilePool::prune();
 
 	// Make sure there is always a savepoint in the history
 	makeSavepoint(m_history.end()-1);
@@ -225,6 +231,7 @@ void StateTracker::localCommand(protocol::MessagePtr msg)
 void StateTracker::receiveQueuedCommand(protocol::MessagePtr msg)
 {
 	m_msgqueue.append(msg);
+	prefetchQueuedPayloads();
 
 	if(!m_isQueued) {
 		// This introduces a tiny bit of lag, but allows sequential
@@ -242,7 +249,17 @@ void StateTracker::processQueuedCommands()
 	elapsed.start();
 
 	while(!m_msgqueue.isEmpty() && elapsed.elapsed() < 100) {
-		receiveCommand(m_msgqueue.takeFirst());
+		const protocol::MessagePtr msg = m_msgqueue.takeFirst();
+		if(m_prefetched > 0)
+			--m_prefetched;
+
+		// Keep the worker threads busy with the upcoming messages
+		prefetchQueuedPayloads();
+
+		receiveCommand(msg);
+
+		// In case the message was not applied (e.g. it was filtered out)
+		m_payloads.discard(&(*msg));
 	}
 
 	if(!m_msgqueue.isEmpty()) {
@@ -254,6 +271,22 @@ void StateTracker::processQueuedCommands()
 	}
 }
 
+/**
+ * @brief Start decoding the image payloads of the upcoming queued messages
+ *
+ * Decompression does not depend on the canvas state, so it can be done
+ * in parallel while the earlier messages are being applied.
+ * The prepared results are picked up in handlePutTile and handlePutImage.
+ */
+void StateTracker::prefetchQueuedPayloads()
+{
+	while(m_prefetched < m_msgqueue.size()) {
+		if(!m_payloads.prefetch(m_msgqueue.at(m_prefetched)))
+			break;
+		++m_prefetched;
+	}
+}
+
 void StateTracker::receiveCommand(protocol::MessagePtr msg)
 {
 	if(msg->type() == protocol::MSG_INTERNAL) {
@@ -442,7 +475,7 @@ void StateTracker::handleCanvasBackground(const protocol::CanvasBackground &cmd)
 		t = paintcore::Tile(QColor::fromRgba(cmd.color()));
 
 	} else {
-		QByteArray data = qUncompress(cmd.image());
+		QByteArray data = protocol::decompressPixels(cmd.image(), paintcore::Tile::BYTES);
 		if(data.length() != paintcore::Tile::BYTES) {
 			qWarning() << "Invalid canvas background: Expected" << paintcore::Tile::BYTES << "bytes, but got" << data.length();
 			return;
@@ -631,7 +664,9 @@ void StateTracker::handlePutImage(const protocol::PutImage &cmd)
 	}
 
 	const int expectedLen = cmd.width() * cmd.height() * 4;
-	QByteArray data = qUncompress(cmd.image());
+	QByteArray data = m_payloads.takePixels(&cmd);
+	if(data.isNull())
+		data = protocol::decompressPixels(cmd.image(), expectedLen);
 	if(data.length() != expectedLen) {
 		qWarning() << "Invalid putImage: Expected" << expectedLen << "bytes, but got" << data.length();
 		return;
@@ -656,8 +691,8 @@ void StateTracker::handlePutTile(const protocol::PutTile &cmd)
 	if(cmd.isSolidColor()) {
 		t = paintcore::Tile(QColor::fromRgba(cmd.color()), cmd.contextId());
 
-	} else {
-		QByteArray data = qUncompress(cmd.image());
+	} else if(!m_payloads.takeTile(&cmd, t)) {
+		QByteArray data = protocol::decompressPixels(cmd.image(), paintcore::Tile::BYTES);
 		if(data.length() != paintcore::Tile::BYTES) {
 			qWarning() << "Invalid putTile: Expected" << paintcore::Tile::BYTES << "bytes, but got" << data.length();
 			return;
@@ -666,6 +701,9 @@ void StateTracker::handlePutTile(const protocol::PutTile &cmd)
 		t = paintcore::Tile(data, cmd.contextId());
 	}
 
+	// Snapshots and repeated PutTiles often contain identical tiles
+	t = paintcore::TilePool::intern(t);
+
 	layer.putTile(cmd.column(), cmd.row(), cmd.repeat(), t, cmd.sublayer());
 }
 
@@ -721,7 +759,7 @@ void StateTracker::handleMoveRegion(const protocol::MoveRegion &cmd)
 	QImage mask;
 	if(!cmd.mask().isEmpty()) {
 		const int expectedLen = (cmd.bw()+31)/32 * 4 * cmd.bh(); // 1bpp lines padded to 32bit boundaries
-		QByteArray maskData = qUncompress(cmd.mask());
+		QByteArray maskData = protocol::decompressPixels(cmd.mask(), expectedLen);
 		if(maskData.length() != expectedLen) {
 			qWarning("Invalid moveRegion mask: Expected %d bytes, but got %d", expectedLen, maskData.length());
 			return;
@@ -734,7 +772,8 @@ void StateTracker::handleMoveRegion(const protocol::MoveRegion &cmd)
 	}
 
 	// Extract selected pixels
-	QImage selbuf = layer->toImage().copy(bounds); // TODO optimize
+	// (Only the tiles under the selection are read, so the cost depends on the selection size)
+	QImage selbuf = layer->toImage(bounds);
 
 	// Mask out unselected pixels (if necessary)
 	if(!mask.isNull()) {
@@ -817,16 +856,23 @@ void StateTracker::handleUndoPoint(const protocol::UndoPoint &cmd, bool replay,
 			// In order to be able to return to the oldest undo point, we must leave
 			// one snapshot that is as old, or older.
 			bool first = true;
+			bool dropped = false;
 
 			while(spi.hasPrevious()) {
 				const StateSavepoint &sp = spi.previous();
 				if(sp->streampointer <= i) {
-					if(first)
+					if(first) {
 						first = false;
-					else
+					} else {
 						spi.remove();
+						dropped = true;
+					}
 				}
 			}
+
+			// The dropped savepoints may have held the last references to many pooled tiles
+			if(dropped)
+				paintcore::TilePool::prune();
 		}
 	}
 
@@ -1004,6 +1050,7 @@ void StateTracker::resetToSavepoint(const StateSavepoint savepoint)
 	m_layerlist->setLayers(savepoint->layermodel);
 
 	m_savepoints.append(savepoint);
+	paintcore::TilePool::prune();
 }
 
 void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
@@ -21,6 +21,7 @@
 
 #include "retcon.h"
 #include "history.h"
+#include "payloaddecoder.h"
 #include "../core/point.h"
 
 #include <QObject>
@@ -239,6 +240,7 @@ private slots:
 
 private:
 	void handleCommand(protocol::MessagePtr msg, bool replay, int pos);
+	void prefetchQueuedPayloads();
 
 	AffectedArea affectedArea(const protocol::MessagePtr msg) const;
 
@@ -294,6 +296,10 @@ private:
 	protocol::MessageList m_msgqueue;
 	QTimer *m_queuetimer;
 	bool m_isQueued;
+
+	// Payloads of the first m_prefetched queued messages are being decoded in the background
+	PayloadDecoder m_payloads;
+	int m_prefetched;
 };
 
 }
@@ -0,0 +1,115 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "concurrent.h"
+#include "tile.h"
+
+#include <QThreadPool>
+#include <QSemaphore>
+#include <QAtomicInt>
+
+namespace paintcore {
+
+namespace {
+
+struct ConcurrentJob {
+	const std::function<void(int)> &func;
+	const int count;
+	const int chunk;
+	QAtomicInt next;
+	QSemaphore done;
+
+	ConcurrentJob(const std::function<void(int)> &f, int c, int ch)
+		: func(f), count(c), chunk(ch), next(0)
+	{ }
+
+	void work()
+	{
+		for(;;) {
+			const int start = next.fetchAndAddRelaxed(chunk);
+			if(start >= count)
+				break;
+
+			const int end = qMin(start + chunk, count);
+			for(int i=start;i<end;++i)
+				func(i);
+		}
+	}
+};
+
+class ConcurrentHelper : public QRunnable {
+public:
+	ConcurrentJob *job = nullptr;
+
+	void run() override
+	{
+		job->work();
+		job->done.release();
+	}
+};
+
+}
+
+void concurrentFor(int count, const std::function<void(int)> &func)
+{
+	if(count <= 0)
+		return;
+
+	QThreadPool *tp = QThreadPool::globalInstance();
+	const int threads = qMin(tp->maxThreadCount(), count);
+
+	if(threads <= 1) {
+		// Just one item (or thread): don't bother with helpers
+		for(int i=0;i<count;++i)
+			func(i);
+		return;
+	}
+
+	// A few chunks per thread, so the load evens out even if
+	// some items take much longer than others
+	ConcurrentJob job(func, count, qMax(1, count / (threads * 4)));
+
+	const int helperCount = threads - 1;
+	ConcurrentHelper *helpers = new ConcurrentHelper[helperCount];
+	int started = 0;
+	for(int i=0;i<helperCount;++i) {
+		helpers[i].setAutoDelete(false);
+		helpers[i].job = &job;
+
+		// If the pool is busy (e.g. when we are already running inside it),
+		// the calling thread will just do more of the work itself.
+		if(!tp->tryStart(&helpers[i]))
+			break;
+		++started;
+	}
+
+	job.work();
+
+	// Wait for the helpers to finish their last chunks
+	job.done.acquire(started);
+	delete [] helpers;
+}
+
+quint32 *tileScratchBuffer()
+{
+	alignas(16) static thread_local quint32 buffer[Tile::LENGTH];
+	return buffer;
+}
+
+}
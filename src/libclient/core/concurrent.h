@@ -16,60 +16,42 @@
    You should have received a copy of the GNU General Public License
    along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
 */
-
 #ifndef PAINTCORE_CONCURRENT_H
 #define PAINTCORE_CONCURRENT_H
 
-#include <QThreadPool>
-#include <QSemaphore>
+#include <QtGlobal>
 #include <functional>
 
 namespace paintcore {
 
-template<typename T>
-void concurrentForEach(QList<T> &list, std::function<void(T)> func)
-{
-	if(list.isEmpty())
-		return;
-
-	if(list.size() == 1) {
-		// Just one item: don't bother with threads
-		func(list[0]);
-		return;
-	}
-
-	class ConcurrentForEachRunnable : public QRunnable {
-	public:
-		T value;
-		std::function<void(T)> func;
-		QSemaphore *semaphore;
-
-		void run() override
-		{
-			func(value);
-			semaphore->release();
-		}
-	};
-
-	QSemaphore s;
-	QThreadPool *tp = QThreadPool::globalInstance();
-
-	// Run functions in the thread pool
-	ConcurrentForEachRunnable *runnables = new ConcurrentForEachRunnable[list.size()];
-	for(int i=0;i<list.size();++i) {
-		runnables[i].setAutoDelete(false);
-		runnables[i].value = list[i];
-		runnables[i].func = func;
-		runnables[i].semaphore = &s;
-		tp->start(&runnables[i]);
-	}
-
-	// Wait for all functions to finish
-	s.acquire(list.size());
-	delete [] runnables;
-}
+/**
+ * @brief Call a function for every index in the range [0, count) in parallel
+ *
+ * The range is split into chunks that the participating threads claim
+ * from a shared counter, so a thread that finishes early simply takes over
+ * the remaining work. The calling thread participates as well and helper
+ * threads are only used if the global thread pool has free capacity, so
+ * this is safe to call from inside a pool thread.
+ *
+ * No per-item allocations are made. This function returns once all
+ * items have been processed.
+ *
+ * @param count number of items
+ * @param func the function to call for each index
+ */
+void concurrentFor(int count, const std::function<void(int)> &func);
+
+/**
+ * @brief Get a tile sized scratch buffer for the current thread
+ *
+ * Each thread has its own buffer, so this can be used from inside
+ * concurrentFor jobs. The content is not preserved between jobs, and the
+ * buffer must not be used by two things at the same time in the same thread.
+ *
+ * @return a buffer of Tile::LENGTH pixels
+ */
+quint32 *tileScratchBuffer();
 
 }
 
 #endif
-
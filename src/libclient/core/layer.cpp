@@ -21,6 +21,7 @@
 #include "layerstackobserver.h"
 #include "layer.h"
 #include "tile.h"
+#include "tilepool.h"
 #include "brushmask.h"
 #include "point.h"
 #include "blendmodes.h"
@@ -30,6 +31,7 @@
 #include <QPainter>
 #include <QImage>
 #include <QDataStream>
+#include <QVarLengthArray>
 
 #define OBSERVERS(notification) for(auto *observer : owner->observers()) observer->notification
 
@@ -115,10 +117,7 @@ Layer::Layer(int id, const QString& title, const QColor& color, const QSize& siz
 	  m_xtiles(Tile::roundTiles(size.width())),
 	  m_ytiles(Tile::roundTiles(size.height()))
 {
-	m_tiles = QVector<Tile>(
-		m_xtiles * m_ytiles,
-		color.alpha() > 0 ? Tile(color) : Tile()
-	);
+	fillTiles(color.alpha() > 0 ? Tile(color) : Tile());
 }
 
 Layer::Layer(int id, const QSize &size)
@@ -129,16 +128,19 @@ Layer::Layer(int id, const QSize &size)
 
 Layer::Layer(const QVector<Tile> &tiles, const QSize &size, const LayerInfo &info, const QList<Layer*> sublayers)
 	: m_info(info),
-	  m_tiles(tiles),
 	  m_sublayers(sublayers),
 	  m_width(size.width()),
 	  m_height(size.height()),
 	  m_xtiles(Tile::roundTiles(size.width())),
 	  m_ytiles(Tile::roundTiles(size.height()))
 {
-	if(m_xtiles * m_ytiles != m_tiles.size()) {
+	if(m_xtiles * m_ytiles != tiles.size()) {
 		qWarning("Layer constructor: tile vector size mismatch!");
-		m_tiles.resize(m_xtiles * m_ytiles);
+		QVector<Tile> resized = tiles;
+		resized.resize(m_xtiles * m_ytiles);
+		setTiles(resized, m_xtiles, m_ytiles);
+	} else {
+		setTiles(tiles, m_xtiles, m_ytiles);
 	}
 }
 
@@ -164,14 +166,94 @@ Layer::~Layer() {
 
 QImage Layer::toImage() const {
 	QImage image(m_width, m_height, QImage::Format_ARGB32_Premultiplied);
-	int i=0;
 	for(int y=0;y<m_ytiles;++y) {
-		for(int x=0;x<m_xtiles;++x,++i)
-			m_tiles[i].copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
+		for(int x=0;x<m_xtiles;++x)
+			tile(x, y).copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
 	}
 	return image;
 }
 
+QImage Layer::toImage(const QRect &rect) const
+{
+	QImage image(rect.size(), QImage::Format_ARGB32_Premultiplied);
+	if(image.isNull())
+		return image;
+
+	image.fill(0);
+
+	const QRect area = rect.intersected(QRect(0, 0, m_width, m_height));
+	if(area.isEmpty())
+		return image;
+
+	const int tx0 = area.left() / Tile::SIZE;
+	const int ty0 = area.top() / Tile::SIZE;
+	const int tx1 = area.right() / Tile::SIZE;
+	const int ty1 = area.bottom() / Tile::SIZE;
+	const int cols = tx1 - tx0 + 1;
+
+	// Note: bits() must be called here rather than in the worker threads, since it may detach
+	uchar *bits = image.bits();
+	const int stride = image.bytesPerLine();
+
+	concurrentFor(cols * (ty1 - ty0 + 1), [=](int i) {
+		const int tx = tx0 + i % cols;
+		const int ty = ty0 + i / cols;
+		const Tile &t = tile(tx, ty);
+		if(t.isNull())
+			return;
+
+		const QRect tileArea = QRect(tx * Tile::SIZE, ty * Tile::SIZE, Tile::SIZE, Tile::SIZE).intersected(area);
+		const quint32 *src = t.constData()
+			+ (tileArea.y() - ty * Tile::SIZE) * Tile::SIZE
+			+ (tileArea.x() - tx * Tile::SIZE);
+		uchar *dest = bits
+			+ (tileArea.y() - rect.y()) * stride
+			+ (tileArea.x() - rect.x()) * 4;
+
+		for(int y=0;y<tileArea.height();++y) {
+			memcpy(dest, src, tileArea.width() * 4);
+			dest += stride;
+			src += Tile::SIZE;
+		}
+	});
+
+	return image;
+}
+
+QVector<Tile> Layer::tiles() const
+{
+	QVector<Tile> tiles;
+	tiles.reserve(m_xtiles * m_ytiles);
+	for(const QVector<Tile> &row : m_tiles)
+		tiles += row;
+	return tiles;
+}
+
+void Layer::fillTiles(const Tile &tile)
+{
+	// All rows share the same data until modified
+	m_tiles = QVector<QVector<Tile>>(m_ytiles, QVector<Tile>(m_xtiles, tile));
+}
+
+void Layer::setTiles(const QVector<Tile> &tiles, int xtiles, int ytiles)
+{
+	Q_ASSERT(tiles.size() == xtiles * ytiles);
+	m_tiles.clear();
+	m_tiles.reserve(ytiles);
+	for(int y=0;y<ytiles;++y)
+		m_tiles.append(tiles.mid(y * xtiles, xtiles));
+}
+
+bool Layer::sharesTileRow(const Layer &other, int row) const
+{
+	Q_ASSERT(row>=0 && row<m_ytiles);
+	// Note: the vectors are implicitly shared, so if the data pointers
+	// are the same, so is the content.
+	return m_xtiles == other.m_xtiles
+		&& row < other.m_ytiles
+		&& m_tiles.at(row).constData() == other.m_tiles.at(row).constData();
+}
+
 QImage Layer::toCroppedImage(int *xOffset, int *yOffset) const
 {
 	int top=m_ytiles, bottom=0;
@@ -180,7 +262,7 @@ QImage Layer::toCroppedImage(int *xOffset, int *yOffset) const
 	// Find bounding rectangle of non-blank tiles
 	for(int y=0;y<m_ytiles;++y) {
 		for(int x=0;x<m_xtiles;++x) {
-			const Tile &t = m_tiles.at(y*m_xtiles + x);
+			const Tile &t = tile(x, y);
 			if(!t.isBlank()) {
 				if(x<left)
 					left=x;
@@ -203,7 +285,7 @@ QImage Layer::toCroppedImage(int *xOffset, int *yOffset) const
 	QImage image((right-left+1)*Tile::SIZE, (bottom-top+1)*Tile::SIZE, QImage::Format_ARGB32_Premultiplied);
 	for(int y=top;y<=bottom;++y) {
 		for(int x=left;x<=right;++x) {
-			m_tiles.at(y*m_xtiles+x).copyToImage(image, (x-left)*Tile::SIZE, (y-top)*Tile::SIZE);
+			tile(x, y).copyToImage(image, (x-left)*Tile::SIZE, (y-top)*Tile::SIZE);
 		}
 	}
 
@@ -367,9 +449,7 @@ QColor Layer::getDabColor(const BrushStamp &stamp) const
 			const int xindex = x / Tile::SIZE;
 			const int xt = x - xindex * Tile::SIZE;
 			const int wb = xt+dia-xb < Tile::SIZE ? dia-xb : Tile::SIZE-xt;
-			const int i = m_xtiles * yindex + xindex;
-
-			std::array<quint32, 5> avg = m_tiles.at(i).weightedAverage(weights + yb * dia + xb, xt, yt, wb, hb, dia-wb);
+			std::array<quint32, 5> avg = tile(xindex, yindex).weightedAverage(weights + yb * dia + xb, xt, yt, wb, hb, dia-wb);
 			weight += avg[0];
 			red += avg[1];
 			green += avg[2];
@@ -402,14 +482,29 @@ QColor Layer::getDabColor(const BrushStamp &stamp) const
 }
 
 /**
- * Free all tiles that are completely transparent
+ * Free all tiles that are completely transparent and share
+ * the rest with identical tiles via the tile pool.
  */
-void Layer::optimize()
+void Layer::optimize(const Layer *since)
 {
 	// Optimize tile memory usage
-	for(int i=0;i<m_tiles.size();++i) {
-		if(!m_tiles[i].isNull() && m_tiles[i].isBlank())
-			m_tiles[i] = Tile();
+	for(int y=0;y<m_ytiles;++y) {
+		if(since && sharesTileRow(*since, y))
+			continue;
+
+		for(int x=0;x<m_xtiles;++x) {
+			const Tile &t = tile(x, y);
+			if(t.isNull())
+				continue;
+
+			if(t.isBlank()) {
+				rtile(x, y) = Tile();
+			} else {
+				const Tile pooled = TilePool::intern(t);
+				if(pooled != t)
+					rtile(x, y) = pooled;
+			}
+		}
 	}
 
 	// Delete unused sublayers
@@ -432,7 +527,7 @@ Layer *Layer::getSubLayer(int id, BlendMode::Mode blendmode, uchar opacity)
 		if(sl->id() == id) {
 			if(sl->isHidden()) {
 				// Hidden, reset properties
-				sl->m_tiles.fill(Tile());
+				sl->fillTiles(Tile());
 				sl->m_info.opacity = opacity;
 				sl->m_info.blend = blendmode;
 				sl->m_info.hidden = false;
@@ -446,7 +541,7 @@ Layer *Layer::getSubLayer(int id, BlendMode::Mode blendmode, uchar opacity)
 		if(sl->isHidden()) {
 			// Set these flags directly to avoid markDirty call.
 			// We know the layer is invisible at this point
-			sl->m_tiles.fill(Tile());
+			sl->fillTiles(Tile());
 			sl->m_info.id = id;
 			sl->m_info.opacity = opacity;
 			sl->m_info.blend = blendmode;
@@ -463,6 +558,43 @@ Layer *Layer::getSubLayer(int id, BlendMode::Mode blendmode, uchar opacity)
 	return sl;
 }
 
+bool Layer::isUnchangedSince(const Layer &copy) const
+{
+	if(m_info.id != copy.m_info.id
+		|| m_info.title != copy.m_info.title
+		|| m_info.opacity != copy.m_info.opacity
+		|| m_info.hidden != copy.m_info.hidden
+		|| m_info.censored != copy.m_info.censored
+		|| m_info.fixed != copy.m_info.fixed
+		|| m_info.blend != copy.m_info.blend
+		|| m_width != copy.m_width
+		|| m_height != copy.m_height
+		|| m_changeBounds != copy.m_changeBounds
+		)
+		return false;
+
+	if(m_tiles.constData() != copy.m_tiles.constData()) {
+		// The row vector has been detached, but the rows themselves
+		// may still be the same
+		for(int y=0;y<m_ytiles;++y) {
+			if(!sharesTileRow(copy, y))
+				return false;
+		}
+	}
+
+	// The copy contains only the visible sublayers
+	int i = 0;
+	for(const Layer *sl : m_sublayers) {
+		if(sl->isHidden())
+			continue;
+		if(i >= copy.m_sublayers.size() || !sl->isUnchangedSince(*copy.m_sublayers.at(i)))
+			return false;
+		++i;
+	}
+
+	return i == copy.m_sublayers.size();
+}
+
 const Layer *Layer::getVisibleSublayer(int id) const
 {
 	for(const Layer *sl : m_sublayers) {
@@ -493,8 +625,8 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 
 	// if there is no old content, resizing is simple
 	bool hascontent = false;
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!d->m_tiles.at(i).isBlank()) {
+	for(int i=0;i<d->m_xtiles*d->m_ytiles;++i) {
+		if(!d->tile(i).isBlank()) {
 			hascontent = true;
 			break;
 		}
@@ -504,7 +636,7 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 		d->m_height = height;
 		d->m_xtiles = xtiles;
 		d->m_ytiles = ytiles;
-		d->m_tiles = tiles;
+		d->fillTiles(Tile());
 		return;
 	}
 
@@ -527,7 +659,6 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 		d->m_height = height;
 		d->m_xtiles = xtiles;
 		d->m_ytiles = ytiles;
-		d->m_tiles = tiles;
 		if(left<0 || top<0) {
 			int cropx = 0;
 			if(left<0) {
@@ -542,7 +673,7 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 			oldcontent = oldcontent.copy(cropx, cropy, oldcontent.width()-cropx, oldcontent.height()-cropy);
 		}
 
-		d->m_tiles.fill(bgtile);
+		d->fillTiles(bgtile);
 
 		// temporarily set the hidden flag, because markDirty must not
 		// be called during a resize operation.
@@ -561,7 +692,6 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 		int oldy = firstrow;
 		for(int y=0;y<ytiles;++y,++oldy) {
 			int oldx = firstcol;
-			const int oldyy = d->m_xtiles * oldy;
 			const int yy = xtiles * y;
 			for(int x=0;x<xtiles;++x,++oldx) {
 				const int i = yy + x;
@@ -570,8 +700,7 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 					tiles[i] = bgtile;
 
 				} else {
-					const int oldi = oldyy + oldx;
-					tiles[i] = d->m_tiles.at(oldi);
+					tiles[i] = d->tile(oldx, oldy);
 				}
 			}
 		}
@@ -580,7 +709,7 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 		d->m_height = height;
 		d->m_xtiles = xtiles;
 		d->m_ytiles = ytiles;
-		d->m_tiles = tiles;
+		d->setTiles(tiles, xtiles, ytiles);
 	}
 }
 
@@ -696,9 +825,9 @@ void EditableLayer::putTile(int col, int row, int repeat, const Tile &tile, int
 	}
 
 	int i=row*d->m_xtiles+col;
-	const int end = qMin(i+repeat, d->m_tiles.size()-1);
+	const int end = qMin(i+repeat, d->m_xtiles*d->m_ytiles-1);
 	for(;i<=end;++i) {
-		d->m_tiles[i] = tile;
+		d->rtile(i) = tile;
 		if(owner && d->isVisible())
 			OBSERVERS(markDirty(i));
 	}
@@ -710,7 +839,7 @@ void EditableLayer::fillRect(const QRect &rectangle, const QColor &color, BlendM
 
 	if(rectangle.contains(canvas) && (blendmode==BlendMode::MODE_REPLACE || (blendmode==BlendMode::MODE_NORMAL && color.alpha() == 255))) {
 		// Special case: overwrite whole layer
-		d->m_tiles.fill(Tile(color));
+		d->fillTiles(Tile(color));
 
 	} else {
 		// The usual case: only a portion of the layer is filled or pixel blending is needed
@@ -744,7 +873,7 @@ void EditableLayer::fillRect(const QRect &rectangle, const QColor &color, BlendM
 				int w = qMin((tx+1)*size, right) - tx*size - left;
 				int h = qMin((ty+1)*size, bottom) - ty*size - top;
 
-				Tile &t = d->m_tiles[ty*d->m_xtiles+tx];
+				Tile &t = d->rtile(tx, ty);
 				t.setLastEditedBy(contextId);
 
 				if(!t.isNull() || canIncrOpacity)
@@ -758,6 +887,18 @@ void EditableLayer::fillRect(const QRect &rectangle, const QColor &color, BlendM
 }
 
 void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, BlendMode::Mode blendmode)
+{
+	markDirty(drawBrushStamp(bs, color, blendmode));
+}
+
+void EditableLayer::markDirty(const QRect &rect)
+{
+	Q_ASSERT(d);
+	if(owner && d->isVisible() && !rect.isEmpty())
+		OBSERVERS(markDirty(rect));
+}
+
+QRect EditableLayer::drawBrushStamp(const BrushStamp &bs, const QColor &color, BlendMode::Mode blendmode)
 {
 	Q_ASSERT(d);
 	const int top=bs.top, left=bs.left;
@@ -766,7 +907,7 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 	const int right = qMin(left + dia, d->m_width);
 
 	if(left+dia<=0 || top+dia<=0 || left>=d->m_width || top>=d->m_height)
-		return;
+		return QRect();
 
 	// Composite the brush mask onto the layer
 	const uchar *values = bs.mask.data();
@@ -786,8 +927,8 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 			const int xindex = x / Tile::SIZE;
 			const int xt = x - xindex * Tile::SIZE;
 			const int wb = xt+dia-xb < Tile::SIZE ? dia-xb : Tile::SIZE-xt;
-			const int i = d->m_xtiles * yindex + xindex;
-			d->m_tiles[i].composite(
+			Tile &t = d->rtile(xindex, yindex);
+			t.composite(
 					blendmode,
 					values + yb * dia + xb,
 					color,
@@ -795,7 +936,7 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 					wb, hb,
 					dia-wb
 					);
-			d->m_tiles[i].setLastEditedBy(contextId);
+			t.setLastEditedBy(contextId);
 
 			x = (xindex+1) * Tile::SIZE;
 			xb = xb + wb;
@@ -804,8 +945,7 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 		yb = yb + hb;
 	}
 
-	if(owner && d->isVisible())
-		OBSERVERS(markDirty(QRect(left, top, right-left, bottom-top)));
+	return QRect(left, top, right-left, bottom-top);
 }
 
 /**
@@ -822,20 +962,26 @@ void EditableLayer::merge(const Layer *layer)
 	Q_ASSERT(layer->m_xtiles == d->m_xtiles);
 	Q_ASSERT(layer->m_ytiles == d->m_ytiles);
 
-	// Gather a list of non-null source tiles to merge
-	QList<int> mergeidx;
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!layer->m_tiles.at(i).isNull())
-			mergeidx.append(i);
+	// Gather a list of non-null source tiles to merge.
+	// Note: rtile detaches the tile rows here, so the concurrent
+	// modifications are all done to the same vectors.
+	struct MergeTile { Tile *target; const Tile *source; };
+	QVarLengthArray<MergeTile, 256> mergetiles;
+	for(int y=0;y<d->m_ytiles;++y) {
+		for(int x=0;x<d->m_xtiles;++x) {
+			const Tile &source = layer->tile(x, y);
+			if(!source.isNull())
+				mergetiles.append(MergeTile { &d->rtile(x, y), &source });
+		}
 	}
 
-	// Detach tile vector explicitly to make sure concurrent modifications
-	// are all done to the same vector
-	d->m_tiles.detach();
+	const uchar opacity = layer->opacity();
+	const BlendMode::Mode blendmode = layer->blendmode();
 
 	// Merge tiles
-	concurrentForEach<int>(mergeidx, [this, layer](int idx) {
-		d->m_tiles[idx].merge(layer->m_tiles.at(idx), layer->opacity(), layer->blendmode());
+	concurrentFor(mergetiles.size(), [opacity, blendmode, &mergetiles](int i) {
+		const MergeTile &mt = mergetiles.at(i);
+		mt.target->merge(*mt.source, opacity, blendmode);
 	});
 
 	// Merging a layer does not cause an immediate visual change, so we don't
@@ -845,7 +991,7 @@ void EditableLayer::merge(const Layer *layer)
 void EditableLayer::makeBlank()
 {
 	Q_ASSERT(d);
-	d->m_tiles.fill(Tile());
+	d->fillTiles(Tile());
 
 	if(owner && d->isVisible())
 		OBSERVERS(markDirty());
@@ -920,8 +1066,8 @@ void EditableLayer::markOpaqueDirty(bool forceVisible)
 	if(!owner || !(forceVisible || d->isVisible()))
 		return;
 
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!d->m_tiles.at(i).isNull())
+	for(int i=0;i<d->m_xtiles*d->m_ytiles;++i) {
+		if(!d->tile(i).isNull())
 			OBSERVERS(markDirty(i));
 	}
 }
@@ -101,6 +101,16 @@ public:
 	//! Get the layer as an image
 	QImage toImage() const;
 
+	/**
+	 * @brief Get a part of the layer as an image
+	 *
+	 * Only the tiles intersecting the rectangle are read.
+	 * Areas outside the layer are transparent, just like with QImage::copy.
+	 *
+	 * @param rect the area to copy
+	 */
+	QImage toImage(const QRect &rect) const;
+
 	//! Get the layer as an image with excess transparency cropped away
 	QImage toCroppedImage(int *xOffset, int *yOffset) const;
 
@@ -167,11 +177,11 @@ public:
 	const Tile &tile(int x, int y) const {
 		Q_ASSERT(x>=0 && x<m_xtiles);
 		Q_ASSERT(y>=0 && y<m_ytiles);
-		return m_tiles[y*m_xtiles+x];
+		return m_tiles.at(y).at(x);
 	}
 
 	//! Get a tile
-	const Tile &tile(int index) const { Q_ASSERT(index>=0 && index<m_xtiles*m_ytiles); return m_tiles[index]; }
+	const Tile &tile(int index) const { Q_ASSERT(index>=0 && index<m_xtiles*m_ytiles); return tile(index % m_xtiles, index / m_xtiles); }
 
 	//! Get the sublayers
 	const QList<Layer*> &sublayers() const { return m_sublayers; }
@@ -197,8 +207,8 @@ public:
 	 */
 	const LayerInfo &info() const { return m_info; }
 
-	//! Get this layer's tile vector
-	const QVector<Tile> tiles() const { return m_tiles; }
+	//! Get this layer's tiles as a flat vector
+	QVector<Tile> tiles() const;
 
 	/**
 	 * @brief Get the layer's change bounds
@@ -217,8 +227,34 @@ public:
 		return QRect();
 	}
 
-	//! Optimize layer memory usage
-	void optimize();
+	/**
+	 * @brief Optimize layer memory usage
+	 *
+	 * If a previous copy of this layer is given, tile rows still shared
+	 * with it are assumed to be optimized already and are skipped.
+	 *
+	 * @param since a previously optimized copy of this layer (may be null)
+	 */
+	void optimize(const Layer *since=nullptr);
+
+	/**
+	 * @brief Does the given tile row of this and the other layer share the same data?
+	 *
+	 * If true, the rows are identical. (Rows that are not shared may still
+	 * have identical content.)
+	 */
+	bool sharesTileRow(const Layer &other, int row) const;
+
+	/**
+	 * @brief Check if this layer is identical to a previously made copy
+	 *
+	 * The tile content is compared by identity only, so this is cheap
+	 * but a false negative is possible, e.g. if a tile is replaced
+	 * with an identical one.
+	 *
+	 * Hidden sublayers are ignored, since they are not copied.
+	 */
+	bool isUnchangedSince(const Layer &copy) const;
 
 private:
 	//! Construct a sublayer
@@ -229,14 +265,24 @@ private:
 	Tile &rtile(int x, int y) {
 		Q_ASSERT(x>=0 && x<m_xtiles);
 		Q_ASSERT(y>=0 && y<m_ytiles);
-		return m_tiles[y*m_xtiles+x];
+		return m_tiles[y][x];
 	}
 
+	Tile &rtile(int index) { return rtile(index % m_xtiles, index / m_xtiles); }
+
+	//! Replace all tiles with the given one
+	void fillTiles(const Tile &tile);
+
+	//! Replace the tile grid with a new one (given as a flat vector)
+	void setTiles(const QVector<Tile> &tiles, int xtiles, int ytiles);
 
 	LayerInfo m_info;
 	QRect m_changeBounds;
 
-	QVector<Tile> m_tiles;
+	// Each row of tiles is stored in its own implicitly shared vector,
+	// so a copy of the layer (e.g. a savepoint) only needs to detach
+	// the rows that are modified after copying.
+	QVector<QVector<Tile>> m_tiles;
 	QList<Layer*> m_sublayers;
 
 	int m_width;
@@ -298,13 +344,26 @@ public:
 	//! Dab a brush
 	void putBrushStamp(const BrushStamp &bs, const QColor &color, BlendMode::Mode blendmode);
 
+	/**
+	 * @brief Dab a brush without marking the area dirty
+	 *
+	 * This is used when drawing a series of dabs: the combined area
+	 * can be marked dirty with a single markDirty call afterwards.
+	 *
+	 * @return the area touched by the dab
+	 */
+	QRect drawBrushStamp(const BrushStamp &bs, const QColor &color, BlendMode::Mode blendmode);
+
+	//! Notify the observers that the given area of this layer has changed
+	void markDirty(const QRect &rect);
+
 	//! Fill a rectangle
 	void fillRect(const QRect &rect, const QColor &color, BlendMode::Mode blendmode);
 
 	//! Get a reference to a tile
 	Tile &rtile(int x, int y) { Q_ASSERT(d); return d->rtile(x, y); }
 
-	Tile &rtile(int index) { return d->m_tiles[index]; }
+	Tile &rtile(int index) { Q_ASSERT(d); return d->rtile(index); }
 
 	//! Merge a sublayer with this layer
 	void mergeSublayer(int id);
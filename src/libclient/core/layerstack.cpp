@@ -28,6 +28,8 @@
 #include <QMimeData>
 #include <QDataStream>
 
+#include <cstring>
+
 namespace paintcore {
 
 static const Tile CENSORED_TILE = Tile::ZebraBlock(QColor("#232629"), QColor("#eff0f1"));
@@ -189,33 +191,111 @@ int LayerStack::tileLastEditedBy(int tx, int ty) const
 	return 0;
 }
 
-QImage LayerStack::toFlatImage(bool includeAnnotations, bool includeBackground, bool includeSublayers) const
+namespace {
+
+//! A layer to include in a flattened image
+struct FlatLayer {
+	const Layer *layer;
+
+	//! Sublayer to composite onto the layer first (may be null)
+	const Layer *sublayer;
+};
+
+/**
+ * @brief Composite the given layers straight into a new image
+ *
+ * Each output tile is independent of the others, so the tiles are flattened
+ * in parallel. The pixels are composited directly onto the image scanlines,
+ * without building an intermediate layer.
+ */
+QImage flattenLayers(const QSize &size, const Tile &background, const QVector<FlatLayer> &layers)
 {
-	if(m_layers.isEmpty())
-		return QImage();
+	QImage image(size, QImage::Format_ARGB32_Premultiplied);
+	if(image.isNull())
+		return image;
 
-	Layer flat(0, QString(), Qt::transparent, size());
-	EditableLayer ef(&flat, nullptr, 0);
+	const int xtiles = Tile::roundTiles(size.width());
+	const int ytiles = Tile::roundTiles(size.height());
 
-	if(includeBackground)
-		ef.putTile(0, 0, 9999*9999, m_backgroundTile);
+	// Note: bits() must be called here rather than in the worker threads, since it may detach
+	uchar *bits = image.bits();
+	const int stride = image.bytesPerLine();
 
-	for(int i=0;i<m_layers.size();++i) {
-		if(m_layers.at(i)->isVisible() && (includeBackground || !m_layers.at(i)->isFixed())) {
-			const Layer *l = m_layers.at(i);
-			if(includeSublayers && l->hasSublayers()) {
-				Layer ll = Layer(*l);
-				EditableLayer el(&ll, nullptr, 0);
-				el.mergeAllSublayers();
-				ef.merge(&ll);
+	concurrentFor(xtiles * ytiles, [&](int i) {
+		const int tx = i % xtiles;
+		const int ty = i / xtiles;
+		const int w = qMin(Tile::SIZE, size.width() - tx * Tile::SIZE);
+		const int h = qMin(Tile::SIZE, size.height() - ty * Tile::SIZE);
+
+		quint32 *rows[Tile::SIZE];
+		for(int y=0;y<h;++y)
+			rows[y] = reinterpret_cast<quint32*>(bits + (ty * Tile::SIZE + y) * stride) + tx * Tile::SIZE;
+
+		if(background.isNull()) {
+			for(int y=0;y<h;++y)
+				memset(rows[y], 0, w * sizeof(quint32));
+		} else {
+			for(int y=0;y<h;++y)
+				memcpy(rows[y], background.constData() + y * Tile::SIZE, w * sizeof(quint32));
+		}
+
+		for(const FlatLayer &fl : layers) {
+			const Tile &tile = fl.layer->tile(tx, ty);
+			const Tile &subtile = fl.sublayer ? fl.sublayer->tile(tx, ty) : tile;
+			const quint32 *pixels;
+
+			if(fl.sublayer && !subtile.isNull()) {
+				// Merge the sublayer with a copy of the tile
+				quint32 *ldata = tileScratchBuffer();
+				tile.copyTo(ldata);
+				compositePixels(fl.sublayer->blendmode(), ldata, subtile.constData(),
+						Tile::LENGTH, fl.sublayer->opacity());
+				pixels = ldata;
+
+			} else if(!tile.isBlank()) {
+				pixels = tile.constData();
 
 			} else {
-				ef.merge(l);
+				// Compositing a blank tile would change nothing
+				continue;
+			}
+
+			for(int y=0;y<h;++y) {
+				compositePixels(fl.layer->blendmode(), rows[y], pixels + y * Tile::SIZE,
+						w, fl.layer->opacity());
 			}
 		}
+	});
+
+	return image;
+}
+
+//! Get the sublayer that would be merged by EditableLayer::mergeAllSublayers
+const Layer *mergeableSublayer(const Layer *layer)
+{
+	for(const Layer *sl : layer->sublayers()) {
+		if(sl->id() > 0)
+			return sl->isHidden() ? nullptr : sl;
 	}
+	return nullptr;
+}
 
-	QImage image = ef->toImage();
+}
+
+QImage LayerStack::toFlatImage(bool includeAnnotations, bool includeBackground, bool includeSublayers) const
+{
+	if(m_layers.isEmpty())
+		return QImage();
+
+	QVector<FlatLayer> layers;
+	layers.reserve(m_layers.size());
+
+	for(const Layer *l : m_layers) {
+		if(l->isVisible() && (includeBackground || !l->isFixed()))
+			layers << FlatLayer { l, includeSublayers ? mergeableSublayer(l) : nullptr };
+	}
+
+	QImage image = flattenLayers(size(), includeBackground ? m_backgroundTile : Tile(), layers);
 
 	if(includeAnnotations) {
 		QPainter painter(&image);
@@ -234,17 +314,13 @@ QImage LayerStack::flatLayerImage(int layerIdx) const
 {
 	Q_ASSERT(layerIdx>=0 && layerIdx < m_layers.size());
 
-	Layer flat(0, QString(), Qt::transparent, size());
-	EditableLayer ef(&flat, nullptr, 0);
-
-	ef.putTile(0, 0, 9999*9999, m_backgroundTile);
-
+	QVector<FlatLayer> layers;
 	for(int i=0;i<m_layers.size();++i) {
 		if(i == layerIdx || m_layers.at(i)->isFixed())
-			ef.merge(m_layers.at(i));
+			layers << FlatLayer { m_layers.at(i), nullptr };
 	}
 
-	QImage image = ef->toImage();
+	QImage image = flattenLayers(size(), m_backgroundTile, layers);
 	if(m_dpix > 0 && m_dpiy > 0) {
 		image.setDotsPerMeterX(int(m_dpix / 0.0254));
 		image.setDotsPerMeterY(int(m_dpiy / 0.0254));
@@ -271,7 +347,7 @@ void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
 
 			} else if(l->sublayers().count() || tint!=0 || m_highlightId > 0) {
 				// Sublayers (or tint) present, composite them first
-				quint32 ldata[Tile::SIZE*Tile::SIZE];
+				quint32 *ldata = tileScratchBuffer();
 				tile.copyTo(ldata);
 
 				for(const Layer *sl : l->sublayers()) {
@@ -292,15 +368,16 @@ void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
 				}
 
 				if(tint)
-					tintPixels(ldata, sizeof ldata / sizeof *ldata, tint);
+					tintPixels(ldata, Tile::LENGTH, tint);
 
 
 				// Composite merged tile
 				compositePixels(l->blendmode(), data, ldata,
 						Tile::SIZE*Tile::SIZE, layerOpacity(layeridx));
 
-			} else if(!tile.isNull()) {
+			} else if(!tile.isBlank()) {
 				// No sublayers or tint, just this tile as it is
+				// (a blank tile would change nothing)
 				compositePixels(l->blendmode(), data, tile.constData(),
 						Tile::LENGTH, layerOpacity(layeridx));
 			}
@@ -377,11 +454,35 @@ bool LayerStack::isVisible(int idx) const
 Savepoint LayerStack::makeSavepoint()
 {
 	Savepoint sp;
-	for(Layer *l : m_layers) {
-		l->optimize();
-		sp.layers.append(new Layer(*l));
+	for(int i=0;i<m_layers.size();++i) {
+		Layer *l = m_layers.at(i);
+
+		// Find the previous version of this layer. (Usually at the same index.)
+		int prev = -1;
+		if(i < m_savepointLayers.size() && m_savepointLayers.at(i)->id() == l->id()) {
+			prev = i;
+		} else {
+			for(int j=0;j<m_savepointLayers.size();++j) {
+				if(m_savepointLayers.at(j)->id() == l->id()) {
+					prev = j;
+					break;
+				}
+			}
+		}
+		const Layer *previous = prev >= 0 ? m_savepointLayers.at(prev).data() : nullptr;
+
+		if(previous && l->isUnchangedSince(*previous)) {
+			sp.layers.append(m_savepointLayers.at(prev));
+
+		} else {
+			// Only the rows changed since the previous version need optimizing
+			l->optimize(previous);
+			sp.layers.append(QSharedPointer<const Layer>(new Layer(*l)));
+		}
 	}
 
+	m_savepointLayers = sp.layers;
+
 	sp.annotations = m_annotations->getAnnotations();
 	sp.background = m_backgroundTile;
 
@@ -390,36 +491,6 @@ Savepoint LayerStack::makeSavepoint()
 	return sp;
 }
 
-Savepoint::Savepoint(const Savepoint &other)
-{
-	for(Layer *l : other.layers)
-		layers << new Layer(*l);
-	annotations = other.annotations;
-	background = other.background;
-	size = other.size;
-}
-
-Savepoint &Savepoint::operator=(const Savepoint &other)
-{
-	if(&other != this) {
-		for(Layer *l : layers)
-			delete l;
-		layers.clear();
-		for(Layer *l : other.layers)
-			layers << new Layer(*l);
-		annotations = other.annotations;
-		background = other.background;
-		size = other.size;
-	}
-	return *this;
-}
-
-Savepoint::~Savepoint()
-{
-	for(Layer *l : layers)
-		delete l;
-}
-
 void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 {
 	const QSize oldsize(d->m_width, d->m_height);
@@ -446,7 +517,7 @@ void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 			// Layer count has not changed, compare layer contents
 			for(int l=0;l<savepoint.layers.size();++l) {
 				const Layer *l0 = d->m_layers.at(l);
-				const Layer *l1 = savepoint.layers.at(l);
+				const Layer *l1 = savepoint.layers.at(l).data();
 				if(l0->effectiveOpacity() != l1->effectiveOpacity()) {
 					// Layer opacity has changed, refresh everything
 					for(auto observer : d->m_observers)
@@ -504,13 +575,19 @@ void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 				}
 
 				// Compare the main layer
-				for(int i=0;i<d->m_xtiles*d->m_ytiles;++i) {
-					// Note: An identity comparison works here, because the tiles
-					// utilize copy-on-write semantics. Unchanged tiles will share
-					// data pointers between savepoints.
-					if(l0->tile(i) != l1->tile(i)) {
-						for(auto observer : d->m_observers)
-							observer->markDirty(i);
+				for(int y=0;y<d->m_ytiles;++y) {
+					// Rows that have not been modified since are still shared
+					if(l0->sharesTileRow(*l1, y))
+						continue;
+
+					for(int x=0;x<d->m_xtiles;++x) {
+						// Note: An identity comparison works here, because the tiles
+						// utilize copy-on-write semantics. Unchanged tiles will share
+						// data pointers between savepoints.
+						if(l0->tile(x, y) != l1->tile(x, y)) {
+							for(auto observer : d->m_observers)
+								observer->markDirty(y*d->m_xtiles+x);
+						}
 					}
 				}
 			}
@@ -520,8 +597,9 @@ void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 	// Restore layers
 	while(!d->m_layers.isEmpty())
 		delete d->m_layers.takeLast();
-	for(const Layer *l : savepoint.layers)
+	for(const QSharedPointer<const Layer> &l : savepoint.layers)
 		d->m_layers.append(new Layer(*l));
+	d->m_savepointLayers = savepoint.layers;
 
 	// Restore background
 	setBackground(savepoint.background);
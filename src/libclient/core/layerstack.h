@@ -27,6 +27,7 @@
 #include <QObject>
 #include <QList>
 #include <QImage>
+#include <QSharedPointer>
 
 class QDataStream;
 
@@ -123,7 +124,13 @@ public:
 	//! Get a merged tile
 	Tile getFlatTile(int x, int y) const;
 
-	//! Create a new savepoint
+	/**
+	 * @brief Create a new savepoint
+	 *
+	 * Layers that have not changed since the previous savepoint
+	 * are shared with it, and the tile rows of changed layers are
+	 * shared with the live layers until modified.
+	 */
 	Savepoint makeSavepoint();
 
 	//! Get the current view rendering mode
@@ -187,6 +194,9 @@ private:
 	QList<Layer*> m_layers;
 	AnnotationModel *m_annotations;
 
+	// Layers of the latest savepoint (made or restored)
+	QList<QSharedPointer<const Layer>> m_savepointLayers;
+
 	Tile m_backgroundTile;
 
 	ViewMode m_viewmode;
@@ -201,13 +211,8 @@ private:
 
 /// Layer stack savepoint for undo use
 struct Savepoint {
-	Savepoint() = default;
-	Savepoint(const Savepoint &other);
-	~Savepoint();
-
-	Savepoint &operator=(const Savepoint &other);
-
-	QList<Layer*> layers;
+	//! Immutable layer copies. Unchanged layers are shared between savepoints.
+	QList<QSharedPointer<const Layer>> layers;
 	QList<Annotation> annotations;
 	Tile background;
 	QSize size;
@@ -25,6 +25,9 @@
 
 namespace paintcore {
 
+// Maximum number of tiles flattened at once by paintChangedTiles (4 MB of pixels)
+static const int UPDATE_BATCH_SIZE = 256;
+
 LayerStackObserver::LayerStackObserver()
 	: m_layerstack(nullptr)
 {
@@ -151,15 +154,6 @@ void LayerStackObserver::canvasBackgroundChanged(const Tile &tile)
 	markDirty();
 }
 
-namespace {
-	struct UpdateTile {
-		UpdateTile(int x_, int y_) : x(x_), y(y_) {}
-
-		int x, y;
-		quint32 data[Tile::LENGTH];
-	};
-}
-
 void LayerStackObserver::paintChangedTiles(const QRect &rect, QPaintDevice *target)
 {
 	Q_ASSERT(m_layerstack);
@@ -173,40 +167,56 @@ void LayerStackObserver::paintChangedTiles(const QRect &rect, QPaintDevice *targ
 	const int ty1 = qBound(ty0, rect.bottom() / Tile::SIZE, m_layerstack->m_ytiles-1);
 
 	// Gather list of tiles in need of updating
-	QList<UpdateTile*> updates;
+	m_updateTiles.clear();
 
 	for(int ty=ty0;ty<=ty1;++ty) {
 		const int y = ty*m_layerstack->m_xtiles;
 		for(int tx=tx0;tx<=tx1;++tx) {
 			const int i = y+tx;
 			if(m_dirtytiles.testBit(i)) {
-				updates.append(new UpdateTile(tx, ty));
+				m_updateTiles.append(QPoint(tx, ty));
 				m_dirtytiles.clearBit(i);
 			}
 		}
 	}
 
-	if(!updates.isEmpty()) {
+	if(m_updateTiles.isEmpty())
+		return;
+
+	// Tiles are flattened and painted in bounded batches, so the
+	// buffer (which is reused between calls) stays small even when
+	// the whole canvas is repainted.
+	const int batchSize = qMin(m_updateTiles.size(), UPDATE_BATCH_SIZE);
+	if(m_updateBuffer.size() < batchSize * Tile::LENGTH)
+		m_updateBuffer.resize(batchSize * Tile::LENGTH);
+
+	quint32 *buffer = m_updateBuffer.data();
+
+	QPainter painter(target);
+	painter.setCompositionMode(QPainter::CompositionMode_Source);
+
+	for(int first=0;first<m_updateTiles.size();first+=batchSize) {
+		const int count = qMin(batchSize, m_updateTiles.size() - first);
+
 		// Flatten tiles
-		concurrentForEach<UpdateTile*>(updates, [this](UpdateTile *t) {
-			m_paintBackgroundTile.copyTo(t->data);
-			m_layerstack->flattenTile(t->data, t->x, t->y);
+		concurrentFor(count, [this, buffer, first](int i) {
+			quint32 *data = buffer + i * Tile::LENGTH;
+			const QPoint &t = m_updateTiles.at(first + i);
+			m_paintBackgroundTile.copyTo(data);
+			m_layerstack->flattenTile(data, t.x(), t.y());
 		});
 
 		// Paint flattened tiles
-		QPainter painter(target);
-		painter.setCompositionMode(QPainter::CompositionMode_Source);
-		while(!updates.isEmpty()) {
-			UpdateTile *ut = updates.takeLast();
+		for(int i=0;i<count;++i) {
+			const QPoint &t = m_updateTiles.at(first + i);
 			painter.drawImage(
-				ut->x*Tile::SIZE,
-				ut->y*Tile::SIZE,
-				QImage(reinterpret_cast<const uchar*>(ut->data),
+				t.x()*Tile::SIZE,
+				t.y()*Tile::SIZE,
+				QImage(reinterpret_cast<const uchar*>(buffer + i * Tile::LENGTH),
 					Tile::SIZE, Tile::SIZE,
 					QImage::Format_ARGB32_Premultiplied
 				)
 			);
-			delete ut;
 		}
 	}
 }
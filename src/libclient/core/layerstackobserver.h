@@ -24,6 +24,7 @@
 
 #include <QBitArray>
 #include <QRect>
+#include <QVector>
 
 class QPaintDevice;
 
@@ -103,6 +104,10 @@ private:
 
 	QBitArray m_dirtytiles;
 	QRect m_dirtyrect;
+
+	// Buffers reused by paintChangedTiles
+	QVector<QPoint> m_updateTiles;
+	QVector<quint32> m_updateBuffer;
 };
 
 }
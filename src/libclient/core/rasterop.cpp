@@ -18,9 +18,14 @@
 */
 
 #include "rasterop.h"
+#include "rasterop_p.h"
 
 #include <QRgb>
 
+#if defined(HAVE_X86_SIMD) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 namespace paintcore {
 
 // This is borrowed from Pigment of koffice libs:
@@ -227,8 +232,9 @@ void color_erase_helper(fRGBA *src, const fRGBA *color)
 }
 
 // Specialized pixel composition: erase alpha channel
-void doMaskErase(quint32 *base, const uchar *mask, int w, int h, int maskskip, int baseskip)
+void doMaskErase(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
 {
+	Q_UNUSED(color);
 	baseskip *= 4;
 	uchar *dest = reinterpret_cast<uchar*>(base);
 	for(int y=0;y<h;++y) {
@@ -455,12 +461,93 @@ void doPixelComposite(quint32 *base, const quint32 *source, uchar alpha, int len
 	}
 }
 
-void compositeMask(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
+const RasterOpImpl RASTEROP_SCALAR {
+	"scalar",
+	doAlphaMaskBlend,
+	doAlphaMaskUnder,
+	doMaskErase,
+	doMaskCopy,
+	doPixelAlphaBlend,
+	doPixelAlphaUnder,
+	doPixelErase
+};
+
+#ifdef HAVE_X86_SIMD
+static bool cpuHasAvx2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 7)
+		return false;
+
+	// The OS must support saving the YMM registers (OSXSAVE + XCR0 bits 1 and 2)
+	__cpuid(info, 1);
+	const bool osxsave = info[2] & (1<<27);
+	const bool avx = info[2] & (1<<28);
+	if(!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return info[1] & (1<<5);
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static bool cpuHasSse2()
+{
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return info[3] & (1<<26);
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+#endif
+
+QVector<const RasterOpImpl*> supportedRasterOpImpls()
+{
+	QVector<const RasterOpImpl*> impls;
+	impls << &RASTEROP_SCALAR;
+
+#ifdef HAVE_X86_SIMD
+	if(cpuHasSse2())
+		impls << &RASTEROP_SSE2;
+	if(cpuHasAvx2())
+		impls << &RASTEROP_AVX2;
+#endif
+
+	return impls;
+}
+
+static const RasterOpImpl &selectRasterOpImpl()
+{
+	// The last supported implementation is the fastest one.
+	// Setting DRAWPILE_NO_SIMD disables the vectorized kernels (for debugging)
+	if(qEnvironmentVariableIsSet("DRAWPILE_NO_SIMD"))
+		return RASTEROP_SCALAR;
+
+	return *supportedRasterOpImpls().last();
+}
+
+const RasterOpImpl &activeRasterOpImpl()
+{
+	static const RasterOpImpl &impl = selectRasterOpImpl();
+	return impl;
+}
+
+void compositeMask(const RasterOpImpl &impl, BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
 		int w, int h, int maskskip, int baseskip)
 {
 	switch(mode) {
-	case BlendMode::MODE_ERASE: doMaskErase(base, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_NORMAL: doAlphaMaskBlend(base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_ERASE: impl.maskErase(base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_NORMAL: impl.maskAlphaBlend(base, color, mask, w, h, maskskip, baseskip); break;
 	case BlendMode::MODE_MULTIPLY: doMaskComposite<blend_multiply>(base, color, mask, w, h, maskskip, baseskip); break;
 	case BlendMode::MODE_DIVIDE: doMaskComposite<blend_divide>(base, color, mask, w, h, maskskip, baseskip); break;
 	case BlendMode::MODE_BURN: doMaskComposite<blend_burn>(base, color, mask, w, h, maskskip, baseskip); break;
@@ -470,19 +557,19 @@ void compositeMask(BlendMode::Mode mode, quint32 *base, quint32 color, const uch
 	case BlendMode::MODE_SUBTRACT: doMaskComposite<blend_subtract>(base, color, mask, w, h, maskskip, baseskip); break;
 	case BlendMode::MODE_ADD: doMaskComposite<blend_add>(base, color, mask, w, h, maskskip, baseskip); break;
 	case BlendMode::MODE_RECOLOR: doMaskComposite<blend_blend>(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_BEHIND: doAlphaMaskUnder(base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_BEHIND: impl.maskAlphaUnder(base, color, mask, w, h, maskskip, baseskip); break;
 	case BlendMode::MODE_COLORERASE: doMaskColorErase(base, color, mask, w, h, maskskip, baseskip); break;
-	case BlendMode::MODE_REPLACE: doMaskCopy(base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_REPLACE: impl.maskCopy(base, color, mask, w, h, maskskip, baseskip); break;
 	}
 }
 
-void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+void compositePixels(const RasterOpImpl &impl, BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
 {
 	Q_ASSERT(len>=0);
 
 	switch(mode) {
-	case BlendMode::MODE_ERASE: doPixelErase(base, over, opacity, len); break;
-	case BlendMode::MODE_NORMAL: doPixelAlphaBlend(base, over, opacity, len); break;
+	case BlendMode::MODE_ERASE: impl.pixelErase(base, over, opacity, len); break;
+	case BlendMode::MODE_NORMAL: impl.pixelAlphaBlend(base, over, opacity, len); break;
 	case BlendMode::MODE_MULTIPLY: doPixelComposite<blend_multiply>(base, over, opacity, len); break;
 	case BlendMode::MODE_DIVIDE: doPixelComposite<blend_divide>(base, over, opacity, len); break;
 	case BlendMode::MODE_BURN: doPixelComposite<blend_burn>(base, over, opacity, len); break;
@@ -492,10 +579,21 @@ void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, i
 	case BlendMode::MODE_SUBTRACT: doPixelComposite<blend_subtract>(base, over, opacity, len); break;
 	case BlendMode::MODE_ADD: doPixelComposite<blend_add>(base, over, opacity, len); break;
 	case BlendMode::MODE_RECOLOR: doPixelComposite<blend_blend>(base, over, opacity, len); break;
-	case BlendMode::MODE_BEHIND: doPixelAlphaUnder(base, over, opacity, len); break;
+	case BlendMode::MODE_BEHIND: impl.pixelAlphaUnder(base, over, opacity, len); break;
 	case BlendMode::MODE_COLORERASE: doPixelColorErase(base, over, opacity, len); break;
 	case BlendMode::MODE_REPLACE: /* not implemented */ break;
 	}
 }
 
+void compositeMask(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
+		int w, int h, int maskskip, int baseskip)
+{
+	compositeMask(activeRasterOpImpl(), mode, base, color, mask, w, h, maskskip, baseskip);
+}
+
+void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+{
+	compositePixels(activeRasterOpImpl(), mode, base, over, len, opacity);
+}
+
 }
@@ -0,0 +1,312 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// AVX2 versions of the integer composition kernels.
+//
+// These work just like the SSE2 versions, but process eight pixels
+// per iteration. This file is compiled with AVX2 enabled, so nothing in here
+// may be called unless the CPU has been checked to support it.
+
+#include "rasterop_p.h"
+
+#include <immintrin.h>
+#include <cstring>
+
+namespace paintcore {
+
+namespace {
+
+//! UINT8_MULT for 16x16 bit lanes
+inline __m256i mul8(__m256i a, __m256i b)
+{
+	const __m256i c = _mm256_add_epi16(_mm256_mullo_epi16(a, b), _mm256_set1_epi16(0x80));
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_srli_epi16(c, 8), c), 8);
+}
+
+//! Copy each pixel's alpha channel to all its lanes
+inline __m256i broadcastAlpha(__m256i px)
+{
+	return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(px, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+}
+
+//! Select a where sel is set, b elsewhere
+inline __m256i selectLanes(__m256i sel, __m256i a, __m256i b)
+{
+	return _mm256_blendv_epi8(b, a, sel);
+}
+
+//! Load four pixels into 16 bit lanes
+inline __m256i unpack(const quint32 *px)
+{
+	return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(px)));
+}
+
+//! Pack four pixels back to bytes, truncating like a store to uchar would
+inline void pack(quint32 *dest, __m256i px)
+{
+	px = _mm256_and_si256(px, _mm256_set1_epi16(0x00ff));
+	_mm_storeu_si128(
+		reinterpret_cast<__m128i*>(dest),
+		_mm_packus_epi16(_mm256_castsi256_si128(px), _mm256_extracti128_si256(px, 1))
+	);
+}
+
+//! Load eight mask values and spread each to the four lanes of a pixel
+inline void loadMask(const uchar *mask, __m256i &lo, __m256i &hi)
+{
+	__m128i m = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask));
+	m = _mm_unpacklo_epi8(m, m);
+	lo = _mm256_cvtepu8_epi16(_mm_unpacklo_epi16(m, m));
+	hi = _mm256_cvtepu8_epi16(_mm_unpackhi_epi16(m, m));
+}
+
+inline bool isZero8(const uchar *mask)
+{
+	quint64 m64;
+	memcpy(&m64, mask, 8);
+	return m64 == 0;
+}
+
+void avx2AlphaMaskBlend(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	const __m256i c255 = _mm256_set1_epi16(255);
+
+	// The mask value is used as the source alpha
+	const __m256i src = _mm256_cvtepu8_epi16(_mm_set1_epi32(int((color & 0x00ffffff) | 0xff000000)));
+
+	const int vw = w & ~7;
+
+	for(int y=0;y<h;++y) {
+		for(int x=0;x<vw;x+=8, mask+=8, base+=8) {
+			if(isZero8(mask))
+				continue;
+
+			__m256i mlo, mhi;
+			loadMask(mask, mlo, mhi);
+
+			const __m256i dlo = unpack(base);
+			const __m256i dhi = unpack(base+4);
+
+			pack(base, _mm256_add_epi16(mul8(src, mlo), mul8(dlo, _mm256_sub_epi16(c255, mlo))));
+			pack(base+4, _mm256_add_epi16(mul8(src, mhi), mul8(dhi, _mm256_sub_epi16(c255, mhi))));
+		}
+		if(vw < w) {
+			doAlphaMaskBlend(base, color, mask, w-vw, 1, 0, 0);
+			mask += w-vw;
+			base += w-vw;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+void avx2AlphaMaskUnder(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	const __m256i c255 = _mm256_set1_epi16(255);
+
+	// Alpha lane is 255 so that the new alpha becomes dest alpha + a
+	const __m256i src = _mm256_cvtepu8_epi16(_mm_set1_epi32(int((color & 0x00ffffff) | 0xff000000)));
+
+	const int vw = w & ~7;
+
+	for(int y=0;y<h;++y) {
+		for(int x=0;x<vw;x+=8, mask+=8, base+=8) {
+			if(isZero8(mask))
+				continue;
+
+			__m256i mlo, mhi;
+			loadMask(mask, mlo, mhi);
+
+			const __m256i dlo = unpack(base);
+			const __m256i dhi = unpack(base+4);
+
+			const __m256i alo = mul8(_mm256_sub_epi16(c255, broadcastAlpha(dlo)), mlo);
+			const __m256i ahi = mul8(_mm256_sub_epi16(c255, broadcastAlpha(dhi)), mhi);
+
+			pack(base, _mm256_add_epi16(mul8(src, alo), dlo));
+			pack(base+4, _mm256_add_epi16(mul8(src, ahi), dhi));
+		}
+		if(vw < w) {
+			doAlphaMaskUnder(base, color, mask, w-vw, 1, 0, 0);
+			mask += w-vw;
+			base += w-vw;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+void avx2MaskErase(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i c255 = _mm256_set1_epi16(255);
+
+	const int vw = w & ~7;
+
+	for(int y=0;y<h;++y) {
+		for(int x=0;x<vw;x+=8, mask+=8, base+=8) {
+			if(isZero8(mask))
+				continue;
+
+			__m256i mlo, mhi;
+			loadMask(mask, mlo, mhi);
+
+			const __m256i dlo = unpack(base);
+			const __m256i dhi = unpack(base+4);
+
+			// Fully transparent destination pixels are left untouched
+			pack(base, selectLanes(
+				_mm256_cmpeq_epi16(broadcastAlpha(dlo), zero),
+				dlo,
+				mul8(dlo, _mm256_sub_epi16(c255, mlo))
+			));
+			pack(base+4, selectLanes(
+				_mm256_cmpeq_epi16(broadcastAlpha(dhi), zero),
+				dhi,
+				mul8(dhi, _mm256_sub_epi16(c255, mhi))
+			));
+		}
+		if(vw < w) {
+			doMaskErase(base, color, mask, w-vw, 1, 0, 0);
+			mask += w-vw;
+			base += w-vw;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+void avx2MaskCopy(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	const __m256i src = _mm256_cvtepu8_epi16(_mm_set1_epi32(int(color)));
+
+	const int vw = w & ~7;
+
+	for(int y=0;y<h;++y) {
+		for(int x=0;x<vw;x+=8, mask+=8, base+=8) {
+			__m256i mlo, mhi;
+			loadMask(mask, mlo, mhi);
+			pack(base, mul8(src, mlo));
+			pack(base+4, mul8(src, mhi));
+		}
+		if(vw < w) {
+			doMaskCopy(base, color, mask, w-vw, 1, 0, 0);
+			mask += w-vw;
+			base += w-vw;
+		}
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+void avx2PixelAlphaBlend(quint32 *base, const quint32 *source, uchar opacity, int len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i c255 = _mm256_set1_epi16(255);
+	const __m256i o = _mm256_set1_epi16(opacity);
+
+	const int vlen = len & ~7;
+
+	for(int i=0;i<vlen;i+=8, base+=8, source+=8) {
+		const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source));
+		if(_mm256_testz_si256(s, s))
+			continue;
+
+		const __m256i slo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(s));
+		const __m256i shi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(s, 1));
+		const __m256i dlo = unpack(base);
+		const __m256i dhi = unpack(base+4);
+
+		const __m256i klo = mul8(broadcastAlpha(slo), o);
+		const __m256i khi = mul8(broadcastAlpha(shi), o);
+
+		// Pixels whose effective source alpha is zero are left untouched
+		pack(base, selectLanes(
+			_mm256_cmpeq_epi16(klo, zero),
+			dlo,
+			_mm256_add_epi16(mul8(slo, o), mul8(dlo, _mm256_sub_epi16(c255, klo)))
+		));
+		pack(base+4, selectLanes(
+			_mm256_cmpeq_epi16(khi, zero),
+			dhi,
+			_mm256_add_epi16(mul8(shi, o), mul8(dhi, _mm256_sub_epi16(c255, khi)))
+		));
+	}
+
+	if(vlen < len)
+		doPixelAlphaBlend(base, source, opacity, len-vlen);
+}
+
+void avx2PixelAlphaUnder(quint32 *base, const quint32 *source, uchar opacity, int len)
+{
+	const __m256i c255 = _mm256_set1_epi16(255);
+	const __m256i o = _mm256_set1_epi16(opacity);
+
+	const int vlen = len & ~7;
+
+	for(int i=0;i<vlen;i+=8, base+=8, source+=8) {
+		const __m256i slo = unpack(source);
+		const __m256i shi = unpack(source+4);
+		const __m256i dlo = unpack(base);
+		const __m256i dhi = unpack(base+4);
+
+		const __m256i alo = mul8(_mm256_sub_epi16(c255, broadcastAlpha(dlo)), mul8(broadcastAlpha(slo), o));
+		const __m256i ahi = mul8(_mm256_sub_epi16(c255, broadcastAlpha(dhi)), mul8(broadcastAlpha(shi), o));
+
+		pack(base, _mm256_add_epi16(mul8(slo, alo), dlo));
+		pack(base+4, _mm256_add_epi16(mul8(shi, ahi), dhi));
+	}
+
+	if(vlen < len)
+		doPixelAlphaUnder(base, source, opacity, len-vlen);
+}
+
+void avx2PixelErase(quint32 *base, const quint32 *source, uchar opacity, int len)
+{
+	const __m256i c255 = _mm256_set1_epi16(255);
+	const __m256i o = _mm256_set1_epi16(opacity);
+
+	const int vlen = len & ~7;
+
+	for(int i=0;i<vlen;i+=8, base+=8, source+=8) {
+		const __m256i alo = _mm256_sub_epi16(c255, mul8(broadcastAlpha(unpack(source)), o));
+		const __m256i ahi = _mm256_sub_epi16(c255, mul8(broadcastAlpha(unpack(source+4)), o));
+
+		pack(base, mul8(unpack(base), alo));
+		pack(base+4, mul8(unpack(base+4), ahi));
+	}
+
+	if(vlen < len)
+		doPixelErase(base, source, opacity, len-vlen);
+}
+
+}
+
+const RasterOpImpl RASTEROP_AVX2 {
+	"avx2",
+	avx2AlphaMaskBlend,
+	avx2AlphaMaskUnder,
+	avx2MaskErase,
+	avx2MaskCopy,
+	avx2PixelAlphaBlend,
+	avx2PixelAlphaUnder,
+	avx2PixelErase
+};
+
+}
@@ -0,0 +1,99 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_RASTEROP_PRIVATE_H
+#define PAINTCORE_RASTEROP_PRIVATE_H
+
+// Note: this header is included by translation units that are compiled
+// with extended instruction sets enabled (e.g. -mavx2). Those files must not
+// call any inline functions from shared headers, since the linker could then
+// pick the AVX2 version of the function for the whole program.
+
+#include <QtGlobal>
+#include <QVector>
+
+#include "blendmodes.h"
+
+namespace paintcore {
+
+typedef void (*MaskCompositeFunc)(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+typedef void (*PixelCompositeFunc)(quint32 *base, const quint32 *source, uchar opacity, int len);
+
+/**
+ * @brief A set of composition kernels
+ *
+ * These are the blending modes that are implemented with integer
+ * arithmetic only and can thus be vectorized while remaining bit-exact
+ * with the scalar implementation. The other modes always use the scalar code.
+ */
+struct RasterOpImpl {
+	const char *name;
+
+	MaskCompositeFunc maskAlphaBlend;
+	MaskCompositeFunc maskAlphaUnder;
+	MaskCompositeFunc maskErase;
+	MaskCompositeFunc maskCopy;
+
+	PixelCompositeFunc pixelAlphaBlend;
+	PixelCompositeFunc pixelAlphaUnder;
+	PixelCompositeFunc pixelErase;
+};
+
+// Scalar reference implementations (rasterop.cpp)
+// The vectorized kernels use these to process the leftover pixels at the end of each row.
+void doAlphaMaskBlend(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void doAlphaMaskUnder(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void doMaskErase(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void doMaskCopy(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void doPixelAlphaBlend(quint32 *base, const quint32 *source, uchar opacity, int len);
+void doPixelAlphaUnder(quint32 *base, const quint32 *source, uchar opacity, int len);
+void doPixelErase(quint32 *base, const quint32 *source, uchar opacity, int len);
+
+#ifdef HAVE_X86_SIMD
+// Vectorized kernels (rasterop_sse2.cpp and rasterop_avx2.cpp)
+extern const RasterOpImpl RASTEROP_SSE2;
+extern const RasterOpImpl RASTEROP_AVX2;
+#endif
+
+//! The portable scalar implementation
+extern const RasterOpImpl RASTEROP_SCALAR;
+
+/**
+ * @brief Get the implementation selected for this CPU
+ *
+ * The selection is done once, on first use.
+ */
+const RasterOpImpl &activeRasterOpImpl();
+
+/**
+ * @brief Get all the implementations the current CPU can run
+ *
+ * The scalar implementation is always the first item.
+ * This is used by the unit tests and the benchmark tool.
+ */
+QVector<const RasterOpImpl*> supportedRasterOpImpls();
+
+//! Composite using a specific implementation
+void compositeMask(const RasterOpImpl &impl, BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+
+//! Composite using a specific implementation
+void compositePixels(const RasterOpImpl &impl, BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity);
+
+}
+
+#endif
@@ -25,6 +25,50 @@
 
 namespace paintcore {
 
+static quint64 hashPixels(const quint32 *pixels)
+{
+	// A simple multiply-rotate hash over 64 bit words
+	quint64 h = 0x9e3779b97f4a7c15ull;
+	for(int i=0;i<Tile::LENGTH;i+=2) {
+		const quint64 w = quint64(pixels[i]) | (quint64(pixels[i+1]) << 32);
+		h ^= w * 0xc2b2ae3d27d4eb4full;
+		h = ((h << 31) | (h >> 33)) * 0x9e3779b97f4a7c15ull;
+	}
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 32;
+	return h;
+}
+
+static quint64 blankTileHash()
+{
+	static const quint64 hash = []() {
+		static const quint32 zeros[Tile::LENGTH] = {};
+		return hashPixels(zeros);
+	}();
+	return hash;
+}
+
+TileData::TileData()
+	: metaFlags(0), solidPixel(0), contentHash(0)
+{
+#ifndef NDEBUG
+	_count.fetchAndAddOrdered(1);
+#endif
+}
+
+TileData::TileData(const TileData &td)
+	: QSharedData(), lastEditedBy(td.lastEditedBy),
+	  metaFlags(td.metaFlags.load(std::memory_order_acquire)),
+	  solidPixel(td.solidPixel.load(std::memory_order_relaxed)),
+	  contentHash(td.contentHash.load(std::memory_order_relaxed))
+{
+	memcpy(pixels, td.pixels, sizeof pixels);
+#ifndef NDEBUG
+	_count.fetchAndAddOrdered(1);
+#endif
+}
+
 Tile::Tile(const QColor& color, int lastEditedBy)
 	: m_data(new TileData)
 {
@@ -198,6 +242,33 @@ void Tile::merge(const Tile &tile, uchar opacity, BlendMode::Mode blend)
 	}
 }
 
+int Tile::metadata() const
+{
+	Q_ASSERT(m_data);
+	const TileData *d = m_data.constData();
+
+	const int flags = d->metaFlags.load(std::memory_order_acquire);
+	if(flags & TileData::META_VALID)
+		return flags;
+
+	// Note: if more than one thread gets here at the same time,
+	// they will all store the same values.
+	// Most tiles that are not solid differ early on, so stop at the first different pixel.
+	const quint32 *pixel = d->pixels;
+	const quint32 first = pixel[0];
+	int i=1;
+	while(i<LENGTH && pixel[i] == first)
+		++i;
+
+	int newFlags = TileData::META_VALID;
+	if(i == LENGTH) {
+		newFlags |= TileData::META_SOLID;
+		d->solidPixel.store(first, std::memory_order_relaxed);
+	}
+
+	return d->metaFlags.fetch_or(newFlags, std::memory_order_release) | newFlags;
+}
+
 /**
  * @return true if every pixel of this tile has an alpha value of zero
  */
@@ -206,15 +277,8 @@ bool Tile::isBlank() const
 	if(isNull())
 		return true;
 
-	const quint32 *pixel = constData();
-	const quint32 *end = pixel + LENGTH;
-	while(pixel<end) {
-		// Note: colors are premultiplied so alpha=0 => rgb=0
-		if(*pixel)
-			return false;
-		++pixel;
-	}
-	return true;
+	// Note: colors are premultiplied so alpha=0 => rgb=0
+	return (metadata() & TileData::META_SOLID) && m_data->solidPixel.load(std::memory_order_relaxed) == 0;
 }
 
 QColor Tile::solidColor() const
@@ -222,16 +286,25 @@ QColor Tile::solidColor() const
 	if(isNull())
 		return Qt::transparent;
 
-	const quint32 *pixel = constData();
-	const quint32 *end = pixel + LENGTH;
-	const quint32 first = *(pixel++);
-	while(pixel<end) {
-		if(*pixel != first)
-			return QColor();
-		++pixel;
-	}
+	if(!(metadata() & TileData::META_SOLID))
+		return QColor();
+
+	return QColor::fromRgba(qUnpremultiply(m_data->solidPixel.load(std::memory_order_relaxed)));
+}
+
+quint64 Tile::contentHash() const
+{
+	if(isNull())
+		return blankTileHash();
 
-	return QColor::fromRgba(qUnpremultiply(first));
+	const TileData *d = m_data.constData();
+	if(d->metaFlags.load(std::memory_order_acquire) & TileData::META_HASHED)
+		return d->contentHash.load(std::memory_order_relaxed);
+
+	const quint64 hash = hashPixels(d->pixels);
+	d->contentHash.store(hash, std::memory_order_relaxed);
+	d->metaFlags.fetch_or(TileData::META_HASHED, std::memory_order_release);
+	return hash;
 }
 
 void Tile::setLastEditedBy(int id)
@@ -249,7 +322,11 @@ quint32 *Tile::data() {
 		memset(m_data->pixels, 0, BYTES);
 		m_data->lastEditedBy = 0;
 	}
-	return m_data->pixels;
+
+	// The caller may change the pixels, so the cached metadata can't be trusted anymore
+	TileData *d = m_data.data();
+	d->metaFlags.store(0, std::memory_order_relaxed);
+	return d->pixels;
 }
 
 bool Tile::equals(const Tile &other) const
@@ -262,15 +339,11 @@ bool Tile::equals(const Tile &other) const
 	if(isNull() || other.isNull())
 		return false;
 
-	// Both are not null: check content
-	const quint32 *d1 = m_data->pixels;
-	const quint32 *d2 = other.m_data->pixels;
-	for(int i=0;i<LENGTH;++i) {
-		if(*(d1++) != *(d2++))
-			return false;
-	}
+	// Both are not null: tiles with different hashes can't be the same
+	if(contentHash() != other.contentHash())
+		return false;
 
-	return true;
+	return memcmp(m_data->pixels, other.m_data->pixels, BYTES) == 0;
 }
 
 QDataStream &operator<<(QDataStream &ds, const Tile &t)
@@ -304,8 +377,6 @@ QDataStream &operator>>(QDataStream &ds, Tile &t)
 
 #ifndef NDEBUG
 QAtomicInt TileData::_count;
-TileData::TileData() { _count.fetchAndAddOrdered(1); }
-TileData::TileData(const TileData &td) : QSharedData() { memcpy(pixels, td.pixels, sizeof pixels); _count.fetchAndAddOrdered(1); }
 TileData::~TileData() { _count.fetchAndAddOrdered(-1); }
 #endif
 
@@ -28,6 +28,7 @@
 #endif
 
 #include <array>
+#include <atomic>
 
 class QColor;
 class QImage;
@@ -40,9 +41,23 @@ struct TileData : public QSharedData {
 	quint32 pixels[64*64]; // the pixel data
 	int lastEditedBy;     // ID of the user who last edited this tile
 
-#ifndef NDEBUG // Debug tool for measuring memory usage
+	// Content metadata cache. This is filled in on first use and
+	// cleared whenever write access to the pixels is requested.
+	// The solid color check and the content hash are calculated separately,
+	// since the hash is only needed when comparing or interning tiles.
+	enum MetadataFlag {
+		META_VALID = 0x01, // solid color check has been done
+		META_SOLID = 0x02, // every pixel is solidPixel
+		META_HASHED = 0x04 // contentHash has been calculated
+	};
+	mutable std::atomic<int> metaFlags;
+	mutable std::atomic<quint32> solidPixel;
+	mutable std::atomic<quint64> contentHash;
+
 	TileData();
 	TileData(const TileData &td);
+
+#ifndef NDEBUG // Debug tool for measuring memory usage
 	~TileData();
 
 	static int globalCount()
@@ -162,7 +177,11 @@ class Tile {
 		 */
 		bool isNull() const { return !m_data; }
 
-		//! Check if this tile is completely transparent
+		/**
+		 * @brief Check if this tile is completely transparent
+		 *
+		 * The result is cached, so only the first call scans the pixels.
+		 */
 		bool isBlank() const;
 
 		/**
@@ -172,6 +191,15 @@ class Tile {
 		 */
 		QColor solidColor() const;
 
+		/**
+		 * @brief Get a hash of the pixel content
+		 *
+		 * Tiles with identical content (including null and blank tiles)
+		 * have the same hash. This is calculated on first use and
+		 * cached until the tile is modified.
+		 */
+		quint64 contentHash() const;
+
 		//! Fill a tile sized memory buffer with a checker pattern
 		static void fillChecker(quint32 *data, const QColor& dark, const QColor& light);
 
@@ -197,6 +225,11 @@ class Tile {
 		friend uint qHash(const Tile &t, uint seed=0) { return qHash(reinterpret_cast<quintptr>(t.m_data.constData()), seed); }
 
 	private:
+		friend class TilePool;
+
+		//! Get the metadata flags, doing the solid color check if needed
+		int metadata() const;
+
 		QSharedDataPointer<TileData> m_data;
 };
 
@@ -0,0 +1,153 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tilepool.h"
+
+#include <QMultiHash>
+#include <QMutex>
+
+namespace paintcore {
+
+//! The pool is pruned when it has grown to this many tiles...
+static const int MIN_PRUNE_SIZE = 1024;
+
+//! ...or by this many tiles (or an eighth of its size, if larger) since the previous prune
+static const int PRUNE_INTERVAL = 256;
+
+namespace {
+
+struct Pool {
+	QMutex mutex;
+	QMultiHash<quint64, Tile> tiles;
+	int pruneAt = MIN_PRUNE_SIZE;
+	quint64 hits = 0;
+	bool enabled = true;
+};
+
+Pool &pool()
+{
+	static Pool p;
+	return p;
+}
+
+inline quint64 poolKey(const Tile &t)
+{
+	return t.contentHash() ^ (quint64(t.lastEditedBy()) * 0x9e3779b97f4a7c15ull);
+}
+
+}
+
+int TilePool::refCount(const Tile &tile)
+{
+#if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
+	return tile.m_data->ref.load();
+#else
+	return tile.m_data->ref.loadRelaxed();
+#endif
+}
+
+void TilePool::setEnabled(bool enabled)
+{
+	Pool &p = pool();
+	QMutexLocker lock(&p.mutex);
+	p.enabled = enabled;
+	if(!enabled) {
+		p.tiles.clear();
+		p.pruneAt = MIN_PRUNE_SIZE;
+	}
+}
+
+bool TilePool::isEnabled()
+{
+	Pool &p = pool();
+	QMutexLocker lock(&p.mutex);
+	return p.enabled;
+}
+
+Tile TilePool::intern(const Tile &tile)
+{
+	if(tile.isNull())
+		return tile;
+
+	// Calculate the hash before locking the pool
+	const quint64 key = poolKey(tile);
+
+	Pool &p = pool();
+	QMutexLocker lock(&p.mutex);
+	if(!p.enabled)
+		return tile;
+
+	for(auto i=p.tiles.constFind(key);i!=p.tiles.constEnd() && i.key()==key;++i) {
+		if(i.value() == tile)
+			return tile;
+
+		if(i.value().lastEditedBy() == tile.lastEditedBy() && i.value().equals(tile)) {
+			++p.hits;
+			return i.value();
+		}
+	}
+
+	p.tiles.insert(key, tile);
+
+	if(p.tiles.size() >= p.pruneAt) {
+		pruneLocked();
+		p.pruneAt = qMax(MIN_PRUNE_SIZE, p.tiles.size() + qMax(PRUNE_INTERVAL, p.tiles.size() / 8));
+	}
+
+	return tile;
+}
+
+void TilePool::prune()
+{
+	Pool &p = pool();
+	QMutexLocker lock(&p.mutex);
+	pruneLocked();
+}
+
+void TilePool::pruneLocked()
+{
+	// If the pool holds the only reference, no one else can be
+	// making a copy of the tile at the same time.
+	Pool &p = pool();
+	auto i = p.tiles.begin();
+	while(i != p.tiles.end()) {
+		if(refCount(i.value()) <= 1)
+			i = p.tiles.erase(i);
+		else
+			++i;
+	}
+}
+
+TilePool::Stats TilePool::stats()
+{
+	Pool &p = pool();
+	QMutexLocker lock(&p.mutex);
+
+	Stats s { 0, 0, p.hits };
+	for(const Tile &t : p.tiles) {
+		const int refs = refCount(t) - 1;
+		if(refs > 0) {
+			++s.tiles;
+			s.references += refs;
+		}
+	}
+	return s;
+}
+
+}
@@ -0,0 +1,87 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILEPOOL_H
+#define PAINTCORE_TILEPOOL_H
+
+#include "tile.h"
+
+namespace paintcore {
+
+/**
+ * @brief A global pool of tiles, indexed by content
+ *
+ * Tiles share their pixel data only when copied from one another.
+ * Identical tiles created separately (e.g. decoded from messages) each
+ * have their own copy of the data. Interning a tile replaces it with
+ * a tile from the pool that has identical content, if there is one.
+ *
+ * Tiles no longer referenced outside the pool are dropped from it
+ * periodically as the pool grows. prune() should also be called when
+ * a large number of tiles is released at once (e.g. when savepoints are dropped.)
+ *
+ * All functions are thread safe.
+ */
+class TilePool {
+public:
+	struct Stats {
+		int tiles;       // number of tiles in the pool that are in use
+		int references;  // number of references to those tiles outside the pool
+		quint64 hits;    // number of times a tile was replaced with a pooled one
+
+		//! Memory used by the pooled tiles
+		qint64 bytes() const { return qint64(tiles) * Tile::BYTES; }
+
+		//! Average number of references per pooled tile
+		float ratio() const { return tiles > 0 ? references / float(tiles) : 0; }
+	};
+
+	/**
+	 * @brief Enable or disable interning
+	 *
+	 * When disabled, the pool is emptied and intern() returns its
+	 * argument as is. Interning is enabled by default.
+	 */
+	static void setEnabled(bool enabled);
+	static bool isEnabled();
+
+	/**
+	 * @brief Get the pooled tile with the same content as the given one
+	 *
+	 * If there is no such tile yet, the given tile is added to the pool.
+	 * The content includes the last edited by tag.
+	 *
+	 * The tile should be one that will not be modified anymore, since a
+	 * pooled tile is copied on the first write.
+	 */
+	static Tile intern(const Tile &tile);
+
+	//! Drop tiles that are not used outside the pool
+	static void prune();
+
+	//! Get pool usage statistics
+	static Stats stats();
+
+private:
+	static int refCount(const Tile &tile);
+	static void pruneLocked();
+};
+
+}
+
+#endif
@@ -19,8 +19,10 @@
 
 #include "tilevector.h"
 #include "layer.h"
+#include "concurrent.h"
 #include "../libshared/net/layer.h"
 #include "../libshared/net/image.h"
+#include "../libshared/net/pixelcodec.h"
 
 #include <QImage>
 
@@ -33,16 +35,34 @@ LayerTileSet LayerTileSet::fromLayer(const Layer &layer)
 
 	Q_ASSERT(!tiles.isEmpty());
 
+	// Comparing tiles and checking for solid colors requires looking at
+	// every pixel, so do that part in parallel.
+	// Note: consecutive identical tiles are compared to their predecessor rather than
+	// the first tile of the run, which is equivalent since equality is transitive.
+	QVector<QColor> solidColors(tiles.size());
+	QVector<bool> sameAsPrevious(tiles.size());
+	{
+		QColor *colorPtr = solidColors.data();
+		bool *samePtr = sameAsPrevious.data();
+		concurrentFor(tiles.size(), [&tiles, colorPtr, samePtr](int i) {
+			samePtr[i] = i > 0 && tiles.at(i-1).equals(tiles.at(i));
+			if(!samePtr[i])
+				colorPtr[i] = tiles.at(i).solidColor();
+		});
+	}
+
 	QVector<TileRun> runs;
 
 	// First, Run Length Encode the tile vector
-	runs << TileRun { tiles.first(), 0, 0, 1, tiles.first().solidColor() };
+	runs << TileRun { tiles.first(), 0, 0, 1, solidColors.first() };
 
 	for(int i=1;i<tiles.size();++i) {
-		if(runs.last().len < 0xffff && runs.last().tile.equals(tiles.at(i))) {
+		if(runs.last().len < 0xffff && sameAsPrevious.at(i)) {
 			runs.last().len++;
 		} else {
-			runs << TileRun { tiles.at(i), i%cols, i/cols, 1, tiles.at(i).solidColor() };
+			// If the run length limit was reached, the color is the same as in the previous run
+			const QColor color = sameAsPrevious.at(i) ? runs.last().color : solidColors.at(i);
+			runs << TileRun { tiles.at(i), i%cols, i/cols, 1, color };
 		}
 	}
 
@@ -93,21 +113,33 @@ LayerTileSet LayerTileSet::fromImage(const QImage &image, const QSize &layerSize
 
 void LayerTileSet::toPutTiles(uint8_t contextId, uint16_t layerId, uint8_t sublayer, protocol::MessageList &msgs) const
 {
-	for(const TileRun &t : tiles) {
+	// Compress the tiles in parallel. The messages are then generated
+	// in order, so the result is the same as when done serially.
+	QVector<QByteArray> compressed(tiles.size());
+	{
+		const TileRun *runs = tiles.constData();
+		QByteArray *compressedPtr = compressed.data();
+		concurrentFor(tiles.size(), [runs, compressedPtr](int i) {
+			if(!runs[i].color.isValid()) {
+				Q_ASSERT(!runs[i].tile.isNull());
+				compressedPtr[i] = protocol::compressPixels(reinterpret_cast<const uchar*>(runs[i].tile.constData()), paintcore::Tile::BYTES, 4);
+			}
+		});
+	}
+
+	for(int i=0;i<tiles.size();++i) {
+		const TileRun &t = tiles.at(i);
 		Q_ASSERT(t.len>0);
 
 		if(t.color.isValid()) {
 			msgs << protocol::MessagePtr(new protocol::PutTile(contextId, layerId, sublayer, t.col, t.row, t.len-1, t.color.rgba()));
 
 		} else {
-			Q_ASSERT(!t.tile.isNull());
-
 			msgs << protocol::MessagePtr(new protocol::PutTile(contextId, layerId, sublayer, t.col, t.row, t.len-1,
-				qCompress(reinterpret_cast<const uchar*>(t.tile.constData()), paintcore::Tile::BYTES)
+				compressed.at(i)
 				));
 		}
 	}
 }
 
 }
-
@@ -63,6 +63,9 @@ struct LayerTileSet {
 
 	/**
 	 * @brief Generate PutTiles commands
+	 *
+	 * The tiles are compressed in parallel.
+	 *
 	 * @param contextid the message context ID to use
 	 * @param layerId target layer ID
 	 * @param sublayer target sublayer (0 for normal layers)
@@ -30,6 +30,7 @@
 #include "canvas/loader.h"
 #include "canvas/userlist.h"
 #include "canvas/canvassaverrunnable.h"
+#include "canvas/snapshotrunnable.h"
 #include "canvas/loader.h"
 #include "tools/toolcontroller.h"
 #include "utils/images.h"
@@ -59,6 +60,8 @@ Document::Document(QObject *parent)
 	  m_autosave(false),
 	  m_canAutosave(false),
 	  m_saveInProgress(false),
+	  m_snapshotInProgress(false),
+	  m_snapshotGeneration(0),
 	  m_sessionPersistent(false),
 	  m_sessionClosed(false),
 	  m_sessionAuthOnly(false),
@@ -106,6 +109,7 @@ Document::~Document()
 
 void Document::initCanvas()
 {
+	discardPendingSnapshot();
 	delete m_canvas;
 	m_canvas = new canvas::CanvasModel(m_client->myId(), this);
 
@@ -172,6 +176,8 @@ bool Document::loadCanvas(canvas::SessionLoader &loader)
 
 void Document::onServerLogin(bool join)
 {
+	discardPendingSnapshot();
+
 	if(join)
 		initCanvas();
 
@@ -196,6 +202,8 @@ void Document::onServerLogin(bool join)
 
 void Document::onServerDisconnect()
 {
+	discardPendingSnapshot();
+
 	if(m_canvas) {
 		m_canvas->disconnectedFromServer();
 		m_canvas->setTitle(QString());
@@ -710,42 +718,32 @@ void Document::snapshotNeeded()
 	// (We) requested a session reset and the server is now ready for it.
 	if(m_canvas) {
 		if(m_resetstate.isEmpty()) {
-			qInfo("Generating snapshot for session reset...");
+			if(m_snapshotInProgress)
+				return;
+
 			if(m_canvas->layerStack()->size().isEmpty()) {
 				qWarning("Canvas has no size! Cannot generate reset snapshot!");
 				m_client->sendMessage(net::command::serverCommand("init-cancel"));
 				return;
 			}
-			 auto loader = canvas::SnapshotLoader(
-				m_client->myId(),
-				m_canvas->layerStack(),
-				m_canvas->aclFilter());
-			 loader.setDefaultLayer(m_canvas->layerlist()->defaultLayer());
-			 loader.setPinnedMessage(m_canvas->pinnedMessage());
-
-			 m_resetstate = loader.loadInitCommands();
-		}
 
-		// Size limit check. The server will kick us if we send an oversized reset.
-		if(m_sessionHistoryMaxSize>0) {
-			int resetsize = 0;
-			for(protocol::MessagePtr msg : m_resetstate)
-				resetsize += msg->length();
+			// Compressing the tiles of a big canvas takes a while,
+			// so the snapshot is generated in a background thread.
+			qInfo("Generating snapshot for session reset...");
+			m_snapshotInProgress = true;
 
-			if(resetsize > m_sessionHistoryMaxSize) {
-				qWarning("Reset snapshot (%d) is larger than the size limit (%d)!", resetsize, m_sessionHistoryMaxSize);
-				emit autoResetTooLarge(m_sessionHistoryMaxSize);
-				m_resetstate.clear();
-				m_client->sendMessage(net::command::serverCommand("init-cancel"));
-				return;
-			}
-		}
+			// Anything drawn while the snapshot is generated is sent after it
+			m_client->holdCommands();
 
-		m_client->sendMessage(net::command::serverCommand("init-begin"));
-		m_client->sendResetMessages(m_resetstate);
-		m_client->sendMessage(net::command::serverCommand("init-complete"));
+			auto *generator = new canvas::SnapshotRunnable(m_client->myId(), m_canvas, m_snapshotGeneration);
+			connect(generator, &canvas::SnapshotRunnable::progress, this, &Document::snapshotProgress);
+			connect(generator, &canvas::SnapshotRunnable::snapshotReady, this, &Document::onSnapshotReady);
+			connect(generator, &canvas::SnapshotRunnable::snapshotReady, generator, &QObject::deleteLater);
+			QThreadPool::globalInstance()->start(generator);
+			return;
+		}
 
-		m_resetstate = protocol::MessageList();
+		sendResetSnapshot();
 
 	} else {
 		qWarning("Server requested snapshot, but canvas is not yet initialized!");
@@ -753,6 +751,70 @@ void Document::snapshotNeeded()
 	}
 }
 
+void Document::onSnapshotReady()
+{
+	auto *generator = qobject_cast<canvas::SnapshotRunnable*>(sender());
+	Q_ASSERT(generator);
+
+	// Taking the snapshot here keeps all message reference counting in this thread
+	const protocol::MessageList snapshot = generator->takeSnapshot();
+
+	if(generator->generation() != m_snapshotGeneration) {
+		qInfo("Discarding reset snapshot generated for a previous session");
+		return;
+	}
+
+	m_snapshotInProgress = false;
+
+	if(!m_canvas) {
+		qWarning("Reset snapshot generated, but the canvas is gone!");
+		return;
+	}
+
+	m_resetstate = snapshot;
+	sendResetSnapshot();
+}
+
+void Document::discardPendingSnapshot()
+{
+	// Snapshots still being generated in the background were made from
+	// a canvas or session that is no longer current. They will be dropped
+	// when they arrive.
+	++m_snapshotGeneration;
+	m_snapshotInProgress = false;
+
+	// The held commands were drawn on a canvas that is no longer current
+	m_client->releaseHeldCommands();
+}
+
+void Document::sendResetSnapshot()
+{
+	// Size limit check. The server will kick us if we send an oversized reset.
+	if(m_sessionHistoryMaxSize>0) {
+		int resetsize = 0;
+		for(protocol::MessagePtr msg : m_resetstate)
+			resetsize += msg->length();
+
+		if(resetsize > m_sessionHistoryMaxSize) {
+			qWarning("Reset snapshot (%d) is larger than the size limit (%d)!", resetsize, m_sessionHistoryMaxSize);
+			emit autoResetTooLarge(m_sessionHistoryMaxSize);
+			m_resetstate.clear();
+			m_client->sendMessage(net::command::serverCommand("init-cancel"));
+			m_client->sendResetMessages(m_client->releaseHeldCommands());
+			return;
+		}
+	}
+
+	// Commands drawn while the snapshot was being generated (if any)
+	// are not in it, so they are sent as the last part of the reset
+	m_client->sendMessage(net::command::serverCommand("init-begin"));
+	m_client->sendResetMessages(m_resetstate);
+	m_client->sendResetMessages(m_client->releaseHeldCommands());
+	m_client->sendMessage(net::command::serverCommand("init-complete"));
+
+	m_resetstate = protocol::MessageList();
+}
+
 void Document::undo()
 {
 	if(!m_canvas)
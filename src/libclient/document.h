@@ -182,6 +182,7 @@ signals:
 	void autoResetTooLarge(int maxSize);
 
 	void catchupProgress(int perent);
+	void snapshotProgress(int percent);
 
 	void canvasSaveStarted();
 	void canvasSaved(const QString &errorMessage);
@@ -231,6 +232,7 @@ private slots:
 	void onAutoresetRequested(int maxSize, bool query);
 
 	void snapshotNeeded();
+	void onSnapshotReady();
 	void markDirty();
 	void unmarkDirty();
 
@@ -239,6 +241,8 @@ private slots:
 
 private:
 	void saveCanvas();
+	void discardPendingSnapshot();
+	void sendResetSnapshot();
 	bool startRecording(const QString &filename, const protocol::MessageList &initialState, QString *error);
 	void setCurrentFilename(const QString &filename);
 	void setSessionPersistent(bool p);
@@ -277,6 +281,8 @@ private:
 	bool m_autosave;
 	bool m_canAutosave;
 	bool m_saveInProgress;
+	bool m_snapshotInProgress;
+	int m_snapshotGeneration;
 	QTimer *m_autosaveTimer;
 
 	QString m_roomcode;
@@ -38,6 +38,7 @@ namespace net {
 
 Client::Client(QObject *parent)
 	: QObject(parent), m_myId(1), m_recordedChat(false),
+	  m_holdCommands(false),
 	  m_catchupTo(0), m_caughtUp(0), m_catchupProgress(0)
 {
 	m_loopback = new LoopbackServer(this);
@@ -136,8 +137,13 @@ void Client::sendMessage(const protocol::MessagePtr &msg)
 #endif
 
 	// Command type messages go to the local fork too
-	if(msg->isCommand())
+	if(msg->isCommand()) {
 		emit drawingCommandLocal(msg);
+		if(m_holdCommands) {
+			m_heldCommands << msg;
+			return;
+		}
+	}
 
 	m_server->sendMessage(msg);
 }
@@ -153,6 +159,20 @@ void Client::sendMessages(const protocol::MessageList &msgs)
 		if(msg->isCommand())
 			emit drawingCommandLocal(msg);
 	}
+
+	if(m_holdCommands) {
+		protocol::MessageList unheld;
+		for(const protocol::MessagePtr &msg : msgs) {
+			if(msg->isCommand())
+				m_heldCommands << msg;
+			else
+				unheld << msg;
+		}
+		if(!unheld.isEmpty())
+			m_server->sendMessages(unheld);
+		return;
+	}
+
 	m_server->sendMessages(msgs);
 }
 
@@ -161,6 +181,19 @@ void Client::sendResetMessages(const protocol::MessageList &msgs)
 	m_server->sendMessages(msgs);
 }
 
+void Client::holdCommands()
+{
+	m_holdCommands = true;
+}
+
+protocol::MessageList Client::releaseHeldCommands()
+{
+	m_holdCommands = false;
+	const protocol::MessageList held = m_heldCommands;
+	m_heldCommands = protocol::MessageList();
+	return held;
+}
+
 void Client::handleMessage(const protocol::MessagePtr &msg)
 {
 	if(m_catchupTo>0) {
@@ -177,6 +177,26 @@ public slots:
 	//! Send messages as part of a session reset/init
 	void sendResetMessages(const protocol::MessageList &msgs);
 
+	/**
+	 * @brief Hold back outgoing drawing commands
+	 *
+	 * This is used while a reset snapshot is generated in the background.
+	 * Commands drawn meanwhile are not in the snapshot, so they must be sent
+	 * after it as part of the reset. They are still applied to the local
+	 * canvas right away.
+	 */
+	void holdCommands();
+
+	/**
+	 * @brief Stop holding back drawing commands
+	 *
+	 * The held commands are not sent. It is up to the caller to send them
+	 * with sendResetMessages or to drop them.
+	 *
+	 * @return the commands held since holdCommands() was called
+	 */
+	protocol::MessageList releaseHeldCommands();
+
 signals:
 	void messageReceived(protocol::MessagePtr msg);
 	void drawingCommandLocal(protocol::MessagePtr msg);
@@ -221,6 +241,9 @@ private:
 	bool m_isAuthenticated;
 	bool m_supportsAutoReset;
 
+	bool m_holdCommands;
+	protocol::MessageList m_heldCommands;
+
 	int m_catchupTo;
 	int m_caughtUp;
 	int m_catchupProgress;
@@ -21,6 +21,7 @@
 
 #include "../libshared/net/control.h"
 #include "../libshared/net/image.h"
+#include "../libshared/net/pixelcodec.h"
 
 #include <QImage>
 
@@ -60,7 +61,7 @@ void splitImage(uint8_t ctxid, uint16_t layer, int x, int y, const QImage &image
 		image.sizeInBytes()
 #endif
 		);
-	QByteArray compressed = qCompress(data);
+	QByteArray compressed = protocol::compressPixels(reinterpret_cast<const uchar*>(data.constData()), data.length(), 4);
 
 	if(compressed.length() > protocol::PutImage::MAX_LEN) {
 		// Too big! Recursively divide the image and try sending those
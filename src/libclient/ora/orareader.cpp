@@ -27,6 +27,7 @@
 
 #include "../libshared/net/layer.h"
 #include "../libshared/net/image.h"
+#include "../libshared/net/pixelcodec.h"
 #include "../libshared/net/annotation.h"
 #include "../libshared/net/meta2.h"
 #include "utils/images.h"
@@ -471,7 +472,7 @@ static OraResult makeInitCommands(KZip &zip, const Canvas &canvas)
 				if(isSolidColor)
 					result.commands << MessagePtr(new protocol::CanvasBackground(ctxId, color));
 				else
-					result.commands << MessagePtr(new protocol::CanvasBackground(ctxId, qCompress(bgimage.constBits(), paintcore::Tile::BYTES)));
+					result.commands << MessagePtr(new protocol::CanvasBackground(ctxId, protocol::compressPixels(bgimage.constBits(), paintcore::Tile::BYTES, 4)));
 
 				continue;
 			}
@@ -25,34 +25,15 @@
 
 namespace recording {
 
-IndexEntry IndexEntry::nearest(const QVector<IndexEntry> &index, int pos)
-{
-	Q_ASSERT(!index.isEmpty());
-
-	int i=0;
-	while(i<index.size() && int(index.at(i).index) < pos)
-		++i;
-	return index.at(qMax(0, i-1));
-}
-
-QDataStream &operator<<(QDataStream &ds, const IndexEntry &ie)
+QDataStream &operator<<(QDataStream &ds, const IndexedEntry &ie)
 {
 	return ds
 		<< ie.index
+		<< ie.reserved
 		<< ie.messageOffset
 		<< ie.snapshotOffset
-		<< ie.title
-		<< ie.thumbnail;
-}
-
-QDataStream &operator>>(QDataStream &ds, IndexEntry &ie)
-{
-	return ds
-		>> ie.index
-		>> ie.messageOffset
-		>> ie.snapshotOffset
-		>> ie.title
-		>> ie.thumbnail;
+		<< ie.titleOffset
+		<< ie.thumbnailOffset;
 }
 
 QDataStream &operator<<(QDataStream &ds, const IndexedLayer &i)
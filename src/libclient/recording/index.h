@@ -21,7 +21,6 @@
 
 #include <QVector>
 #include <QString>
-#include <QImage>
 
 namespace recording {
 
@@ -37,21 +36,8 @@ struct IndexEntry {
 
 	//! Title of this entry (if this is a marker)
 	QString title;
-
-	//! The thumbnail of this entry
-	QImage thumbnail;
-
-	/**
-	 * Find the index entry closest to the given position, such that entry.index <= pos.
-	 *
-	 * @return stop index or 0 if not found
-	 */
-	static IndexEntry nearest(const QVector<IndexEntry> &index, int pos);
 };
 
-QDataStream &operator>>(QDataStream&, IndexEntry&);
-QDataStream &operator<<(QDataStream&, const IndexEntry&);
-
 //! Hash the recording file
 QByteArray hashRecording(const QString &filename);
 
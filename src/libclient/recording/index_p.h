@@ -28,11 +28,42 @@
 namespace recording {
 
 //! Index format version
-static const quint32 INDEX_VERSION = 7;
+static const quint32 INDEX_VERSION = 8;
+
+/*
+ * Index file layout (all integers are big-endian):
+ *
+ *   "DPIDX"
+ *   quint32 INDEX_VERSION
+ *   QByteArray recording hash
+ *   quint64 entry table offset
+ *   quint32 number of entries
+ *   quint32 number of messages in the recording
+ *   ...snapshot data, titles and thumbnails...
+ *   entry table
+ *
+ * The entry table is an array of fixed size records, so that the index can be
+ * searched directly from the memory mapped file without loading it first.
+ * All offsets are 64 bit. An offset of zero means "none".
+ */
+
+//! Size of an entry table record
+static const int INDEX_ENTRY_SIZE = 40;
+
+struct IndexedEntry {
+	quint32 index;           // Number of the message in the recording file
+	quint32 reserved;        // Always zero (for now)
+	qint64 messageOffset;    // Message position in the recording file
+	quint64 snapshotOffset;  // IndexedLayerStack offset
+	quint64 titleOffset;     // Marker title (QString) offset
+	quint64 thumbnailOffset; // Thumbnail (QImage) offset
+};
+
+QDataStream &operator<<(QDataStream&, const IndexedEntry&);
 
 struct IndexedLayer {
-	QVector<quint32> tileOffsets;
-	QVector<quint32> sublayerOffsets;
+	QVector<quint64> tileOffsets;
+	QVector<quint64> sublayerOffsets;
 	paintcore::LayerInfo info;
 };
 
@@ -40,9 +71,9 @@ QDataStream &operator>>(QDataStream&, IndexedLayer&);
 QDataStream &operator<<(QDataStream&, const IndexedLayer&);
 
 struct IndexedLayerStack {
-	QVector<quint32> layerOffsets;
-	QVector<quint32> annotationOffsets;
-	quint32 backgroundTileOffset;
+	QVector<quint64> layerOffsets;
+	QVector<quint64> annotationOffsets;
+	quint64 backgroundTileOffset;
 	QSize size;
 };
 
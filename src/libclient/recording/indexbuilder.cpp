@@ -34,11 +34,19 @@
 #include <QDebug>
 #include <QElapsedTimer>
 #include <QSaveFile>
+#include <QImage>
+#include <QMutex>
+#include <QQueue>
+#include <QSet>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QWaitCondition>
 
 namespace recording {
 
 IndexBuilder::IndexBuilder(const QString &inputfile, const QString &targetfile, const QByteArray &hash, QObject *parent)
-	: QObject(parent), m_inputfile(inputfile), m_targetfile(targetfile), m_recordingHash(hash)
+	: QObject(parent), m_inputfile(inputfile), m_targetfile(targetfile), m_recordingHash(hash),
+	  m_snapshotInterval(500)
 {
 }
 
@@ -74,7 +82,8 @@ void IndexBuilder::run()
 	stream << INDEX_VERSION;
 	stream << m_recordingHash;
 	const auto indexOffsetPos = stream.device()->pos();
-	stream << quint32(0); // placeholder (index entry vector offset)
+	stream << quint64(0); // placeholder (entry table offset)
+	stream << quint32(0); // placeholder (number of entries)
 	stream << quint32(0); // placeholder (number of messages in recording)
 
 	// Generate index and write snapshots and thumbnails
@@ -83,16 +92,21 @@ void IndexBuilder::run()
 		return;
 	}
 
+	// Write the entry table
+	const quint64 indexOffset = quint64(stream.device()->pos());
+	for(const IndexedEntry &entry : m_index)
+		stream << entry;
+
 	// Fill in the placeholders
-	const auto indexOffset = stream.device()->pos();
 	stream.device()->seek(indexOffsetPos);
-	stream << quint32(indexOffset);
+	stream << indexOffset;
+	stream << quint32(m_index.size());
 	stream << quint32(m_messageCount);
-	stream.device()->seek(indexOffset);
 
-	// Write the index
-	for(const IndexEntry &entry : m_index)
-		stream << entry;
+	if(stream.status() != QDataStream::Ok) {
+		emit done(false, outfile.errorString());
+		return;
+	}
 
 	// Done!
 	if(!outfile.commit()) {
@@ -105,81 +119,128 @@ void IndexBuilder::run()
 
 namespace {
 
-// Tile --> index file offset mapping
-typedef QHash<paintcore::Tile, quint32> IndexedTiles;
+/**
+ * Tile --> index file offset mapping
+ *
+ * Tiles are primarily matched by identity, but tiles with identical content
+ * are deduplicated as well.
+ */
+struct IndexedTiles {
+	QHash<paintcore::Tile, quint64> offsets;
+	QMultiHash<quint64, paintcore::Tile> byContent;
+
+	void insert(const paintcore::Tile &tile, quint64 offset)
+	{
+		if(!offsets.contains(tile)) {
+			offsets[tile] = offset;
+			byContent.insert(tile.contentHash(), tile);
+		}
+	}
+
+	bool find(const paintcore::Tile &tile, quint64 &offset) const
+	{
+		const auto i = offsets.constFind(tile);
+		if(i != offsets.constEnd()) {
+			offset = *i;
+			return true;
+		}
+
+		auto c = byContent.constFind(tile.contentHash());
+		while(c != byContent.constEnd() && c.key() == tile.contentHash()) {
+			if(c->lastEditedBy() == tile.lastEditedBy() && c->equals(tile)) {
+				offset = offsets[*c];
+				return true;
+			}
+			++c;
+		}
+		return false;
+	}
+};
+
+// Tile --> compressed pixel data
+typedef QHash<paintcore::Tile, QByteArray> CompressedTiles;
+
+static QByteArray compressTile(const paintcore::Tile &tile)
+{
+	return qCompress(reinterpret_cast<const uchar*>(tile.constData()), paintcore::Tile::BYTES);
+}
 
-static quint32 writeTile(QDataStream &stream, const IndexedTiles &oldTileMap, IndexedTiles &newTileMap, const paintcore::Tile &tile)
+static quint64 writeTile(QDataStream &stream, const IndexedTiles &oldTileMap, IndexedTiles &newTileMap, const CompressedTiles &compressed, const paintcore::Tile &tile)
 {
-	quint32 tileOffset;
+	quint64 tileOffset;
 	if(tile.isNull()) {
 		tileOffset = 0;
 
-	} else if(newTileMap.contains(tile)) {
-		tileOffset = newTileMap[tile];
+	} else if(newTileMap.find(tile, tileOffset)) {
+		// Already written as a part of this snapshot
 
-	} else if(oldTileMap.contains(tile)) {
-		tileOffset = oldTileMap[tile];
-		newTileMap[tile] = tileOffset;
+	} else if(oldTileMap.find(tile, tileOffset)) {
+		newTileMap.insert(tile, tileOffset);
 
 	} else {
-		tileOffset = quint32(stream.device()->pos());
-		stream << tile;
-		newTileMap[tile] = tileOffset;
+		tileOffset = quint64(stream.device()->pos());
+
+		// Same format as operator<<(QDataStream&, const Tile&)
+		const QByteArray data = compressed.value(tile);
+		stream << (data.isNull() ? compressTile(tile) : data) << tile.lastEditedBy();
+
+		newTileMap.insert(tile, tileOffset);
 	}
 
 	return tileOffset;
 }
 
-static quint32 writeLayer(QDataStream &stream, const paintcore::Layer *layer, const IndexedTiles &oldTileMap, IndexedTiles &newTileMap, bool writeSublayers=true)
+static quint64 writeLayer(QDataStream &stream, const paintcore::Layer *layer, const IndexedTiles &oldTileMap, IndexedTiles &newTileMap, const CompressedTiles &compressed, bool writeSublayers=true)
 {
 	IndexedLayer indexedLayer {
-		QVector<quint32>(),
-		QVector<quint32>(),
+		QVector<quint64>(),
+		QVector<quint64>(),
 		layer->info()
 	};
 
 	if(writeSublayers) {
 		for(const paintcore::Layer *sublayer : layer->sublayers()) {
 			if(sublayer->id() > 0) {
-				indexedLayer.sublayerOffsets << writeLayer(stream, sublayer, oldTileMap, newTileMap, false);
+				indexedLayer.sublayerOffsets << writeLayer(stream, sublayer, oldTileMap, newTileMap, compressed, false);
 			}
 		}
 	}
 
-	indexedLayer.tileOffsets.reserve(layer->tiles().size());
-	for(const paintcore::Tile &tile : layer->tiles()) {
-		indexedLayer.tileOffsets << writeTile(stream, oldTileMap, newTileMap, tile);
+	const QVector<paintcore::Tile> tiles = layer->tiles();
+	indexedLayer.tileOffsets.reserve(tiles.size());
+	for(const paintcore::Tile &tile : tiles) {
+		indexedLayer.tileOffsets << writeTile(stream, oldTileMap, newTileMap, compressed, tile);
 	}
 
 	// Dependencies written, write the actual layer now
-	const quint32 layerOffset = quint32(stream.device()->pos());
+	const quint64 layerOffset = quint64(stream.device()->pos());
 	stream << indexedLayer;
 
 	return layerOffset;
 }
 
-static quint32 writeAnnotation(QDataStream &stream, const paintcore::Annotation &annotation)
+static quint64 writeAnnotation(QDataStream &stream, const paintcore::Annotation &annotation)
 {
-	const auto pos = quint32(stream.device()->pos());
+	const auto pos = quint64(stream.device()->pos());
 	annotation.toDataStream(stream);
 	return pos;
 }
 
 struct LayerStackWriteResult {
 	IndexedTiles tileMap;
-	quint32 offset;
+	quint64 offset;
 };
 
-static LayerStackWriteResult writeLayerStack(QDataStream &stream, const paintcore::Savepoint &savepoint, const IndexedTiles &oldTileMap)
+static LayerStackWriteResult writeLayerStack(QDataStream &stream, const paintcore::Savepoint &savepoint, const IndexedTiles &oldTileMap, const CompressedTiles &compressed)
 {
 	LayerStackWriteResult result;
 	IndexedLayerStack indexedStack;
 
-	indexedStack.backgroundTileOffset = writeTile(stream, oldTileMap, result.tileMap, savepoint.background);
+	indexedStack.backgroundTileOffset = writeTile(stream, oldTileMap, result.tileMap, compressed, savepoint.background);
 
-	for(const paintcore::Layer *layer : savepoint.layers) {
+	for(const QSharedPointer<const paintcore::Layer> &layer : savepoint.layers) {
 		// TODO deduplicate?
-		indexedStack.layerOffsets << writeLayer(stream, layer, oldTileMap, result.tileMap);
+		indexedStack.layerOffsets << writeLayer(stream, layer.data(), oldTileMap, result.tileMap, compressed);
 	}
 
 	for(const paintcore::Annotation &annotation : savepoint.annotations) {
@@ -189,17 +250,196 @@ static LayerStackWriteResult writeLayerStack(QDataStream &stream, const paintcor
 
 	indexedStack.size = savepoint.size;
 
-	result.offset = quint32(stream.device()->pos());
+	result.offset = quint64(stream.device()->pos());
 	stream << indexedStack;
 
 	return result;
 }
 
+/**
+ * A snapshot waiting to be written into the index.
+ *
+ * The savepoints are immutable, so the expensive parts of writing a
+ * snapshot (compressing and hashing the new tiles and rendering the thumbnail)
+ * can be done in a worker thread.
+ */
+struct SnapshotJob {
+	// Input
+	canvas::StateSavepoint savepoint;
+	paintcore::Savepoint previous;
+	bool makeThumbnail;
+	IndexedEntry entry;
+	QString title;
+
+	// Output (valid once done is set)
+	CompressedTiles compressedTiles;
+	QByteArray thumbnail; // serialized QImage
+	bool done = false;
+
+	void prepare();
+};
+
+static void collectTiles(const paintcore::Layer *layer, QVector<paintcore::Tile> &tiles)
+{
+	for(const paintcore::Layer *sublayer : layer->sublayers()) {
+		if(sublayer->id() > 0)
+			tiles += sublayer->tiles();
+	}
+	tiles += layer->tiles();
+}
+
+void SnapshotJob::prepare()
+{
+	const paintcore::Savepoint sp = savepoint.canvas();
+
+	// Unchanged layers are shared with the previous savepoint.
+	// Their tiles are all in the previous snapshot's tile map already.
+	QSet<const paintcore::Layer*> currentLayers;
+	for(const auto &layer : sp.layers)
+		currentLayers << layer.data();
+
+	QSet<const paintcore::Layer*> previousLayers;
+	QVector<paintcore::Tile> previousTiles { previous.background };
+	for(const auto &layer : previous.layers) {
+		previousLayers << layer.data();
+		if(!currentLayers.contains(layer.data()))
+			collectTiles(layer.data(), previousTiles);
+	}
+
+	QSet<paintcore::Tile> oldTiles;
+	oldTiles.reserve(previousTiles.size());
+	for(const paintcore::Tile &t : previousTiles)
+		oldTiles << t;
+
+	// Compress the tiles that will (probably) be written
+	QVector<paintcore::Tile> tiles { sp.background };
+	for(const auto &layer : sp.layers) {
+		if(!previousLayers.contains(layer.data()))
+			collectTiles(layer.data(), tiles);
+	}
+
+	for(const paintcore::Tile &t : tiles) {
+		if(t.isNull() || oldTiles.contains(t) || compressedTiles.contains(t))
+			continue;
+
+		// Prime the content hash cache for the deduplication check
+		t.contentHash();
+		compressedTiles[t] = compressTile(t);
+	}
+
+	if(makeThumbnail) {
+		QDataStream ds(&thumbnail, QIODevice::WriteOnly);
+		ds << savepoint.thumbnail(QSize(171, 128));
+	}
+}
+
+struct PipelineSync {
+	QMutex mutex;
+	QWaitCondition jobDone;
+};
+
+class SnapshotPreparer : public QRunnable
+{
+public:
+	SnapshotPreparer(const QSharedPointer<SnapshotJob> &job, const QSharedPointer<PipelineSync> &sync)
+		: m_job(job), m_sync(sync)
+	{ }
+
+	void run() override
+	{
+		m_job->prepare();
+
+		QMutexLocker lock(&m_sync->mutex);
+		m_job->done = true;
+		m_sync->jobDone.wakeAll();
+	}
+
+private:
+	QSharedPointer<SnapshotJob> m_job;
+	QSharedPointer<PipelineSync> m_sync;
+};
+
+/**
+ * Snapshots are prepared in parallel, but written in order
+ */
+class SnapshotPipeline
+{
+public:
+	SnapshotPipeline(QDataStream &stream, QVector<IndexedEntry> &index)
+		: m_stream(stream), m_index(index), m_sync(new PipelineSync),
+		  m_maxPending(qMax(2, QThreadPool::globalInstance()->maxThreadCount() * 2))
+	{ }
+
+	//! Start preparing a snapshot and write out the ones that are ready
+	void submit(const QSharedPointer<SnapshotJob> &job)
+	{
+		m_queue.enqueue(job);
+		QThreadPool::globalInstance()->start(new SnapshotPreparer(job, m_sync));
+
+		writeReady(m_queue.size() > m_maxPending);
+	}
+
+	//! Wait until all snapshots have been written
+	void finish()
+	{
+		while(!m_queue.isEmpty())
+			writeReady(true);
+	}
+
+	int pending() const { return m_queue.size(); }
+
+private:
+	void writeReady(bool wait)
+	{
+		while(!m_queue.isEmpty()) {
+			{
+				QMutexLocker lock(&m_sync->mutex);
+				if(!m_queue.head()->done) {
+					if(!wait)
+						return;
+					while(!m_queue.head()->done)
+						m_sync->jobDone.wait(&m_sync->mutex);
+				}
+			}
+
+			write(*m_queue.dequeue());
+			wait = false;
+		}
+	}
+
+	void write(SnapshotJob &job)
+	{
+		const paintcore::Savepoint sp = job.savepoint.canvas();
+
+		LayerStackWriteResult result = writeLayerStack(m_stream, sp, m_lastTiles, job.compressedTiles);
+		m_lastTiles = result.tileMap;
+		job.entry.snapshotOffset = result.offset;
+
+		if(job.makeThumbnail) {
+			job.entry.thumbnailOffset = quint64(m_stream.device()->pos());
+			m_stream.writeRawData(job.thumbnail.constData(), job.thumbnail.length());
+		}
+
+		if(!job.title.isNull()) {
+			job.entry.titleOffset = quint64(m_stream.device()->pos());
+			m_stream << job.title;
+		}
+
+		m_index << job.entry;
+	}
+
+	QDataStream &m_stream;
+	QVector<IndexedEntry> &m_index;
+	QSharedPointer<PipelineSync> m_sync;
+	QQueue<QSharedPointer<SnapshotJob>> m_queue;
+	IndexedTiles m_lastTiles;
+	int m_maxPending;
+};
+
 } // end anonymous namespace
 
 bool IndexBuilder::generateIndex(QDataStream &stream, Reader &reader)
 {
-	static const qint64 SNAPSHOT_INTERVAL_MS = 500; // snapshot interval in milliseconds
 	static const int SNAPSHOT_MIN_ACTIONS = 25;     // minimum number of actions between snapshots
 	static const int THUMBNAIL_INTERVAL = 1000;     // minimum number of actions between thumbnails
 
@@ -207,11 +447,17 @@ bool IndexBuilder::generateIndex(QDataStream &stream, Reader &reader)
 	canvas::LayerListModel layermodel;
 	canvas::StateTracker statetracker(&image, &layermodel, 1);
 
+	// Replay happens in this thread, while the snapshots are compressed
+	// and written in the background.
+	SnapshotPipeline pipeline(stream, m_index);
+	paintcore::Savepoint previousSavepoint;
+
 	MessageRecord record;
 	QElapsedTimer timer;
+	QElapsedTimer totalTime;
+	totalTime.start();
 	int messagesSinceLastEntry = SNAPSHOT_MIN_ACTIONS + 1;
 	int messagesSinceLastThumbnail = THUMBNAIL_INTERVAL + 1;
-	LayerStackWriteResult lastSnapshot;
 
 	do {
 #if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
@@ -233,35 +479,40 @@ bool IndexBuilder::generateIndex(QDataStream &stream, Reader &reader)
 				record.message->type() == protocol::MSG_MARKER ||
 				(
 					messagesSinceLastEntry > SNAPSHOT_MIN_ACTIONS &&
-					(!timer.isValid() || timer.hasExpired(SNAPSHOT_INTERVAL_MS))
+					(!timer.isValid() || timer.hasExpired(m_snapshotInterval))
 				)
 			) {
 				messagesSinceLastEntry = 0;
 
 				// A snapshot is saved at each index entry
-				const canvas::StateSavepoint sp = statetracker.createSavepoint(0);
-				lastSnapshot = writeLayerStack(stream, sp.canvas(), lastSnapshot.tileMap);
+				QSharedPointer<SnapshotJob> job(new SnapshotJob);
+				job->savepoint = statetracker.createSavepoint(0);
+				job->previous = previousSavepoint;
+				previousSavepoint = job->savepoint.canvas();
 
 				// A thumbnail is saved no more often than once every THUMBNAIL_INTERVAL messages
-				QImage thumbnail;
-				if(messagesSinceLastThumbnail >= THUMBNAIL_INTERVAL) {
+				job->makeThumbnail = messagesSinceLastThumbnail >= THUMBNAIL_INTERVAL;
+				if(job->makeThumbnail)
 					messagesSinceLastThumbnail = 0;
-					thumbnail = sp.thumbnail(QSize(171, 128));
-				}
 
-				// Remember the position of the message and the state snapshot at that point in time
-				m_index << IndexEntry {
+				if(record.message->type() == protocol::MSG_MARKER)
+					job->title = record.message.cast<protocol::Marker>().text();
+
+				// Remember the position of the message and the state snapshot at that point in time.
+				// (The other offsets are filled in when the snapshot is written.)
+				job->entry = IndexedEntry {
 					quint32(reader.currentIndex()),
+					0,
 					messageOffset,
-					lastSnapshot.offset,
-					record.message->type() == protocol::MSG_MARKER ?
-						record.message.cast<protocol::Marker>().text()
-						:
-						QString(),
-					thumbnail
+					0,
+					0,
+					0
 				};
 
+				pipeline.submit(job);
+
 				emit progress(messageOffset);
+				emit throughput(messageOffset * 1000 / qMax(qint64(1), totalTime.elapsed()), pipeline.pending());
 
 				timer.start();
 			}
@@ -274,10 +525,11 @@ bool IndexBuilder::generateIndex(QDataStream &stream, Reader &reader)
 		}
 	} while(record.status != MessageRecord::END_OF_RECORDING);
 
+	pipeline.finish();
+
 	m_messageCount = reader.currentIndex();
 
 	return true;
 }
 
 }
-
@@ -19,7 +19,7 @@
 #ifndef INDEXBUILDER_H
 #define INDEXBUILDER_H
 
-#include "recording/index.h"
+#include "recording/index_p.h"
 
 #include <QObject>
 #include <QString>
@@ -40,11 +40,26 @@ public:
 	//! Abort index building (thread-safe)
 	void abort();
 
+	/**
+	 * @brief Set the minimum time between snapshots
+	 *
+	 * Shorter intervals make seeking faster, but make the index larger.
+	 * This must be set before index building is started.
+	 */
+	void setSnapshotInterval(int ms) { m_snapshotInterval = ms; }
+
 public slots:
 	void run();
 
 signals:
-	void progress(int pos);
+	void progress(qint64 pos);
+
+	/**
+	 * @brief Indexing speed
+	 * @param bytesPerSecond recording bytes processed per second
+	 * @param pendingSnapshots number of snapshots waiting to be written
+	 */
+	void throughput(qint64 bytesPerSecond, int pendingSnapshots);
 	void done(bool ok, const QString &msg);
 
 private:
@@ -53,8 +68,9 @@ private:
 	QString m_inputfile, m_targetfile;
 	QByteArray m_recordingHash;
 	QAtomicInt m_abortflag;
+	int m_snapshotInterval;
 
-	QVector<IndexEntry> m_index;
+	QVector<IndexedEntry> m_index;
 	int m_messageCount;
 };
 
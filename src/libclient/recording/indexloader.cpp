@@ -29,6 +29,10 @@
 #include <QFile>
 #include <QImage>
 #include <QCache>
+#include <QBuffer>
+#include <QtEndian>
+
+#include <limits>
 
 namespace recording {
 
@@ -39,18 +43,86 @@ struct IndexLoader::Private : public QSharedData
 	QString recordingfile;
 	QByteArray recordingHash;
 	QFile file;
-	QDataStream stream;
 
-	QVector<IndexEntry> index;
+	// The memory mapped index file
+	const uchar *data = nullptr;
+	qint64 size = 0;
+	QByteArray fallbackBuffer;
+
+	quint64 entryTableOffset = 0;
+	int entryCount = 0;
+
 	QVector<IndexEntry> markers;
-	QVector<IndexEntry> thumbnails;
+	QVector<quint64> thumbnailOffsets;
 
-	QCache<quint32, paintcore::Tile> tileCache;
+	QCache<quint64, paintcore::Tile> tileCache;
 
-	paintcore::Tile readTile(quint32 offset);
-	paintcore::Layer *readLayer(quint32 layerOffset, const QSize &size, bool readSublayers=true);
+	bool isValidOffset(quint64 offset, quint64 len=1) const { return offset < quint64(size) && len <= quint64(size) - offset; }
+	QDataStream *streamAt(quint64 offset);
+	IndexedEntry readEntry(int i) const;
+	IndexEntry toIndexEntry(const IndexedEntry &e);
+	paintcore::Tile readTile(quint64 offset);
+	paintcore::Layer *readLayer(quint64 layerOffset, const QSize &size, bool readSublayers=true);
+
+	Private() { m_stream.setDevice(&m_buffer); }
+
+private:
+	QBuffer m_buffer;
+	QDataStream m_stream;
 };
 
+/**
+ * @brief Get a data stream positioned at the given offset of the mapped file
+ *
+ * The stream reads directly from the mapped memory. It remains valid
+ * until the next call of this function.
+ */
+QDataStream *IndexLoader::Private::streamAt(quint64 offset)
+{
+	Q_ASSERT(isValidOffset(offset));
+
+	// A QByteArray can't span more than 2GB, so a window starting at the
+	// offset is used. Individual objects are always much smaller than that.
+	m_buffer.close();
+	m_buffer.setData(QByteArray::fromRawData(
+		reinterpret_cast<const char*>(data + offset),
+		int(qMin(quint64(size) - offset, quint64(std::numeric_limits<int>::max())))
+		));
+	m_buffer.open(QIODevice::ReadOnly);
+	m_stream.resetStatus();
+
+	return &m_stream;
+}
+
+IndexedEntry IndexLoader::Private::readEntry(int i) const
+{
+	Q_ASSERT(i >= 0 && i < entryCount);
+	const uchar *p = data + entryTableOffset + quint64(i) * INDEX_ENTRY_SIZE;
+
+	return IndexedEntry {
+		qFromBigEndian<quint32>(p),
+		qFromBigEndian<quint32>(p + 4),
+		qFromBigEndian<qint64>(p + 8),
+		qFromBigEndian<quint64>(p + 16),
+		qFromBigEndian<quint64>(p + 24),
+		qFromBigEndian<quint64>(p + 32)
+	};
+}
+
+IndexEntry IndexLoader::Private::toIndexEntry(const IndexedEntry &e)
+{
+	QString title;
+	if(e.titleOffset > 0 && isValidOffset(e.titleOffset))
+		*streamAt(e.titleOffset) >> title;
+
+	return IndexEntry {
+		e.index,
+		e.messageOffset,
+		qint64(e.snapshotOffset),
+		title
+	};
+}
+
 IndexLoader::IndexLoader()
 {
 }
@@ -80,9 +152,9 @@ IndexLoader &IndexLoader::operator=(const IndexLoader &other)
 	return *this;
 }
 
-QVector<IndexEntry> IndexLoader::index() const { return d->index; }
+int IndexLoader::entryCount() const { return d->entryCount; }
 QVector<IndexEntry> IndexLoader::markers() const { return d->markers; }
-QVector<IndexEntry> IndexLoader::thumbnails() const { return d->thumbnails; }
+int IndexLoader::thumbnailCount() const { return d->thumbnailOffsets.size(); }
 int IndexLoader::messageCount() const { return d->messageCount; }
 
 bool IndexLoader::open()
@@ -93,18 +165,26 @@ bool IndexLoader::open()
 	if(!d->file.open(QIODevice::ReadOnly))
 		return false;
 
-	d->stream.setDevice(&d->file);
+	d->size = d->file.size();
+	d->data = d->file.map(0, d->size);
+	if(!d->data) {
+		// Shouldn't normally happen, but some file systems don't support mapping
+		qWarning("%s: couldn't map index file, reading it into memory instead", qPrintable(d->file.fileName()));
+		d->fallbackBuffer = d->file.readAll();
+		d->data = reinterpret_cast<const uchar*>(d->fallbackBuffer.constData());
+		d->size = d->fallbackBuffer.size();
+	}
 
 	// Check magic numbers
-	char magic[5];
-	d->stream.readRawData(magic, 5);
-	if(memcmp(magic, "DPIDX", 5) != 0) {
+	if(d->size <= 5 || memcmp(d->data, "DPIDX", 5) != 0) {
 		qWarning("%s: not an index file", qPrintable(d->file.fileName()));
 		return false;
 	}
 
+	QDataStream &stream = *d->streamAt(5);
+
 	quint32 formatVersion;
-	d->stream >> formatVersion;
+	stream >> formatVersion;
 
 	if(formatVersion != INDEX_VERSION) {
 		qWarning("%s: wrong version (%d)", qPrintable(d->file.fileName()), formatVersion);
@@ -112,7 +192,7 @@ bool IndexLoader::open()
 	}
 
 	QByteArray checksum;
-	d->stream >> checksum;
+	stream >> checksum;
 
 	if(checksum != d->recordingHash) {
 		qWarning("%s: checksum mismatch", qPrintable(d->file.fileName()));
@@ -120,66 +200,101 @@ bool IndexLoader::open()
 	}
 
 	// Read header fields
-	quint32 entryVectorOffset;
-	d->stream >> entryVectorOffset >> d->messageCount;
-
-	// Load index entry vector
-	d->stream.device()->seek(entryVectorOffset);
-	while(d->stream.status() == QDataStream::Ok) {
-		IndexEntry e;
-		d->stream
-			>> e.index
-			>> e.messageOffset
-			>> e.snapshotOffset
-			>> e.title
-			>> e.thumbnail;
-
-		if(d->stream.status() == QDataStream::ReadPastEnd)
-			return true;
-
-		d->index << e;
-		if(!e.thumbnail.isNull())
-			d->thumbnails << e;
-		if(!e.title.isEmpty())
-			d->markers << e;
+	quint32 entryCount, messageCount;
+	stream >> d->entryTableOffset >> entryCount >> messageCount;
+
+	if(stream.status() != QDataStream::Ok || !d->isValidOffset(d->entryTableOffset, quint64(entryCount) * INDEX_ENTRY_SIZE) || entryCount == 0) {
+		qWarning("Index reading error!");
+		return false;
 	}
 
-	qWarning("Index reading error!");
-	return false;
+	d->entryCount = int(entryCount);
+	d->messageCount = int(messageCount);
+
+	// Collect markers and thumbnails. The entries themselves are read on demand.
+	for(int i=0;i<d->entryCount;++i) {
+		const IndexedEntry e = d->readEntry(i);
+		if(e.thumbnailOffset > 0)
+			d->thumbnailOffsets << e.thumbnailOffset;
+		if(e.titleOffset > 0)
+			d->markers << d->toIndexEntry(e);
+	}
+
+	return true;
+}
+
+IndexEntry IndexLoader::entry(int i) const
+{
+	Q_ASSERT(d && i >= 0 && i < d->entryCount);
+	return d->toIndexEntry(d->readEntry(i));
+}
+
+IndexEntry IndexLoader::nearest(int messageIndex) const
+{
+	Q_ASSERT(d && d->entryCount > 0);
+
+	// Find the last entry whose message index is less than the target
+	// (or the first entry, if there is no such entry.)
+	int lo = 0, hi = d->entryCount;
+	while(hi - lo > 1) {
+		const int mid = lo + (hi - lo) / 2;
+		if(int(d->readEntry(mid).index) < messageIndex)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return entry(lo);
+}
+
+QImage IndexLoader::thumbnail(int thumbnailIndex) const
+{
+	if(!d || thumbnailIndex < 0 || thumbnailIndex >= d->thumbnailOffsets.size())
+		return QImage();
+
+	const quint64 offset = d->thumbnailOffsets.at(thumbnailIndex);
+	if(!d->isValidOffset(offset))
+		return QImage();
+
+	QImage image;
+	*d->streamAt(offset) >> image;
+	return image;
 }
 
 canvas::StateSavepoint IndexLoader::loadSavepoint(const IndexEntry &entry)
 {
-	d->file.seek(entry.snapshotOffset);
-	d->stream.resetStatus();
+	if(!d->isValidOffset(entry.snapshotOffset)) {
+		qWarning("Index read error!");
+		return canvas::StateSavepoint();
+	}
+
+	QDataStream &stream = *d->streamAt(entry.snapshotOffset);
 
 	// Read layer stack
 	IndexedLayerStack layerstack;
-	d->stream >> layerstack;
+	stream >> layerstack;
 
-	if(d->stream.status() != QDataStream::Ok) {
+	if(stream.status() != QDataStream::Ok) {
 		qWarning("Index read error!");
 		return canvas::StateSavepoint();
 	}
 
 	// Read layers
-	QList<paintcore::Layer*> layers;
-	for(const quint32 layerOffset : layerstack.layerOffsets) {
+	QList<QSharedPointer<const paintcore::Layer>> layers;
+	for(const quint64 layerOffset : layerstack.layerOffsets) {
 		auto *layer = d->readLayer(layerOffset, layerstack.size);
-		if(!layer) {
-			for(auto *l : layers)
-				delete l;
+		if(!layer)
 			return canvas::StateSavepoint();
-		}
-		layers << layer;
+		layers << QSharedPointer<const paintcore::Layer>(layer);
 	}
 
 
 	// Read annotations
 	QList<paintcore::Annotation> annotations;
-	for(const quint32 annotationOffset : layerstack.annotationOffsets) {
-		d->file.seek(annotationOffset);
-		annotations << paintcore::Annotation::fromDataStream(d->stream);
+	for(const quint64 annotationOffset : layerstack.annotationOffsets) {
+		if(!d->isValidOffset(annotationOffset))
+			return canvas::StateSavepoint();
+		annotations << paintcore::Annotation::fromDataStream(*d->streamAt(annotationOffset));
 	}
 
 	// Make savepoint
@@ -192,24 +307,28 @@ canvas::StateSavepoint IndexLoader::loadSavepoint(const IndexEntry &entry)
 	return canvas::StateSavepoint::fromCanvasSavepoint(sp);
 }
 
-paintcore::Tile IndexLoader::Private::readTile(quint32 offset)
+paintcore::Tile IndexLoader::Private::readTile(quint64 offset)
 {
-	if(offset == 0)
+	if(offset == 0 || !isValidOffset(offset))
 		return paintcore::Tile();
 
 	if(tileCache.contains(offset))
 		return *tileCache[offset];
 
-	file.seek(offset);
 	auto *t = new paintcore::Tile;
-	stream >> *t;
+	*streamAt(offset) >> *t;
 	tileCache.insert(offset, t);
 	return *t;
 }
 
-paintcore::Layer *IndexLoader::Private::readLayer(quint32 layerOffset, const QSize &size, bool readSublayers)
+paintcore::Layer *IndexLoader::Private::readLayer(quint64 layerOffset, const QSize &size, bool readSublayers)
 {
-	file.seek(layerOffset);
+	if(!isValidOffset(layerOffset)) {
+		qWarning("Could not read layer from index");
+		return nullptr;
+	}
+
+	QDataStream &stream = *streamAt(layerOffset);
 
 	IndexedLayer il;
 	stream >> il;
@@ -221,15 +340,17 @@ paintcore::Layer *IndexLoader::Private::readLayer(quint32 layerOffset, const QSi
 
 	QVector<paintcore::Tile> tiles;
 	tiles.reserve(il.tileOffsets.size());
-	for(const quint32 tileOffset : il.tileOffsets) {
+	for(const quint64 tileOffset : il.tileOffsets) {
 		tiles << readTile(tileOffset);
 	}
 
 	QList<paintcore::Layer*> sublayers;
 	if(readSublayers) {
 		sublayers.reserve(il.sublayerOffsets.size());
-		for(const quint32 sublayerOffset : il.sublayerOffsets) {
-			sublayers << readLayer(sublayerOffset, size, false);
+		for(const quint64 sublayerOffset : il.sublayerOffsets) {
+			paintcore::Layer *sublayer = readLayer(sublayerOffset, size, false);
+			if(sublayer)
+				sublayers << sublayer;
 		}
 	}
 
@@ -46,18 +46,32 @@ public:
 	/**
 	 * @brief Open the index
 	 *
-	 * The list of index entries is read and loadSavepoint can then be used.
+	 * The index file is memory mapped and the marker list is read.
+	 * Everything else is read on demand.
 	 */
 	bool open();
 
-	//! All index entries
-	QVector<IndexEntry> index() const;
+	//! Number of index entries
+	int entryCount() const;
+
+	//! Get the index entry at the given position
+	IndexEntry entry(int i) const;
+
+	/**
+	 * Find the index entry closest to the given message, such that entry.index <= messageIndex.
+	 *
+	 * This is a binary search over the memory mapped entry table.
+	 */
+	IndexEntry nearest(int messageIndex) const;
 
 	//! Entries with markers
 	QVector<IndexEntry> markers() const;
 
-	//! Entries with thumbnails
-	QVector<IndexEntry> thumbnails() const;
+	//! Number of entries with thumbnails
+	int thumbnailCount() const;
+
+	//! Read the thumbnail with the given index
+	QImage thumbnail(int thumbnailIndex) const;
 
 	//! Total number of messages in the recording
 	int messageCount() const;
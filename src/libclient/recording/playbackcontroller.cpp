@@ -246,10 +246,7 @@ void PlaybackController::prevSequence()
 		return;
 	}
 
-	jumpToSnapshot(IndexEntry::nearest(
-		m_indexloader.index(),
-		m_reader->currentIndex()
-		));
+	jumpToSnapshot(m_indexloader.nearest(m_reader->currentIndex()));
 	expectSequencePoint(0);
 }
 
@@ -269,8 +266,7 @@ void PlaybackController::jumpTo(int messageIndex)
 	// If the target position is behind current position or sufficiently far ahead, jump
 	// to the closest snapshot point first
 	if(messageIndex < m_reader->currentIndex() || messageIndex - m_reader->currentIndex() > 500) {
-		const auto &index = m_indexloader.index();
-		const auto nearest = IndexEntry::nearest(index, messageIndex);
+		const auto nearest = m_indexloader.nearest(messageIndex);
 
 		// Restore snapshot only when jumping backward and when
 		// the nearest target snapshot is after this one
@@ -364,7 +360,7 @@ void PlaybackController::buildIndex()
 	m_indexbuilder->moveToThread(thread);
 
 	const qreal filesize = m_reader->filesize();
-	connect(m_indexbuilder.data(), &IndexBuilder::progress, this, [this, filesize](int progress) {
+	connect(m_indexbuilder.data(), &IndexBuilder::progress, this, [this, filesize](qint64 progress) {
 		m_indexBuildProgress = progress / filesize;
 		emit indexBuildProgressed(m_indexBuildProgress);
 	});
@@ -425,7 +421,7 @@ QStringList PlaybackController::getMarkers() const
 int PlaybackController::indexThumbnailCount() const
 {
 	if(m_indexloader)
-		return qMax(1, m_indexloader.thumbnails().size());
+		return qMax(1, m_indexloader.thumbnailCount());
 	else
 		return -1;
 }
@@ -435,12 +431,7 @@ QImage PlaybackController::getIndexThumbnail(int thumbnailIndex) const
 	if(!m_indexloader)
 		return QImage();
 
-	const auto thumbnails = m_indexloader.thumbnails();
-
-	if(thumbnailIndex < 0 || thumbnailIndex >= thumbnails.size())
-		return QImage();
-
-	return thumbnails.at(thumbnailIndex).thumbnail;
+	return m_indexloader.thumbnail(thumbnailIndex);
 }
 
 QString PlaybackController::recordingFilename() const
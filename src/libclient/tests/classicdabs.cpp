@@ -0,0 +1,93 @@
+#include "../core/layer.h"
+#include "../core/tile.h"
+#include "../brushes/classicbrushpainter.h"
+#include "../../libshared/net/brushes.h"
+
+#include <QtTest/QtTest>
+#include <QRandomGenerator>
+
+using namespace paintcore;
+
+class TestClassicDabs : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testBitIdentical_data()
+	{
+		QTest::addColumn<quint32>("color");
+		QTest::addColumn<int>("mode");
+
+		QTest::newRow("indirect") << 0x80ff8800u << int(BlendMode::MODE_NORMAL);
+		QTest::newRow("direct") << 0x00228844u << int(BlendMode::MODE_NORMAL);
+		QTest::newRow("erase") << 0x00000000u << int(BlendMode::MODE_ERASE);
+	}
+
+	void testBitIdentical()
+	{
+		QFETCH(quint32, color);
+		QFETCH(int, mode);
+
+		QRandomGenerator rng(4321);
+
+		Layer expected(1, QString(), Qt::gray, QSize(300, 200));
+		Layer actual(1, QString(), Qt::gray, QSize(300, 200));
+
+		for(int round=0;round<50;++round) {
+			// Strokes start near the edges, so clipping is tested too
+			protocol::ClassicBrushDabVector dabs;
+			const uint16_t size = rng.bounded(2) ? 0x1000 : uint16_t(rng.bounded(0x100, 0x4000));
+			for(int i=0;i<40;++i) {
+				dabs << protocol::ClassicBrushDab {
+					int8_t(rng.bounded(-8, 16)),
+					int8_t(rng.bounded(-8, 16)),
+					i % 4 == 0 ? uint16_t(rng.bounded(0x100, 0x4000)) : size,
+					uint8_t(rng.bounded(256)),
+					uint8_t(rng.bounded(256))
+				};
+			}
+
+			const protocol::DrawDabsClassic msg(1, 1, rng.bounded(-100, 1100), rng.bounded(-100, 700), color, mode, dabs);
+
+			referenceDrawDabs(msg, EditableLayer(&expected, nullptr, 0));
+			brushes::drawClassicBrushDabs(msg, EditableLayer(&actual, nullptr, 0));
+		}
+
+		QCOMPARE(actual.toImage(), expected.toImage());
+		QCOMPARE(actual.sublayers().size(), expected.sublayers().size());
+		for(int i=0;i<actual.sublayers().size();++i)
+			QCOMPARE(actual.sublayers().at(i)->toImage(), expected.sublayers().at(i)->toImage());
+	}
+
+private:
+	// The original uncached implementation of drawClassicBrushDabs
+	static void referenceDrawDabs(const protocol::DrawDabsClassic &dabs, EditableLayer layer)
+	{
+		auto blendmode = BlendMode::Mode(dabs.mode());
+		const QColor color = QColor::fromRgba(dabs.color());
+
+		if(color.alpha()>0) {
+			layer = layer.getEditableSubLayer(dabs.contextId(), blendmode, color.alpha());
+			blendmode = BlendMode::MODE_NORMAL;
+		}
+
+		int lastX = dabs.originX();
+		int lastY = dabs.originY();
+		for(const protocol::ClassicBrushDab &d : dabs.dabs()) {
+			const int nextX = lastX + d.x;
+			const int nextY = lastY + d.y;
+			const BrushStamp bs = brushes::makeGimpStyleBrushStamp(
+				QPointF(nextX/4.0, nextY/4.0),
+				d.size/256.0,
+				d.hardness/255.0,
+				d.opacity/255.0
+			);
+			layer.putBrushStamp(bs, color, blendmode);
+			lastX = nextX;
+			lastY = nextY;
+		}
+	}
+};
+
+
+QTEST_MAIN(TestClassicDabs)
+#include "classicdabs.moc"
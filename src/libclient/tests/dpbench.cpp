@@ -0,0 +1,460 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Micro-benchmarks for the paintcore and protocol hot paths.
+//
+// The results are printed as JSON, so runs of different builds (or before
+// and after an optimization) can be compared with a script.
+
+#include "config.h"
+
+#include "../core/rasterop_p.h"
+#include "../core/layerstack.h"
+#include "../core/layer.h"
+#include "../core/tilevector.h"
+#include "../core/floodfill.h"
+#include "../core/brushmask.h"
+#include "../brushes/classicbrushpainter.h"
+#include "../../libshared/net/brushes.h"
+#include "../../libshared/net/image.h"
+#include "../../libshared/net/meta2.h"
+#include "../../libshared/net/undo.h"
+#include "../../libshared/net/messagepool.h"
+
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QRandomGenerator>
+#include <QThread>
+#include <QtMath>
+
+#include <functional>
+
+using namespace paintcore;
+
+namespace {
+
+struct BenchSettings {
+	QString filter;
+	qint64 minTime; // minimum measurement time per benchmark in milliseconds
+};
+
+class Bench {
+public:
+	explicit Bench(const BenchSettings &settings) : m_settings(settings) { }
+
+	/**
+	 * @brief Run a benchmark
+	 *
+	 * The function is called repeatedly until the minimum time has elapsed.
+	 * Each call should perform `work` units of work, which are reported
+	 * per second, scaled by `scale`. (E.g. 1e-6 for megapixels)
+	 *
+	 * @param name benchmark name
+	 * @param params benchmark parameters (included in the result)
+	 * @param unit the name of the throughput unit
+	 * @param work units of work done per call
+	 * @param scale throughput scaling factor
+	 * @param func the function to benchmark
+	 */
+	void run(const QString &name, const QJsonObject &params, const QString &unit, double work, double scale, std::function<void()> func)
+	{
+		if(!m_settings.filter.isEmpty() && !name.contains(m_settings.filter, Qt::CaseInsensitive))
+			return;
+
+		// Warm up
+		func();
+
+		const protocol::MessagePool::Stats poolBefore = protocol::MessagePool::stats();
+
+		QElapsedTimer timer;
+		qint64 iterations = 0;
+		timer.start();
+		do {
+			func();
+			++iterations;
+		} while(timer.elapsed() < m_settings.minTime);
+
+		const double seconds = timer.nsecsElapsed() / 1.0e9;
+
+		QJsonObject result = params;
+		result["name"] = name;
+		result["iterations"] = iterations;
+		result["seconds"] = seconds;
+		result["unit"] = unit;
+		result["throughput"] = work * iterations * scale / seconds;
+
+		// Report message pool usage for benchmarks that allocate messages
+		const protocol::MessagePool::Stats poolAfter = protocol::MessagePool::stats();
+		const quint64 poolAllocations = poolAfter.allocations - poolBefore.allocations;
+		if(poolAllocations > 0) {
+			result["poolAllocations"] = double(poolAllocations) / iterations;
+			result["poolHeapAllocations"] = double(poolAfter.heapAllocations - poolBefore.heapAllocations) / iterations;
+			result["poolReuseRate"] = double(poolAfter.reused - poolBefore.reused) / poolAllocations;
+			result["poolRemoteFrees"] = double(poolAfter.remoteFrees - poolBefore.remoteFrees) / iterations;
+		}
+
+		m_results << result;
+
+		fprintf(stderr, "%s %s: %.2f %s\n",
+			qPrintable(name),
+			QJsonDocument(params).toJson(QJsonDocument::Compact).constData(),
+			work * iterations * scale / seconds,
+			qPrintable(unit)
+		);
+	}
+
+	QJsonArray results() const { return m_results; }
+
+private:
+	BenchSettings m_settings;
+	QJsonArray m_results;
+};
+
+const BlendMode::Mode ALL_MODES[] = {
+	BlendMode::MODE_ERASE,
+	BlendMode::MODE_NORMAL,
+	BlendMode::MODE_MULTIPLY,
+	BlendMode::MODE_DIVIDE,
+	BlendMode::MODE_BURN,
+	BlendMode::MODE_DODGE,
+	BlendMode::MODE_DARKEN,
+	BlendMode::MODE_LIGHTEN,
+	BlendMode::MODE_SUBTRACT,
+	BlendMode::MODE_ADD,
+	BlendMode::MODE_RECOLOR,
+	BlendMode::MODE_BEHIND,
+	BlendMode::MODE_COLORERASE,
+	BlendMode::MODE_REPLACE
+};
+
+QVector<quint32> randomPixels(QRandomGenerator &rng, int count)
+{
+	QVector<quint32> pixels(count);
+	for(quint32 &p : pixels)
+		p = qPremultiply(rng.generate());
+	return pixels;
+}
+
+//! Scribble some brush strokes on a layer
+void scribble(EditableLayer layer, QRandomGenerator &rng, int strokes)
+{
+	for(int s=0;s<strokes;++s) {
+		QPointF p(rng.bounded(layer->width()), rng.bounded(layer->height()));
+		const QColor color = QColor::fromRgb(rng.generate());
+		const qreal radius = 4 + rng.bounded(60);
+		for(int i=0;i<50;++i) {
+			p += QPointF(rng.bounded(16) - 8, rng.bounded(16) - 8);
+			layer.putBrushStamp(brushes::makeGimpStyleBrushStamp(p, radius, 0.5, 0.5), color, BlendMode::MODE_NORMAL);
+		}
+	}
+}
+
+//! Create a layer stack with some content on each layer
+void makeCanvas(LayerStack &canvas, const QSize &size, int layers, QRandomGenerator &rng)
+{
+	auto editor = canvas.editor(0);
+	editor.resize(0, size.width(), size.height(), 0);
+	editor.setBackground(Tile(Qt::white));
+
+	for(int i=0;i<layers;++i) {
+		EditableLayer layer = editor.createLayer(0x0100 + i, 0, Qt::transparent, false, false, QString("Layer %1").arg(i));
+		scribble(layer, rng, 8);
+	}
+}
+
+void benchCompositing(Bench &bench)
+{
+	QRandomGenerator rng(1);
+
+	const QVector<quint32> pixels = randomPixels(rng, Tile::LENGTH);
+	const QVector<quint32> over = randomPixels(rng, Tile::LENGTH);
+	QVector<uchar> mask(Tile::LENGTH);
+	for(uchar &m : mask)
+		m = rng.bounded(256);
+
+	for(const RasterOpImpl *impl : supportedRasterOpImpls()) {
+		for(const BlendMode::Mode mode : ALL_MODES) {
+			const QString modeName = findBlendMode(mode).svgname;
+
+			for(const int size : {16, Tile::SIZE}) {
+				QVector<quint32> base = pixels;
+				bench.run(
+					"compositeMask",
+					QJsonObject { {"impl", impl->name}, {"mode", modeName}, {"size", size} },
+					"MPix/s", size*size, 1.0e-6,
+					[&]() {
+						compositeMask(*impl, mode, base.data(), 0xff8844cc, mask.constData(), size, size, Tile::SIZE-size, Tile::SIZE-size);
+					}
+				);
+			}
+
+			QVector<quint32> base = pixels;
+			bench.run(
+				"compositePixels",
+				QJsonObject { {"impl", impl->name}, {"mode", modeName}, {"size", Tile::LENGTH} },
+				"MPix/s", Tile::LENGTH, 1.0e-6,
+				[&]() {
+					compositePixels(*impl, mode, base.data(), over.constData(), Tile::LENGTH, 200);
+				}
+			);
+		}
+	}
+}
+
+void benchFlatten(Bench &bench)
+{
+	for(const int layers : {1, 10, 50}) {
+		QRandomGenerator rng(2);
+		LayerStack canvas;
+		const QSize size(1024, 1024);
+		makeCanvas(canvas, size, layers, rng);
+
+		const int xtiles = Tile::roundTiles(size.width());
+		const int ytiles = Tile::roundTiles(size.height());
+
+		bench.run(
+			"flattenTile",
+			QJsonObject { {"layers", layers}, {"width", size.width()}, {"height", size.height()} },
+			"MPix/s", size.width() * size.height(), 1.0e-6,
+			[&]() {
+				for(int y=0;y<ytiles;++y)
+					for(int x=0;x<xtiles;++x)
+						canvas.getFlatTile(x, y);
+			}
+		);
+
+		bench.run(
+			"toFlatImage",
+			QJsonObject { {"layers", layers}, {"width", size.width()}, {"height", size.height()} },
+			"MPix/s", size.width() * size.height(), 1.0e-6,
+			[&]() { canvas.toFlatImage(false, true, true); }
+		);
+	}
+}
+
+void benchBrushStamp(Bench &bench)
+{
+	for(const int radius : {2, 16, 64}) {
+		Layer layer(1, QString(), Qt::transparent, QSize(1024, 1024));
+		EditableLayer el(&layer, nullptr, 0);
+
+		const BrushStamp stamp = brushes::makeGimpStyleBrushStamp(QPointF(500.3, 500.7), radius, 0.5, 0.5);
+		const int dia = stamp.mask.diameter();
+
+		for(const BlendMode::Mode mode : {BlendMode::MODE_NORMAL, BlendMode::MODE_MULTIPLY, BlendMode::MODE_ERASE}) {
+			// Paint something first so erasing and multiplying have something to do
+			el.putBrushStamp(stamp, Qt::red, BlendMode::MODE_NORMAL);
+
+			bench.run(
+				"putBrushStamp",
+				QJsonObject { {"radius", radius}, {"mode", findBlendMode(mode).svgname} },
+				"MPix/s", dia * dia, 1.0e-6,
+				[&]() { el.putBrushStamp(stamp, Qt::blue, mode); }
+			);
+		}
+
+		bench.run(
+			"makeGimpStyleBrushStamp",
+			QJsonObject { {"radius", radius} },
+			"stamps/s", 1, 1,
+			[&]() { brushes::makeGimpStyleBrushStamp(QPointF(500.3, 500.7), radius, 0.5, 0.5); }
+		);
+	}
+}
+
+void benchMerge(Bench &bench)
+{
+	QRandomGenerator rng(3);
+	const QSize size(2048, 2048);
+
+	for(const BlendMode::Mode mode : {BlendMode::MODE_NORMAL, BlendMode::MODE_MULTIPLY}) {
+		Layer bottom(1, QString(), Qt::white, size);
+		Layer top(2, QString(), Qt::transparent, size);
+		EditableLayer et(&top, nullptr, 0);
+		scribble(et, rng, 20);
+		et.setBlend(mode);
+		et.setOpacity(200);
+
+		EditableLayer eb(&bottom, nullptr, 0);
+
+		bench.run(
+			"EditableLayer::merge",
+			QJsonObject { {"mode", findBlendMode(mode).svgname}, {"width", size.width()}, {"height", size.height()} },
+			"MPix/s", size.width() * size.height(), 1.0e-6,
+			[&]() { eb.merge(&top); }
+		);
+	}
+}
+
+void benchTileSet(Bench &bench)
+{
+	QRandomGenerator rng(4);
+	const QSize size(2048, 2048);
+
+	Layer layer(1, QString(), Qt::white, size);
+	scribble(EditableLayer(&layer, nullptr, 0), rng, 20);
+
+	bench.run(
+		"LayerTileSet::fromLayer",
+		QJsonObject { {"width", size.width()}, {"height", size.height()} },
+		"MPix/s", size.width() * size.height(), 1.0e-6,
+		[&]() { LayerTileSet::fromLayer(layer); }
+	);
+
+	bench.run(
+		"LayerTileSet::toPutTiles",
+		QJsonObject { {"width", size.width()}, {"height", size.height()} },
+		"MPix/s", size.width() * size.height(), 1.0e-6,
+		[&]() {
+			protocol::MessageList msgs;
+			LayerTileSet::fromLayer(layer).toPutTiles(1, 1, 0, msgs);
+		}
+	);
+}
+
+void benchMessages(Bench &bench)
+{
+	QRandomGenerator rng(5);
+
+	protocol::ClassicBrushDabVector dabs;
+	for(int i=0;i<100;++i)
+		dabs << protocol::ClassicBrushDab { int8_t(rng.bounded(8)), int8_t(rng.bounded(8)), uint16_t(rng.bounded(0xffff)), 128, 200 };
+
+	QByteArray tile(Tile::BYTES, 0);
+	for(int i=0;i<tile.size();++i)
+		tile[i] = char(rng.bounded(4));
+	tile = qCompress(tile);
+
+	const QList<QPair<QString, protocol::MessagePtr>> messages {
+		{ "DrawDabsClassic", protocol::MessagePtr(new protocol::DrawDabsClassic(1, 0x0101, 1000, 1000, 0xff000000, 1, dabs)) },
+		{ "PutTile", protocol::MessagePtr(new protocol::PutTile(1, 0x0101, 0, 1, 1, 0, tile)) },
+		{ "MovePointer", protocol::MessagePtr(new protocol::MovePointer(1, 1000, 1000)) },
+		{ "PenUp", protocol::MessagePtr(new protocol::PenUp(1)) },
+		{ "UndoPoint", protocol::MessagePtr(new protocol::UndoPoint(1)) },
+	};
+
+	for(const auto &m : messages) {
+		QByteArray buffer(m.second->length(), 0);
+
+		bench.run(
+			"Message::serialize",
+			QJsonObject { {"type", m.first}, {"length", m.second->length()} },
+			"msgs/s", 1, 1,
+			[&]() { m.second->serialize(buffer.data()); }
+		);
+
+		bench.run(
+			"Message::deserialize",
+			QJsonObject { {"type", m.first}, {"length", m.second->length()} },
+			"msgs/s", 1, 1,
+			[&]() {
+				protocol::NullableMessageRef msg = protocol::Message::deserialize(
+					reinterpret_cast<const uchar*>(buffer.constData()),
+					buffer.length(),
+					true
+				);
+				Q_ASSERT(!msg.isNull());
+			}
+		);
+	}
+}
+
+void benchFloodfill(Bench &bench)
+{
+	QRandomGenerator rng(6);
+	LayerStack canvas;
+	const QSize size(1024, 1024);
+	makeCanvas(canvas, size, 3, rng);
+
+	// Draw a closed outline in the middle, so the fill has a bounded area
+	{
+		auto editor = canvas.editor(0);
+		EditableLayer layer = editor.getEditableLayer(0x0100);
+		for(int a=0;a<360;++a) {
+			const QPointF p(512 + 300 * qCos(qDegreesToRadians(qreal(a))), 512 + 300 * qSin(qDegreesToRadians(qreal(a))));
+			layer.putBrushStamp(brushes::makeGimpStyleBrushStamp(p, 8, 1.0, 1.0), Qt::black, BlendMode::MODE_NORMAL);
+		}
+	}
+
+	for(const bool merge : {false, true}) {
+		bench.run(
+			"floodfill",
+			QJsonObject { {"merged", merge}, {"width", size.width()}, {"height", size.height()} },
+			"MPix/s", size.width() * size.height(), 1.0e-6,
+			[&]() { floodfill(&canvas, QPoint(512, 512), Qt::red, 10, 0x0100, merge, size.width() * size.height()); }
+		);
+	}
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	// Use the offscreen platform, so this can be run headlessly
+	qputenv("QT_QPA_PLATFORM", "offscreen");
+
+	QGuiApplication app(argc, argv);
+	QGuiApplication::setApplicationName("dpbench");
+	QGuiApplication::setApplicationVersion(DRAWPILE_VERSION);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Drawpile paint engine micro-benchmarks");
+	parser.addHelpOption();
+
+	// --filter, -f <name>
+	QCommandLineOption filterOption(QStringList() << "f" << "filter", "Run only benchmarks whose name contains this string", "name");
+	parser.addOption(filterOption);
+
+	// --time, -t <ms>
+	QCommandLineOption timeOption(QStringList() << "t" << "time", "Minimum run time of each benchmark in milliseconds (default 200)", "ms", "200");
+	parser.addOption(timeOption);
+
+	parser.process(app);
+
+	const BenchSettings settings {
+		parser.value(filterOption),
+		qMax(1, parser.value(timeOption).toInt())
+	};
+
+	Bench bench(settings);
+
+	benchCompositing(bench);
+	benchFlatten(bench);
+	benchBrushStamp(bench);
+	benchMerge(bench);
+	benchTileSet(bench);
+	benchMessages(bench);
+	benchFloodfill(bench);
+
+	const QJsonObject report {
+		{"version", DRAWPILE_VERSION},
+		{"qt", qVersion()},
+		{"rasterop", activeRasterOpImpl().name},
+		{"threads", QThread::idealThreadCount()},
+		{"results", bench.results()}
+	};
+
+	printf("%s", QJsonDocument(report).toJson().constData());
+
+	return 0;
+}
@@ -0,0 +1,164 @@
+#include "../core/layerstack.h"
+#include "../core/layer.h"
+#include "../core/tile.h"
+#include "../core/brushmask.h"
+#include "../brushes/classicbrushpainter.h"
+
+#include <QtTest/QtTest>
+#include <QRandomGenerator>
+
+using namespace paintcore;
+
+class TestFlatten : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testFlatImage_data()
+	{
+		QTest::addColumn<bool>("background");
+		QTest::addColumn<bool>("sublayers");
+
+		QTest::newRow("plain") << false << false;
+		QTest::newRow("background") << true << false;
+		QTest::newRow("sublayers") << false << true;
+		QTest::newRow("all") << true << true;
+	}
+
+	void testFlatImage()
+	{
+		QFETCH(bool, background);
+		QFETCH(bool, sublayers);
+
+		LayerStack canvas;
+		makeCanvas(canvas);
+
+		const QImage expected = referenceFlatImage(canvas, background, sublayers);
+		const QImage actual = canvas.toFlatImage(false, background, sublayers);
+
+		QCOMPARE(actual.size(), expected.size());
+		QCOMPARE(actual, expected);
+	}
+
+	void testFlatLayerImage()
+	{
+		LayerStack canvas;
+		makeCanvas(canvas);
+
+		for(int i=0;i<canvas.layerCount();++i) {
+			const QImage expected = referenceFlatLayerImage(canvas, i);
+			const QImage actual = canvas.flatLayerImage(i);
+			QCOMPARE(actual, expected);
+		}
+	}
+
+	void testLayerRegionImage()
+	{
+		LayerStack canvas;
+		makeCanvas(canvas);
+		const Layer *layer = canvas.getLayerByIndex(0);
+		const QImage full = layer->toImage();
+
+		const QRect rects[] = {
+			QRect(0, 0, 300, 171),
+			QRect(10, 20, 30, 40),
+			QRect(60, 60, 70, 70),
+			QRect(-20, -30, 100, 100),
+			QRect(250, 150, 100, 100),
+			QRect(400, 400, 10, 10)
+		};
+
+		for(const QRect &r : rects)
+			QCOMPARE(layer->toImage(r), full.copy(r));
+	}
+
+private:
+	//! Create a canvas whose size is not a multiple of the tile size
+	static void makeCanvas(LayerStack &canvas)
+	{
+		QRandomGenerator rng(1234);
+
+		auto editor = canvas.editor(0);
+		editor.resize(0, 300, 171, 0);
+		editor.setBackground(Tile(QColor(200, 220, 240)));
+
+		const BlendMode::Mode modes[] = {
+			BlendMode::MODE_NORMAL,
+			BlendMode::MODE_MULTIPLY,
+			BlendMode::MODE_ERASE,
+			BlendMode::MODE_BEHIND,
+			BlendMode::MODE_LIGHTEN
+		};
+
+		for(int i=0;i<5;++i) {
+			EditableLayer layer = editor.createLayer(0x0100 + i, 0, Qt::transparent, false, false, QString("Layer %1").arg(i));
+			scribble(layer, rng, BlendMode::MODE_NORMAL);
+			layer.setBlend(modes[i]);
+			layer.setOpacity(100 + i * 30);
+		}
+
+		editor.getEditableLayerByIndex(1).setFixed(true);
+		editor.getEditableLayerByIndex(3).setHidden(true);
+
+		// An indirect stroke in progress
+		scribble(editor.getEditableLayerByIndex(2).getEditableSubLayer(1, BlendMode::MODE_MULTIPLY, 128), rng, BlendMode::MODE_NORMAL);
+	}
+
+	static void scribble(EditableLayer layer, QRandomGenerator &rng, BlendMode::Mode mode)
+	{
+		for(int s=0;s<4;++s) {
+			QPointF p(rng.bounded(layer->width()), rng.bounded(layer->height()));
+			const QColor color = QColor::fromRgb(rng.generate());
+			for(int i=0;i<30;++i) {
+				p += QPointF(rng.bounded(16) - 8, rng.bounded(16) - 8);
+				layer.putBrushStamp(brushes::makeGimpStyleBrushStamp(p, 20, 0.5, 0.5), color, mode);
+			}
+		}
+	}
+
+	// The original serial implementation of LayerStack::toFlatImage
+	static QImage referenceFlatImage(const LayerStack &stack, bool includeBackground, bool includeSublayers)
+	{
+		Layer flat(0, QString(), Qt::transparent, stack.size());
+		EditableLayer ef(&flat, nullptr, 0);
+
+		if(includeBackground)
+			ef.putTile(0, 0, 9999*9999, stack.background());
+
+		for(int i=0;i<stack.layerCount();++i) {
+			const Layer *l = stack.getLayerByIndex(i);
+			if(l->isVisible() && (includeBackground || !l->isFixed())) {
+				if(includeSublayers && l->hasSublayers()) {
+					Layer ll = Layer(*l);
+					EditableLayer el(&ll, nullptr, 0);
+					el.mergeAllSublayers();
+					ef.merge(&ll);
+
+				} else {
+					ef.merge(l);
+				}
+			}
+		}
+
+		return ef->toImage();
+	}
+
+	// The original serial implementation of LayerStack::flatLayerImage
+	static QImage referenceFlatLayerImage(const LayerStack &stack, int layerIdx)
+	{
+		Layer flat(0, QString(), Qt::transparent, stack.size());
+		EditableLayer ef(&flat, nullptr, 0);
+
+		ef.putTile(0, 0, 9999*9999, stack.background());
+
+		for(int i=0;i<stack.layerCount();++i) {
+			if(i == layerIdx || stack.getLayerByIndex(i)->isFixed())
+				ef.merge(stack.getLayerByIndex(i));
+		}
+
+		return ef->toImage();
+	}
+};
+
+
+QTEST_MAIN(TestFlatten)
+#include "flatten.moc"
@@ -0,0 +1,121 @@
+#include "../canvas/payloaddecoder.h"
+#include "../../libshared/net/image.h"
+#include "../../libshared/net/pixelcodec.h"
+
+#include <QtTest/QtTest>
+
+using namespace canvas;
+using paintcore::Tile;
+
+class TestPayloadDecoder : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testPrefetchedTiles()
+	{
+		PayloadDecoder decoder;
+
+		QVector<QByteArray> pixels;
+		protocol::MessageList msgs;
+		for(int i=0;i<64;++i) {
+			pixels << tilePixels(i);
+			msgs << protocol::MessagePtr(new protocol::PutTile(1, 1, 0, i, 0, 0,
+				protocol::compressPixels(reinterpret_cast<const uchar*>(pixels.last().constData()), Tile::BYTES, 4)
+			));
+			QVERIFY(decoder.prefetch(msgs.last()));
+		}
+		QCOMPARE(decoder.outstanding(), msgs.size());
+
+		// Taking a job that has not been started yet is allowed to fail,
+		// but a tile that is returned must always be correct.
+		for(int i=0;i<msgs.size();++i) {
+			Tile t;
+			if(decoder.takeTile(&(*msgs.at(i)), t)) {
+				QVERIFY(t.equals(Tile(pixels.at(i), 1)));
+				QCOMPARE(t.lastEditedBy(), 1);
+			}
+		}
+		QCOMPARE(decoder.outstanding(), 0);
+	}
+
+	void testPrefetchedImage()
+	{
+		PayloadDecoder decoder;
+
+		QByteArray pixels(100 * 50 * 4, 0);
+		for(int i=0;i<pixels.length();++i)
+			pixels[i] = char(i * 7);
+
+		const protocol::MessagePtr msg(new protocol::PutImage(1, 1, 0, 0, 0, 100, 50,
+			protocol::compressPixels(reinterpret_cast<const uchar*>(pixels.constData()), pixels.length(), 4)
+		));
+		QVERIFY(decoder.prefetch(msg));
+
+		// Wait for the job to get started
+		QThreadPool::globalInstance()->waitForDone();
+
+		QCOMPARE(decoder.takePixels(&(*msg)), pixels);
+
+		// Can be taken only once
+		QVERIFY(decoder.takePixels(&(*msg)).isNull());
+	}
+
+	void testInvalidPayload()
+	{
+		PayloadDecoder decoder;
+
+		const protocol::MessagePtr msg(new protocol::PutTile(1, 1, 0, 0, 0, 0, QByteArray("garbage")));
+		QVERIFY(decoder.prefetch(msg));
+		QThreadPool::globalInstance()->waitForDone();
+
+		Tile t;
+		QVERIFY(!decoder.takeTile(&(*msg), t));
+		QVERIFY(t.isNull());
+	}
+
+	void testIgnoredMessages()
+	{
+		PayloadDecoder decoder;
+
+		const protocol::MessagePtr solid(new protocol::PutTile(1, 1, 0, 0, 0, 0, 0xffff0000));
+		QVERIFY(decoder.prefetch(solid));
+		QCOMPARE(decoder.outstanding(), 0);
+	}
+
+	void testLimit()
+	{
+		PayloadDecoder decoder;
+
+		const QByteArray pixels = tilePixels(0);
+		const QByteArray compressed = protocol::compressPixels(reinterpret_cast<const uchar*>(pixels.constData()), Tile::BYTES, 4);
+
+		protocol::MessageList msgs;
+		for(int i=0;i<PayloadDecoder::MAX_OUTSTANDING;++i) {
+			msgs << protocol::MessagePtr(new protocol::PutTile(1, 1, 0, i, 0, 0, compressed));
+			QVERIFY(decoder.prefetch(msgs.last()));
+		}
+
+		const protocol::MessagePtr extra(new protocol::PutTile(1, 1, 0, 0, 1, 0, compressed));
+		QVERIFY(!decoder.prefetch(extra));
+
+		decoder.discard(&(*msgs.first()));
+		QCOMPARE(decoder.outstanding(), PayloadDecoder::MAX_OUTSTANDING - 1);
+		QVERIFY(decoder.prefetch(extra));
+
+		decoder.clear();
+		QCOMPARE(decoder.outstanding(), 0);
+	}
+
+private:
+	static QByteArray tilePixels(int seed)
+	{
+		QByteArray pixels(Tile::BYTES, 0);
+		for(int i=0;i<pixels.length();++i)
+			pixels[i] = char((i / 64) * (seed + 1));
+		return pixels;
+	}
+};
+
+
+QTEST_MAIN(TestPayloadDecoder)
+#include "payloaddecoder.moc"
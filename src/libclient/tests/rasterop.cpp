@@ -0,0 +1,127 @@
+#include "../core/rasterop_p.h"
+#include "../core/tile.h"
+
+#include <QtTest/QtTest>
+#include <QRandomGenerator>
+
+using namespace paintcore;
+
+Q_DECLARE_METATYPE(BlendMode::Mode)
+
+static const BlendMode::Mode ALL_MODES[] = {
+	BlendMode::MODE_ERASE,
+	BlendMode::MODE_NORMAL,
+	BlendMode::MODE_MULTIPLY,
+	BlendMode::MODE_DIVIDE,
+	BlendMode::MODE_BURN,
+	BlendMode::MODE_DODGE,
+	BlendMode::MODE_DARKEN,
+	BlendMode::MODE_LIGHTEN,
+	BlendMode::MODE_SUBTRACT,
+	BlendMode::MODE_ADD,
+	BlendMode::MODE_RECOLOR,
+	BlendMode::MODE_BEHIND,
+	BlendMode::MODE_COLORERASE,
+	BlendMode::MODE_REPLACE
+};
+
+class TestRasterOp : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testCompositeMask_data() { modeData(); }
+	void testCompositeMask()
+	{
+		QFETCH(BlendMode::Mode, mode);
+		QRandomGenerator rng(1234);
+
+		for(int round=0;round<200;++round) {
+			// Odd widths exercise the scalar tail handling
+			const int w = 1 + rng.bounded(Tile::SIZE);
+			const int h = 1 + rng.bounded(Tile::SIZE);
+			const QVector<quint32> base = randomPixels(rng, round % 3 == 0);
+			const QVector<uchar> mask = randomMask(rng);
+			const quint32 color = rng.generate();
+
+			for(const RasterOpImpl *impl : supportedRasterOpImpls()) {
+				QVector<quint32> expected = base;
+				QVector<quint32> actual = base;
+
+				compositeMask(RASTEROP_SCALAR, mode, expected.data(), color, mask.constData(), w, h, Tile::SIZE-w, Tile::SIZE-w);
+				compositeMask(*impl, mode, actual.data(), color, mask.constData(), w, h, Tile::SIZE-w, Tile::SIZE-w);
+
+				if(actual != expected)
+					QFAIL(qPrintable(QStringLiteral("%1 differs in round %2 (%3x%4)").arg(impl->name).arg(round).arg(w).arg(h)));
+			}
+		}
+	}
+
+	void testCompositePixels_data() { modeData(); }
+	void testCompositePixels()
+	{
+		QFETCH(BlendMode::Mode, mode);
+		QRandomGenerator rng(4321);
+
+		for(int round=0;round<200;++round) {
+			const int len = 1 + rng.bounded(Tile::LENGTH);
+			const QVector<quint32> base = randomPixels(rng, round % 3 == 0);
+			const QVector<quint32> over = randomPixels(rng, round % 2 == 0);
+			const uchar opacity = round % 4 == 0 ? 255 : rng.bounded(256);
+
+			for(const RasterOpImpl *impl : supportedRasterOpImpls()) {
+				QVector<quint32> expected = base;
+				QVector<quint32> actual = base;
+
+				compositePixels(RASTEROP_SCALAR, mode, expected.data(), over.constData(), len, opacity);
+				compositePixels(*impl, mode, actual.data(), over.constData(), len, opacity);
+
+				if(actual != expected)
+					QFAIL(qPrintable(QStringLiteral("%1 differs in round %2 (length %3)").arg(impl->name).arg(round).arg(len)));
+			}
+		}
+	}
+
+private:
+	void modeData()
+	{
+		QTest::addColumn<BlendMode::Mode>("mode");
+		for(BlendMode::Mode m : ALL_MODES)
+			QTest::newRow(qPrintable(findBlendMode(m).svgname)) << m;
+	}
+
+	static QVector<quint32> randomPixels(QRandomGenerator &rng, bool extremeAlpha)
+	{
+		// Note: the pixels are deliberately not all valid premultiplied values.
+		// The vectorized kernels must match the scalar ones even then.
+		QVector<quint32> pixels(Tile::LENGTH);
+		for(quint32 &p : pixels) {
+			p = rng.generate();
+			if(extremeAlpha) {
+				switch(rng.bounded(3)) {
+				case 0: p &= 0x00ffffff; break;
+				case 1: p |= 0xff000000; break;
+				default: break;
+				}
+			}
+		}
+		return pixels;
+	}
+
+	static QVector<uchar> randomMask(QRandomGenerator &rng)
+	{
+		// Fully transparent and opaque mask values are special cased in the scalar code
+		QVector<uchar> mask(Tile::LENGTH);
+		for(uchar &m : mask) {
+			switch(rng.bounded(4)) {
+			case 0: m = 0; break;
+			case 1: m = 255; break;
+			default: m = rng.bounded(256);
+			}
+		}
+		return mask;
+	}
+};
+
+
+QTEST_MAIN(TestRasterOp)
+#include "rasterop.moc"
@@ -0,0 +1,231 @@
+#include "../recording/index.h"
+#include "../recording/index_p.h"
+#include "../recording/indexbuilder.h"
+#include "../recording/indexloader.h"
+#include "../canvas/statetracker.h"
+#include "../core/layerstack.h"
+#include "../core/blendmodes.h"
+#include "../../libshared/record/writer.h"
+#include "../../libshared/net/layer.h"
+#include "../../libshared/net/image.h"
+#include "../../libshared/net/recording.h"
+
+#include <QtTest/QtTest>
+#include <QTemporaryDir>
+#include <QThreadPool>
+#include <QtEndian>
+
+#include <limits>
+
+using namespace recording;
+
+// The test recording is a run of fills in different parts of the canvas,
+// each followed by a marker
+static const int SEGMENTS = 12;
+static const int FILLS_PER_SEGMENT = 30;
+static const int SEGMENT_SIZE = 64;
+
+class TestRecordingIndex : public QObject
+{
+	Q_OBJECT
+private slots:
+	void initTestCase()
+	{
+		QVERIFY(m_dir.isValid());
+		m_recording = m_dir.filePath("test.dprec");
+		QVERIFY(writeRecording(m_recording));
+		m_hash = hashRecording(m_recording);
+	}
+
+	void testRoundTrip()
+	{
+		const QString indexfile = m_dir.filePath("roundtrip.dpidx");
+		QVERIFY(buildIndex(indexfile));
+
+		IndexLoader loader(m_recording, indexfile, m_hash);
+		QVERIFY(loader.open());
+
+		// One entry at the start of the recording and one at each marker
+		QCOMPARE(loader.entryCount(), SEGMENTS + 1);
+		QCOMPARE(loader.thumbnailCount(), 1);
+
+		const QVector<IndexEntry> markers = loader.markers();
+		QCOMPARE(markers.size(), SEGMENTS);
+		for(int i=0;i<SEGMENTS;++i) {
+			QCOMPARE(markers.at(i).title, QStringLiteral("Marker %1").arg(i));
+			QCOMPARE(markers.at(i).index, quint32(markerIndex(i)));
+			QCOMPARE(loader.entry(i+1).index, markers.at(i).index);
+			QCOMPARE(loader.entry(i+1).snapshotOffset, markers.at(i).snapshotOffset);
+		}
+
+		// The nearest entry is the last one before the given message
+		QCOMPARE(loader.nearest(0).index, 0u);
+		QCOMPARE(loader.nearest(markerIndex(0)).index, 0u);
+		QCOMPARE(loader.nearest(markerIndex(0)+1).index, quint32(markerIndex(0)));
+		QCOMPARE(loader.nearest(markerIndex(5)).index, quint32(markerIndex(4)));
+		QCOMPARE(loader.nearest(markerIndex(5)+10).index, quint32(markerIndex(5)));
+		QCOMPARE(loader.nearest(100000).index, quint32(markerIndex(SEGMENTS-1)));
+
+		// Each marker's snapshot contains the fills made before it, but not the ones after
+		for(int i=0;i<SEGMENTS;++i) {
+			const canvas::StateSavepoint sp = loader.loadSavepoint(markers.at(i));
+			QVERIFY(sp);
+
+			const paintcore::Savepoint savepoint = sp.canvas();
+			QCOMPARE(savepoint.size, QSize(SEGMENT_SIZE * 4, SEGMENT_SIZE * 3));
+			QCOMPARE(savepoint.layers.size(), 1);
+
+			const paintcore::Layer *layer = savepoint.layers.first().data();
+			QCOMPARE(layer->pixelAt(segmentPos(i).x(), segmentPos(i).y()), segmentColor(i));
+			if(i+1 < SEGMENTS)
+				QCOMPARE(layer->pixelAt(segmentPos(i+1).x(), segmentPos(i+1).y()), 0u);
+		}
+	}
+
+	void testTruncatedEntryTable()
+	{
+		QByteArray index = buildIndexData("truncated.dpidx");
+		QVERIFY(!index.isEmpty());
+
+		index.chop(INDEX_ENTRY_SIZE / 2);
+		QVERIFY(!openIndex("truncated.dpidx", index));
+
+		index.truncate(index.size() / 2);
+		QVERIFY(!openIndex("truncated.dpidx", index));
+	}
+
+	void testBadEntryTableOffset()
+	{
+		QByteArray index = buildIndexData("badtable.dpidx");
+		QVERIFY(!index.isEmpty());
+
+		qToBigEndian<quint64>(quint64(index.size()) + 8, reinterpret_cast<uchar*>(index.data()) + entryTableOffsetPos());
+		QVERIFY(!openIndex("badtable.dpidx", index));
+
+		qToBigEndian<quint64>(std::numeric_limits<quint64>::max() - 16, reinterpret_cast<uchar*>(index.data()) + entryTableOffsetPos());
+		QVERIFY(!openIndex("badtable.dpidx", index));
+	}
+
+	void testCorruptEntry()
+	{
+		QByteArray index = buildIndexData("badentry.dpidx");
+		QVERIFY(!index.isEmpty());
+
+		// Point the first marker's snapshot and title past the end of the file
+		const quint64 tableOffset = qFromBigEndian<quint64>(reinterpret_cast<const uchar*>(index.constData()) + entryTableOffsetPos());
+		uchar *entry = reinterpret_cast<uchar*>(index.data()) + tableOffset + INDEX_ENTRY_SIZE;
+		qToBigEndian<quint64>(quint64(index.size()) + 100, entry + 16);
+		qToBigEndian<quint64>(quint64(index.size()) + 100, entry + 24);
+
+		IndexLoader loader(m_recording, writeIndex("badentry.dpidx", index), m_hash);
+		QVERIFY(loader.open());
+		QCOMPARE(loader.entryCount(), SEGMENTS + 1);
+
+		// The title can't be read, but the entry is still listed as a marker
+		QCOMPARE(loader.markers().size(), SEGMENTS);
+		QVERIFY(loader.markers().first().title.isEmpty());
+		QVERIFY(loader.entry(1).title.isEmpty());
+		QVERIFY(!loader.loadSavepoint(loader.entry(1)));
+
+		// Other entries still work
+		QVERIFY(loader.loadSavepoint(loader.entry(2)));
+	}
+
+	void testParallelOutputIsIdentical()
+	{
+		QThreadPool *tp = QThreadPool::globalInstance();
+		const int oldThreads = tp->maxThreadCount();
+
+		tp->setMaxThreadCount(1);
+		const QByteArray serial = buildIndexData("serial.dpidx");
+
+		tp->setMaxThreadCount(8);
+		const QByteArray parallel = buildIndexData("parallel.dpidx");
+
+		tp->setMaxThreadCount(oldThreads);
+
+		QVERIFY(!serial.isEmpty());
+		QCOMPARE(parallel.size(), serial.size());
+		QVERIFY(parallel == serial);
+	}
+
+private:
+	static int markerIndex(int segment) { return 2 + segment * (FILLS_PER_SEGMENT + 1) + FILLS_PER_SEGMENT; }
+	static QPoint segmentPos(int segment) { return QPoint((segment % 4) * SEGMENT_SIZE + 10, (segment / 4) * SEGMENT_SIZE + 10); }
+	static quint32 segmentColor(int segment) { return 0xff000000 | (segment * 0x151515); }
+
+	// Position of the entry table offset field in the index header
+	int entryTableOffsetPos() const { return 5 + 4 + 4 + m_hash.length(); }
+
+	static bool writeRecording(const QString &filename)
+	{
+		Writer writer(filename);
+		if(!writer.open() || !writer.writeHeader())
+			return false;
+
+		writer.writeMessage(protocol::CanvasResize(1, 0, SEGMENT_SIZE * 4, SEGMENT_SIZE * 3, 0));
+		writer.writeMessage(protocol::LayerCreate(1, 0x0101, 0, 0, 0, QStringLiteral("Layer")));
+
+		for(int i=0;i<SEGMENTS;++i) {
+			const QPoint p = segmentPos(i) - QPoint(10, 10);
+			for(int j=0;j<FILLS_PER_SEGMENT;++j) {
+				// The last fill covers the whole segment
+				const int size = SEGMENT_SIZE * (j+1) / FILLS_PER_SEGMENT;
+				writer.writeMessage(protocol::FillRect(1, 0x0101, paintcore::BlendMode::MODE_NORMAL, p.x(), p.y(), size, size, segmentColor(i)));
+			}
+			writer.writeMessage(protocol::Marker(1, QStringLiteral("Marker %1").arg(i)));
+		}
+
+		writer.close();
+		return true;
+	}
+
+	bool buildIndex(const QString &indexfile)
+	{
+		IndexBuilder builder(m_recording, indexfile, m_hash);
+
+		// Snapshot only at markers, so the result doesn't depend on timing
+		builder.setSnapshotInterval(std::numeric_limits<int>::max());
+
+		QSignalSpy doneSpy(&builder, &IndexBuilder::done);
+		builder.run();
+
+		return doneSpy.count() == 1 && doneSpy.first().first().toBool();
+	}
+
+	QByteArray buildIndexData(const QString &name)
+	{
+		const QString indexfile = m_dir.filePath(name);
+		if(!buildIndex(indexfile))
+			return QByteArray();
+
+		QFile f(indexfile);
+		if(!f.open(QFile::ReadOnly))
+			return QByteArray();
+		return f.readAll();
+	}
+
+	QString writeIndex(const QString &name, const QByteArray &content)
+	{
+		const QString indexfile = m_dir.filePath(name);
+		QFile f(indexfile);
+		if(!f.open(QFile::WriteOnly | QFile::Truncate))
+			return QString();
+		f.write(content);
+		return indexfile;
+	}
+
+	bool openIndex(const QString &name, const QByteArray &content)
+	{
+		IndexLoader loader(m_recording, writeIndex(name, content), m_hash);
+		return loader.open();
+	}
+
+	QTemporaryDir m_dir;
+	QString m_recording;
+	QByteArray m_hash;
+};
+
+
+QTEST_MAIN(TestRecordingIndex)
+#include "recordingindex.moc"
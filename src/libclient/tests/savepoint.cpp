@@ -0,0 +1,100 @@
+#include "../core/layerstack.h"
+#include "../core/layer.h"
+#include "../core/tile.h"
+#include "../brushes/classicbrushpainter.h"
+
+#include <QtTest/QtTest>
+
+using namespace paintcore;
+
+class TestSavepoint : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testUnchangedLayersAreShared()
+	{
+		LayerStack canvas;
+		makeCanvas(canvas);
+
+		const Savepoint sp1 = canvas.makeSavepoint();
+		stroke(canvas.editor(0).getEditableLayerByIndex(1), QPointF(10, 10));
+		const Savepoint sp2 = canvas.makeSavepoint();
+
+		QCOMPARE(sp2.layers.size(), 3);
+		QCOMPARE(sp2.layers.at(0), sp1.layers.at(0));
+		QVERIFY(sp2.layers.at(1) != sp1.layers.at(1));
+		QCOMPARE(sp2.layers.at(2), sp1.layers.at(2));
+
+		// Only the rows touched by the stroke should have been copied
+		const Layer *l1 = sp1.layers.at(1).data();
+		const Layer *l2 = sp2.layers.at(1).data();
+		QVERIFY(!l2->sharesTileRow(*l1, 0));
+		for(int y=1;y<Tile::roundTiles(canvas.height());++y)
+			QVERIFY(l2->sharesTileRow(*l1, y));
+	}
+
+	void testLayerPropertyChange()
+	{
+		LayerStack canvas;
+		makeCanvas(canvas);
+
+		const Savepoint sp1 = canvas.makeSavepoint();
+		canvas.editor(0).getEditableLayerByIndex(2).setOpacity(10);
+		const Savepoint sp2 = canvas.makeSavepoint();
+
+		QVERIFY(sp2.layers.at(2) != sp1.layers.at(2));
+		QCOMPARE(sp2.layers.at(2)->opacity(), 10);
+		QCOMPARE(sp1.layers.at(2)->opacity(), 255);
+	}
+
+	void testRestore()
+	{
+		LayerStack canvas;
+		makeCanvas(canvas);
+
+		const Savepoint sp1 = canvas.makeSavepoint();
+		const QImage image1 = canvas.toFlatImage(false, true, false);
+
+		stroke(canvas.editor(0).getEditableLayerByIndex(0), QPointF(300, 200));
+		canvas.editor(0).deleteLayer(0x0102);
+		const Savepoint sp2 = canvas.makeSavepoint();
+		const QImage image2 = canvas.toFlatImage(false, true, false);
+		QVERIFY(image1 != image2);
+
+		canvas.editor(0).restoreSavepoint(sp1);
+		QCOMPARE(canvas.toFlatImage(false, true, false), image1);
+
+		// Savepoints made after restoring share the restored layers
+		stroke(canvas.editor(0).getEditableLayerByIndex(1), QPointF(100, 100));
+		const Savepoint sp3 = canvas.makeSavepoint();
+		QCOMPARE(sp3.layers.at(0), sp1.layers.at(0));
+		QCOMPARE(sp3.layers.at(2), sp1.layers.at(2));
+
+		canvas.editor(0).restoreSavepoint(sp2);
+		QCOMPARE(canvas.toFlatImage(false, true, false), image2);
+	}
+
+private:
+	static void makeCanvas(LayerStack &canvas)
+	{
+		auto editor = canvas.editor(0);
+		editor.resize(0, 400, 300, 0);
+		editor.setBackground(Tile(Qt::white));
+		for(int i=0;i<3;++i) {
+			EditableLayer layer = editor.createLayer(0x0100 + i, 0, Qt::transparent, false, false, QString("Layer %1").arg(i));
+			stroke(layer, QPointF(50 + i * 100, 150));
+		}
+	}
+
+	static void stroke(EditableLayer layer, QPointF p)
+	{
+		for(int i=0;i<10;++i) {
+			layer.putBrushStamp(brushes::makeGimpStyleBrushStamp(p, 8, 0.5, 1.0), Qt::black, BlendMode::MODE_NORMAL);
+			p += QPointF(3, 0);
+		}
+	}
+};
+
+
+QTEST_MAIN(TestSavepoint)
+#include "savepoint.moc"
@@ -0,0 +1,122 @@
+#include "../core/tile.h"
+#include "../core/tilepool.h"
+
+#include <QtTest/QtTest>
+#include <QColor>
+
+using namespace paintcore;
+
+class TestTile : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testNullTile()
+	{
+		const Tile t;
+		QVERIFY(t.isBlank());
+		QCOMPARE(t.solidColor(), QColor(Qt::transparent));
+
+		// Null and blank tiles are equivalent
+		const Tile blank(QColor(Qt::transparent));
+		QVERIFY(!blank.isNull());
+		QVERIFY(blank.isBlank());
+		QCOMPARE(t.contentHash(), blank.contentHash());
+		QVERIFY(t.equals(blank));
+		QVERIFY(blank.equals(t));
+	}
+
+	void testSolidTile()
+	{
+		const Tile t(QColor(255, 0, 0));
+		QVERIFY(!t.isBlank());
+		QCOMPARE(t.solidColor(), QColor(255, 0, 0));
+
+		const Tile t2(QColor(255, 0, 0));
+		QCOMPARE(t.contentHash(), t2.contentHash());
+		QVERIFY(t.equals(t2));
+
+		const Tile t3(QColor(0, 0, 255));
+		QVERIFY(t.contentHash() != t3.contentHash());
+		QVERIFY(!t.equals(t3));
+	}
+
+	void testMetadataInvalidation()
+	{
+		Tile t(QColor(Qt::transparent));
+		QVERIFY(t.isBlank());
+		const quint64 blankHash = t.contentHash();
+
+		// Writing to a shared tile must not change the other copy's metadata
+		const Tile copy = t;
+		t.data()[100] = 0xff000000;
+
+		QVERIFY(!t.isBlank());
+		QVERIFY(!t.solidColor().isValid());
+		QVERIFY(t.contentHash() != blankHash);
+		QVERIFY(!t.equals(copy));
+
+		QVERIFY(copy.isBlank());
+		QCOMPARE(copy.contentHash(), blankHash);
+
+		// Metadata is recalculated after each write
+		t.data()[100] = 0;
+		QVERIFY(t.isBlank());
+		QCOMPARE(t.contentHash(), blankHash);
+		QVERIFY(t.equals(copy));
+	}
+
+	void testSinglePixelDifference()
+	{
+		Tile t1(QColor(10, 20, 30));
+		Tile t2(QColor(10, 20, 30));
+
+		t1.data()[Tile::LENGTH-1] = 0xff000000;
+		QVERIFY(!t1.equals(t2));
+		QVERIFY(!t1.solidColor().isValid());
+
+		t2.data()[Tile::LENGTH-1] = 0xff000000;
+		QCOMPARE(t1.contentHash(), t2.contentHash());
+		QVERIFY(t1.equals(t2));
+	}
+
+	void testInterning()
+	{
+		const Tile t1(QColor(1, 2, 3), 1);
+		const Tile t2(QColor(1, 2, 3), 1);
+		const Tile t3(QColor(1, 2, 3), 2);
+		QVERIFY(t1 != t2);
+
+		const Tile p1 = TilePool::intern(t1);
+		const Tile p2 = TilePool::intern(t2);
+		QVERIFY(p1 == t1);
+		QVERIFY(p2 == t1);
+
+		// The last edited by tag is a part of the content
+		const Tile p3 = TilePool::intern(t3);
+		QVERIFY(p3 == t3);
+
+		const TilePool::Stats stats = TilePool::stats();
+		QVERIFY(stats.tiles >= 2);
+		QVERIFY(stats.hits >= 1);
+
+		// Writing to an interned tile does not affect the pooled copy
+		Tile w = p2;
+		w.data()[0] = 0;
+		QVERIFY(w != p1);
+		QCOMPARE(p1.solidColor(), QColor(1, 2, 3));
+	}
+
+	void testDisabledPool()
+	{
+		TilePool::setEnabled(false);
+		const Tile t1(QColor(4, 5, 6));
+		const Tile t2(QColor(4, 5, 6));
+		TilePool::intern(t1);
+		QVERIFY(TilePool::intern(t2) == t2);
+		TilePool::setEnabled(true);
+	}
+};
+
+
+QTEST_MAIN(TestTile)
+#include "tile.moc"
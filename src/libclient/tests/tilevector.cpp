@@ -0,0 +1,78 @@
+#include "../core/tilevector.h"
+#include "../core/layer.h"
+#include "../core/tile.h"
+
+#include <QtTest/QtTest>
+#include <QRandomGenerator>
+#include <QThreadPool>
+#include <QImage>
+
+using namespace paintcore;
+
+class TestTileVector : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testParallelPutTiles()
+	{
+		Layer layer(0, QString(), Qt::transparent, QSize(Tile::SIZE * 10, Tile::SIZE * 6));
+		EditableLayer(&layer, nullptr, 0).putImage(0, 0, makeImage(layer.width(), layer.height()), BlendMode::MODE_REPLACE);
+
+		// With just one thread, concurrentFor processes the items in order
+		const protocol::MessageList serial = putTiles(layer, 1);
+		const protocol::MessageList parallel = putTiles(layer, 8);
+
+		QVERIFY(serial.size() > 10);
+		QCOMPARE(parallel.size(), serial.size());
+		for(int i=0;i<serial.size();++i)
+			QCOMPARE(parallel.at(i)->serialized(), serial.at(i)->serialized());
+	}
+
+private:
+	static protocol::MessageList putTiles(const Layer &layer, int threads)
+	{
+		QThreadPool *tp = QThreadPool::globalInstance();
+		const int oldThreads = tp->maxThreadCount();
+		tp->setMaxThreadCount(threads);
+
+		protocol::MessageList msgs;
+		LayerTileSet::fromLayer(layer).toPutTiles(1, 2, 0, msgs);
+
+		tp->setMaxThreadCount(oldThreads);
+		return msgs;
+	}
+
+	// A mix of solid background, solid color runs and noisy tiles
+	static QImage makeImage(int width, int height)
+	{
+		QImage img(width, height, QImage::Format_ARGB32_Premultiplied);
+		img.fill(Qt::white);
+
+		QRandomGenerator rng(1234);
+		for(int ty=0;ty<height/Tile::SIZE;++ty) {
+			for(int tx=0;tx<width/Tile::SIZE;++tx) {
+				const int kind = rng.bounded(4);
+				if(kind == 0)
+					continue;
+
+				for(int y=0;y<Tile::SIZE;++y) {
+					quint32 *row = reinterpret_cast<quint32*>(img.scanLine(ty*Tile::SIZE + y)) + tx*Tile::SIZE;
+					for(int x=0;x<Tile::SIZE;++x) {
+						if(kind == 1)
+							row[x] = 0xff336699;
+						else if(kind == 2)
+							row[x] = 0xff000000 | rng.bounded(0x1000000);
+						else
+							row[x] = (x+y) % 8 ? 0xffffffff : 0xff000000;
+					}
+				}
+			}
+		}
+
+		return img;
+	}
+};
+
+
+QTEST_MAIN(TestTileVector)
+#include "tilevector.moc"
@@ -71,6 +71,7 @@ Client::Client(QTcpSocket *socket, ServerLog *logger, QObject *parent)
 	: QObject(parent), d(new Private(socket, logger))
 {
 	d->msgqueue = new protocol::MessageQueue(socket, this);
+	d->msgqueue->setCacheSerialization(true);
 	d->socket->setParent(this);
 
 	connect(d->socket, &QAbstractSocket::disconnected, this, &Client::socketDisconnect);
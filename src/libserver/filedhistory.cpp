@@ -22,18 +22,32 @@
 #include "../libshared/util/filename.h"
 #include "../libshared/record/header.h"
 #include "../libshared/net/meta.h"
+#include "../libshared/net/raw.h"
 
 #include <QFile>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QCryptographicHash>
 #include <QJsonObject>
 #include <QVarLengthArray>
 #include <QDebug>
 #include <QTimerEvent>
 
+#include <algorithm>
+
 namespace server {
 
 // A block is closed when its size goes above this limit
 static const qint64 MAX_BLOCK_SIZE = 0xffff * 10;
 
+// Block index sidecar file format
+static const char BLOCK_INDEX_MAGIC[] = "DPBLKIDX";
+static const quint32 BLOCK_INDEX_VERSION = 1;
+
+// How much of the end of the indexed part of the recording is
+// checked to make sure the block index is up to date
+static const qint64 BLOCK_INDEX_TAIL = 4096;
+
 FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QString &id, const QString &alias, const protocol::ProtocolVersion &version, const QString &founder, QObject *parent)
 	: SessionHistory(id, parent),
 	  m_dir(dir),
@@ -60,6 +74,9 @@ FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QString &id, Q
 
 FiledHistory::~FiledHistory()
 {
+	// Save the block index so the session can be loaded quickly next time
+	if(m_recording && m_recording->isOpen())
+		saveBlockIndex();
 }
 
 QString FiledHistory::journalFilename(const QString &id)
@@ -67,6 +84,11 @@ QString FiledHistory::journalFilename(const QString &id)
 	return id + ".session";
 }
 
+QString FiledHistory::blockIndexFilename(const QString &recordingFilename)
+{
+	return recordingFilename + ".blocks";
+}
+
 static QString uniqueRecordingFilename(const QDir &dir, const QString &id, int idx)
 {
 	QString idstr = id;
@@ -115,6 +137,21 @@ FiledHistory *FiledHistory::load(const QString &path, QObject *parent)
 	return fh;
 }
 
+QString FiledHistory::readAlias(const QString &path)
+{
+	QFile journal(path);
+	if(!journal.open(QFile::ReadOnly))
+		return QString();
+
+	while(!journal.atEnd()) {
+		const QByteArray line = journal.readLine().trimmed();
+		if(line.startsWith("ALIAS "))
+			return QString::fromUtf8(line.mid(6).trimmed());
+	}
+
+	return QString();
+}
+
 bool FiledHistory::create()
 {
 	if(m_journal->exists()) {
@@ -335,9 +372,13 @@ bool FiledHistory::load()
 		return false;
 	}
 
-	qint64 startOffset = m_recording->pos();
+	const qint64 startOffset = m_recording->pos();
+
+	// Scan the recording file and build the index of blocks.
+	// If there is an up to date block index, only the part of the recording
+	// written after the index was saved needs to be scanned.
+	loadBlockIndex(startOffset);
 
-	// Scan the recording file and build the index of blocks
 	if(!scanBlocks()) {
 		qWarning() << recordingFile << "error occurred during indexing";
 		return false;
@@ -353,25 +394,26 @@ bool FiledHistory::load()
 		return false;
 	}
 
+	saveBlockIndex();
+
 	return true;
 }
 
 bool FiledHistory::scanBlocks()
 {
-	Q_ASSERT(m_blocks.isEmpty());
-	// Note: m_recording should be at the start of the recording
-
-	m_blocks << Block {
-		m_recording->pos(),
-		firstIndex(),
-		0,
-		m_recording->pos(),
-		protocol::MessageList()
-	};
-
-	QSet<uint8_t> users;
+	// Note: m_recording should be at the start of the recording,
+	// or at the end of the part already indexed by loadBlockIndex
+	if(m_blocks.isEmpty()) {
+		m_blocks << Block {
+			m_recording->pos(),
+			firstIndex(),
+			0,
+			m_recording->pos(),
+			protocol::MessageList()
+		};
+	}
 
-	do {
+	while(!m_recording->atEnd()) {
 		Block &b = m_blocks.last();
 		uint8_t msgType, ctxId;
 
@@ -398,16 +440,14 @@ bool FiledHistory::scanBlocks()
 			};
 		}
 
-		switch(msgType) {
-		case protocol::MSG_USER_JOIN: users.insert(ctxId); break;
-		case protocol::MSG_USER_LEAVE:
-			users.remove(ctxId);
+		trackUsers(msgType, ctxId);
+		if(msgType == protocol::MSG_USER_LEAVE)
 			idQueue().reserveId(ctxId);
-			break;
-		}
-	} while(!m_recording->atEnd());
+	}
 
 	// There should be no users at the end of the recording.
+	QList<uint8_t> users = m_activeUsers.values();
+	std::sort(users.begin(), users.end());
 	for(const uint8_t user : users) {
 		protocol::UserLeave msg(user);
 		m_blocks.last().count++;
@@ -415,16 +455,196 @@ bool FiledHistory::scanBlocks()
 		char buf[16];
 		msg.serialize(buf);
 		m_recording->write(buf, msg.length());
+		trackUsers(protocol::MSG_USER_LEAVE, user);
 		idQueue().reserveId(user);
 	}
 	return true;
 }
 
+void FiledHistory::trackUsers(uint8_t msgType, uint8_t ctxId)
+{
+	switch(msgType) {
+	case protocol::MSG_USER_JOIN:
+		m_activeUsers.insert(ctxId);
+		break;
+	case protocol::MSG_USER_LEAVE:
+		m_activeUsers.remove(ctxId);
+		m_leaveOrder.removeOne(ctxId);
+		m_leaveOrder.append(ctxId);
+		break;
+	}
+}
+
+/**
+ * @brief Load the block index sidecar file
+ *
+ * The index is used only if it is intact and matches the recording.
+ * On success, the recording file is positioned at the end of the
+ * indexed part.
+ *
+ * @param startOffset the position of the first message in the recording
+ * @return true if the index was loaded
+ */
+bool FiledHistory::loadBlockIndex(qint64 startOffset)
+{
+	Q_ASSERT(m_blocks.isEmpty());
+
+	QFile f(blockIndexFilename(m_recording->fileName()));
+	if(!f.open(QFile::ReadOnly))
+		return false;
+
+	QDataStream ds(&f);
+	char magic[sizeof(BLOCK_INDEX_MAGIC)-1];
+	quint32 version;
+	QByteArray payload, checksum;
+
+	if(ds.readRawData(magic, sizeof magic) != sizeof magic || memcmp(magic, BLOCK_INDEX_MAGIC, sizeof magic) != 0) {
+		qWarning() << f.fileName() << "not a block index";
+		return false;
+	}
+
+	ds >> version >> payload >> checksum;
+	if(ds.status() != QDataStream::Ok || version != BLOCK_INDEX_VERSION || QCryptographicHash::hash(payload, QCryptographicHash::Sha1) != checksum) {
+		qWarning() << f.fileName() << "invalid block index";
+		return false;
+	}
+
+	QDataStream ps(payload);
+	qint64 endOffset;
+	QByteArray tailHash;
+	quint32 blockCount;
+	ps >> endOffset >> tailHash >> blockCount;
+
+	QVector<Block> blocks;
+	int index = firstIndex();
+	for(quint32 i=0;i<blockCount && ps.status() == QDataStream::Ok;++i) {
+		qint64 blockStart, blockEnd;
+		qint32 count;
+		ps >> blockStart >> count >> blockEnd;
+
+		if(blockStart != (blocks.isEmpty() ? startOffset : blocks.last().endOffset) || blockEnd < blockStart || count < 0) {
+			qWarning() << f.fileName() << "invalid block" << i;
+			return false;
+		}
+
+		blocks << Block { blockStart, index, count, blockEnd, protocol::MessageList() };
+		index += count;
+	}
+
+	QSet<uint8_t> activeUsers;
+	QVector<uint8_t> leaveOrder;
+	quint32 userCount;
+	ps >> userCount;
+	for(quint32 i=0;i<userCount && ps.status() == QDataStream::Ok;++i) {
+		quint8 user;
+		ps >> user;
+		activeUsers.insert(user);
+	}
+	ps >> userCount;
+	for(quint32 i=0;i<userCount && ps.status() == QDataStream::Ok;++i) {
+		quint8 user;
+		ps >> user;
+		if(user >= IdQueue::FIRST_ID && user <= IdQueue::LAST_ID && !leaveOrder.contains(user))
+			leaveOrder << user;
+	}
+
+	if(ps.status() != QDataStream::Ok || blocks.isEmpty() || blocks.last().endOffset != endOffset) {
+		qWarning() << f.fileName() << "invalid block index content";
+		return false;
+	}
+
+	// Make sure the indexed part of the recording has not changed
+	if(m_recording->size() < endOffset) {
+		qWarning() << f.fileName() << "block index is out of date";
+		return false;
+	}
+
+	const qint64 tailStart = qMax(startOffset, endOffset - BLOCK_INDEX_TAIL);
+	if(!m_recording->seek(tailStart))
+		return false;
+
+	const QByteArray tail = m_recording->read(endOffset - tailStart);
+	if(QCryptographicHash::hash(tail, QCryptographicHash::Sha1) != tailHash) {
+		qWarning() << f.fileName() << "block index is out of date";
+		m_recording->seek(startOffset);
+		return false;
+	}
+
+	m_blocks = blocks;
+	m_activeUsers = activeUsers;
+	m_leaveOrder = leaveOrder;
+	for(const uint8_t user : m_leaveOrder)
+		idQueue().reserveId(user);
+
+	Q_ASSERT(m_recording->pos() == endOffset);
+	return true;
+}
+
+/**
+ * @brief Write the block index sidecar file
+ *
+ * The index covers the recording up to the end of the last block.
+ */
+void FiledHistory::saveBlockIndex()
+{
+	if(m_blocks.isEmpty())
+		return;
+
+	m_recording->flush();
+
+	const qint64 endOffset = m_blocks.last().endOffset;
+	const qint64 tailStart = qMax(m_blocks.first().startOffset, endOffset - BLOCK_INDEX_TAIL);
+
+	const qint64 prevPos = m_recording->pos();
+	m_recording->seek(tailStart);
+	const QByteArray tail = m_recording->read(endOffset - tailStart);
+	m_recording->seek(prevPos);
+
+	if(tail.length() != endOffset - tailStart) {
+		qWarning() << m_recording->fileName() << "couldn't read recording to update block index";
+		return;
+	}
+
+	QByteArray payload;
+	{
+		QDataStream ps(&payload, QIODevice::WriteOnly);
+		ps << endOffset << QCryptographicHash::hash(tail, QCryptographicHash::Sha1) << quint32(m_blocks.size());
+		for(const Block &b : m_blocks)
+			ps << b.startOffset << qint32(b.count) << b.endOffset;
+
+		QList<uint8_t> activeUsers = m_activeUsers.values();
+		std::sort(activeUsers.begin(), activeUsers.end());
+		ps << quint32(activeUsers.size());
+		for(const uint8_t user : activeUsers)
+			ps << quint8(user);
+
+		ps << quint32(m_leaveOrder.size());
+		for(const uint8_t user : m_leaveOrder)
+			ps << quint8(user);
+	}
+
+	QSaveFile f(blockIndexFilename(m_recording->fileName()));
+	if(!f.open(QFile::WriteOnly)) {
+		qWarning() << f.fileName() << f.errorString();
+		return;
+	}
+
+	QDataStream ds(&f);
+	ds.writeRawData(BLOCK_INDEX_MAGIC, sizeof(BLOCK_INDEX_MAGIC)-1);
+	ds << BLOCK_INDEX_VERSION << payload << QCryptographicHash::hash(payload, QCryptographicHash::Sha1);
+
+	if(!f.commit())
+		qWarning() << f.fileName() << f.errorString();
+}
+
 void FiledHistory::terminate()
 {
 	m_recording->close();
 	m_journal->close();
 
+	// The block index is needed only for loading live sessions
+	QFile::remove(blockIndexFilename(m_recording->fileName()));
+
 	if(m_archive) {
 		m_journal->rename(m_journal->fileName() + ".archived");
 		m_recording->rename(m_recording->fileName() + ".archived");
@@ -453,6 +673,8 @@ void FiledHistory::closeBlock()
 				b.endOffset,
 				protocol::MessageList()
 	};
+
+	saveBlockIndex();
 }
 
 void FiledHistory::setPasswordHash(const QByteArray &password)
@@ -557,24 +779,23 @@ std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
 		return std::make_tuple(protocol::MessageList(), b.startIndex+b.count-1);
 
 	if(b.messages.isEmpty() && b.count>0) {
-		// Load the block worth of messages to memory if not already loaded
+		// Load the block worth of messages to memory if not already loaded.
+		// The messages are not deserialized: the block is read into a single
+		// buffer and the messages are views into it that can be sent as is.
 		const qint64 prevPos = m_recording->pos();
 		qDebug() << m_recording->fileName() << "loading block" << i;
 		m_recording->seek(b.startOffset);
-		QByteArray buffer;
-		for(int m=0;m<b.count;++m) {
-			if(!recording::readRecordingMessage(m_recording, buffer)) {
-				qWarning() << m_recording->fileName() << "read error!";
-				m_recording->close();
-				break;
-			}
-			protocol::NullableMessageRef msg = protocol::Message::deserialize((const uchar*)buffer.constData(), buffer.length(), false);
-			if(msg.isNull()) {
-				qWarning() << m_recording->fileName() << "Invalid message in block" << i;
-				m_recording->close();
-				break;
-			}
-			const_cast<Block&>(b).messages << protocol::MessagePtr::fromNullable(msg);
+		const QByteArray buffer = m_recording->read(b.endOffset - b.startOffset);
+		if(buffer.length() != b.endOffset - b.startOffset) {
+			qWarning() << m_recording->fileName() << "read error!";
+			m_recording->close();
+		}
+
+		int consumed;
+		const_cast<Block&>(b).messages = protocol::RawMessage::split(buffer, &consumed);
+		if(consumed != buffer.length() || b.messages.size() != b.count) {
+			qWarning() << m_recording->fileName() << "Invalid message in block" << i;
+			m_recording->close();
 		}
 
 		m_recording->seek(prevPos);
@@ -594,6 +815,8 @@ void FiledHistory::historyAdd(const protocol::MessagePtr &msg)
 	b.count++;
 	b.endOffset += len;
 
+	trackUsers(msg->type(), msg->contextId());
+
 	// Add message to cache, if already active (if cache is empty, it will be loaded from disk when needed)
 	if(!b.messages.isEmpty())
 		b.messages.append(msg);
@@ -609,8 +832,12 @@ void FiledHistory::historyReset(const protocol::MessageList &newHistory)
 
 	m_recording = nullptr;
 	m_blocks.clear();
+	m_activeUsers.clear();
+	m_leaveOrder.clear();
 	initRecording();
 
+	QFile::remove(blockIndexFilename(oldRecording->fileName()));
+
 	// Remove old recording after the new one has been created so
 	// that the new file will not have the same name.
 	if(m_archive)
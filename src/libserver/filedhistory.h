@@ -55,8 +55,21 @@ public:
 	 */
 	static FiledHistory *load(const QString &path, QObject *parent=nullptr);
 
+	/**
+	 * @brief Read just the ID alias from a session journal
+	 *
+	 * This only parses the journal, not the recording, so it is cheap
+	 * enough to do before the session itself is loaded.
+	 *
+	 * @param path path to the journal file
+	 * @return the alias or an empty string if none is set
+	 */
+	static QString readAlias(const QString &path);
+
 	/**
 	 * @brief Close the currently open block (if any) and start a new one
+	 *
+	 * The block index sidecar file is updated as well.
 	 */
 	void closeBlock();
 
@@ -72,6 +85,9 @@ public:
 	//! Get the metadata journal file name for the given session ID
 	static QString journalFilename(const QString &id);
 
+	//! Get the block index file name for the given recording file
+	static QString blockIndexFilename(const QString &recordingFilename);
+
 	QString idAlias() const override { return m_alias; }
 	QString founderName() const override { return m_founder; }
 	protocol::ProtocolVersion protocolVersion() const override { return m_version; }
@@ -121,6 +137,9 @@ private:
 		int startIndex;
 		int count;
 		qint64 endOffset;
+
+		// Cached block content. Messages loaded from the file are
+		// RawMessages referring to a single buffer holding the whole block.
 		protocol::MessageList messages;
 	};
 
@@ -129,6 +148,10 @@ private:
 	bool scanBlocks();
 	bool initRecording();
 
+	bool loadBlockIndex(qint64 startOffset);
+	void saveBlockIndex();
+	void trackUsers(uint8_t msgType, uint8_t ctxId);
+
 	QDir m_dir;
 	QFile *m_journal;
 	QFile *m_recording;
@@ -150,6 +173,12 @@ private:
 	QVector<Block> m_blocks;
 	int m_fileCount;
 	bool m_archive;
+
+	// User state at the end of the recording. This is saved in the block
+	// index so that the indexed part of the recording need not be rescanned.
+	QSet<uint8_t> m_activeUsers;
+	QVector<uint8_t> m_leaveOrder; // users in the order they last left
+
 };
 
 }
@@ -34,6 +34,7 @@ InMemoryConfig::~InMemoryConfig()
 
 QString InMemoryConfig::getConfigValue(const ConfigKey key, bool &found) const
 {
+	QMutexLocker lock(&m_mutex);
 	if(m_config.count(key.index)==0) {
 		found = false;
 		return QString();
@@ -45,6 +46,7 @@ QString InMemoryConfig::getConfigValue(const ConfigKey key, bool &found) const
 
 void InMemoryConfig::setConfigValue(ConfigKey key, const QString &value)
 {
+	QMutexLocker lock(&m_mutex);
 	m_config[key.index] = value;
 }
 
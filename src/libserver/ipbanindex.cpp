@@ -0,0 +1,137 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ipbanindex.h"
+
+#include <QHostAddress>
+#include <QDateTime>
+
+#include <limits>
+#include <cstring>
+
+namespace server {
+
+static const qint64 NEVER_EXPIRES = std::numeric_limits<qint64>::max();
+
+//! Get the address as an IPv6 address (IPv4 addresses are mapped)
+static bool addressBits(const QHostAddress &address, Q_IPV6ADDR &bits, int &prefixOffset)
+{
+	bool isIpv4;
+	const quint32 ipv4 = address.toIPv4Address(&isIpv4);
+
+	if(isIpv4) {
+		// Note: toIPv4Address also converts IPv4-mapped IPv6 addresses
+		memset(&bits, 0, sizeof bits);
+		bits[10] = 0xff;
+		bits[11] = 0xff;
+		bits[12] = ipv4 >> 24;
+		bits[13] = ipv4 >> 16;
+		bits[14] = ipv4 >> 8;
+		bits[15] = ipv4;
+		prefixOffset = address.protocol() == QAbstractSocket::IPv4Protocol ? 96 : 0;
+		return true;
+
+	} else if(address.protocol() == QAbstractSocket::IPv6Protocol) {
+		bits = address.toIPv6Address();
+		prefixOffset = 0;
+		return true;
+	}
+
+	return false;
+}
+
+static inline int bitAt(const Q_IPV6ADDR &bits, int i)
+{
+	return (bits[i / 8] >> (7 - i % 8)) & 1;
+}
+
+IpBanIndex::IpBanIndex()
+	: m_count(0)
+{
+	clear();
+}
+
+void IpBanIndex::clear()
+{
+	m_nodes.clear();
+	m_nodes.append(Node { {0, 0}, -1 });
+	m_count = 0;
+}
+
+void IpBanIndex::add(const QHostAddress &address, int prefixLength, const QDateTime &expires)
+{
+	Q_IPV6ADDR bits;
+	int prefixOffset;
+	if(!addressBits(address, bits, prefixOffset)) {
+		qWarning("IpBanIndex: not an IP address: %s", qPrintable(address.toString()));
+		return;
+	}
+
+	const int length = qBound(0, prefixOffset + prefixLength, 128);
+
+	int node = 0;
+	for(int i=0;i<length;++i) {
+		const int b = bitAt(bits, i);
+		if(m_nodes.at(node).child[b] == 0) {
+			m_nodes.append(Node { {0, 0}, -1 });
+			m_nodes[node].child[b] = m_nodes.size() - 1;
+		}
+		node = m_nodes.at(node).child[b];
+	}
+
+	const qint64 exp = expires.isValid() ? expires.toMSecsSinceEpoch() : NEVER_EXPIRES;
+	Node &n = m_nodes[node];
+	if(n.expires < 0)
+		++m_count;
+	n.expires = qMax(n.expires, exp);
+}
+
+bool IpBanIndex::contains(const QHostAddress &address, const QDateTime &now) const
+{
+	Q_IPV6ADDR bits;
+	int prefixOffset;
+	if(m_count == 0 || !addressBits(address, bits, prefixOffset))
+		return false;
+
+	const qint64 t = now.toMSecsSinceEpoch();
+
+	// Check every range along the path, from the widest to the narrowest
+	int node = 0;
+	for(int i=0;;++i) {
+		const Node &n = m_nodes.at(node);
+		if(n.expires > t)
+			return true;
+
+		if(i == 128)
+			break;
+
+		node = n.child[bitAt(bits, i)];
+		if(node == 0)
+			break;
+	}
+
+	return false;
+}
+
+bool IpBanIndex::contains(const QHostAddress &address) const
+{
+	return contains(address, QDateTime::currentDateTimeUtc());
+}
+
+}
@@ -0,0 +1,89 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SRV_IPBANINDEX_H
+#define DP_SRV_IPBANINDEX_H
+
+#include <QVector>
+
+class QHostAddress;
+class QDateTime;
+
+namespace server {
+
+/**
+ * @brief A set of banned IP address ranges
+ *
+ * The ranges are stored in a binary prefix trie, so checking an
+ * address takes at most one step per address bit, regardless of the
+ * number of bans.
+ *
+ * IPv4 addresses are stored as IPv4-mapped IPv6 addresses, so an
+ * IPv4 range also matches the mapped addresses of a dual stack socket.
+ */
+class IpBanIndex {
+public:
+	IpBanIndex();
+
+	/**
+	 * @brief Add a banned range
+	 *
+	 * If the same range is added more than once, the latest expiration time is kept.
+	 *
+	 * @param address the network address
+	 * @param prefixLength number of significant bits (0-32 for IPv4, 0-128 for IPv6)
+	 * @param expires when the ban expires (invalid for no expiration)
+	 */
+	void add(const QHostAddress &address, int prefixLength, const QDateTime &expires);
+
+	/**
+	 * @brief Check if the address is in any range that has not yet expired
+	 * @param address the address to check
+	 * @param now the current time
+	 */
+	bool contains(const QHostAddress &address, const QDateTime &now) const;
+
+	//! Check if the address is banned right now
+	bool contains(const QHostAddress &address) const;
+
+	//! Remove all ranges
+	void clear();
+
+	//! Get the number of distinct ranges
+	int size() const { return m_count; }
+
+	bool isEmpty() const { return m_count == 0; }
+
+private:
+	struct Node {
+		// Index of the child node for bit value 0 and 1 (0 if none)
+		int child[2];
+
+		// Expiration time of the range ending at this node (in ms since epoch)
+		// or -1 if no range ends here.
+		qint64 expires;
+	};
+
+	QVector<Node> m_nodes;
+	int m_count;
+};
+
+}
+
+#endif
@@ -23,10 +23,12 @@
 #include "sessions.h"
 #include "serverconfig.h"
 #include "serverlog.h"
+#include "passwordcheck.h"
 
 #include "../libshared/net/control.h"
 #include "../libshared/util/authtoken.h"
 #include "../libshared/util/networkaccess.h"
+#include "../libshared/util/passwordhash.h"
 #include "../libshared/util/validators.h"
 
 #include "config.h"
@@ -36,6 +38,8 @@
 #include <QNetworkRequest>
 #include <QNetworkReply>
 
+#include <memory>
+
 #ifndef Q_FALLTHROUGH
 	#define Q_FALLTHROUGH() (void)0  // work-around for qt<5.8
 #endif
@@ -46,6 +50,17 @@ Sessions::~Sessions()
 {
 }
 
+void Sessions::withSession(Session *session, std::function<void(Session*)> fn)
+{
+	fn(session);
+}
+
+void Sessions::moveToSession(Client *client, Session *session, std::function<void(Session*)> fn)
+{
+	Q_UNUSED(client);
+	fn(session);
+}
+
 LoginHandler::LoginHandler(Client *client, Sessions *sessions, ServerConfig *config)
 	: QObject(client), m_client(client), m_sessions(sessions), m_config(config)
 {
@@ -162,7 +177,11 @@ void LoginHandler::handleLoginMessage(protocol::MessagePtr msg)
 
 	protocol::ServerCommand cmd = msg.cast<protocol::Command>().cmd();
 
-	if(m_state == State::WaitForSecure) {
+	if(m_state == State::WaitForCheck || m_state == State::Joining) {
+		// The client should wait for a reply before sending anything else
+		m_client->log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message("Login command received while busy: " + cmd.cmd));
+
+	} else if(m_state == State::WaitForSecure) {
 		// Secure mode: wait for STARTTLS before doing anything
 		if(cmd.cmd == "startTls") {
 			handleStarttls();
@@ -219,7 +238,26 @@ void LoginHandler::handleIdentMessage(const protocol::ServerCommand &cmd)
 		return;
 	}
 
-	const RegisteredUser userAccount = m_config->getUserAccount(username, password);
+	// Looking up the account involves a password hash check, which can be slow
+	const ServerConfig *config = m_config;
+	auto userAccount = std::make_shared<RegisteredUser>();
+	m_state = State::WaitForCheck;
+
+	PasswordCheck::start(this,
+		[config, username, password, userAccount]() {
+			*userAccount = config->getUserAccount(username, password);
+		},
+		[this, cmd, userAccount]() {
+			m_state = State::WaitForIdent;
+			finishIdent(cmd, *userAccount);
+		}
+	);
+}
+
+void LoginHandler::finishIdent(const protocol::ServerCommand &cmd, const RegisteredUser &userAccount)
+{
+	const QString username = cmd.args[0].toString();
+	const QString password = cmd.args.size()>1 ? cmd.args[1].toString() : QString();
 
 	if(userAccount.status != RegisteredUser::NotFound && cmd.kwargs.contains("extauth")) {
 		// This should never happen. If it does, it means there's a bug in the client
@@ -562,26 +600,39 @@ void LoginHandler::handleHostMessage(const protocol::ServerCommand &cmd)
 		return;
 	}
 
-	if(cmd.kwargs["password"].isString())
-		session->history()->setPassword(cmd.kwargs["password"].toString());
+	const QJsonValue password = cmd.kwargs["password"];
 
-	// Mark login phase as complete. No more login messages will be sent to this user
-	protocol::ServerReply reply;
-	reply.type = protocol::ServerReply::RESULT;
-	reply.message = "Starting new session!";
-	reply.reply["state"] = "host";
-
-	QJsonObject joinInfo;
-	joinInfo["id"] = sessionAlias.isEmpty() ? session->id() : sessionAlias;
-	joinInfo["user"] = userId;
-	joinInfo["flags"] = sessionFlags(session);
-	reply.reply["join"] = joinInfo;
-	send(reply);
+	// The rest is done in the session's context
+	m_state = State::Joining;
+	m_sessions->moveToSession(m_client, session, [this, password, sessionAlias, userId](Session *session) {
+		if(!session) {
+			// The session went away before we got there
+			m_state = State::WaitForLogin;
+			sendError("notFound", "Session not found!");
+			return;
+		}
+
+		if(password.isString())
+			session->history()->setPassword(password.toString());
+
+		// Mark login phase as complete. No more login messages will be sent to this user
+		protocol::ServerReply reply;
+		reply.type = protocol::ServerReply::RESULT;
+		reply.message = "Starting new session!";
+		reply.reply["state"] = "host";
 
-	m_complete = true;
-	session->joinUser(m_client, true);
+		QJsonObject joinInfo;
+		joinInfo["id"] = sessionAlias.isEmpty() ? session->id() : sessionAlias;
+		joinInfo["user"] = userId;
+		joinInfo["flags"] = sessionFlags(session);
+		reply.reply["join"] = joinInfo;
+		send(reply);
 
-	deleteLater();
+		m_complete = true;
+		session->joinUser(m_client, true);
+
+		deleteLater();
+	});
 }
 
 void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
@@ -600,65 +651,169 @@ void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
 		return;
 	}
 
-	if(!m_client->isModerator()) {
-		// Non-moderators have to obey access restrictions
-		if(session->history()->banlist().isBanned(m_client->peerAddress(), m_client->authId())) {
-			sendError("banned", "You have been banned from this session");
+	QString errorCode, errorMessage;
+	QByteArray passwordHash;
+	m_sessions->withSession(session, [this, &errorCode, &errorMessage, &passwordHash](Session *session) {
+		if(!session) {
+			errorCode = "notFound";
+			errorMessage = "Session not found!";
 			return;
 		}
-		if(session->isClosed()) {
-			sendError("closed", "This session is closed");
-			return;
-		}
-		if(session->history()->hasFlag(SessionHistory::AuthOnly) && !m_client->isAuthenticated()) {
-			sendError("authOnly", "This session does not allow guest logins");
+
+		if(!checkSessionAccess(session, errorCode, errorMessage))
 			return;
-		}
 
-		if(!session->history()->checkPassword(cmd.kwargs.value("password").toString())) {
+		if(!m_client->isModerator())
+			passwordHash = session->history()->passwordHash();
+	});
+
+	if(!errorCode.isEmpty()) {
+		sendError(errorCode, errorMessage);
+		return;
+	}
+
+	const QString password = cmd.kwargs.value("password").toString();
+
+	if(m_client->isModerator() || passwordHash.isEmpty()) {
+		// No slow hash to check
+		if(!m_client->isModerator() && !passwordhash::check(password, passwordHash)) {
 			sendError("badPassword", "Incorrect password");
 			return;
 		}
+		joinSession(sessionId);
+		return;
 	}
 
-	if(session->getClientByUsername(m_client->username())) {
+	auto passwordOk = std::make_shared<bool>(false);
+	m_state = State::WaitForCheck;
+
+	PasswordCheck::start(this,
+		[password, passwordHash, passwordOk]() {
+			*passwordOk = passwordhash::check(password, passwordHash);
+		},
+		[this, sessionId, passwordOk]() {
+			m_state = State::WaitForLogin;
+			if(*passwordOk)
+				joinSession(sessionId);
+			else
+				sendError("badPassword", "Incorrect password");
+		}
+	);
+}
+
+/**
+ * @brief Check if this client may join the given session
+ *
+ * Non-moderators have to obey the session's access restrictions.
+ * Must be called in the session's thread.
+ *
+ * @return false if access is denied
+ */
+bool LoginHandler::checkSessionAccess(Session *session, QString &errorCode, QString &errorMessage) const
+{
+	if(m_client->isModerator())
+		return true;
+
+	if(session->history()->banlist().isBanned(m_client->peerAddress(), m_client->authId())) {
+		errorCode = "banned";
+		errorMessage = "You have been banned from this session";
+		return false;
+	}
+	if(session->isClosed()) {
+		errorCode = "closed";
+		errorMessage = "This session is closed";
+		return false;
+	}
+	if(session->history()->hasFlag(SessionHistory::AuthOnly) && !m_client->isAuthenticated()) {
+		errorCode = "authOnly";
+		errorMessage = "This session does not allow guest logins";
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief Join a session after the password has been checked
+ *
+ * The session is looked up and the access restrictions are checked
+ * again, since the session may have been closed or the user banned
+ * while the password was being checked.
+ */
+void LoginHandler::joinSession(const QString &sessionId)
+{
+	Session *session = m_sessions->getSessionById(sessionId, false);
+
+	QString errorCode, errorMessage;
+	m_sessions->withSession(session, [this, &errorCode, &errorMessage](Session *session) {
+		if(!session) {
+			errorCode = "notFound";
+			errorMessage = "Session not found!";
+			return;
+		}
+
+		if(!checkSessionAccess(session, errorCode, errorMessage))
+			return;
+
+		if(session->getClientByUsername(m_client->username())) {
 #ifdef NDEBUG
-		sendError("nameInuse", "This username is already in use");
-		return;
+			errorCode = "nameInuse";
+			errorMessage = "This username is already in use";
+			return;
 #else
-		// Allow identical usernames in debug builds, so I don't have to keep changing
-		// the username when testing. There is no technical requirement for unique usernames;
-		// the limitation is solely for the benefit of the human users.
-		m_client->log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message("Username clash ignored because this is a debug build."));
+			// Allow identical usernames in debug builds, so I don't have to keep changing
+			// the username when testing. There is no technical requirement for unique usernames;
+			// the limitation is solely for the benefit of the human users.
+			m_client->log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message("Username clash ignored because this is a debug build."));
 #endif
+		}
+
+		session->assignId(m_client);
+	});
+
+	if(!errorCode.isEmpty()) {
+		sendError(errorCode, errorMessage);
+		return;
 	}
 
 	// Ok, join the session
-	session->assignId(m_client);
+	m_state = State::Joining;
+	m_sessions->moveToSession(m_client, session, [this](Session *session) {
+		if(!session) {
+			// The session went away before we got there
+			m_state = State::WaitForLogin;
+			sendError("notFound", "Session not found!");
+			return;
+		}
 
-	protocol::ServerReply reply;
-	reply.type = protocol::ServerReply::RESULT;
-	reply.message = "Joining a session!";
-	reply.reply["state"] = "join";
-	QJsonObject joinInfo;
-	joinInfo["id"] = session->aliasOrId();
-	joinInfo["user"] = m_client->id();
-	joinInfo["flags"] = sessionFlags(session);
-	reply.reply["join"] = joinInfo;
-	send(reply);
+		protocol::ServerReply reply;
+		reply.type = protocol::ServerReply::RESULT;
+		reply.message = "Joining a session!";
+		reply.reply["state"] = "join";
+		QJsonObject joinInfo;
+		joinInfo["id"] = session->aliasOrId();
+		joinInfo["user"] = m_client->id();
+		joinInfo["flags"] = sessionFlags(session);
+		reply.reply["join"] = joinInfo;
+		send(reply);
 
-	m_complete = true;
+		m_complete = true;
 
-	session->joinUser(m_client, false);
+		session->joinUser(m_client, false);
 
-	deleteLater();
+		deleteLater();
+	});
 }
 
 void LoginHandler::handleAbuseReport(const protocol::ServerCommand &cmd)
 {
 	Session *s = m_sessions->getSessionById(cmd.kwargs["session"].toString(), false);
 	if(s) {
-		s->sendAbuseReport(m_client, 0, cmd.kwargs["reason"].toString());
+		const QString reason = cmd.kwargs["reason"].toString();
+		m_sessions->withSession(s, [this, reason](Session *s) {
+			if(s)
+				s->sendAbuseReport(m_client, 0, reason);
+		});
 	}
 }
 
@@ -36,6 +36,7 @@ class Client;
 class Session;
 class Sessions;
 class ServerConfig;
+struct RegisteredUser;
 
 /**
  * @brief Perform the client login handshake
@@ -98,13 +99,18 @@ private:
 	enum class State {
 		WaitForSecure,
 		WaitForIdent,
-		WaitForLogin
+		WaitForLogin,
+		WaitForCheck, // a password check is in progress
+		Joining
 	};
 
 	void announceServerInfo();
 	void handleIdentMessage(const protocol::ServerCommand &cmd);
+	void finishIdent(const protocol::ServerCommand &cmd, const RegisteredUser &userAccount);
 	void handleHostMessage(const protocol::ServerCommand &cmd);
 	void handleJoinMessage(const protocol::ServerCommand &cmd);
+	void joinSession(const QString &sessionId);
+	bool checkSessionAccess(Session *session, QString &errorCode, QString &errorMessage) const;
 	void handleAbuseReport(const protocol::ServerCommand &cmd);
 	void handleStarttls();
 	void requestExtAuth();
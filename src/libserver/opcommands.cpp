@@ -21,6 +21,7 @@
 #include "client.h"
 #include "session.h"
 #include "serverlog.h"
+#include "passwordcheck.h"
 #include "../libshared/net/control.h"
 #include "../libshared/net/meta.h"
 #include "../libshared/util/passwordhash.h"
@@ -29,6 +30,8 @@
 #include <QStringList>
 #include <QUrl>
 
+#include <memory>
+
 namespace server {
 
 namespace {
@@ -122,12 +125,24 @@ void opWord(Client *client, const QJsonArray &args, const QJsonObject &kwargs)
 	if(opwordHash.isEmpty())
 		throw CmdError("No opword set");
 
-	if(passwordhash::check(args.at(0).toString(), opwordHash)) {
-		client->session()->changeOpStatus(client->id(), true, "password");
+	// The hash check can be slow, so it's done in the background
+	const QString opword = args.at(0).toString();
+	auto ok = std::make_shared<bool>(false);
 
-	} else {
-		throw CmdError("Incorrect password");
-	}
+	PasswordCheck::start(client,
+		[opword, opwordHash, ok]() {
+			*ok = passwordhash::check(opword, opwordHash);
+		},
+		[client, ok]() {
+			if(!client->session())
+				return;
+
+			if(*ok)
+				client->session()->changeOpStatus(client->id(), true, "password");
+			else
+				client->sendDirectMessage(protocol::Command::error("Incorrect password"));
+		}
+	);
 }
 
 Client *_getClient(Session *session, const QJsonValue &idOrName)
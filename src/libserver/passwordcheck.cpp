@@ -0,0 +1,78 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "passwordcheck.h"
+
+#include <QThreadPool>
+#include <QThread>
+#include <QAtomicInt>
+
+namespace server {
+
+static QAtomicInt QUEUE_DEPTH;
+
+static QThreadPool *checkPool()
+{
+	static QThreadPool *pool = []() {
+		auto *p = new QThreadPool;
+		p->setMaxThreadCount(qMax(1, QThread::idealThreadCount() / 2));
+		return p;
+	}();
+	return pool;
+}
+
+PasswordCheck::PasswordCheck(std::function<void()> check)
+	: m_check(check)
+{
+	setAutoDelete(false);
+}
+
+void PasswordCheck::start(QObject *context, std::function<void()> check, std::function<void()> done)
+{
+	Q_ASSERT(context);
+	Q_ASSERT(context->thread() == QThread::currentThread());
+
+	// The job object lives in the context's thread, so it is deleted there
+	// and the done function is called there too.
+	auto *job = new PasswordCheck(check);
+	connect(job, &PasswordCheck::finished, context, done, Qt::QueuedConnection);
+	connect(job, &PasswordCheck::finished, job, &QObject::deleteLater, Qt::QueuedConnection);
+
+	QUEUE_DEPTH.ref();
+	checkPool()->start(job);
+}
+
+int PasswordCheck::queueDepth()
+{
+	return QUEUE_DEPTH.load();
+}
+
+void PasswordCheck::setMaxConcurrency(int threads)
+{
+	checkPool()->setMaxThreadCount(qMax(1, threads));
+}
+
+void PasswordCheck::run()
+{
+	m_check();
+	QUEUE_DEPTH.deref();
+	emit finished();
+}
+
+}
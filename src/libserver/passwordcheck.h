@@ -0,0 +1,80 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SRV_PASSWORDCHECK_H
+#define DP_SRV_PASSWORDCHECK_H
+
+#include <QObject>
+#include <QRunnable>
+
+#include <functional>
+
+namespace server {
+
+/**
+ * @brief A password check run in a background thread
+ *
+ * Checking a password against a strong hash is deliberately slow, so the
+ * checks are run in a dedicated thread pool to keep the event loop responsive.
+ * The number of checks run in parallel is bounded; the rest are queued.
+ */
+class PasswordCheck : public QObject, public QRunnable
+{
+	Q_OBJECT
+public:
+	/**
+	 * @brief Start a password check
+	 *
+	 * The check function is called in the pool. Once it has finished, the done
+	 * function is called in the context object's thread. If the context object
+	 * is deleted before that, the done function is not called.
+	 *
+	 * The functions typically share the result via a captured shared pointer.
+	 *
+	 * @param context the context object
+	 * @param check the function to run in the background
+	 * @param done the function to call when finished
+	 */
+	static void start(QObject *context, std::function<void()> check, std::function<void()> done);
+
+	/**
+	 * @brief Get the number of checks that are queued or in progress
+	 */
+	static int queueDepth();
+
+	/**
+	 * @brief Set the maximum number of checks run in parallel
+	 *
+	 * The default is half the number of CPU cores.
+	 */
+	static void setMaxConcurrency(int threads);
+
+	void run() override;
+
+signals:
+	void finished();
+
+private:
+	explicit PasswordCheck(std::function<void()> check);
+
+	std::function<void()> m_check;
+};
+
+}
+
+#endif
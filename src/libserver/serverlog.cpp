@@ -73,6 +73,7 @@ void ServerLog::logMessage(const Log &entry)
 
 void InMemoryLog::setHistoryLimit(int limit)
 {
+	QMutexLocker lock(&m_mutex);
 	m_limit = limit;
 	if(limit>0 && limit<m_history.size())
 		m_history.erase(m_history.begin() + limit, m_history.end());
@@ -80,6 +81,7 @@ void InMemoryLog::setHistoryLimit(int limit)
 
 void InMemoryLog::storeMessage(const Log &entry)
 {
+	QMutexLocker lock(&m_mutex);
 	m_history.prepend(entry);
 	if(m_limit>0 && m_history.size() >= m_limit)
 		m_history.pop_back();
@@ -87,6 +89,7 @@ void InMemoryLog::storeMessage(const Log &entry)
 
 QList<Log> InMemoryLog::getLogEntries(const QString &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const
 {
+	QMutexLocker lock(&m_mutex);
 	QList<Log> filtered;
 
 	for(const Log &l : m_history) {
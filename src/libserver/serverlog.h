@@ -22,6 +22,7 @@
 
 #include <QDateTime>
 #include <QHostAddress>
+#include <QMutex>
 
 #include "../libshared/util/ulid.h"
 
@@ -224,6 +225,7 @@ protected:
 	void storeMessage(const Log &entry) override;
 
 private:
+	mutable QMutex m_mutex;
 	QList<Log> m_history;
 	int m_limit;
 };
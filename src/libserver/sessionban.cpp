@@ -21,6 +21,7 @@
 
 #include <QJsonArray>
 #include <QJsonObject>
+#include <QDateTime>
 
 namespace server {
 
@@ -59,9 +60,22 @@ int SessionBanList::addBan(const QString &username, const QHostAddress &ip, cons
 		toIpv6(ip), // Always use IPv6 notation for consistency
 		bannedBy
 	};
+
+	if(extAuthId.isEmpty())
+		m_ipbans.add(m_banlist.last().ip, 128, QDateTime());
+
 	return id;
 }
 
+void SessionBanList::rebuildIpIndex()
+{
+	m_ipbans.clear();
+	for(const SessionBan &b : m_banlist) {
+		if(b.authId.isEmpty())
+			m_ipbans.add(b.ip, 128, QDateTime());
+	}
+}
+
 QString SessionBanList::removeBan(int id)
 {
 	QMutableListIterator<SessionBan> i(m_banlist);
@@ -69,6 +83,7 @@ QString SessionBanList::removeBan(int id)
 		SessionBan entry = i.next();
 		if(entry.id == id) {
 			i.remove();
+			rebuildIpIndex();
 			return entry.username;
 		}
 	}
@@ -90,15 +105,8 @@ bool SessionBanList::isBanned(const QHostAddress &address, const QString &authId
 	}
 
 	// Guest users are banned by IP, because that's the best we can do.
-	if(!address.isNull()) {
-		const QHostAddress ip = toIpv6(address);
-		for(const SessionBan &b : m_banlist) {
-			if(b.authId.isEmpty() && b.ip == ip)
-				return true;
-		}
-
-		return false;
-	}
+	if(!address.isNull())
+		return m_ipbans.contains(address);
 
 	qWarning("isBanned() called without a valid address or extAuthId");
 	return false;
@@ -19,6 +19,8 @@
 #ifndef DP_SERVER_SESSIONBAN_H
 #define DP_SERVER_SESSIONBAN_H
 
+#include "ipbanindex.h"
+
 #include <QString>
 #include <QHostAddress>
 #include <QList>
@@ -86,7 +88,12 @@ public:
 	QJsonArray toJson(bool showIp) const;
 
 private:
+	void rebuildIpIndex();
+
 	QList<SessionBan> m_banlist;
+
+	// Addresses of the bans that apply to guest users
+	IpBanIndex m_ipbans;
 	int m_idautoinc;
 };
 
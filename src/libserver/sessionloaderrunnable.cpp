@@ -0,0 +1,45 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sessionloaderrunnable.h"
+#include "filedhistory.h"
+
+#include <QThread>
+
+namespace server {
+
+SessionLoaderRunnable::SessionLoaderRunnable(const QString &path, bool archive, QThread *targetThread, QObject *parent)
+	: QObject(parent), m_path(path), m_archive(archive), m_targetThread(targetThread)
+{
+}
+
+void SessionLoaderRunnable::run()
+{
+	FiledHistory *fh = FiledHistory::load(m_path);
+	if(fh) {
+		fh->setArchive(m_archive);
+
+		// Objects can only be pushed to another thread from their current thread
+		fh->moveToThread(m_targetThread);
+	}
+
+	emit sessionLoaded(m_path, fh);
+}
+
+}
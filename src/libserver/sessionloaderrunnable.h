@@ -0,0 +1,70 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SRV_SESSIONLOADERRUNNABLE_H
+#define DP_SRV_SESSIONLOADERRUNNABLE_H
+
+#include <QObject>
+#include <QRunnable>
+
+class QThread;
+
+namespace server {
+
+class FiledHistory;
+
+/**
+ * @brief A runnable for loading a file backed session in a background thread
+ *
+ * Loading a session requires scanning (at least a part of) its recording
+ * file, which can take a while for big sessions. Many sessions can be
+ * loaded in parallel this way.
+ */
+class SessionLoaderRunnable : public QObject, public QRunnable
+{
+	Q_OBJECT
+public:
+	/**
+	 * @param path path to the session journal file
+	 * @param archive enable archive mode for the loaded session
+	 * @param targetThread the thread the loaded history object will be moved to
+	 */
+	SessionLoaderRunnable(const QString &path, bool archive, QThread *targetThread, QObject *parent=nullptr);
+
+	void run() override;
+
+signals:
+	/**
+	 * @brief Emitted when the session has been loaded
+	 *
+	 * The receiver takes ownership of the history object.
+	 *
+	 * @param path path to the session journal file
+	 * @param history the loaded session history or nullptr if loading failed
+	 */
+	void sessionLoaded(const QString &path, server::FiledHistory *history);
+
+private:
+	QString m_path;
+	bool m_archive;
+	QThread *m_targetThread;
+};
+
+}
+
+#endif
@@ -21,6 +21,7 @@
 #define SESSIONS_INTERFACE_H
 
 #include <tuple>
+#include <functional>
 
 class QJsonArray;
 class QString;
@@ -32,6 +33,7 @@ namespace protocol {
 namespace server {
 
 class Session;
+class Client;
 
 /**
  * Interface for a class that can accept client logins
@@ -71,6 +73,31 @@ public:
 	 * @return session, error string pair: if session is null, error string contains the error code
 	 */
 	virtual std::tuple<Session*, QString> createSession(const QString &id, const QString &alias, const protocol::ProtocolVersion &protocolVersion, const QString &founder) = 0;
+
+	/**
+	 * Call a function in the context of the session
+	 *
+	 * Sessions may live in their own threads, in which case this blocks
+	 * until the function has been run in the session's thread.
+	 * If the session no longer exists, the function is called with nullptr.
+	 *
+	 * The default implementation calls the function directly.
+	 */
+	virtual void withSession(Session *session, std::function<void(Session*)> fn);
+
+	/**
+	 * Hand over a client to a session
+	 *
+	 * If the session lives in a different thread, the client is moved
+	 * there first. The function is then called (asynchronously) in the
+	 * session's thread. If the session has been deleted in the meantime,
+	 * the function is called with nullptr.
+	 *
+	 * The function is not called if the client is deleted before the handover.
+	 *
+	 * The default implementation calls the function directly.
+	 */
+	virtual void moveToSession(Client *client, Session *session, std::function<void(Session*)> fn);
 };
 
 }
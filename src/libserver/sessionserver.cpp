@@ -27,8 +27,13 @@
 #include "filedhistory.h"
 #include "templateloader.h"
 #include "announcements.h"
+#include "sessionthreads.h"
+#include "sessionloaderrunnable.h"
 
 #include <QTimer>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
 #include <QJsonArray>
 #include <QJsonDocument>
 
@@ -38,7 +43,8 @@ SessionServer::SessionServer(ServerConfig *config, QObject *parent)
 	: QObject(parent),
 	m_config(config),
 	m_tpls(nullptr),
-	m_useFiledSessions(false)
+	m_useFiledSessions(false),
+	m_threads(nullptr)
 {
 	m_announcements = new sessionlisting::Announcements(config, this);
 
@@ -52,6 +58,105 @@ SessionServer::SessionServer(ServerConfig *config, QObject *parent)
 #endif
 }
 
+SessionServer::~SessionServer()
+{
+	if(m_threads) {
+		// Objects living in the worker threads must be deleted there
+		forEachSession([](int, Session *s) { delete s; }, true);
+		forEachClient([](int, ThinServerClient *c) { delete c; }, true);
+
+		for(auto i=m_threadAnnouncements.constBegin();i!=m_threadAnnouncements.constEnd();++i) {
+			sessionlisting::Announcements *a = i.value();
+			m_threads->call(i.key(), [a]() { delete a; });
+		}
+	}
+}
+
+void SessionServer::setSessionThreads(int threads)
+{
+	Q_ASSERT(m_sessions.isEmpty());
+	if(m_threads || threads <= 0)
+		return;
+
+	m_threads = new SessionThreads(threads, this);
+
+	// Each thread gets its own announcer so sessions never call it across threads
+	for(QThread *t : m_threads->threads()) {
+		auto *announcements = new sessionlisting::Announcements(m_config);
+		announcements->moveToThread(t);
+		m_threadAnnouncements[t] = announcements;
+	}
+}
+
+void SessionServer::callIn(QThread *thread, std::function<void()> fn) const
+{
+	if(m_threads)
+		m_threads->call(thread, fn);
+	else
+		fn();
+}
+
+void SessionServer::postIn(QThread *thread, std::function<void()> fn) const
+{
+	if(m_threads && thread != QThread::currentThread())
+		m_threads->post(thread, fn);
+	else
+		fn();
+}
+
+/**
+ * @brief Call a function for each session, in the session's own thread
+ *
+ * The index parameter is the session's position in the session list.
+ *
+ * @param fn the function to call
+ * @param wait if true, wait until the function has been called for all sessions
+ */
+void SessionServer::forEachSession(std::function<void(int, Session*)> fn, bool wait) const
+{
+	QHash<QThread*, QVector<QPair<int, QPointer<Session>>>> byThread;
+	for(int i=0;i<m_sessions.size();++i)
+		byThread[m_sessions.at(i).thread] << qMakePair(i, m_sessions.at(i).guard);
+
+	for(auto i=byThread.constBegin();i!=byThread.constEnd();++i) {
+		const auto sessions = i.value();
+		auto task = [sessions, fn]() {
+			for(const auto &s : sessions) {
+				if(s.second)
+					fn(s.first, s.second.data());
+			}
+		};
+
+		if(wait)
+			callIn(i.key(), task);
+		else
+			postIn(i.key(), task);
+	}
+}
+
+//! Like forEachSession, but for clients
+void SessionServer::forEachClient(std::function<void(int, ThinServerClient*)> fn, bool wait) const
+{
+	QHash<QThread*, QVector<QPair<int, QPointer<ThinServerClient>>>> byThread;
+	for(int i=0;i<m_clients.size();++i)
+		byThread[m_clients.at(i).thread] << qMakePair(i, m_clients.at(i).guard);
+
+	for(auto i=byThread.constBegin();i!=byThread.constEnd();++i) {
+		const auto clients = i.value();
+		auto task = [clients, fn]() {
+			for(const auto &c : clients) {
+				if(c.second)
+					fn(c.first, c.second.data());
+			}
+		};
+
+		if(wait)
+			callIn(i.key(), task);
+		else
+			postIn(i.key(), task);
+	}
+}
+
 void SessionServer::setSessionDir(const QDir &dir)
 {
 	if(dir.isReadable()) {
@@ -68,19 +173,38 @@ void SessionServer::loadNewSessions()
 	if(!m_useFiledSessions)
 		return;
 
+	const bool archive = m_config->getConfigBool(config::ArchiveMode);
+
 	auto sessionFiles = m_sessiondir.entryInfoList(QStringList() << "*.session", QDir::Files|QDir::Writable|QDir::Readable);
 	for(const QFileInfo &f : sessionFiles) {
-		if(getSessionById(f.baseName(), false))
+		if(m_loadingSessions.contains(f.baseName()) || getSessionById(f.baseName(), false))
 			continue;
 
-		FiledHistory *fh = FiledHistory::load(f.absoluteFilePath());
-		if(fh) {
-			fh->setArchive(m_config->getConfigBool(config::ArchiveMode));
-			Session *session = new ThinSession(fh, m_config, m_announcements, this);
-			initSession(session);
-			session->log(Log().about(Log::Level::Debug, Log::Topic::Status).message("Loaded from file."));
-		}
+		// The alias is reserved along with the ID, so no new session can take
+		// it while this one is loading
+		m_loadingSessions.insert(f.baseName(), FiledHistory::readAlias(f.absoluteFilePath()));
+
+		auto *loader = new SessionLoaderRunnable(f.absoluteFilePath(), archive, thread());
+		connect(loader, &SessionLoaderRunnable::sessionLoaded, this, &SessionServer::onSessionLoaded, Qt::QueuedConnection);
+		QThreadPool::globalInstance()->start(loader);
+	}
+}
+
+void SessionServer::onSessionLoaded(const QString &path, FiledHistory *history)
+{
+	m_loadingSessions.remove(QFileInfo(path).baseName());
+
+	if(history)
+		initSession(history, Log().about(Log::Level::Debug, Log::Topic::Status).message("Loaded from file."));
+}
+
+bool SessionServer::isReservedByLoadingSession(const QString &idOrAlias) const
+{
+	for(auto i=m_loadingSessions.constBegin();i!=m_loadingSessions.constEnd();++i) {
+		if(i.key() == idOrAlias || i.value() == idOrAlias)
+			return true;
 	}
+	return false;
 }
 
 QJsonArray SessionServer::sessionDescriptions() const
@@ -88,10 +212,16 @@ QJsonArray SessionServer::sessionDescriptions() const
 	QJsonArray descs;
 	QStringList aliases;
 
-	for(const Session *s : m_sessions) {
-		descs.append(s->getDescription());
-		if(!s->idAlias().isEmpty())
-			aliases << s->idAlias();
+	QVector<QJsonObject> sessionDescs(m_sessions.size());
+	forEachSession([&sessionDescs](int i, Session *s) {
+		sessionDescs[i] = s->getDescription();
+	}, true);
+
+	for(int i=0;i<m_sessions.size();++i) {
+		if(!sessionDescs.at(i).isEmpty())
+			descs.append(sessionDescs.at(i));
+		if(!m_sessions.at(i).idAlias.isEmpty())
+			aliases << m_sessions.at(i).idAlias;
 	}
 
 	if(templateLoader()) {
@@ -125,7 +255,10 @@ std::tuple<Session*, QString> SessionServer::createSession(const QString &id, co
 		return std::tuple<Session*, QString> { nullptr, "closed" };
 	}
 
-	if(getSessionById(id, false) || (!idAlias.isEmpty() && getSessionById(idAlias, false))) {
+	if(
+		isReservedByLoadingSession(id) || getSessionById(id, false) ||
+		(!idAlias.isEmpty() && (isReservedByLoadingSession(idAlias) || getSessionById(idAlias, false)))
+	) {
 		return std::tuple<Session*, QString> { nullptr, "idInUse" };
 	}
 
@@ -133,15 +266,14 @@ std::tuple<Session*, QString> SessionServer::createSession(const QString &id, co
 		return std::tuple<Session*, QString> { nullptr, "badProtocol" };
 	}
 
-	Session *session = new ThinSession(initHistory(id, idAlias, protocolVersion, founder), m_config, m_announcements, this);
-
-	initSession(session);
-
 	QString aka = idAlias.isEmpty() ? QString() : QStringLiteral(" (AKA %1)").arg(idAlias);
 
-	session->log(Log()
-		.about(Log::Level::Info, Log::Topic::Status)
-		.message("Session" + aka + " created by " + founder));
+	Session *session = initSession(
+		initHistory(id, idAlias, protocolVersion, founder),
+		Log()
+			.about(Log::Level::Info, Log::Topic::Status)
+			.message("Session" + aka + " created by " + founder)
+		);
 
 	return std::make_tuple(session, QString());
 }
@@ -165,64 +297,162 @@ Session *SessionServer::createFromTemplate(const QString &idAlias)
 		return nullptr;
 	}
 
-	Session *session = new ThinSession(history, m_config, m_announcements, this);
-	initSession(session);
-	session->log(Log()
+	return initSession(history, Log()
 		.about(Log::Level::Info, Log::Topic::Status)
 		.message(QStringLiteral("Session instantiated from template %1").arg(idAlias)));
-
-	return session;
 }
 
-void SessionServer::initSession(Session *session)
+/**
+ * @brief Create a session for the given history
+ *
+ * In threaded mode, the session is created in (and the history moved to)
+ * the least busy worker thread.
+ *
+ * @param history the session history
+ * @param createdLog log entry to write once the session is up
+ * @return the new session
+ */
+Session *SessionServer::initSession(SessionHistory *history, const Log &createdLog)
 {
-	m_sessions.append(session);
+	QThread *thread = m_threads ? m_threads->acquire() : this->thread();
+	sessionlisting::Announcements *announcements = m_threads ? m_threadAnnouncements.value(thread) : m_announcements;
+
+	if(m_threads)
+		history->moveToThread(thread);
+
+	SessionEntry entry { nullptr, QPointer<Session>(), thread, history->id(), history->idAlias() };
+
+	callIn(thread, [this, &entry, thread, history, announcements, createdLog]() {
+		Session *session = new ThinSession(history, m_config, announcements, m_threads ? nullptr : this);
+		entry.session = session;
+		entry.guard = session;
+
+		const QString idString = session->id();
+
+		// The attribute change handler touches only the session, so it can be run in the session's thread
+		connect(session, &Session::sessionAttributeChanged, this, &SessionServer::onSessionAttributeChanged, Qt::DirectConnection);
+		connect(session, &Session::destroyed, this, [this, idString, announcements, thread](QObject *object) {
+			auto *session = static_cast<Session*>(object);
+			for(int i=0;i<m_sessions.size();++i) {
+				if(m_sessions.at(i).session == session) {
+					m_sessions.removeAt(i);
+					break;
+				}
+			}
+
+			// just to be safe
+			if(m_threads) {
+				m_threads->post(thread, [announcements, session]() {
+					announcements->unlistSession(session);
+				});
+				m_threads->release(thread);
+			} else {
+				announcements->unlistSession(session);
+			}
 
-	const QString idString = session->id();
+			emit sessionEnded(idString);
+		});
 
-	connect(session, &Session::sessionAttributeChanged, this, &SessionServer::onSessionAttributeChanged);
-	connect(session, &Session::destroyed, this, [this, idString](QObject *object) {
-		auto *session = static_cast<Session*>(object);
-		m_sessions.removeOne(session);
-		m_announcements->unlistSession(session); // just to be safe
+		emit sessionCreated(session);
+		emit sessionChanged(session->getDescription());
 
-		emit sessionEnded(idString);
+		session->log(createdLog);
 	});
 
-	emit sessionCreated(session);
-	emit sessionChanged(session->getDescription());
+	m_sessions.append(entry);
+
+	return entry.session;
+}
+
+const SessionServer::SessionEntry *SessionServer::findSession(const Session *session) const
+{
+	for(const SessionEntry &s : m_sessions) {
+		if(s.session == session)
+			return &s;
+	}
+	return nullptr;
 }
 
 Session *SessionServer::getSessionById(const QString &id, bool load)
 {
-	for(Session *s : m_sessions) {
-		if(s->id() == id || s->idAlias() == id)
-			return s;
+	for(const SessionEntry &s : m_sessions) {
+		if(s.id == id || s.idAlias == id)
+			return s.session;
 	}
 
-	if(load && templateLoader() && templateLoader()->exists(id)) {
+	if(load && templateLoader() && templateLoader()->exists(id) && !isReservedByLoadingSession(id)) {
 		return createFromTemplate(id);
 	}
 
 	return nullptr;
 }
 
+void SessionServer::withSession(Session *session, std::function<void(Session*)> fn)
+{
+	const SessionEntry *entry = findSession(session);
+	if(!entry) {
+		fn(nullptr);
+		return;
+	}
+
+	const QPointer<Session> guard = entry->guard;
+	callIn(entry->thread, [guard, &fn]() {
+		fn(guard.data());
+	});
+}
+
+void SessionServer::moveToSession(Client *client, Session *session, std::function<void(Session*)> fn)
+{
+	if(!m_threads) {
+		fn(session);
+		return;
+	}
+
+	const SessionEntry *entry = findSession(session);
+	if(!entry) {
+		fn(nullptr);
+		return;
+	}
+
+	QThread *thread = entry->thread;
+	const QPointer<Session> guard = entry->guard;
+
+	// This is typically called from the client's own message handler, so the
+	// actual move is deferred until control returns to the event loop.
+	QTimer::singleShot(0, client, [this, client, thread, guard, fn]() {
+		for(ClientEntry &c : m_clients) {
+			if(c.client == client)
+				c.thread = thread;
+		}
+
+		client->setParent(nullptr);
+		client->moveToThread(thread);
+
+		const QPointer<Client> clientGuard = client;
+		m_threads->post(thread, [clientGuard, guard, fn]() {
+			if(clientGuard)
+				fn(guard.data());
+		});
+	});
+}
+
 void SessionServer::stopAll()
 {
-	for(ThinServerClient *c : m_clients) {
+	forEachClient([](int, ThinServerClient *c) {
 		// Note: this just sends the disconnect command, clients don't self-delete immediately
 		c->disconnectClient(Client::DisconnectionReason::Shutdown, "Server shutting down");
-	}
+	}, false);
 
-	for(Session *s : m_sessions)
+	forEachSession([](int, Session *s) {
 		s->killSession(false);
+	}, false);
 }
 
 void SessionServer::messageAll(const QString &message, bool alert)
 {
-	for(Session *s : m_sessions) {
+	forEachSession([message, alert](int, Session *s) {
 		s->messageAll(message, alert);
-	}
+	}, false);
 }
 
 void SessionServer::addClient(ThinServerClient *client)
@@ -234,7 +464,7 @@ void SessionServer::addClient(ThinServerClient *client)
 	client->setRandomLag(m_randomlag);
 #endif
 
-	m_clients.append(client);
+	m_clients.append(ClientEntry { client, client, thread() });
 	connect(client, &Client::destroyed, this, &SessionServer::removeClient);
 
 	emit userCountChanged(m_clients.size());
@@ -247,7 +477,12 @@ void SessionServer::addClient(ThinServerClient *client)
 
 void SessionServer::removeClient(QObject *client)
 {
-	m_clients.removeOne(static_cast<ThinServerClient*>(client));
+	for(int i=0;i<m_clients.size();++i) {
+		if(m_clients.at(i).client == client) {
+			m_clients.removeAt(i);
+			break;
+		}
+	}
 	emit userCountChanged(m_clients.size());
 }
 
@@ -256,6 +491,8 @@ void SessionServer::removeClient(QObject *client)
  *
  * The session takes care of the client itself. Here, we clean up after the session
  * in case it needs to be closed.
+ *
+ * Note: this is called in the session's thread.
  * @param session
  */
 void SessionServer::onSessionAttributeChanged(Session *session)
@@ -286,12 +523,12 @@ void SessionServer::cleanupSessions()
 	const qint64 expirationTime = m_config->getConfigTime(config::IdleTimeLimit) * 1000;
 
 	if(expirationTime>0) {
-		for(Session *s : m_sessions) {
+		forEachSession([expirationTime](int, Session *s) {
 			if(s->lastEventTime() > expirationTime) {
 				s->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Idle session expired."));
 				s->killSession();
 			}
-		}
+		}, false);
 	}
 }
 
@@ -303,10 +540,14 @@ JsonApiResult SessionServer::callSessionJsonApi(JsonApiMethod method, const QStr
 
 	if(!head.isEmpty()) {
 		Session *s = getSessionById(head, false);
-		if(s)
-			return s->callJsonApi(method, tail, request);
-		else
-			return JsonApiNotFound();
+		JsonApiResult result = JsonApiNotFound();
+		if(s) {
+			withSession(s, [&result, method, &tail, &request](Session *s) {
+				if(s)
+					result = s->callJsonApi(method, tail, request);
+			});
+		}
+		return result;
 	}
 
 	if(method == JsonApiMethod::Get) {
@@ -337,9 +578,16 @@ JsonApiResult SessionServer::callUserJsonApi(JsonApiMethod method, const QString
 		return JsonApiNotFound();
 
 	if(method == JsonApiMethod::Get) {
+		QVector<QJsonObject> descs(m_clients.size());
+		forEachClient([&descs](int i, ThinServerClient *c) {
+			descs[i] = c->description();
+		}, true);
+
 		QJsonArray userlist;
-		for(const ThinServerClient *c : m_clients)
-			userlist << c->description();
+		for(const QJsonObject &d : descs) {
+			if(!d.isEmpty())
+				userlist << d;
+		}
 
 		return {JsonApiResult::Ok, QJsonDocument(userlist)};
 
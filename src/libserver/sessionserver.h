@@ -23,6 +23,10 @@
 
 #include <QObject>
 #include <QDir>
+#include <QHash>
+#include <QPointer>
+
+class QThread;
 
 namespace sessionlisting {
 	class Announcements;
@@ -32,9 +36,12 @@ namespace server {
 
 class Session;
 class SessionHistory;
+class FiledHistory;
 class ThinServerClient;
 class ServerConfig;
 class TemplateLoader;
+class SessionThreads;
+class Log;
 
 /**
  * @brief Session manager
@@ -44,6 +51,20 @@ class SessionServer : public QObject, public Sessions {
 Q_OBJECT
 public:
 	SessionServer(ServerConfig *config, QObject *parent=nullptr);
+	~SessionServer();
+
+	/**
+	 * @brief Run the sessions in a pool of worker threads
+	 *
+	 * Each session lives in one of the threads, and its users are moved to the
+	 * same thread when they join. The session server itself stays in the
+	 * current thread.
+	 *
+	 * This must be called before any sessions are created.
+	 *
+	 * @param threads number of worker threads (0 runs everything in this thread)
+	 */
+	void setSessionThreads(int threads);
 
 	/**
 	 * @brief Enable file backed sessions
@@ -60,10 +81,16 @@ public:
 	/**
 	 * @brief Load new sessions from the directory
 	 *
+	 * The sessions are loaded in parallel in background threads and
+	 * each session becomes available as soon as it has been loaded.
+	 *
 	 * If no session directory is set, this does nothing.
 	 */
 	void loadNewSessions();
 
+	//! Are there sessions still being loaded?
+	bool isLoadingSessions() const { return !m_loadingSessions.isEmpty(); }
+
 	/**
 	 * @brief Get the server configuration
 	 * @return
@@ -115,6 +142,9 @@ public:
 	 */
 	Session *getSessionById(const QString &id, bool load) override;
 
+	void withSession(Session *session, std::function<void(Session*)> fn) override;
+	void moveToSession(Client *client, Session *session, std::function<void(Session*)> fn) override;
+
 	/**
 	 * @brief Get the total number of connected users
 	 */
@@ -187,19 +217,47 @@ private slots:
 	void removeClient(QObject *client);
 	void onSessionAttributeChanged(Session *session);
 	void cleanupSessions();
+	void onSessionLoaded(const QString &path, server::FiledHistory *history);
 
 private:
+	struct SessionEntry {
+		Session *session;        // for identification only: may be dangling in threaded mode
+		QPointer<Session> guard; // may only be dereferenced in the session's thread
+		QThread *thread;
+		QString id;
+		QString idAlias;
+	};
+
+	struct ClientEntry {
+		ThinServerClient *client;
+		QPointer<ThinServerClient> guard;
+		QThread *thread;
+	};
+
 	SessionHistory *initHistory(const QString &id, const QString alias, const protocol::ProtocolVersion &protocolVersion, const QString &founder);
-	void initSession(Session *session);
+	Session *initSession(SessionHistory *history, const Log &createdLog);
+	const SessionEntry *findSession(const Session *session) const;
+
+	//! Is the given ID or alias reserved by a session that is still being loaded?
+	bool isReservedByLoadingSession(const QString &idOrAlias) const;
+
+	void callIn(QThread *thread, std::function<void()> fn) const;
+	void postIn(QThread *thread, std::function<void()> fn) const;
+	void forEachSession(std::function<void(int, Session*)> fn, bool wait) const;
+	void forEachClient(std::function<void(int, ThinServerClient*)> fn, bool wait) const;
 
 	sessionlisting::Announcements *m_announcements;
 	ServerConfig *m_config;
 	TemplateLoader *m_tpls;
 	QDir m_sessiondir;
 	bool m_useFiledSessions;
+	QHash<QString, QString> m_loadingSessions; // IDs and aliases of the sessions being loaded
+
+	SessionThreads *m_threads;
+	QHash<QThread*, sessionlisting::Announcements*> m_threadAnnouncements;
 
-	QList<Session*> m_sessions;
-	QList<ThinServerClient*> m_clients;
+	QList<SessionEntry> m_sessions;
+	QList<ClientEntry> m_clients;
 
 #ifndef NDEBUG
 	uint m_randomlag;
@@ -0,0 +1,162 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sessionthreads.h"
+
+#include <QCoreApplication>
+#include <QEvent>
+#include <QSemaphore>
+#include <QThread>
+
+namespace server {
+
+namespace {
+
+class FunctionEvent : public QEvent
+{
+public:
+	static const QEvent::Type TYPE = QEvent::Type(QEvent::User + 1);
+
+	FunctionEvent(std::function<void()> fn, QSemaphore *done)
+		: QEvent(TYPE), fn(fn), done(done)
+	{ }
+
+	~FunctionEvent()
+	{
+		// Released in the destructor so a waiting caller is woken up
+		// even if the event gets discarded without being delivered.
+		if(done)
+			done->release();
+	}
+
+	std::function<void()> fn;
+	QSemaphore *done;
+};
+
+}
+
+//! A helper object that lives in a worker thread and runs the posted functions
+class SessionThreads::Runner : public QObject
+{
+public:
+	bool event(QEvent *e) override
+	{
+		if(e->type() == FunctionEvent::TYPE) {
+			static_cast<FunctionEvent*>(e)->fn();
+			return true;
+		}
+		return QObject::event(e);
+	}
+};
+
+SessionThreads::SessionThreads(int threadCount, QObject *parent)
+	: QObject(parent)
+{
+	for(int i=0;i<threadCount;++i) {
+		QThread *thread = new QThread(this);
+		thread->setObjectName(QStringLiteral("session-%1").arg(i+1));
+
+		Runner *runner = new Runner;
+		runner->moveToThread(thread);
+		connect(thread, &QThread::finished, runner, &QObject::deleteLater);
+
+		thread->start();
+		m_threads << Worker { thread, runner, 0 };
+	}
+}
+
+SessionThreads::~SessionThreads()
+{
+	for(const Worker &w : m_threads)
+		w.thread->quit();
+
+	for(const Worker &w : m_threads)
+		w.thread->wait();
+}
+
+QThread *SessionThreads::acquire()
+{
+	Q_ASSERT(!m_threads.isEmpty());
+
+	Worker *best = &m_threads[0];
+	for(Worker &w : m_threads) {
+		if(w.load < best->load)
+			best = &w;
+	}
+
+	++best->load;
+	return best->thread;
+}
+
+void SessionThreads::release(QThread *thread)
+{
+	for(Worker &w : m_threads) {
+		if(w.thread == thread) {
+			Q_ASSERT(w.load > 0);
+			--w.load;
+			return;
+		}
+	}
+	qWarning("SessionThreads::release: unknown thread");
+}
+
+QVector<QThread*> SessionThreads::threads() const
+{
+	QVector<QThread*> list;
+	list.reserve(m_threads.size());
+	for(const Worker &w : m_threads)
+		list << w.thread;
+	return list;
+}
+
+SessionThreads::Runner *SessionThreads::runnerFor(QThread *thread) const
+{
+	for(const Worker &w : m_threads) {
+		if(w.thread == thread)
+			return w.runner;
+	}
+	return nullptr;
+}
+
+void SessionThreads::post(QThread *thread, std::function<void()> fn)
+{
+	Runner *runner = runnerFor(thread);
+	Q_ASSERT(runner);
+	if(runner)
+		QCoreApplication::postEvent(runner, new FunctionEvent(fn, nullptr));
+}
+
+void SessionThreads::call(QThread *thread, std::function<void()> fn)
+{
+	if(thread == QThread::currentThread()) {
+		fn();
+		return;
+	}
+
+	Runner *runner = runnerFor(thread);
+	Q_ASSERT(runner);
+	if(!runner)
+		return;
+
+	QSemaphore done;
+	QCoreApplication::postEvent(runner, new FunctionEvent(fn, &done));
+	done.acquire();
+}
+
+}
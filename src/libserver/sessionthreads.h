@@ -0,0 +1,95 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SRV_SESSIONTHREADS_H
+#define DP_SRV_SESSIONTHREADS_H
+
+#include <QObject>
+#include <QVector>
+
+#include <functional>
+
+class QThread;
+
+namespace server {
+
+/**
+ * @brief A pool of threads for running sessions in
+ *
+ * Each session (along with its history and the sockets of its users) lives
+ * entirely in one of these threads. The session server itself stays in the
+ * main thread and talks to the sessions via post() and call().
+ *
+ * To avoid deadlocks, only the thread that owns the pool may block on a
+ * session thread. A session thread must never call() the owner thread.
+ */
+class SessionThreads : public QObject
+{
+	Q_OBJECT
+public:
+	SessionThreads(int threadCount, QObject *parent=nullptr);
+	~SessionThreads();
+
+	//! Get the number of worker threads
+	int threadCount() const { return m_threads.size(); }
+
+	/**
+	 * @brief Pick a thread for a new session
+	 *
+	 * The thread with the fewest sessions is chosen.
+	 * Call release() when the session is gone.
+	 */
+	QThread *acquire();
+
+	//! Release a thread reservation made with acquire()
+	void release(QThread *thread);
+
+	//! Get all the worker threads
+	QVector<QThread*> threads() const;
+
+	/**
+	 * @brief Run a function in the given thread's event loop
+	 *
+	 * This returns immediately.
+	 */
+	void post(QThread *thread, std::function<void()> fn);
+
+	/**
+	 * @brief Run a function in the given thread and wait until it finishes
+	 *
+	 * If the thread is the current thread, the function is called directly.
+	 */
+	void call(QThread *thread, std::function<void()> fn);
+
+private:
+	class Runner;
+
+	struct Worker {
+		QThread *thread;
+		Runner *runner;
+		int load;
+	};
+
+	Runner *runnerFor(QThread *thread) const;
+
+	QVector<Worker> m_threads;
+};
+
+}
+
+#endif
@@ -2,6 +2,7 @@
 #include "../../libshared/util/passwordhash.h"
 #include "../../libshared/util/ulid.h"
 #include "../../libshared/net/meta.h"
+#include "../../libshared/net/raw.h"
 
 #include <QtTest/QtTest>
 #include <QTemporaryDir>
@@ -66,6 +67,8 @@ private slots:
 			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test"))));
 		}
 
+		QCOMPARE(FiledHistory::readAlias(m_dir.absoluteFilePath(FiledHistory::journalFilename(testId))), idAlias);
+
 		{
 			std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(FiledHistory::journalFilename(testId))) };
 			QVERIFY(fh.get());
@@ -116,19 +119,27 @@ private slots:
 		std::tie(msgs, lastIdx) = fh->getBatch(-1);
 
 		QCOMPARE(msgs.size(), 3);
-		QCOMPARE(msgs.at(0).cast<protocol::Chat>().message(), QString("test1"));
+		QCOMPARE(chatMessage(msgs.at(0)), QString("test1"));
 		QCOMPARE(lastIdx, 2);
 
+		// Loaded messages should be views to the same block buffer
+		int offset0, offset1;
+		const QByteArray buf0 = msgs.at(0)->serializedSlice(&offset0);
+		const QByteArray buf1 = msgs.at(1)->serializedSlice(&offset1);
+		QCOMPARE(buf0.constData(), buf1.constData());
+		QCOMPARE(offset1, offset0 + msgs.at(0)->length());
+		QCOMPARE(buf0.mid(offset0, msgs.at(0)->length()), msgs.at(0)->serialized());
+
 		std::tie(msgs, lastIdx) = fh->getBatch(0);
 
 		QCOMPARE(msgs.size(), 2);
-		QCOMPARE(msgs.at(0).cast<protocol::Chat>().message(), QString("test2"));
+		QCOMPARE(chatMessage(msgs.at(0)), QString("test2"));
 		QCOMPARE(lastIdx, 2);
 
 		std::tie(msgs, lastIdx) = fh->getBatch(1);
 
 		QCOMPARE(msgs.size(), 1);
-		QCOMPARE(msgs.at(0).cast<protocol::Chat>().message(), QString("test3"));
+		QCOMPARE(chatMessage(msgs.at(0)), QString("test3"));
 		QCOMPARE(lastIdx, 2);
 
 		std::tie(msgs, lastIdx) = fh->getBatch(2);
@@ -182,8 +193,8 @@ private slots:
 		std::tie(msgs, lastIdx) = fh->getBatch(-1);
 
 		QCOMPARE(msgs.size(), 2);
-		QCOMPARE(msgs.at(0).cast<protocol::Chat>().message(), QString("test1"));
-		QCOMPARE(msgs.at(1).cast<protocol::Chat>().message(), QString("test2"));
+		QCOMPARE(chatMessage(msgs.at(0)), QString("test1"));
+		QCOMPARE(chatMessage(msgs.at(1)), QString("test2"));
 		QCOMPARE(lastIdx, 1);
 	}
 
@@ -246,13 +257,13 @@ private slots:
 		std::tie(msgs, lastIdx) = fh->getBatch(-1);
 		QCOMPARE(msgs.size(), 3);
 		QCOMPARE(lastIdx, 2);
-		QCOMPARE(msgs.last().cast<protocol::Chat>().message(), QString("test3"));
+		QCOMPARE(chatMessage(msgs.last()), QString("test3"));
 
 		// Second batch
 		std::tie(msgs, lastIdx) = fh->getBatch(lastIdx);
 		QCOMPARE(msgs.size(), 2);
 		QCOMPARE(lastIdx, 4);
-		QCOMPARE(msgs.first().cast<protocol::Chat>().message(), QString("test0"));
+		QCOMPARE(chatMessage(msgs.first()), QString("test0"));
 
 		// There is no third batch
 		std::tie(msgs, lastIdx) = fh->getBatch(lastIdx);
@@ -302,7 +313,81 @@ private slots:
 		}
 	}
 
+	void testBlockIndex()
+	{
+		auto id = Ulid::make().toString();
+		const QString recordingFile = m_dir.absoluteFilePath(id + ".dprec");
+		const QString indexFile = FiledHistory::blockIndexFilename(recordingFile);
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::startNew(m_dir, id, QString(), protocol::ProtocolVersion::current(), "test") };
+
+			fh->addMessage(protocol::MessagePtr(new protocol::UserJoin(1, 0, QByteArray("u1"), QByteArray())));
+			fh->addMessage(protocol::MessagePtr(new protocol::UserJoin(2, 0, QByteArray("u2"), QByteArray())));
+			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test1"))));
+			fh->addMessage(protocol::MessagePtr(new protocol::UserLeave(2)));
+		}
+
+		// The index is saved when the history is closed
+		QVERIFY(QFile::exists(indexFile));
+		QFile::remove(indexFile + ".old");
+		QVERIFY(QFile::copy(indexFile, indexFile + ".old"));
+
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(FiledHistory::journalFilename(id))) };
+			QVERIFY(fh.get());
+
+			protocol::MessageList msgs;
+			int lastIdx;
+			std::tie(msgs, lastIdx) = fh->getBatch(-1);
+			QCOMPARE(msgs.size(), 5);
+
+			// User state is restored from the index
+			QCOMPARE(msgs.last()->type(), protocol::MSG_USER_LEAVE);
+			QCOMPARE(msgs.last()->contextId(), uint8_t(1));
+			QVERIFY(fh->idQueue().nextId() > 2);
+
+			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test2"))));
+		}
+
+		// An outdated index: only the tail of the recording needs to be scanned
+		QVERIFY(QFile::remove(indexFile));
+		QVERIFY(QFile::rename(indexFile + ".old", indexFile));
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(FiledHistory::journalFilename(id))) };
+			QVERIFY(fh.get());
+
+			protocol::MessageList msgs;
+			int lastIdx;
+			std::tie(msgs, lastIdx) = fh->getBatch(-1);
+			QCOMPARE(msgs.size(), 6);
+			QCOMPARE(chatMessage(msgs.last()), QString("test2"));
+		}
+
+		// A corrupted index is ignored
+		{
+			QFile f(indexFile);
+			QVERIFY(f.open(QFile::ReadWrite));
+			f.seek(f.size() - 30);
+			f.write("garbage");
+		}
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(FiledHistory::journalFilename(id))) };
+			QVERIFY(fh.get());
+			QCOMPARE(fh->lastIndex(), 5);
+		}
+	}
+
 private:
+	static QString chatMessage(const protocol::MessagePtr &msg)
+	{
+		// Messages loaded from the recording are not deserialized by FiledHistory
+		const protocol::RawMessage *raw = dynamic_cast<const protocol::RawMessage*>(&(*msg));
+		const protocol::NullableMessageRef decoded = raw ? raw->decode() : protocol::NullableMessageRef(msg);
+		if(decoded.isNull() || decoded->type() != protocol::MSG_CHAT)
+			return QString();
+		return decoded.cast<protocol::Chat>().message();
+	}
+
 	// Generate a test recording containing three messages.
 	QString makeTestRecording()
 	{
@@ -0,0 +1,69 @@
+#include "../ipbanindex.h"
+
+#include <QtTest/QtTest>
+#include <QHostAddress>
+#include <QDateTime>
+
+using server::IpBanIndex;
+
+class TestIpBanIndex: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testMatch_data()
+	{
+		QTest::addColumn<QString>("address");
+		QTest::addColumn<bool>("banned");
+
+		QTest::newRow("ipv4 exact") << "192.168.1.5" << true;
+		QTest::newRow("ipv4 neighbour") << "192.168.1.6" << false;
+		QTest::newRow("ipv4 subnet") << "10.20.30.40" << true;
+		QTest::newRow("ipv4 outside subnet") << "10.21.0.1" << false;
+		QTest::newRow("ipv4 mapped") << "::ffff:10.20.0.1" << true;
+		QTest::newRow("ipv4 mapped outside") << "::ffff:10.21.0.1" << false;
+		QTest::newRow("ipv6 subnet") << "2001:db8:1234::1" << true;
+		QTest::newRow("ipv6 outside subnet") << "2001:db8:1235::1" << false;
+		QTest::newRow("ipv6 exact") << "fe80::1" << true;
+		QTest::newRow("ipv6 other") << "fe80::2" << false;
+		QTest::newRow("expired") << "172.16.0.1" << false;
+		QTest::newRow("renewed") << "172.16.0.2" << true;
+		QTest::newRow("loopback") << "127.0.0.1" << false;
+	}
+
+	void testMatch()
+	{
+		QFETCH(QString, address);
+		QFETCH(bool, banned);
+
+		const QDateTime now = QDateTime::currentDateTimeUtc();
+		IpBanIndex index;
+		index.add(QHostAddress("192.168.1.5"), 32, QDateTime());
+		index.add(QHostAddress("10.20.0.0"), 16, now.addDays(1));
+		index.add(QHostAddress("2001:db8:1234::"), 48, QDateTime());
+		index.add(QHostAddress("fe80::1"), 128, now.addSecs(60));
+		index.add(QHostAddress("172.16.0.1"), 32, now.addSecs(-60));
+		index.add(QHostAddress("172.16.0.2"), 32, now.addSecs(-60));
+		index.add(QHostAddress("172.16.0.2"), 32, now.addSecs(60));
+
+		QCOMPARE(index.size(), 6);
+		QCOMPARE(index.contains(QHostAddress(address), now), banned);
+	}
+
+	void testEverything()
+	{
+		IpBanIndex index;
+		QVERIFY(!index.contains(QHostAddress("1.2.3.4")));
+
+		index.add(QHostAddress("0.0.0.0"), 0, QDateTime());
+		QVERIFY(index.contains(QHostAddress("1.2.3.4")));
+		QVERIFY(!index.contains(QHostAddress("2001:db8::1")));
+
+		index.clear();
+		QVERIFY(index.isEmpty());
+		QVERIFY(!index.contains(QHostAddress("1.2.3.4")));
+	}
+};
+
+
+QTEST_MAIN(TestIpBanIndex)
+#include "ipbanindex.moc"
@@ -0,0 +1,59 @@
+#include "../passwordcheck.h"
+#include "../../libshared/util/passwordhash.h"
+
+#include <QtTest/QtTest>
+
+#include <memory>
+
+using server::PasswordCheck;
+
+class TestPasswordCheck: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testChecks()
+	{
+		const QByteArray hash = server::passwordhash::hash("hunter2", server::passwordhash::SALTED_SHA1);
+		const QThread *mainThread = QThread::currentThread();
+
+		QObject context;
+		int done = 0;
+		int matches = 0;
+
+		for(int i=0;i<8;++i) {
+			auto ok = std::make_shared<bool>(false);
+			const QString password = i % 2 ? "hunter2" : "wrong";
+
+			PasswordCheck::start(&context,
+				[password, hash, ok]() { *ok = server::passwordhash::check(password, hash); },
+				[&done, &matches, ok, mainThread]() {
+					QCOMPARE(QThread::currentThread(), mainThread);
+					++done;
+					if(*ok)
+						++matches;
+				}
+			);
+		}
+
+		QTRY_COMPARE(done, 8);
+		QCOMPARE(matches, 4);
+		QCOMPARE(PasswordCheck::queueDepth(), 0);
+	}
+
+	void testDeletedContext()
+	{
+		auto *context = new QObject;
+		bool called = false;
+
+		PasswordCheck::start(context, []() { }, [&called]() { called = true; });
+		delete context;
+
+		QTRY_COMPARE(PasswordCheck::queueDepth(), 0);
+		QTest::qWait(50);
+		QVERIFY(!called);
+	}
+};
+
+
+QTEST_MAIN(TestPasswordCheck)
+#include "passwordcheck.moc"
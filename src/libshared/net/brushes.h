@@ -20,6 +20,7 @@
 #define DP_NET_BRUSHES_H
 
 #include "message.h"
+#include "messagepool.h"
 
 #include <QVector>
 #include <QRect>
@@ -64,8 +65,8 @@ Q_DECLARE_TYPEINFO(protocol::PixelBrushDab, Q_PRIMITIVE_TYPE);
 
 namespace protocol {
 
-typedef QVector<ClassicBrushDab> ClassicBrushDabVector;
-typedef QVector<PixelBrushDab> PixelBrushDabVector;
+typedef PooledVector<ClassicBrushDab> ClassicBrushDabVector;
+typedef PooledVector<PixelBrushDab> PixelBrushDabVector;
 
 enum class DabShape {
 	Round,
@@ -109,7 +110,7 @@ public:
  * @brief Draw Classic Brush Dabs
  *
  */
-class DrawDabsClassic : public DrawDabs {
+class DrawDabsClassic : public DrawDabs, public PooledMessage {
 public:
 	static const int MAX_DABS = (0xffff - 15) / ClassicBrushDab::LENGTH;
 
@@ -145,7 +146,9 @@ public:
 	bool isIndirect() const override { return (m_color & 0xff000000) > 0; }
 
 	const ClassicBrushDabVector &dabs() const { return m_dabs; }
-	ClassicBrushDabVector &dabs() { return m_dabs; }
+
+	//! Append a dab to the end of the dab vector
+	void appendDab(const ClassicBrushDab &dab) { m_dabs << dab; invalidateSerialization(); }
 
 	QString toString() const override;
 	QString messageName() const override { return QStringLiteral("classicdabs"); }
@@ -173,7 +176,7 @@ private:
  * @brief Draw Pixel Brush Dabs
  *
  */
-class DrawDabsPixel : public DrawDabs {
+class DrawDabsPixel : public DrawDabs, public PooledMessage {
 public:
 	static const int MAX_DABS = (0xffff - 15) / PixelBrushDab::LENGTH;
 
@@ -211,7 +214,9 @@ public:
 	bool isIndirect() const override { return (m_color & 0xff000000) > 0; }
 
 	const PixelBrushDabVector &dabs() const { return m_dabs; }
-	PixelBrushDabVector &dabs() { return m_dabs; }
+
+	//! Append a dab to the end of the dab vector
+	void appendDab(const PixelBrushDab &dab) { m_dabs << dab; invalidateSerialization(); }
 
 	QString toString() const override;
 	QString messageName() const override { return isSquare() ? QStringLiteral("squarepixeldabs") : QStringLiteral("pixeldabs"); }
@@ -240,7 +245,7 @@ private:
  * The pen up command signals the end of a stroke. In indirect drawing mode, it causes
  * indirect dabs (by this user) to be merged to their parent layers.
  */
-class PenUp : public ZeroLengthMessage<PenUp> {
+class PenUp : public ZeroLengthMessage<PenUp>, public PooledMessage {
 public:
 	PenUp(uint8_t ctx) : ZeroLengthMessage(MSG_PEN_UP, ctx) {}
 
@@ -52,6 +52,25 @@ int Message::serialize(char *data) const
 	return HEADER_LEN + written;
 }
 
+QByteArray Message::serialized() const
+{
+	if(m_serialized.isEmpty()) {
+		QByteArray buf(length(), Qt::Uninitialized);
+		const int len = serialize(buf.data());
+		Q_ASSERT(len == buf.length());
+		Q_UNUSED(len);
+		m_serialized = buf;
+	}
+	return m_serialized;
+}
+
+void Message::releaseSerialization() const
+{
+	Q_ASSERT(m_pendingSends > 0);
+	if(--m_pendingSends == 0)
+		m_serialized = QByteArray();
+}
+
 bool Message::equals(const Message &m) const
 {
 	if(type() != m.type() || contextId() != m.contextId())
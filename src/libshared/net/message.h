@@ -23,6 +23,7 @@
 #include <QMap>
 #include <QString>
 #include <QList>
+#include <QByteArray>
 
 namespace protocol {
 
@@ -107,7 +108,7 @@ public:
 	//! Length of the fixed message header
 	static const int HEADER_LEN = 4;
 
-	Message(MessageType type, uint8_t ctx): m_type(type), _undone(DONE), m_refcount(0), m_contextid(ctx) {}
+	Message(MessageType type, uint8_t ctx): m_type(type), _undone(DONE), m_refcount(0), m_contextid(ctx), m_pendingSends(0) {}
 	virtual ~Message() {}
 	
 	/**
@@ -177,7 +178,7 @@ public:
 	 *
 	 * @param userid the new user id
 	 */
-	void setContextId(uint8_t userid) { m_contextid = userid; }
+	void setContextId(uint8_t userid) { m_contextid = userid; invalidateSerialization(); }
 
 	/**
 	 * @brief Get the ID of the layer this command affects
@@ -230,6 +231,51 @@ public:
 	 */
 	int serialize(char *data) const;
 
+	/**
+	 * @brief Get the serialized form of this message
+	 *
+	 * The message is serialized on first call and the result is cached.
+	 * The returned byte array shares its data with the cache, so the same
+	 * message can be sent to any number of clients while being serialized
+	 * just once.
+	 *
+	 * Note: any function that modifies the message content must
+	 * call invalidateSerialization()
+	 *
+	 * @return length() bytes of serialized message
+	 */
+	QByteArray serialized() const;
+
+	/**
+	 * @brief Get the serialized form of this message as a slice of a buffer
+	 *
+	 * The default implementation returns serialized() with a zero offset.
+	 * Messages that are views to a larger buffer (see RawMessage) return the
+	 * whole buffer, so sending them requires no copying at all.
+	 *
+	 * @param offset the offset of the message in the returned buffer
+	 * @return buffer containing length() bytes of serialized message at the offset
+	 */
+	virtual QByteArray serializedSlice(int *offset) const { *offset = 0; return serialized(); }
+
+	/**
+	 * @brief Is the serialized form of this message cached?
+	 */
+	bool isSerializationCached() const { return !m_serialized.isEmpty(); }
+
+	/**
+	 * @brief Keep the serialization cached while this message is queued for sending
+	 *
+	 * Each call must be paired with a call to releaseSerialization().
+	 * When the last sender releases the message, the cached serialization
+	 * is dropped, so messages kept in the session history don't hold
+	 * a second copy of their content.
+	 */
+	void retainSerialization() const { ++m_pendingSends; }
+
+	//! See retainSerialization()
+	void releaseSerialization() const;
+
 	/**
 	 * @brief get the length of the message from the given data
 	 *
@@ -314,11 +360,16 @@ protected:
 	 */
 	virtual Kwargs kwargs() const = 0;
 
+	//! Drop the cached serialization. Must be called whenever the content of the message changes
+	void invalidateSerialization() { m_serialized = QByteArray(); }
+
 private:
 	const MessageType m_type;
 	MessageUndoState _undone;
 	int m_refcount;
 	uint8_t m_contextid;
+	mutable int m_pendingSends;
+	mutable QByteArray m_serialized;
 };
 
 typedef QList<MessagePtr> MessageList;
@@ -0,0 +1,287 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "messagepool.h"
+
+#include <atomic>
+#include <new>
+
+namespace protocol {
+namespace MessagePool {
+
+namespace {
+
+static const size_t GRANULARITY = 16;
+static const int SIZE_CLASSES = MAX_BLOCK_SIZE / GRANULARITY;
+
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+/**
+ * The shared part of a thread's pool.
+ *
+ * This outlives the thread as long as any of its blocks are still in use,
+ * so other threads can always return blocks to it.
+ */
+struct Owner {
+	// Blocks freed by other threads. Other threads only ever push to this
+	// list and the owner takes the whole list at once, so there is no ABA problem.
+	// Set to CLOSED when the owning thread exits.
+	std::atomic<FreeBlock*> remoteFree{nullptr};
+
+	// One reference for the thread itself and one for every block
+	// allocated from the heap that has not been returned to it yet.
+	std::atomic<int> refs{1};
+
+	void unref()
+	{
+		if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+};
+
+FreeBlock * const CLOSED = reinterpret_cast<FreeBlock*>(quintptr(1));
+
+// Every pooled block is preceded by a header telling where it belongs.
+// The header size is rounded up so the block itself stays suitably aligned.
+struct BlockHeader {
+	Owner *owner;
+	int sizeClass;
+};
+
+static const size_t ALIGNMENT = alignof(std::max_align_t);
+static const size_t HEADER_SIZE = (sizeof(BlockHeader) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+inline BlockHeader *headerOf(void *block)
+{
+	return reinterpret_cast<BlockHeader*>(static_cast<char*>(block) - HEADER_SIZE);
+}
+
+inline void *newBlock(Owner *owner, int sc)
+{
+	char *mem = static_cast<char*>(::operator new(HEADER_SIZE + (sc+1) * GRANULARITY));
+	BlockHeader *h = reinterpret_cast<BlockHeader*>(mem);
+	h->owner = owner;
+	h->sizeClass = sc;
+	if(owner)
+		owner->refs.fetch_add(1, std::memory_order_relaxed);
+	return mem + HEADER_SIZE;
+}
+
+inline void deleteBlock(void *block)
+{
+	BlockHeader *h = headerOf(block);
+	Owner *owner = h->owner;
+	::operator delete(h);
+	if(owner)
+		owner->unref();
+}
+
+// Counters of threads that have exited
+std::atomic<quint64> retiredAllocations{0};
+std::atomic<quint64> retiredReused{0};
+std::atomic<quint64> retiredHeapAllocations{0};
+std::atomic<quint64> retiredFrees{0};
+std::atomic<quint64> retiredRemoteFrees{0};
+
+struct ThreadCache;
+
+// These are trivially destructible, so they remain usable even after
+// the cache itself has been destroyed at thread exit.
+thread_local ThreadCache *currentCache = nullptr;
+thread_local bool cacheDestroyed = false;
+
+struct ThreadCache {
+	Owner *owner = new Owner;
+	FreeBlock *freeList[SIZE_CLASSES] = {};
+	int freeCount[SIZE_CLASSES] = {};
+	Stats stats = {};
+
+	~ThreadCache()
+	{
+		for(int i=0;i<SIZE_CLASSES;++i) {
+			FreeBlock *b = freeList[i];
+			while(b) {
+				FreeBlock *next = b->next;
+				deleteBlock(b);
+				b = next;
+			}
+		}
+
+		// Blocks freed by other threads from now on go straight back to the heap
+		FreeBlock *b = owner->remoteFree.exchange(CLOSED, std::memory_order_acquire);
+		while(b) {
+			FreeBlock *next = b->next;
+			deleteBlock(b);
+			b = next;
+		}
+
+		owner->unref();
+
+		retiredAllocations += stats.allocations;
+		retiredReused += stats.reused;
+		retiredHeapAllocations += stats.heapAllocations;
+		retiredFrees += stats.frees;
+		retiredRemoteFrees += stats.remoteFrees;
+
+		currentCache = nullptr;
+		cacheDestroyed = true;
+	}
+
+	//! Move the blocks freed by other threads to the local free lists
+	void takeRemoteFrees()
+	{
+		FreeBlock *b = owner->remoteFree.exchange(nullptr, std::memory_order_acquire);
+		while(b) {
+			FreeBlock *next = b->next;
+			const int sc = headerOf(b)->sizeClass;
+			if(freeCount[sc] < MAX_FREE_BLOCKS) {
+				b->next = freeList[sc];
+				freeList[sc] = b;
+				++freeCount[sc];
+			} else {
+				deleteBlock(b);
+			}
+			b = next;
+		}
+	}
+};
+
+ThreadCache *threadCache()
+{
+	if(!currentCache && !cacheDestroyed) {
+		static thread_local ThreadCache cache;
+		currentCache = &cache;
+	}
+	return currentCache;
+}
+
+inline int sizeClass(size_t size)
+{
+	return int((size + GRANULARITY - 1) / GRANULARITY) - 1;
+}
+
+//! Return a block to the thread it was allocated in
+void releaseRemote(FreeBlock *b, Owner *owner)
+{
+	FreeBlock *head = owner->remoteFree.load(std::memory_order_relaxed);
+	do {
+		if(head == CLOSED) {
+			// The owning thread has exited
+			deleteBlock(b);
+			return;
+		}
+		b->next = head;
+	} while(!owner->remoteFree.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+}
+
+}
+
+void *allocate(size_t size)
+{
+	if(size > MAX_BLOCK_SIZE)
+		return ::operator new(size);
+
+	const int sc = sizeClass(size);
+	ThreadCache *cache = threadCache();
+	if(!cache) {
+		// Only happens during thread shutdown
+		return newBlock(nullptr, sc);
+	}
+
+	++cache->stats.allocations;
+
+	if(!cache->freeList[sc])
+		cache->takeRemoteFrees();
+
+	FreeBlock *b = cache->freeList[sc];
+	if(b) {
+		cache->freeList[sc] = b->next;
+		--cache->freeCount[sc];
+		++cache->stats.reused;
+		return b;
+	}
+
+	++cache->stats.heapAllocations;
+	return newBlock(cache->owner, sc);
+}
+
+void release(void *ptr, size_t size)
+{
+	if(!ptr)
+		return;
+
+	if(size > MAX_BLOCK_SIZE) {
+		::operator delete(ptr);
+		return;
+	}
+
+	Q_ASSERT(headerOf(ptr)->sizeClass == sizeClass(size));
+
+	FreeBlock *b = static_cast<FreeBlock*>(ptr);
+	Owner *owner = headerOf(ptr)->owner;
+	ThreadCache *cache = threadCache();
+
+	if(cache)
+		++cache->stats.frees;
+
+	if(!owner) {
+		deleteBlock(b);
+
+	} else if(cache && cache->owner == owner) {
+		const int sc = headerOf(ptr)->sizeClass;
+		if(cache->freeCount[sc] < MAX_FREE_BLOCKS) {
+			b->next = cache->freeList[sc];
+			cache->freeList[sc] = b;
+			++cache->freeCount[sc];
+		} else {
+			deleteBlock(b);
+		}
+
+	} else {
+		if(cache)
+			++cache->stats.remoteFrees;
+		releaseRemote(b, owner);
+	}
+}
+
+Stats stats()
+{
+	Stats s {
+		retiredAllocations,
+		retiredReused,
+		retiredHeapAllocations,
+		retiredFrees,
+		retiredRemoteFrees
+	};
+
+	if(const ThreadCache *cache = threadCache()) {
+		s.allocations += cache->stats.allocations;
+		s.reused += cache->stats.reused;
+		s.heapAllocations += cache->stats.heapAllocations;
+		s.frees += cache->stats.frees;
+		s.remoteFrees += cache->stats.remoteFrees;
+	}
+
+	return s;
+}
+
+}
+}
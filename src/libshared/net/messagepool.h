@@ -0,0 +1,192 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_NET_MESSAGEPOOL_H
+#define DP_NET_MESSAGEPOOL_H
+
+#include <QtGlobal>
+
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <type_traits>
+
+namespace protocol {
+
+/**
+ * @brief Free list allocator for frequently created small messages
+ *
+ * Blocks are grouped into size classes of 16 bytes and each thread keeps its own
+ * free lists, so allocating and freeing needs no locking. Each block remembers the
+ * thread it was allocated in. A block freed by another thread is pushed to the
+ * owning thread's lock-free remote free list, which the owner takes over the next
+ * time its own free list runs out. This way, blocks flow back to the thread that
+ * produces the messages. A bounded number of blocks is cached per thread; the rest
+ * are returned to the heap.
+ */
+namespace MessagePool {
+
+//! Largest object size served from the pool. Larger allocations go to the heap.
+static const size_t MAX_BLOCK_SIZE = 256;
+
+//! Maximum number of free blocks cached per size class per thread
+static const int MAX_FREE_BLOCKS = 4096;
+
+struct Stats {
+	//! Total number of pooled object allocations
+	quint64 allocations;
+
+	//! Allocations served from a free list
+	quint64 reused;
+
+	//! Allocations that needed a new block from the heap
+	quint64 heapAllocations;
+
+	//! Number of pooled objects freed
+	quint64 frees;
+
+	//! Frees that returned the block to another thread
+	quint64 remoteFrees;
+};
+
+void *allocate(size_t size);
+void release(void *ptr, size_t size);
+
+/**
+ * @brief Get the allocation counters
+ *
+ * The counters are kept per thread. The returned numbers include the
+ * calling thread and all threads that have already exited.
+ */
+Stats stats();
+
+}
+
+/**
+ * @brief Mixin for message classes that should be allocated from the pool
+ *
+ * Since Message has a virtual destructor, deleting a message through a
+ * base class pointer still finds the right deallocation function.
+ */
+struct PooledMessage {
+	static void *operator new(size_t size) { return MessagePool::allocate(size); }
+	static void operator delete(void *ptr, size_t size) { MessagePool::release(ptr, size); }
+};
+
+/**
+ * @brief A minimal vector of plain data whose buffer is allocated from the message pool
+ *
+ * This is used for the dab lists of the DrawDabs messages, so creating
+ * and freeing a short stroke segment needs no heap allocations at all.
+ * Only the parts of the QVector API the messages need are provided.
+ */
+template<typename T> class PooledVector {
+	static_assert(std::is_trivially_copyable<T>::value, "PooledVector only supports plain data");
+public:
+	PooledVector() : m_data(nullptr), m_size(0), m_capacity(0) { }
+
+	PooledVector(std::initializer_list<T> items)
+		: PooledVector()
+	{
+		reserve(int(items.size()));
+		for(const T &t : items)
+			m_data[m_size++] = t;
+	}
+
+	PooledVector(const PooledVector &other)
+		: PooledVector()
+	{
+		reserve(other.m_size);
+		if(other.m_size > 0)
+			memcpy(m_data, other.m_data, other.m_size * sizeof(T));
+		m_size = other.m_size;
+	}
+
+	PooledVector(PooledVector &&other) noexcept
+		: m_data(other.m_data), m_size(other.m_size), m_capacity(other.m_capacity)
+	{
+		other.m_data = nullptr;
+		other.m_size = 0;
+		other.m_capacity = 0;
+	}
+
+	~PooledVector() { MessagePool::release(m_data, m_capacity * sizeof(T)); }
+
+	PooledVector &operator=(PooledVector other) noexcept { swap(other); return *this; }
+
+	void swap(PooledVector &other) noexcept
+	{
+		qSwap(m_data, other.m_data);
+		qSwap(m_size, other.m_size);
+		qSwap(m_capacity, other.m_capacity);
+	}
+
+	int size() const { return m_size; }
+	int length() const { return m_size; }
+	bool isEmpty() const { return m_size == 0; }
+
+	const T &at(int i) const { Q_ASSERT(i >= 0 && i < m_size); return m_data[i]; }
+	const T &operator[](int i) const { return at(i); }
+	const T &first() const { return at(0); }
+	const T &last() const { return at(m_size - 1); }
+
+	const T *begin() const { return m_data; }
+	const T *end() const { return m_data + m_size; }
+
+	void reserve(int capacity)
+	{
+		if(capacity > m_capacity)
+			reallocate(capacity);
+	}
+
+	void append(const T &t)
+	{
+		if(m_size == m_capacity) {
+			// The item may be a reference into this vector
+			const T copy = t;
+			reallocate(m_capacity > 0 ? m_capacity * 2 : MIN_CAPACITY);
+			m_data[m_size++] = copy;
+		} else {
+			m_data[m_size++] = t;
+		}
+	}
+
+	PooledVector &operator<<(const T &t) { append(t); return *this; }
+
+private:
+	//! Initial capacity when appending to an empty vector (fills a 64 byte block)
+	static const int MIN_CAPACITY = 64 / sizeof(T) > 0 ? int(64 / sizeof(T)) : 1;
+
+	void reallocate(int capacity)
+	{
+		T *data = static_cast<T*>(MessagePool::allocate(capacity * sizeof(T)));
+		if(m_size > 0)
+			memcpy(data, m_data, m_size * sizeof(T));
+		MessagePool::release(m_data, m_capacity * sizeof(T));
+		m_data = data;
+		m_capacity = capacity;
+	}
+
+	T *m_data;
+	int m_size;
+	int m_capacity;
+};
+
+}
+
+#endif
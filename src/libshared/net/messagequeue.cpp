@@ -35,13 +35,27 @@ namespace protocol {
 // Reserve enough buffer space for one complete message
 static const int MAX_BUF_LEN = 1024*64 + protocol::Message::HEADER_LEN;
 
+// The reception buffer is larger, so many messages can be read with a single call.
+// There is always room for at least one whole message after the buffer has been compacted.
+static const int RECV_BUF_LEN = MAX_BUF_LEN * 4;
+
+// Messages at least this long are bulk data. Each one is sent in a batch of its own,
+// straight from its cached serialization if possible.
+static const int BULK_MESSAGE_LEN = 1024*4;
+
+// Don't write more to the socket while it still has this much unsent data buffered.
+// Otherwise a long run of bulk data would all end up in the socket's buffer,
+// where priority messages cannot overtake it.
+static const int MAX_SOCKET_BACKLOG = 1024*64;
+
 MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 	: QObject(parent), m_socket(socket),
 	  m_pingTimer(nullptr),
 	  m_lastRecvTime(0),
 	  m_idleTimeout(0), m_pingSent(0), m_closeWhenReady(false),
 	  m_ignoreIncoming(false),
-	  m_decodeOpaque(false)
+	  m_decodeOpaque(false),
+	  m_cacheSerialization(false)
 {
 	connect(socket, SIGNAL(readyRead()), this, SLOT(readData()));
 	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(dataWritten(qint64)));
@@ -50,11 +64,12 @@ MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 		connect(socket, SIGNAL(encrypted()), this, SLOT(sslEncrypted()));
 	}
 
-	m_recvbuffer = new char[MAX_BUF_LEN];
-	m_sendbuffer = new char[MAX_BUF_LEN];
+	m_recvbuffer = new char[RECV_BUF_LEN];
+	m_sendbuffer.resize(MAX_BUF_LEN);
 	m_recvbytes = 0;
 	m_sentbytes = 0;
 	m_sendbuflen = 0;
+	m_sendBatchSize = 1024*64;
 
 	m_idleTimer = new QTimer(this);
 	connect(m_idleTimer, &QTimer::timeout, this, &MessageQueue::checkIdleTimeout);
@@ -103,8 +118,8 @@ void MessageQueue::setPingInterval(int msecs)
 
 MessageQueue::~MessageQueue()
 {
+	clearOutbox();
 	delete [] m_recvbuffer;
-	delete [] m_sendbuffer;
 }
 
 bool MessageQueue::isPending() const
@@ -117,10 +132,54 @@ MessagePtr MessageQueue::getPending()
 	return m_inbox.dequeue();
 }
 
+MessageQueue::SendLane MessageQueue::sendLane(MessageType type)
+{
+	switch(type) {
+	case MSG_PING:
+		return ControlLane;
+
+	case MSG_CHAT:
+	case MSG_PRIVATE_CHAT:
+	case MSG_LASERTRAIL:
+	case MSG_MOVEPOINTER:
+		return InteractiveLane;
+
+	default:
+		return OrderedLane;
+	}
+}
+
+bool MessageQueue::isOutboxEmpty() const
+{
+	for(int i=0;i<SEND_LANE_COUNT;++i) {
+		if(!m_outbox[i].isEmpty())
+			return false;
+	}
+	return true;
+}
+
+void MessageQueue::enqueue(SendLane lane, const MessagePtr &msg)
+{
+	if(m_cacheSerialization)
+		msg->retainSerialization();
+	m_outbox[lane].enqueue(msg);
+}
+
+void MessageQueue::clearOutbox()
+{
+	for(int i=0;i<SEND_LANE_COUNT;++i) {
+		if(m_cacheSerialization) {
+			for(const MessagePtr &msg : m_outbox[i])
+				msg->releaseSerialization();
+		}
+		m_outbox[i].clear();
+	}
+}
+
 void MessageQueue::send(const MessagePtr &message)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.enqueue(message);
+		enqueue(sendLane(message->type()), message);
 		if(m_sendbuflen==0)
 			writeData();
 	}
@@ -129,7 +188,8 @@ void MessageQueue::send(const MessagePtr &message)
 void MessageQueue::send(const MessageList &messages)
 {
 	if(!m_closeWhenReady) {
-		m_outbox << messages;
+		for(const MessagePtr &msg : messages)
+			enqueue(sendLane(msg->type()), msg);
 		if(m_sendbuflen==0)
 			writeData();
 	}
@@ -138,7 +198,7 @@ void MessageQueue::send(const MessageList &messages)
 void MessageQueue::sendNow(MessagePtr msg)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.prepend(msg);
+		enqueue(ControlLane, msg);
 		if(m_sendbuflen==0)
 			writeData();
 	}
@@ -166,8 +226,10 @@ void MessageQueue::sendPing()
 int MessageQueue::uploadQueueBytes() const
 {
 	int total = m_socket->bytesToWrite() + m_sendbuflen - m_sentbytes;
-	for(const MessagePtr &msg : m_outbox)
-		total += msg->length();
+	for(int i=0;i<SEND_LANE_COUNT;++i) {
+		for(const MessagePtr &msg : m_outbox[i])
+			total += msg->length();
+	}
 	return total;
 }
 
@@ -186,7 +248,7 @@ void MessageQueue::readData() {
 	int read, totalread=0;
 	do {
 		// Read as much as fits in to the deserialization buffer
-		read = m_socket->read(m_recvbuffer+m_recvbytes, MAX_BUF_LEN-m_recvbytes);
+		read = m_socket->read(m_recvbuffer+m_recvbytes, RECV_BUF_LEN-m_recvbytes);
 		if(read<0) {
 			emit socketError(m_socket->errorString());
 			return;
@@ -204,12 +266,16 @@ void MessageQueue::readData() {
 		m_recvbytes += read;
 
 		// Extract all complete messages
+		int pos = 0;
 		int len;
-		while(m_recvbytes >= Message::HEADER_LEN && m_recvbytes >= (len=Message::sniffLength(m_recvbuffer))) {
+		while(!m_ignoreIncoming && m_recvbytes-pos >= Message::HEADER_LEN && m_recvbytes-pos >= (len=Message::sniffLength(m_recvbuffer+pos))) {
 			// Whole message received!
-			NullableMessageRef msg = Message::deserialize((const uchar*)m_recvbuffer, m_recvbytes, m_decodeOpaque);
+			const char *msgdata = m_recvbuffer + pos;
+			pos += len;
+
+			NullableMessageRef msg = Message::deserialize((const uchar*)msgdata, len, m_decodeOpaque);
 			if(msg.isNull()) {
-				emit badData(len, (unsigned char)m_recvbuffer[2], (unsigned char)m_recvbuffer[3]);
+				emit badData(len, (unsigned char)msgdata[2], (unsigned char)msgdata[3]);
 
 			} else {
 				 if(msg->type() == MSG_PING) {
@@ -234,12 +300,17 @@ void MessageQueue::readData() {
 					gotmessage = true;
 				}
 			}
+		}
 
-			if(len < m_recvbytes) {
-				// Buffer contains more than one message
-				memmove(m_recvbuffer, m_recvbuffer+len, m_recvbytes-len);
-			}
-			m_recvbytes -= len;
+		if(m_ignoreIncoming) {
+			// sendDisconnect was called while handling a message
+			m_recvbytes = 0;
+
+		} else if(pos > 0) {
+			// Move the trailing partial message (if any) to the start of the buffer
+			m_recvbytes -= pos;
+			if(m_recvbytes > 0)
+				memmove(m_recvbuffer, m_recvbuffer+pos, m_recvbytes);
 		}
 
 		// All messages extracted from buffer (if there were any):
@@ -262,33 +333,75 @@ void MessageQueue::dataWritten(qint64 bytes)
 
 	// Write more once the buffer is empty
 	if(m_socket->bytesToWrite()==0) {
-		if(m_sendbuflen==0 && m_outbox.isEmpty())
+		if(m_sendbuflen==0 && isOutboxEmpty())
 			emit allSent();
 		else
 			writeData();
 	}
 }
 
-void MessageQueue::writeData() {
-	int sentBatch = 0;
-	bool sendMore = true;
+void MessageQueue::fillSendBuffer()
+{
+	Q_ASSERT(m_sendbuflen == 0 && m_sentbytes == 0);
+	Q_ASSERT(m_sharedbuffer.isNull());
 
-	while(sendMore && sentBatch < 1024*64) {
-		sendMore = false;
-		if(m_sendbuflen==0 && !m_outbox.isEmpty()) {
-			// Upload buffer is empty, but there are messages in the outbox
-			Q_ASSERT(m_sentbytes == 0);
+	for(int lane=0;lane<SEND_LANE_COUNT;++lane) {
+		QQueue<MessagePtr> &outbox = m_outbox[lane];
+
+		while(!outbox.isEmpty()) {
+			const int len = outbox.head()->length();
+			if(m_sendbuflen > 0 && m_sendbuflen + len > m_sendBatchSize)
+				return;
+
+			// Bulk messages get a batch of their own, so the
+			// higher priority lanes can be checked between each one.
+			const bool bulk = len >= BULK_MESSAGE_LEN;
+			if(bulk && m_sendbuflen > 0)
+				return;
+
+			const MessagePtr msg = outbox.dequeue();
+
+			if(bulk && m_cacheSerialization) {
+				// No copying: the buffer is shared with the message and
+				// every other queue that is sending it. The buffer stays
+				// alive until written, even if the message drops its cache.
+				m_sharedbuffer = msg->serializedSlice(&m_sentbytes);
+				msg->releaseSerialization();
+				m_sendbuflen = m_sentbytes + len;
+				Q_ASSERT(m_sendbuflen <= m_sharedbuffer.length());
+				return;
+			}
+
+			if(m_sendbuffer.length() < m_sendbuflen + len)
+				m_sendbuffer.resize(m_sendbuflen + len);
 
-			MessagePtr msg = m_outbox.dequeue();
-			m_sendbuflen = msg->serialize(m_sendbuffer);
-			Q_ASSERT(m_sendbuflen>0);
-			Q_ASSERT(m_sendbuflen <= MAX_BUF_LEN);
+			// Small messages are cheaper to serialize again than to cache
+			msg->serialize(m_sendbuffer.data() + m_sendbuflen);
+			if(m_cacheSerialization)
+				msg->releaseSerialization();
+			m_sendbuflen += len;
 
 			if(msg->type() == protocol::MSG_DISCONNECT) {
 				// Automatically disconnect after Disconnect notification is sent
 				m_closeWhenReady = true;
-				m_outbox.clear();
+				clearOutbox();
+				return;
 			}
+
+			if(bulk)
+				return;
+		}
+	}
+}
+
+void MessageQueue::writeData() {
+	bool sendMore = true;
+
+	while(sendMore && m_socket->bytesToWrite() < MAX_SOCKET_BACKLOG) {
+		sendMore = false;
+		if(m_sendbuflen==0 && !isOutboxEmpty()) {
+			// Upload buffer is empty, but there are messages in the outbox
+			fillSendBuffer();
 		}
 
 		if(m_sentbytes < m_sendbuflen) {
@@ -299,18 +412,19 @@ void MessageQueue::writeData() {
 			}
 #endif
 
-			const int sent = m_socket->write(m_sendbuffer+m_sentbytes, m_sendbuflen-m_sentbytes);
+			const char *buffer = m_sharedbuffer.isNull() ? m_sendbuffer.constData() : m_sharedbuffer.constData();
+			const int sent = m_socket->write(buffer+m_sentbytes, m_sendbuflen-m_sentbytes);
 			if(sent<0) {
 				// Error
 				emit socketError(m_socket->errorString());
 				return;
 			}
 			m_sentbytes += sent;
-			sentBatch += sent;
 
 			Q_ASSERT(m_sentbytes <= m_sendbuflen);
 			if(m_sentbytes >= m_sendbuflen) {
-				// Complete message sent
+				// Complete batch sent
+				m_sharedbuffer = QByteArray();
 				m_sendbuflen=0;
 				m_sentbytes=0;
 				if(m_closeWhenReady) {
@@ -32,10 +32,28 @@ namespace protocol {
 
 /**
  * A wrapper for an IO device for sending and receiving messages.
+ *
+ * Outgoing messages are queued in priority lanes. Connection control messages
+ * go first, followed by interactive messages such as pointer movements and chat.
+ * All other messages, including everything that is part of the session history,
+ * are sent in the exact order they were queued. Large messages are sent one at
+ * a time, so higher priority messages don't have to wait for a long run of
+ * bulk data (e.g. a pasted image) to be sent first.
  */
 class MessageQueue : public QObject {
 Q_OBJECT
 public:
+	//! Send priority lanes, highest priority first
+	enum SendLane {
+		ControlLane,     // ping and pong
+		InteractiveLane, // messages that can be freely reordered relative to the session history
+		OrderedLane,     // everything else, always sent in order
+		SEND_LANE_COUNT
+	};
+
+	//! Get the lane messages of the given type are sent through
+	static SendLane sendLane(MessageType type);
+
 	/**
 	 * @brief Create a message queue that wraps a TCP socket.
 	 *
@@ -53,6 +71,31 @@ public:
 	 */
 	void setDecodeOpaque(bool d) { m_decodeOpaque = d; }
 
+	/**
+	 * @brief Use the messages' cached serializations when sending
+	 *
+	 * When enabled, each bulk message is serialized only once no matter how
+	 * many queues it is sent through at the same time. The serialized data
+	 * is kept only until every queue has sent the message.
+	 * This should be used on the server side only, where the same messages
+	 * are sent to many clients.
+	 */
+	void setCacheSerialization(bool cache) { m_cacheSerialization = cache; }
+
+	/**
+	 * @brief Set the maximum size of a send batch
+	 *
+	 * Queued messages are serialized back to back into a single buffer,
+	 * which is then written to the socket in one go. A batch is always
+	 * allowed to contain at least one message, so setting this to 1
+	 * disables batching.
+	 *
+	 * The default is 64 kilobytes.
+	 *
+	 * @param bytes maximum batch size in bytes
+	 */
+	void setSendBatchSize(int bytes) { m_sendBatchSize = qMax(1, bytes); }
+
 	/**
 	 * @brief Check if there are new messages available
 	 * @return true if getPending will return a message
@@ -184,17 +227,23 @@ private:
 	void sendNow(MessagePtr msg);
 
 	void writeData();
+	void fillSendBuffer();
+	void enqueue(SendLane lane, const MessagePtr &msg);
+	void clearOutbox();
+	bool isOutboxEmpty() const;
 
 	QTcpSocket *m_socket;
 
 	char *m_recvbuffer; // raw message reception buffer
-	char *m_sendbuffer; // raw message upload buffer
+	QByteArray m_sendbuffer; // raw message upload buffer (a batch of serialized messages)
+	QByteArray m_sharedbuffer; // upload buffer shared with a large message (when caching serializations)
 	int m_recvbytes;    // number of bytes in reception buffer
-	int m_sentbytes;    // number of bytes in upload buffer already sent
-	int m_sendbuflen;   // length of the data in the upload buffer
+	int m_sentbytes;    // position of the next byte to send in the upload buffer
+	int m_sendbuflen;   // end of the data to send in the upload buffer
+	int m_sendBatchSize; // maximum number of bytes to batch together
 
 	QQueue<MessagePtr> m_inbox;  // pending messages
-	QQueue<MessagePtr> m_outbox; // messages to be sent
+	QQueue<MessagePtr> m_outbox[SEND_LANE_COUNT]; // messages to be sent
 
 	QTimer *m_idleTimer;
 	QTimer *m_pingTimer;
@@ -206,6 +255,7 @@ private:
 	bool m_ignoreIncoming;
 
 	bool m_decodeOpaque;
+	bool m_cacheSerialization;
 
 #ifndef NDEBUG
 	uint m_randomlag;
@@ -20,6 +20,7 @@
 #define DP_NET_META_OPAQUE_H
 
 #include "message.h"
+#include "messagepool.h"
 
 #include <QString>
 #include <QList>
@@ -63,7 +64,7 @@ private:
  * Note. This is a META message, since this is used for a temporary visual effect only,
  * and thus doesn't affect the actual canvas content.
  */
-class MovePointer : public Message {
+class MovePointer : public Message, public PooledMessage {
 public:
 	MovePointer(uint8_t ctx, int32_t x, int32_t y)
 		: Message(MSG_MOVEPOINTER, ctx), m_x(x), m_y(y)
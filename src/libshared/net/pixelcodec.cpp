@@ -0,0 +1,275 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pixelcodec.h"
+
+#include <QtEndian>
+#include <cstring>
+
+namespace protocol {
+
+// qCompress output starts with the big endian uncompressed length.
+// The first byte of a length under 2GB never has the top bit set,
+// so codec IDs with the top bit set can't be confused with it.
+static const uchar CODEC_RLE = 0x80;     // [codec][bpp][length:4][RLE data]
+static const uchar CODEC_DEFLATE = 0x81; // [codec][bpp][qCompress output]
+
+// RLE control bytes
+static const int MAX_LITERAL = 128;                 // 0x00-0x7f: 1-128 literal bytes follow
+static const int MIN_RUN = 3;                       // 0x80-0xfe: the next byte repeats 3-129 times
+static const int MAX_SHORT_RUN = MIN_RUN + 0x7e;
+static const int MAX_LONG_RUN = MAX_SHORT_RUN + 1 + 0xffff; // 0xff: 16 bit length (+130) and the byte follow
+
+//! Split the pixels into byte planes and delta code each plane
+static void predict(const uchar *in, uchar *out, int length, int bpp)
+{
+	if(bpp == 1) {
+		memcpy(out, in, length);
+		return;
+	}
+
+	const int n = length / bpp;
+	for(int p=0;p<bpp;++p) {
+		uchar prev = 0;
+		for(int i=0;i<n;++i) {
+			const uchar v = in[i*bpp+p];
+			*(out++) = v - prev;
+			prev = v;
+		}
+	}
+}
+
+//! The inverse of predict()
+static void unpredict(const uchar *in, uchar *out, int length, int bpp)
+{
+	if(bpp == 1) {
+		memcpy(out, in, length);
+		return;
+	}
+
+	const int n = length / bpp;
+	for(int p=0;p<bpp;++p) {
+		uchar acc = 0;
+		for(int i=0;i<n;++i) {
+			acc += *(in++);
+			out[i*bpp+p] = acc;
+		}
+	}
+}
+
+static void rleEncode(const uchar *in, int length, QByteArray &out)
+{
+	int literalStart = 0;
+
+	auto flushLiterals = [in, &out](int from, int to) {
+		while(from < to) {
+			const int n = qMin(MAX_LITERAL, to - from);
+			out.append(char(n - 1));
+			out.append(reinterpret_cast<const char*>(in + from), n);
+			from += n;
+		}
+	};
+
+	int i = 0;
+	while(i < length) {
+		int run = 1;
+		while(i+run < length && run < MAX_LONG_RUN && in[i+run] == in[i])
+			++run;
+
+		if(run >= MIN_RUN) {
+			flushLiterals(literalStart, i);
+			if(run <= MAX_SHORT_RUN) {
+				out.append(char(0x80 + run - MIN_RUN));
+			} else {
+				const int n = run - MAX_SHORT_RUN - 1;
+				out.append(char(0xff));
+				out.append(char(n >> 8));
+				out.append(char(n & 0xff));
+			}
+			out.append(char(in[i]));
+			i += run;
+			literalStart = i;
+		} else {
+			++i;
+		}
+	}
+	flushLiterals(literalStart, length);
+}
+
+/**
+ * Walk through the RLE data (without decoding it) to find its decoded length.
+ * This way, the output buffer size is known to be right before it is allocated.
+ *
+ * @return decoded length or -1 if the data is malformed
+ */
+static qint64 rleDecodedLength(const uchar *in, int length)
+{
+	const uchar *end = in + length;
+	qint64 total = 0;
+
+	while(in < end) {
+		const uchar c = *(in++);
+		if(c < 0x80) {
+			const int n = c + 1;
+			if(end - in < n)
+				return -1;
+			in += n;
+			total += n;
+
+		} else if(c < 0xff) {
+			if(in == end)
+				return -1;
+			++in;
+			total += c - 0x80 + MIN_RUN;
+
+		} else {
+			if(end - in < 3)
+				return -1;
+			total += ((in[0] << 8) | in[1]) + MAX_SHORT_RUN + 1;
+			in += 3;
+		}
+	}
+
+	return total;
+}
+
+//! Decode RLE data that has already been checked with rleDecodedLength
+static void rleDecode(const uchar *in, int length, uchar *out)
+{
+	const uchar *end = in + length;
+
+	while(in < end) {
+		const uchar c = *(in++);
+		if(c < 0x80) {
+			const int n = c + 1;
+			memcpy(out, in, n);
+			in += n;
+			out += n;
+
+		} else if(c < 0xff) {
+			const int n = c - 0x80 + MIN_RUN;
+			memset(out, *(in++), n);
+			out += n;
+
+		} else {
+			const int n = ((in[0] << 8) | in[1]) + MAX_SHORT_RUN + 1;
+			memset(out, in[2], n);
+			in += 3;
+			out += n;
+		}
+	}
+}
+
+QByteArray compressPixels(const uchar *data, int length, int bytesPerPixel)
+{
+	Q_ASSERT(bytesPerPixel == 1 || bytesPerPixel == 4);
+	Q_ASSERT(length % bytesPerPixel == 0);
+
+	QByteArray predicted(length, Qt::Uninitialized);
+	predict(data, reinterpret_cast<uchar*>(predicted.data()), length, bytesPerPixel);
+
+	QByteArray rle;
+	rle.reserve(6 + length + length / MAX_LITERAL + 1);
+	rle.append(char(CODEC_RLE));
+	rle.append(char(bytesPerPixel));
+	uchar len[4];
+	qToBigEndian(quint32(length), len);
+	rle.append(reinterpret_cast<const char*>(len), 4);
+	rleEncode(reinterpret_cast<const uchar*>(predicted.constData()), length, rle);
+
+	QByteArray deflated = qCompress(predicted);
+	deflated.prepend(char(bytesPerPixel));
+	deflated.prepend(char(CODEC_DEFLATE));
+
+	// Fast decoding is worth a little extra size
+	if(rle.length() <= deflated.length() + deflated.length() / 4)
+		return rle;
+
+	return deflated;
+}
+
+/**
+ * Decompress qCompress output, checking the length from its header first.
+ *
+ * qUncompress trusts the header when allocating its output buffer, so
+ * the header must be checked before calling it. The result is checked
+ * too, since the header could be lying.
+ */
+static QByteArray boundedUncompress(const uchar *data, int length, int expectedLength)
+{
+	if(length < 4 || qFromBigEndian<quint32>(data) != quint32(expectedLength))
+		return QByteArray();
+
+	QByteArray out = qUncompress(data, length);
+	if(out.length() != expectedLength)
+		return QByteArray();
+
+	return out;
+}
+
+QByteArray decompressPixels(const QByteArray &data, int expectedLength)
+{
+	if(data.isEmpty() || expectedLength < 0)
+		return QByteArray();
+
+	const uchar *d = reinterpret_cast<const uchar*>(data.constData());
+
+	if(!(d[0] & 0x80)) {
+		// Plain qCompress data
+		return boundedUncompress(d, data.length(), expectedLength);
+	}
+
+	if(data.length() < 2)
+		return QByteArray();
+
+	const int bpp = d[1];
+	if(bpp != 1 && bpp != 4)
+		return QByteArray();
+
+	QByteArray predicted;
+	switch(d[0]) {
+	case CODEC_RLE: {
+		if(data.length() < 6)
+			return QByteArray();
+
+		const quint32 length = qFromBigEndian<quint32>(d + 2);
+		if(length != quint32(expectedLength) || rleDecodedLength(d + 6, data.length() - 6) != length)
+			return QByteArray();
+
+		predicted = QByteArray(int(length), Qt::Uninitialized);
+		rleDecode(d + 6, data.length() - 6, reinterpret_cast<uchar*>(predicted.data()));
+		break;
+	}
+	case CODEC_DEFLATE:
+		predicted = boundedUncompress(d + 2, data.length() - 2, expectedLength);
+		break;
+	default:
+		qWarning("Unknown pixel codec 0x%x", d[0]);
+		return QByteArray();
+	}
+
+	if(predicted.length() % bpp)
+		return QByteArray();
+
+	QByteArray pixels(predicted.length(), Qt::Uninitialized);
+	unpredict(reinterpret_cast<const uchar*>(predicted.constData()), reinterpret_cast<uchar*>(pixels.data()), predicted.length(), bpp);
+	return pixels;
+}
+
+}
@@ -0,0 +1,61 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_NET_PIXELCODEC_H
+#define DP_NET_PIXELCODEC_H
+
+#include <QByteArray>
+
+namespace protocol {
+
+/**
+ * @brief Compress pixel data for a PutTile, PutImage, CanvasBackground or MoveRegion message
+ *
+ * The pixels are first split into byte planes and delta coded, which turns
+ * flat areas and smooth gradients into runs of zeros. The result is then
+ * either run length encoded or compressed with zlib, whichever gives the
+ * better tradeoff between size and decoding speed. Run length coded data
+ * decodes several times faster than zlib.
+ *
+ * This encoding was introduced in protocol version dp:4.21.3. Older
+ * clients can only decode plain qCompress output.
+ *
+ * @param data the pixels
+ * @param length length of the pixel data in bytes (must be a multiple of bytesPerPixel)
+ * @param bytesPerPixel 4 for ARGB pixels, 1 for other data (e.g. 1 bit masks)
+ */
+QByteArray compressPixels(const uchar *data, int length, int bytesPerPixel);
+
+/**
+ * @brief Decompress pixel data
+ *
+ * Both the compressPixels format and plain qCompress output are supported.
+ *
+ * The data is rejected without decompressing it if the length declared in its
+ * header is not the expected one. This keeps a malicious message from making
+ * us allocate more memory than the receiving command could ever use.
+ *
+ * @param data the compressed data
+ * @param expectedLength the exact length the decompressed data must have
+ * @return the decompressed data, or an empty array if the data was invalid
+ */
+QByteArray decompressPixels(const QByteArray &data, int expectedLength);
+
+}
+
+#endif
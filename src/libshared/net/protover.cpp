@@ -83,7 +83,9 @@ QString ProtocolVersion::versionName() const
 	if(m_namespace != QStringLiteral("dp"))
 		return QString();
 
-	if(m_server == 4 && m_major == 21 && m_minor == 2)
+	if(m_server == 4 && m_major == 21 && m_minor == 3)
+		return QStringLiteral("2.2.x");
+	else if(m_server == 4 && m_major == 21 && m_minor == 2)
 		return QStringLiteral("2.1.x");
 	else if(m_server == 4 && m_major == 20 && m_minor == 1)
 		return QStringLiteral("2.0.x");
@@ -0,0 +1,107 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "raw.h"
+
+#include <QtEndian>
+#include <QVarLengthArray>
+#include <cstring>
+
+namespace protocol {
+
+RawMessage::RawMessage(const QByteArray &buffer, int offset)
+	: Message(MessageType(uchar(buffer.at(offset+2))), uchar(buffer.at(offset+3))),
+	  m_buffer(buffer), m_offset(offset)
+{
+	Q_ASSERT(offset + HEADER_LEN <= buffer.length());
+	Q_ASSERT(offset + sniffLength(buffer.constData()+offset) <= buffer.length());
+}
+
+MessageList RawMessage::split(const QByteArray &buffer, int *consumed)
+{
+	MessageList messages;
+	int offset = 0;
+	while(offset + HEADER_LEN <= buffer.length()) {
+		const int len = sniffLength(buffer.constData() + offset);
+		if(offset + len > buffer.length())
+			break;
+
+		messages << MessagePtr(new RawMessage(buffer, offset));
+		offset += len;
+	}
+
+	if(consumed)
+		*consumed = offset;
+
+	return messages;
+}
+
+NullableMessageRef RawMessage::decode() const
+{
+	return Message::deserialize(
+		reinterpret_cast<const uchar*>(m_buffer.constData() + m_offset),
+		m_buffer.length() - m_offset,
+		true
+	);
+}
+
+QByteArray RawMessage::serializedSlice(int *offset) const
+{
+	// Note: setContextId could make the header in the shared buffer stale
+	if(contextId() != uchar(m_buffer.at(m_offset+3)))
+		return Message::serializedSlice(offset);
+
+	*offset = m_offset;
+	return m_buffer;
+}
+
+QString RawMessage::toString() const
+{
+	const NullableMessageRef msg = decode();
+	if(msg.isNull())
+		return QStringLiteral("_raw %1 (invalid)").arg(type());
+	return msg->toString();
+}
+
+int RawMessage::payloadLength() const
+{
+	return qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(m_buffer.constData() + m_offset));
+}
+
+int RawMessage::serializePayload(uchar *data) const
+{
+	const int len = payloadLength();
+	memcpy(data, m_buffer.constData() + m_offset + HEADER_LEN, len);
+	return len;
+}
+
+bool RawMessage::payloadEquals(const Message &m) const
+{
+	// The other message may be of any type, so compare the serialized forms
+	const int len = payloadLength();
+	if(m.length() != len + HEADER_LEN)
+		return false;
+
+	QVarLengthArray<char> buf(m.length());
+	m.serialize(buf.data());
+
+	return memcmp(buf.data() + HEADER_LEN, m_buffer.constData() + m_offset + HEADER_LEN, len) == 0;
+}
+
+}
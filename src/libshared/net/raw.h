@@ -0,0 +1,86 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_NET_RAW_H
+#define DP_NET_RAW_H
+
+#include "message.h"
+
+#include <QByteArray>
+
+namespace protocol {
+
+/**
+ * @brief A message that is a view to serialized message data
+ *
+ * The message refers to a slice of a shared buffer, typically containing
+ * many messages read from a file in one go. Its content is never parsed:
+ * only the fixed header is looked at. This is used by the server for
+ * relaying stored history.
+ *
+ * Use decode() to get the actual message.
+ */
+class RawMessage : public Message
+{
+public:
+	/**
+	 * @brief Construct a view to a message in the given buffer
+	 *
+	 * The buffer must contain a complete message at the given offset.
+	 */
+	RawMessage(const QByteArray &buffer, int offset);
+	RawMessage(const RawMessage &m) = delete;
+	RawMessage &operator=(const RawMessage &m) = delete;
+
+	/**
+	 * @brief Split a buffer into messages
+	 *
+	 * Messages are extracted until the end of the buffer or until an
+	 * incomplete message is encountered.
+	 *
+	 * @param buffer the buffer containing serialized messages
+	 * @param consumed if not null, the number of bytes used is stored here
+	 * @return list of views to the buffer
+	 */
+	static MessageList split(const QByteArray &buffer, int *consumed=nullptr);
+
+	/**
+	 * @brief Deserialize this message
+	 * @return Message or nullptr if data is invalid
+	 */
+	NullableMessageRef decode() const;
+
+	QByteArray serializedSlice(int *offset) const override;
+
+	QString toString() const override;
+	QString messageName() const override { return QStringLiteral("_raw"); }
+
+protected:
+	int payloadLength() const override;
+	int serializePayload(uchar *data) const override;
+	bool payloadEquals(const Message &m) const override;
+	Kwargs kwargs() const override { return Kwargs(); }
+
+private:
+	QByteArray m_buffer;
+	int m_offset;
+};
+
+}
+
+#endif
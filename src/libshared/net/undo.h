@@ -20,6 +20,7 @@
 #define DP_NET_UNDO_H
 
 #include "message.h"
+#include "messagepool.h"
 
 namespace protocol {
 
@@ -37,7 +38,7 @@ static const int UNDO_DEPTH_LIMIT = 30;
  *
  * The client sends an UndoPoint message to signal the start of an undoable sequence.
  */
-class UndoPoint : public ZeroLengthMessage<UndoPoint>
+class UndoPoint : public ZeroLengthMessage<UndoPoint>, public PooledMessage
 {
 public:
 	UndoPoint(uint8_t ctx) : ZeroLengthMessage(MSG_UNDOPOINT, ctx) {}
@@ -157,7 +157,7 @@ int skipRecordingMessage(QIODevice *file, uint8_t *msgType, uint8_t *ctxId)
 
 	char header[protocol::Message::HEADER_LEN];
 
-	if(file->read(header, protocol::Message::HEADER_LEN) != sizeof(protocol::Message::HEADER_LEN))
+	if(file->read(header, protocol::Message::HEADER_LEN) != protocol::Message::HEADER_LEN)
 		return -1;
 
 	const int payloadLen = qFromBigEndian<quint16>((uchar*)header);
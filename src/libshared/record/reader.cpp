@@ -27,13 +27,19 @@
 #include <QtEndian>
 #include <QVarLengthArray>
 #include <QFile>
+#include <QBuffer>
 #include <KCompressionDevice>
 #include <QRegularExpression>
 
+#include <cstring>
+
 namespace recording {
 
 using protocol::text::Parser;
 
+//! Size of the read-ahead buffer used when the file cannot be mapped
+static const int READAHEAD_SIZE = 1024 * 1024;
+
 struct Reader::Private {
 	Encoding encoding;
 	QString filename;
@@ -41,6 +47,21 @@ struct Reader::Private {
 
 	QByteArray msgbuf;
 
+	// How binary messages are read once the header is parsed
+	enum class Access {
+		Direct,  // read straight from the device (text mode and header)
+		Mapped,  // the whole file is available in memory
+		Buffered // read through the read-ahead buffer
+	} access;
+
+	const uchar *mapped;
+	qint64 mappedLength;
+	qint64 mappedPos;
+
+	QByteArray readahead;
+	int readaheadLen;
+	int readaheadPos;
+
 	QJsonObject metadata;
 
 	int current;
@@ -51,8 +72,144 @@ struct Reader::Private {
 	bool eof;
 	bool isCompressed;
 	bool opaque;
+
+	void setupBinaryAccess();
+	void resetBinaryAccess();
+	qint64 position() const;
+	void seek(qint64 pos);
+	bool fillReadahead();
+	bool nextMessage(MessageView &view);
 };
 
+void Reader::Private::setupBinaryAccess()
+{
+	const qint64 pos = file->pos();
+
+	if(QBuffer *buf = qobject_cast<QBuffer*>(file)) {
+		mapped = reinterpret_cast<const uchar*>(buf->data().constData());
+		mappedLength = buf->data().length();
+
+	} else if(QFile *f = qobject_cast<QFile*>(file)) {
+		if(f->size() > 0)
+			mapped = f->map(0, f->size());
+		mappedLength = f->size();
+	}
+
+	if(mapped) {
+		access = Access::Mapped;
+		mappedPos = pos;
+
+	} else {
+		access = Access::Buffered;
+		if(readahead.length() != READAHEAD_SIZE)
+			readahead.resize(READAHEAD_SIZE);
+		readaheadLen = 0;
+		readaheadPos = 0;
+	}
+}
+
+void Reader::Private::resetBinaryAccess()
+{
+	if(mapped) {
+		if(QFile *f = qobject_cast<QFile*>(file))
+			f->unmap(const_cast<uchar*>(mapped));
+		mapped = nullptr;
+	}
+	access = Access::Direct;
+	readaheadLen = 0;
+	readaheadPos = 0;
+}
+
+qint64 Reader::Private::position() const
+{
+	switch(access) {
+	case Access::Mapped: return mappedPos;
+	case Access::Buffered: return file->pos() - (readaheadLen - readaheadPos);
+	case Access::Direct: break;
+	}
+	return file->pos();
+}
+
+void Reader::Private::seek(qint64 pos)
+{
+	switch(access) {
+	case Access::Mapped:
+		mappedPos = pos;
+		break;
+	case Access::Buffered:
+		readaheadLen = 0;
+		readaheadPos = 0;
+		file->seek(pos);
+		break;
+	case Access::Direct:
+		file->seek(pos);
+		break;
+	}
+}
+
+bool Reader::Private::fillReadahead()
+{
+	// Move the partial message (if any) to the start of the buffer
+	// and fill the rest. A buffer is always big enough to hold the
+	// longest possible message.
+	const int remaining = readaheadLen - readaheadPos;
+	if(remaining > 0 && readaheadPos > 0)
+		memmove(readahead.data(), readahead.constData() + readaheadPos, remaining);
+	readaheadLen = remaining;
+	readaheadPos = 0;
+
+	bool added = false;
+	while(readaheadLen < readahead.length()) {
+		const qint64 r = file->read(readahead.data() + readaheadLen, readahead.length() - readaheadLen);
+		if(r <= 0)
+			break;
+		readaheadLen += r;
+		added = true;
+	}
+	return added;
+}
+
+bool Reader::Private::nextMessage(MessageView &view)
+{
+	const int HEADER_LEN = protocol::Message::HEADER_LEN;
+
+	if(access == Access::Mapped) {
+		if(mappedLength - mappedPos < HEADER_LEN)
+			return false;
+
+		const uchar *ptr = mapped + mappedPos;
+		const int len = protocol::Message::sniffLength(reinterpret_cast<const char*>(ptr));
+		if(mappedLength - mappedPos < len)
+			return false;
+
+		view.data = ptr;
+		view.length = len;
+		mappedPos += len;
+		return true;
+	}
+
+	Q_ASSERT(access == Access::Buffered);
+
+	int available = readaheadLen - readaheadPos;
+	if(available < HEADER_LEN || available < protocol::Message::sniffLength(readahead.constData() + readaheadPos)) {
+		if(!fillReadahead())
+			return false;
+		available = readaheadLen;
+		if(available < HEADER_LEN)
+			return false;
+	}
+
+	const uchar *ptr = reinterpret_cast<const uchar*>(readahead.constData()) + readaheadPos;
+	const int len = protocol::Message::sniffLength(reinterpret_cast<const char*>(ptr));
+	if(available < len)
+		return false;
+
+	view.data = ptr;
+	view.length = len;
+	readaheadPos += len;
+	return true;
+}
+
 bool Reader::isRecordingExtension(const QString &filename)
 {
 	QRegularExpression re("\\.dp(?:rec|txt)(?:z|\\.(?:gz|bz2|xz))?$");
@@ -69,6 +226,12 @@ Reader::Reader(const QString &filename, Encoding encoding, QObject *parent)
 	d->autoclose = true;
 	d->eof = false;
 	d->opaque = false;
+	d->access = Private::Access::Direct;
+	d->mapped = nullptr;
+	d->mappedLength = 0;
+	d->mappedPos = 0;
+	d->readaheadLen = 0;
+	d->readaheadPos = 0;
 
 	KCompressionDevice::CompressionType ct = KCompressionDevice::None;
 	if(filename.endsWith(".gz", Qt::CaseInsensitive) || filename.endsWith(".dprecz", Qt::CaseInsensitive) || filename.endsWith(".dptxtz", Qt::CaseInsensitive))
@@ -95,13 +258,22 @@ Reader::Reader(const QString &filename, QIODevice *file, bool autoclose, Encodin
 	d->filename = filename;
 	d->file = file;
 	d->current = -1;
+	d->currentPos = 0;
 	d->autoclose = autoclose;
 	d->eof = false;
 	d->isCompressed = false;
+	d->opaque = false;
+	d->access = Private::Access::Direct;
+	d->mapped = nullptr;
+	d->mappedLength = 0;
+	d->mappedPos = 0;
+	d->readaheadLen = 0;
+	d->readaheadPos = 0;
 }
 
 Reader::~Reader()
 {
+	d->resetBinaryAccess();
 	if(d->autoclose)
 		delete d->file;
 	delete d;
@@ -203,6 +375,8 @@ Compatibility Reader::openOpaque()
 
 Compatibility Reader::open(bool opaque)
 {
+	d->resetBinaryAccess();
+
 	if(!d->file->isOpen()) {
 		if(!d->file->open(QFile::ReadOnly)) {
 			return CANNOT_READ;
@@ -236,6 +410,7 @@ Compatibility Reader::readBinaryHeader() {
 
 	// Header completed!
 	d->beginning = d->file->pos();
+	d->setupBinaryAccess();
 
 	// Check version numbers
 	const auto version = formatVersion();
@@ -388,18 +563,19 @@ qint64 Reader::filesize() const
 
 qint64 Reader::filePosition() const
 {
-	return d->file->pos();
+	return d->position();
 }
 
 void Reader::close()
 {
 	Q_ASSERT(d->file->isOpen());
+	d->resetBinaryAccess();
 	d->file->close();
 }
 
 void Reader::rewind()
 {
-	d->file->seek(d->beginning);
+	d->seek(d->beginning);
 	d->current = -1;
 	d->currentPos = -1;
 	d->eof = false;
@@ -409,7 +585,7 @@ void Reader::seekTo(int pos, qint64 position)
 {
 	d->current = pos;
 	d->currentPos = position;
-	d->file->seek(position);
+	d->seek(position);
 	d->eof = false;
 }
 
@@ -444,10 +620,14 @@ bool Reader::readNextToBuffer(QByteArray &buffer)
 	d->currentPos = filePosition();
 
 	if(d->encoding == Encoding::Binary) {
-		if(!readRecordingMessage(d->file, buffer)) {
+		MessageView view;
+		if(!d->nextMessage(view)) {
 			d->eof = true;
 			return false;
 		}
+		if(buffer.length() < view.length)
+			buffer.resize(view.length);
+		memcpy(buffer.data(), view.data, view.length);
 
 	} else {
 		protocol::NullableMessageRef msg = readTextMessage(d->file, &d->eof);
@@ -463,22 +643,41 @@ bool Reader::readNextToBuffer(QByteArray &buffer)
 	return true;
 }
 
-MessageRecord Reader::readNext()
+bool Reader::readNextView(MessageView &view)
 {
 	Q_ASSERT(d->encoding != Encoding::Autodetect);
 
 	if(d->encoding == Encoding::Binary) {
+		d->currentPos = d->position();
+		if(!d->nextMessage(view)) {
+			d->eof = true;
+			return false;
+		}
+		++d->current;
+
+	} else {
 		if(!readNextToBuffer(d->msgbuf))
+			return false;
+		view.data = reinterpret_cast<const uchar*>(d->msgbuf.constData());
+		view.length = protocol::Message::sniffLength(d->msgbuf.constData());
+	}
+
+	return true;
+}
+
+MessageRecord Reader::readNext()
+{
+	Q_ASSERT(d->encoding != Encoding::Autodetect);
+
+	if(d->encoding == Encoding::Binary) {
+		MessageView view;
+		if(!readNextView(view))
 			return MessageRecord::Eor();
 
-		protocol::NullableMessageRef message;
-		message = protocol::Message::deserialize((const uchar*)d->msgbuf.constData(), d->msgbuf.length(), !d->opaque);
+		const protocol::NullableMessageRef message = view.toMessage(!d->opaque);
 
 		if(message.isNull())
-			return MessageRecord::Invalid(
-				protocol::Message::sniffLength(d->msgbuf.constData()),
-				protocol::MessageType(d->msgbuf.at(2))
-			);
+			return MessageRecord::Invalid(view.length, view.type());
 		else
 			return MessageRecord::Ok(message);
 
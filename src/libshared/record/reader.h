@@ -59,10 +59,34 @@ struct MessageRecord {
 	protocol::MessageType invalid_type;
 };
 
+/**
+ * @brief A non-owning view of a serialized message
+ *
+ * The view points directly into the reader's mapped file or read-ahead buffer
+ * and is only valid until the next read, seek or rewind call.
+ */
+struct MessageView {
+	const uchar *data;
+	int length;
+
+	//! Type of the message
+	protocol::MessageType type() const { return protocol::MessageType(data[2]); }
+
+	//! Context ID of the message
+	uint8_t contextId() const { return data[3]; }
+
+	//! Deserialize the viewed message
+	protocol::NullableMessageRef toMessage(bool decodeOpaque=true) const { return protocol::Message::deserialize(data, length, decodeOpaque); }
+};
+
 /**
  * @brief Recording file reader
  *
  * Supports both binary and text encodings.
+ *
+ * Uncompressed binary recordings are memory mapped when possible (an in-memory QBuffer
+ * is used as is), so reading a message involves no system calls or copying.
+ * Other binary recordings are read through a large read-ahead buffer.
  */
 class Reader : public QObject
 {
@@ -90,6 +114,9 @@ public:
 	 *
 	 * @param filename the original file name
 	 * @param file input file device
+	 * If the device is a QBuffer, its contents are read in place and must not
+	 * be modified while the recording is open.
+	 *
 	 * @param autoclose if true, the Reader instance will take ownership of the file device
 	 * @param parent
 	 */
@@ -180,6 +207,22 @@ public:
 	 */
 	bool readNextToBuffer(QByteArray &buffer);
 
+	/**
+	 * @brief Read the next message without copying it
+	 *
+	 * The returned view is valid until the next read, seek or rewind.
+	 * This does not allocate anything for binary recordings, so it
+	 * is the preferred way to scan messages when only the envelope
+	 * (type, context ID and length) is needed.
+	 *
+	 * If this is a text mode recording, the message is serialized
+	 * into an internal buffer.
+	 *
+	 * @param view the view to set
+	 * @return false on error or end of file
+	 */
+	bool readNextView(MessageView &view);
+
 	/**
 	 * @brief Read the next message
 	 * @return
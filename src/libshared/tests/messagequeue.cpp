@@ -1,5 +1,8 @@
 #include "../net/messagequeue.h"
 #include "../net/meta.h"
+#include "../net/meta2.h"
+#include "../net/undo.h"
+#include "../net/opaque.h"
 
 #include <QtTest/QtTest>
 #include <QTcpSocket>
@@ -80,11 +83,7 @@ private slots:
 		while((s=m_server->nextPendingConnection())) {
 			connect(s, &QTcpSocket::disconnected, s, &QTcpSocket::deleteLater);
 			connect(s, &QTcpSocket::readyRead, [s]() {
-				char buf[128];
-				qint64 readbytes;
-				while((readbytes=s->read(buf, sizeof(buf)))>0) {
-					s->write(buf, readbytes);
-				}
+				s->write(s->readAll());
 			});
 		}
 	}
@@ -171,6 +170,84 @@ private slots:
 		loopUntil(allReceived);
 	}
 
+	void testSendLanes()
+	{
+		auto mq = getMsgQueue();
+
+		QVector<MessageType> received;
+		const int expectedCount = 12;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, &received, &allReceived]() {
+			while(mq->isPending())
+				received << mq->getPending()->type();
+			if(received.size() == expectedCount)
+				allReceived = true;
+		});
+
+		// A long run of bulk data, followed by an interactive message and a command
+		const QByteArray payload(30000, 'x');
+		MessageList bulk;
+		for(int i=0;i<10;++i)
+			bulk << MessagePtr(new OpaqueMessage(MSG_PUTIMAGE, 1, reinterpret_cast<const uchar*>(payload.constData()), payload.length()));
+
+		mq->send(bulk);
+		mq->send(MessagePtr(new UndoPoint(1)));
+		mq->send(MessagePtr(new MovePointer(1, 10, 10)));
+
+		loopUntil(allReceived);
+		QCOMPARE(received.size(), expectedCount);
+
+		// The pointer movement should have overtaken some of the bulk data
+		const int pointerIndex = received.indexOf(MSG_MOVEPOINTER);
+		QVERIFY(pointerIndex >= 0);
+		QVERIFY(pointerIndex < received.lastIndexOf(MSG_PUTIMAGE));
+
+		// but the ordered messages must arrive in the order they were sent
+		received.removeAt(pointerIndex);
+		for(int i=0;i<10;++i)
+			QCOMPARE(received.at(i), MSG_PUTIMAGE);
+		QCOMPARE(received.last(), MSG_UNDOPOINT);
+	}
+
+	void benchmarkBurst_data()
+	{
+		QTest::addColumn<int>("batchSize");
+		QTest::newRow("unbatched") << 1;
+		QTest::newRow("batched") << 1024*64;
+	}
+
+	void benchmarkBurst()
+	{
+		// A burst of small messages, like what a fast brush stroke produces
+		QFETCH(int, batchSize);
+		auto mq = getMsgQueue();
+		mq->setSendBatchSize(batchSize);
+
+		const int sendCount = 1000;
+		MessageList msgs;
+		for(int i=0;i<sendCount;++i)
+			msgs << MessagePtr(new Chat(1, 0, 0, QByteArray::number(i)));
+
+		int countReceived = 0;
+		bool allReceived = false;
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, sendCount, &countReceived, &allReceived]() {
+			while(mq->isPending()) {
+				mq->getPending();
+				if(++countReceived == sendCount)
+					allReceived = true;
+			}
+		});
+
+		QBENCHMARK {
+			countReceived = 0;
+			allReceived = false;
+			mq->send(msgs);
+			loopUntil(allReceived);
+		}
+		QCOMPARE(countReceived, sendCount);
+	}
+
 	void testSendDisconnect()
 	{
 		auto s = getConnection();
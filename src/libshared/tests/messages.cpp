@@ -8,8 +8,11 @@
 #include "../net/undo.h"
 #include "../net/brushes.h"
 #include "../net/textmode.h"
+#include "../net/messagepool.h"
 
 #include <QtTest/QtTest>
+#include <QThread>
+#include <QSemaphore>
 
 using namespace protocol;
 
@@ -17,6 +20,26 @@ Q_DECLARE_METATYPE(Message*)
 
 typedef QList<uint16_t> IdList;
 
+// Allocates a message, lets the main thread free it and allocates again
+class PoolThread : public QThread {
+public:
+	QSemaphore allocated;
+	QSemaphore freed;
+	Message *message = nullptr;
+	quintptr reallocatedAddress = 0;
+
+	void run() override
+	{
+		message = new PenUp(1);
+		allocated.release();
+		freed.acquire();
+
+		Message *m = new PenUp(2);
+		reallocatedAddress = quintptr(m);
+		delete m;
+	}
+};
+
 class TestMessages: public QObject
 {
 	Q_OBJECT
@@ -106,6 +129,68 @@ private slots:
 		}
 	}
 
+	void testSerializationCache()
+	{
+		MessagePtr msg(new TrustedUsers(1, QList<uint8_t>() << 2 << 3));
+		QVERIFY(!msg->isSerializationCached());
+
+		QByteArray expected(msg->length(), 0);
+		msg->serialize(expected.data());
+
+		const QByteArray cached = msg->serialized();
+		QCOMPARE(cached, expected);
+		QVERIFY(msg->isSerializationCached());
+
+		// Subsequent calls should share the same buffer
+		QCOMPARE(msg->serialized().constData(), cached.constData());
+
+		// Modifying the message must drop the cache
+		msg->setContextId(5);
+		QVERIFY(!msg->isSerializationCached());
+		QCOMPARE(int(uchar(msg->serialized().at(3))), 5);
+
+		msg.cast<TrustedUsers>().setIds(QList<uint8_t>() << 4);
+		QVERIFY(!msg->isSerializationCached());
+		QCOMPARE(msg->serialized().length(), msg->length());
+	}
+
+	void testSerializationRetention()
+	{
+		MessagePtr msg(new TrustedUsers(1, QList<uint8_t>() << 2 << 3));
+
+		// The cache lives as long as some sender still holds the message
+		msg->retainSerialization();
+		msg->retainSerialization();
+		const QByteArray cached = msg->serialized();
+
+		msg->releaseSerialization();
+		QVERIFY(msg->isSerializationCached());
+		QCOMPARE(msg->serialized().constData(), cached.constData());
+
+		msg->releaseSerialization();
+		QVERIFY(!msg->isSerializationCached());
+	}
+
+	void testDabSerializationCache()
+	{
+		ClassicBrushDabVector dabs;
+		dabs << ClassicBrushDab { 0, 0, 256, 255, 128 };
+
+		MessagePtr msg(new DrawDabsClassic(1, 0x0101, 0, 0, 0xff000000, 1, dabs));
+		const int originalLength = msg->serialized().length();
+
+		// Appending and extending must drop the cached serialization
+		msg.cast<DrawDabsClassic>().appendDab(ClassicBrushDab { 1, 1, 256, 255, 128 });
+		QVERIFY(!msg->isSerializationCached());
+		QCOMPARE(msg->serialized().length(), originalLength + ClassicBrushDab::LENGTH);
+
+		DrawDabsClassic more(1, 0x0101, 4, 4, 0xff000000, 1, dabs);
+		QVERIFY(msg.cast<DrawDabsClassic>().extend(more));
+		QVERIFY(!msg->isSerializationCached());
+		QCOMPARE(msg->serialized().length(), msg->length());
+		QCOMPARE(msg->serialized().length(), originalLength + 2 * ClassicBrushDab::LENGTH);
+	}
+
 	void testFilteredWrapping()
 	{
 		MessagePtr original = MessagePtr(new CanvasResize(1, 2, 3, 4, 5));
@@ -128,6 +213,76 @@ private slots:
 		QVERIFY(unwrapped->equals(*original));
 	}
 
+	void testPooledAllocation()
+	{
+		const MessagePool::Stats before = MessagePool::stats();
+
+		// A freed block should be reused by the next allocation of the same size
+		{
+			char buf[Message::HEADER_LEN];
+			PenUp(5).serialize(buf);
+			NullableMessageRef msg = Message::deserialize((const uchar*)buf, sizeof(buf), true);
+			QVERIFY(!msg.isNull());
+			QCOMPARE(msg->type(), MSG_PEN_UP);
+		}
+		Message *first = new PenUp(1);
+		const quintptr firstAddress = quintptr(first);
+		delete first;
+		Message *second = new PenUp(2);
+		QCOMPARE(quintptr(second), firstAddress);
+		delete second;
+
+		// Messages of different types in the same size class share the pool
+		ClassicBrushDabVector dabs;
+		dabs << ClassicBrushDab { 1, 2, 256, 255, 128 };
+		MessagePtr dab(new DrawDabsClassic(1, 0x0101, 10, 20, 0xff000000, 1, dabs));
+		MessagePtr pointer(new MovePointer(1, 100, 200));
+		MessagePtr undo(new UndoPoint(1));
+		QCOMPARE(dab.cast<DrawDabsClassic>().dabs().size(), 1);
+		QCOMPARE(pointer.cast<MovePointer>().x(), 100);
+
+		const MessagePool::Stats after = MessagePool::stats();
+		// The dab vectors (the local one and the message's copy) are pooled as well
+		QCOMPARE(after.allocations - before.allocations, quint64(8));
+		QVERIFY(after.reused - before.reused >= 2);
+		QCOMPARE(after.frees - before.frees, quint64(3));
+	}
+
+	void testPooledAllocationAcrossThreads()
+	{
+		const MessagePool::Stats before = MessagePool::stats();
+
+		// A block freed by another thread should go back to the thread that allocated it
+		PoolThread thread;
+		thread.start();
+		thread.allocated.acquire();
+		const quintptr address = quintptr(thread.message);
+		delete thread.message;
+		thread.freed.release();
+		QVERIFY(thread.wait(10000));
+
+		QCOMPARE(thread.reallocatedAddress, address);
+		QCOMPARE(MessagePool::stats().remoteFrees - before.remoteFrees, quint64(1));
+	}
+
+	void testPooledVector()
+	{
+		PixelBrushDabVector dabs { PixelBrushDab { 1, 2, 3, 4 } };
+		for(int i=0;i<100;++i)
+			dabs << dabs.at(i);
+
+		QCOMPARE(dabs.size(), 101);
+		QCOMPARE(dabs.last().size, uint8_t(3));
+
+		const PixelBrushDabVector copy = dabs;
+		QCOMPARE(copy.length(), dabs.length());
+		QVERIFY(!(copy.first() != dabs.first()));
+
+		PixelBrushDabVector moved = std::move(dabs);
+		QCOMPARE(moved.size(), 101);
+		QVERIFY(dabs.isEmpty());
+	}
+
 	void testLayerOrderSanitation_data()
 	{
 		QTest::addColumn<IdList>("reorder");
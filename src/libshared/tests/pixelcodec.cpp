@@ -0,0 +1,122 @@
+#include "../net/pixelcodec.h"
+
+#include <QtTest/QtTest>
+#include <QRandomGenerator>
+
+using protocol::compressPixels;
+using protocol::decompressPixels;
+
+class TestPixelCodec: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testRoundtrip_data()
+	{
+		QTest::addColumn<QByteArray>("pixels");
+		QTest::addColumn<int>("bpp");
+
+		const int LEN = 64*64*4;
+		QRandomGenerator rng(1234);
+
+		QTest::newRow("blank") << QByteArray(LEN, 0) << 4;
+		QTest::newRow("solid") << QByteArray(LEN, char(0x7f)) << 4;
+
+		QByteArray gradient(LEN, 0);
+		for(int i=0;i<LEN/4;++i) {
+			gradient[i*4+0] = char(i % 64);
+			gradient[i*4+1] = char(i / 64);
+			gradient[i*4+2] = char(128);
+			gradient[i*4+3] = char(255);
+		}
+		QTest::newRow("gradient") << gradient << 4;
+
+		QByteArray sparse(LEN, 0);
+		for(int i=0;i<64;++i)
+			reinterpret_cast<quint32*>(sparse.data())[i*64+i] = 0xff000000;
+		QTest::newRow("sparse") << sparse << 4;
+
+		QByteArray noise(LEN, 0);
+		for(int i=0;i<LEN;++i)
+			noise[i] = char(rng.bounded(256));
+		QTest::newRow("noise") << noise << 4;
+
+		// Long enough to need long runs and several literal blocks
+		QByteArray mixed(300000, 0);
+		for(int i=0;i<mixed.length();i+=1000)
+			mixed[i] = char(rng.bounded(256));
+		QTest::newRow("mixed") << mixed << 4;
+
+		QTest::newRow("mask") << QByteArray(1000, char(0xff)) + noise.left(77) << 1;
+		QTest::newRow("empty") << QByteArray() << 4;
+	}
+
+	void testRoundtrip()
+	{
+		QFETCH(QByteArray, pixels);
+		QFETCH(int, bpp);
+
+		const QByteArray compressed = compressPixels(reinterpret_cast<const uchar*>(pixels.constData()), pixels.length(), bpp);
+		QCOMPARE(decompressPixels(compressed, pixels.length()), pixels);
+	}
+
+	void testLegacyData()
+	{
+		QByteArray pixels(64*64*4, char(0x33));
+		pixels[100] = 1;
+		QCOMPARE(decompressPixels(qCompress(pixels), pixels.length()), pixels);
+	}
+
+	void testUnexpectedLength_data()
+	{
+		QTest::addColumn<QByteArray>("data");
+		QTest::addColumn<int>("expectedLength");
+
+		const QByteArray pixels(64*64*4, 0);
+		const QByteArray rle = compressPixels(reinterpret_cast<const uchar*>(pixels.constData()), pixels.length(), 4);
+
+		QByteArray deflated = qCompress(pixels);
+		deflated.prepend(char(4));
+		deflated.prepend(char(0x81));
+
+		QTest::newRow("rle too long") << rle << pixels.length() / 2;
+		QTest::newRow("rle too short") << rle << pixels.length() * 2;
+		QTest::newRow("deflate too long") << deflated << pixels.length() / 2;
+		QTest::newRow("deflate too short") << deflated << pixels.length() * 2;
+		QTest::newRow("legacy too long") << qCompress(pixels) << pixels.length() / 2;
+		QTest::newRow("legacy too short") << qCompress(pixels) << pixels.length() * 2;
+		QTest::newRow("huge declared length") << QByteArray::fromHex("80047fffffff8100") << 4;
+	}
+
+	void testUnexpectedLength()
+	{
+		QFETCH(QByteArray, data);
+		QFETCH(int, expectedLength);
+		QVERIFY(decompressPixels(data, expectedLength).isEmpty());
+	}
+
+	void testInvalidData_data()
+	{
+		QTest::addColumn<QByteArray>("data");
+		QTest::addColumn<int>("expectedLength");
+
+		QTest::newRow("empty") << QByteArray() << 0;
+		QTest::newRow("unknown codec") << QByteArray::fromHex("f004000000040000") << 4;
+		QTest::newRow("bad bpp") << QByteArray::fromHex("800300000003ff00") << 3;
+		QTest::newRow("truncated header") << QByteArray::fromHex("800400") << 4;
+		QTest::newRow("wrong length") << QByteArray::fromHex("8004000000088100") << 8;
+		QTest::newRow("truncated literal") << QByteArray::fromHex("80040000000407aabb") << 4;
+		QTest::newRow("truncated long run") << QByteArray::fromHex("8004000100ffff00") << 0x100ff;
+		QTest::newRow("not a multiple of bpp") << QByteArray::fromHex("80040000000380aa") << 3;
+	}
+
+	void testInvalidData()
+	{
+		QFETCH(QByteArray, data);
+		QFETCH(int, expectedLength);
+		QVERIFY(decompressPixels(data, expectedLength).isEmpty());
+	}
+};
+
+
+QTEST_MAIN(TestPixelCodec)
+#include "pixelcodec.moc"
@@ -17,15 +17,15 @@ using namespace protocol;
 
 // Hex encoded test recording.
 // Header contains one extra key: "test": "TESTING"
-// Protocol version is "dp:4.21.2"
+// Protocol version is "dp:4.21.3"
 // Body contains one message: UserJoin(1, 0, "hello", "world")
-static const char *TEST_RECORDING = "44505245430000427b2274657374223a2254455354494e47222c2276657273696f6e223a2264703a342e32312e32222c2277726974657276657273696f6e223a22322e302e306232227d000c2001000568656c6c6f776f726c64";
+static const char *TEST_RECORDING = "44505245430000427b2274657374223a2254455354494e47222c2276657273696f6e223a2264703a342e32312e33222c2277726974657276657273696f6e223a22322e302e306232227d000c2001000568656c6c6f776f726c64";
 
 // A test recording with a version number of dp:4.10.0, containing a single NewLayer message.
 static const char *TEST_RECORDING_OLD = "44505245430000317b2276657273696f6e223a2264703a342e31302e30222c2277726974657276657273696f6e223a22322e302e306232227d00098201000100000000000000";
 
 static const char *TEST_TEXTMODE =
-	"!version=dp:4.21.2\n"
+	"!version=dp:4.21.3\n"
 	"!test=TESTING\n"
 	"1 join name=hello avatar=d29ybGQ=\n";
 
@@ -104,12 +104,12 @@ private slots:
 			QCOMPARE(reader.isCompressed(), false);
 
 			Compatibility compat = reader.open();
-			QCOMPARE(reader.formatVersion().asString(), QString("dp:4.21.2"));
+			QCOMPARE(reader.formatVersion().asString(), QString("dp:4.21.3"));
 			QCOMPARE(compat, COMPATIBLE);
 
 			QCOMPARE(int(reader.encoding()), encoding);
 
-			QCOMPARE(reader.formatVersion().asString(), QString("dp:4.21.2"));
+			QCOMPARE(reader.formatVersion().asString(), QString("dp:4.21.3"));
 			QCOMPARE(reader.metadata()["test"].toString(), QString("TESTING"));
 
 			// No message read yet
@@ -171,6 +171,70 @@ private slots:
 		QVERIFY(skipRecordingMessage(&buffer)<0);
 	}
 
+	void testMessageViews_data()
+	{
+		QTest::addColumn<QString>("filename");
+		QTest::addColumn<bool>("compressed");
+		QTest::newRow("mapped") << "test.dprec" << false;
+		QTest::newRow("buffered") << "test.dprecz" << true;
+	}
+
+	void testMessageViews()
+	{
+		QFETCH(QString, filename);
+		QFETCH(bool, compressed);
+
+		QTemporaryDir tempDir;
+		const QString path = QDir(tempDir.path()).filePath(filename);
+
+		// Enough messages to span several read-ahead buffers
+		QVector<QByteArray> expected;
+		{
+			Writer writer(path);
+			QVERIFY(writer.open());
+			writer.writeHeader(QJsonObject());
+			for(int i=0;i<5000;++i) {
+				MessagePtr msg(new UserJoin(i % 256, 0, QByteArray("user") + QByteArray::number(i), QByteArray(i % 1000, 'x')));
+				QByteArray buf(msg->length(), 0);
+				msg->serialize(buf.data());
+				expected << buf;
+				writer.writeMessage(*msg);
+			}
+		}
+
+		Reader reader(path);
+		QCOMPARE(reader.open(), COMPATIBLE);
+		QCOMPARE(reader.isCompressed(), compressed);
+
+		QVector<qint64> positions;
+		MessageView view;
+		for(const QByteArray &e : expected) {
+			positions << reader.filePosition();
+			QVERIFY(reader.readNextView(view));
+			QCOMPARE(view.type(), MSG_USER_JOIN);
+			QCOMPARE(view.contextId(), uint8_t(e.at(3)));
+			QCOMPARE(QByteArray(reinterpret_cast<const char*>(view.data), view.length), e);
+			QCOMPARE(reader.currentPosition(), positions.last());
+		}
+		QVERIFY(!reader.readNextView(view));
+		QVERIFY(reader.isEof());
+
+		// Seeking should work with both access modes
+		reader.seekTo(2999, positions.at(3000));
+		QCOMPARE(reader.filePosition(), positions.at(3000));
+		const MessageRecord mr = reader.readNext();
+		QCOMPARE(mr.status, MessageRecord::OK);
+		QCOMPARE(reader.currentIndex(), 3000);
+		QByteArray buf(mr.message->length(), 0);
+		mr.message->serialize(buf.data());
+		QCOMPARE(buf, expected.at(3000));
+
+		reader.rewind();
+		QByteArray msgbuf;
+		QVERIFY(reader.readNextToBuffer(msgbuf));
+		QCOMPARE(msgbuf.left(expected.first().length()), expected.first());
+	}
+
 	void testVersionMismatch()
 	{
 		QByteArray testRecording = QByteArray::fromHex(TEST_RECORDING_OLD);
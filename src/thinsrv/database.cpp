@@ -19,9 +19,11 @@
 
 #include "database.h"
 #include "dblog.h"
+#include "dbconnection.h"
 #include "../libshared/util/passwordhash.h"
 #include "../libshared/util/validators.h"
 #include "../libserver/serverlog.h"
+#include "../libserver/ipbanindex.h"
 
 #include <QSqlDatabase>
 #include <QSqlQuery>
@@ -34,18 +36,28 @@
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QTimer>
+#include <QMutex>
 
 namespace server {
 
 struct Database::Private {
 	QSqlDatabase db;
 	ServerLog *logger;
+
+	// In-memory copy of the ipbans table, rebuilt when the table changes
+	QMutex banMutex;
+	IpBanIndex bans;
+	bool bansValid = false;
 };
 
 static bool initDatabase(QSqlDatabase db)
 {
 	QSqlQuery q(db);
 
+	// Let the log writer and session threads write without blocking readers.
+	// (In-memory databases don't support this, but don't need it either.)
+	q.exec("PRAGMA journal_mode=WAL");
+
 	// Settings key/value table
 	if(!q.exec(
 		"CREATE TABLE IF NOT EXISTS settings (key PRIMARY KEY, value);"
@@ -102,7 +114,11 @@ Database::~Database()
 bool Database::openFile(const QString &path)
 {
 	d->db = QSqlDatabase::addDatabase("QSQLITE");
-	d->db.setDatabaseName(path);
+	if(path == QStringLiteral(":memory:"))
+		openMemoryDatabase(d->db);
+	else
+		d->db.setDatabaseName(path);
+
 	if(!d->db.open()) {
 		qCritical("Unable to open database: %s", qPrintable(path));
 		return false;
@@ -113,6 +129,9 @@ bool Database::openFile(const QString &path)
 		return false;
 	}
 
+	// Sessions may run in their own threads
+	shareConnection(d->db);
+
 	DbLog *dblog = new DbLog(d->db);
 	if(!dblog->initDb()) {
 		qWarning("Couldn't initialize database log!");
@@ -132,7 +151,7 @@ bool Database::openFile(const QString &path)
 
 void Database::setConfigValue(ConfigKey key, const QString &value)
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.prepare("INSERT OR REPLACE INTO settings VALUES (?, ?)");
 	q.bindValue(0, key.name);
 	q.bindValue(1, value);
@@ -141,7 +160,7 @@ void Database::setConfigValue(ConfigKey key, const QString &value)
 
 QString Database::getConfigValue(const ConfigKey key, bool &found) const
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.prepare("SELECT value FROM settings WHERE key=?");
 	q.bindValue(0, key.name);
 	q.exec();
@@ -165,7 +184,7 @@ bool Database::isAllowedAnnouncementUrl(const QUrl &url) const
 
 	const QString urlStr = url.toString();
 
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.exec("SELECT url FROM listingservers");
 	while(q.next()) {
 		const QString serverUrl = q.value(0).toString();
@@ -184,7 +203,7 @@ bool Database::isAllowedAnnouncementUrl(const QUrl &url) const
 QStringList Database::listServerWhitelist() const
 {
 	QStringList list;
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.exec("SELECT url FROM listingservers");
 	while(q.next()) {
 		list << q.value(0).toString();
@@ -194,7 +213,7 @@ QStringList Database::listServerWhitelist() const
 
 void Database::updateListServerWhitelist(const QStringList &whitelist)
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.exec("BEGIN TRANSACTION");
 	q.exec("DELETE FROM listingservers");
 	if(!whitelist.isEmpty()) {
@@ -211,25 +230,40 @@ void Database::updateListServerWhitelist(const QStringList &whitelist)
 
 bool Database::isAddressBanned(const QHostAddress &addr) const
 {
-	QSqlQuery q(d->db);
-	q.exec("SELECT ip, subnet FROM ipbans WHERE expires > datetime('now')");
+	QMutexLocker lock(&d->banMutex);
+
+	if(!d->bansValid) {
+		d->bans.clear();
+
+		QSqlQuery q(threadConnection(d->db));
+		q.exec("SELECT ip, subnet, expires FROM ipbans");
+
+		while(q.next()) {
+			const QHostAddress a(q.value(0).toString());
+			int subnet = q.value(1).toInt();
+			if(subnet==0) {
+				switch(a.protocol()) {
+				case QAbstractSocket::IPv4Protocol: subnet=32; break;
+				case QAbstractSocket::IPv6Protocol: subnet=128; break;
+				default: break;
+				}
+			}
 
-	while(q.next()) {
-		const QHostAddress a(q.value(0).toString());
-		int subnet = q.value(1).toInt();
-		if(subnet==0) {
-			switch(a.protocol()) {
-			case QAbstractSocket::IPv4Protocol: subnet=32; break;
-			case QAbstractSocket::IPv6Protocol: subnet=128; break;
-			default: break;
+			// Expiration times are compared to SQLite's datetime('now'), which is in UTC
+			QDateTime expires = QDateTime::fromString(q.value(2).toString(), "yyyy-MM-dd HH:mm:ss");
+			if(!expires.isValid()) {
+				qWarning("Invalid ban expiration time: %s", qPrintable(q.value(2).toString()));
+				continue;
 			}
+			expires.setTimeSpec(Qt::UTC);
+
+			d->bans.add(a, subnet, expires);
 		}
 
-		if(addr.isInSubnet(a, subnet))
-			return true;
+		d->bansValid = true;
 	}
 
-	return false;
+	return d->bans.contains(addr);
 }
 
 static QJsonObject banResultToJson(const QSqlQuery &q)
@@ -247,7 +281,7 @@ static QJsonObject banResultToJson(const QSqlQuery &q)
 QJsonArray Database::getBanlist() const
 {
 	QJsonArray result;
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.exec("SELECT rowid, ip, subnet, expires, comment, added FROM ipbans");
 
 	while(q.next()) {
@@ -258,7 +292,7 @@ QJsonArray Database::getBanlist() const
 
 QJsonObject Database::addBan(const QHostAddress &ip, int subnet, const QDateTime &expiration, const QString &comment)
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.prepare("SELECT rowid, ip, subnet, expires, comment, added FROM ipbans WHERE ip=? AND subnet=?");
 	q.bindValue(0, ip.toString());
 	q.bindValue(1, subnet);
@@ -279,6 +313,8 @@ QJsonObject Database::addBan(const QHostAddress &ip, int subnet, const QDateTime
 		q.bindValue(4, now);
 		q.exec();
 
+		invalidateBans();
+
 		QJsonObject b;
 		b["id"] = q.lastInsertId().toInt();
 		b["ip"] = ip.toString();
@@ -292,13 +328,20 @@ QJsonObject Database::addBan(const QHostAddress &ip, int subnet, const QDateTime
 
 bool Database::deleteBan(int entryId)
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.prepare("DELETE FROM ipbans WHERE rowid=?");
 	q.bindValue(0, entryId);
 	q.exec();
+	invalidateBans();
 	return q.numRowsAffected()>0;
 }
 
+void Database::invalidateBans()
+{
+	QMutexLocker lock(&d->banMutex);
+	d->bansValid = false;
+}
+
 ServerLog *Database::logger() const
 {
 	return d->logger;
@@ -306,7 +349,7 @@ ServerLog *Database::logger() const
 
 RegisteredUser Database::getUserAccount(const QString &username, const QString &password) const
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.prepare("SELECT rowid, password, locked, flags FROM users WHERE username=?");
 	q.bindValue(0, username);
 	q.exec();
@@ -367,7 +410,7 @@ static QJsonObject userQueryToJson(const QSqlQuery &q)
 QJsonArray Database::getAccountList() const
 {
 	QJsonArray list;
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.exec("SELECT rowid, username, locked, flags FROM users");
 	while(q.next()) {
 		list << userQueryToJson(q);
@@ -380,7 +423,7 @@ QJsonObject Database::addAccount(const QString &username, const QString &passwor
 	if(!validateUsername(username))
 		return QJsonObject();
 
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.prepare("INSERT INTO users (username, password, locked, flags) VALUES (?, ?, ?, ?)");
 	q.bindValue(0, username);
 	q.bindValue(1, passwordhash::hash(password));
@@ -420,7 +463,7 @@ QJsonObject Database::updateAccount(int id, const QJsonObject &update)
 		params << update["flags"].toString();
 	}
 
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 
 	if(!updates.isEmpty()) {
 		QString sql = QString("UPDATE users SET %1 WHERE rowid=?").arg(updates.join(','));
@@ -443,7 +486,7 @@ QJsonObject Database::updateAccount(int id, const QJsonObject &update)
 
 bool Database::deleteAccount(int userId)
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(threadConnection(d->db));
 	q.prepare("DELETE FROM users WHERE rowid=?");
 	q.bindValue(0, userId);
 	q.exec();
@@ -452,6 +495,9 @@ bool Database::deleteAccount(int userId)
 
 void Database::dailyTasks()
 {
+	// Pick up any changes made to the ban table outside the server
+	invalidateBans();
+
 	// Purge old Database log entries
 	DbLog *dblog = dynamic_cast<DbLog*>(d->logger);
 	if(dblog) {
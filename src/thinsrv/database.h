@@ -68,6 +68,9 @@ protected:
 	void setConfigValue(ConfigKey key, const QString &value) override;
 
 private:
+	//! Rebuild the in-memory ban index on the next check
+	void invalidateBans();
+
 	struct Private;
 	Private *d;
 };
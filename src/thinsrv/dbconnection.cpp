@@ -0,0 +1,83 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dbconnection.h"
+
+#include <QMutexLocker>
+#include <QAtomicInt>
+#include <QHash>
+#include <QThread>
+#include <QDebug>
+
+namespace server {
+
+struct Connections {
+	QMutex mutex;
+	QHash<QString, QThread*> owners;
+};
+
+static Connections CONNECTIONS;
+
+void shareConnection(const QSqlDatabase &db)
+{
+	QMutexLocker lock(&CONNECTIONS.mutex);
+	CONNECTIONS.owners[db.connectionName()] = QThread::currentThread();
+}
+
+void openMemoryDatabase(QSqlDatabase &db)
+{
+	static QAtomicInt counter;
+
+	db.setDatabaseName(QStringLiteral("file:drawpile-memory-%1?mode=memory&cache=shared").arg(counter.fetchAndAddRelaxed(1)));
+	db.setConnectOptions(QStringLiteral("QSQLITE_OPEN_URI"));
+}
+
+bool isMemoryDatabase(const QSqlDatabase &db)
+{
+	return db.databaseName().contains(QStringLiteral("mode=memory"));
+}
+
+QSqlDatabase threadConnection(const QSqlDatabase &db)
+{
+	QThread *t = QThread::currentThread();
+
+	{
+		QMutexLocker lock(&CONNECTIONS.mutex);
+		if(CONNECTIONS.owners.value(db.connectionName(), t) == t)
+			return db;
+	}
+
+	const QString name = QStringLiteral("%1-thread-%2").arg(db.connectionName()).arg(quintptr(t), 0, 16);
+
+	if(QSqlDatabase::contains(name))
+		return QSqlDatabase::database(name);
+
+	qDebug() << "Opening new database connection for thread" << t;
+	QSqlDatabase conn = QSqlDatabase::cloneDatabase(db, name);
+	if(!conn.open())
+		qWarning("Unable to open database connection %s", qPrintable(name));
+
+	t->connect(t, &QThread::finished, [name]() {
+		QSqlDatabase::removeDatabase(name);
+	});
+
+	return conn;
+}
+
+}
@@ -0,0 +1,63 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SRV_DBCONNECTION_H
+#define DP_SRV_DBCONNECTION_H
+
+#include <QSqlDatabase>
+
+namespace server {
+
+/**
+ * @brief Allow the database connection to be used from other threads
+ *
+ * A QSqlDatabase connection may only be used from the thread that opened it.
+ * After this is called, threadConnection() will open a separate connection to
+ * the same database for each other thread that needs one.
+ *
+ * Every new connection to a private in-memory database would be a new empty
+ * database, so in-memory databases must be opened with openMemoryDatabase()
+ * for this to work.
+ *
+ * This must be called from the thread that opened the connection.
+ */
+void shareConnection(const QSqlDatabase &db);
+
+/**
+ * @brief Configure the connection to use a new in-memory database
+ *
+ * The database is opened in shared cache mode with a unique name, so
+ * the per-thread connections made by threadConnection() all see the same
+ * data. It lives as long as the original connection is open.
+ */
+void openMemoryDatabase(QSqlDatabase &db);
+
+//! Is this connection configured by openMemoryDatabase()?
+bool isMemoryDatabase(const QSqlDatabase &db);
+
+/**
+ * @brief Get a connection to the database that is usable in the current thread
+ *
+ * If the connection was not shared, or this is the thread that opened it,
+ * the connection itself is returned.
+ */
+QSqlDatabase threadConnection(const QSqlDatabase &db);
+
+}
+
+#endif
@@ -18,30 +18,98 @@
 */
 
 #include "dblog.h"
+#include "dbconnection.h"
 
 #include <QSqlQuery>
 #include <QMetaEnum>
 #include <QSqlError>
+#include <QThread>
 
 namespace server {
 
+//! Write the queue out when it grows this long...
+static const int BATCH_SIZE = 256;
+
+//! ...or when the oldest entry has waited this long (milliseconds)
+static const int FLUSH_INTERVAL = 1000;
+
+//! Maximum number of queued entries. Further entries are dropped.
+static const int MAX_BACKLOG = 10000;
+
+class DbLog::Writer : public QThread
+{
+public:
+	explicit Writer(DbLog *log) : m_log(log) { }
+
+protected:
+	void run() override
+	{
+		QMutexLocker lock(&m_log->m_queueMutex);
+		while(!m_log->m_stopping) {
+			if(m_log->m_queue.size() < BATCH_SIZE)
+				m_log->m_queueCond.wait(&m_log->m_queueMutex, FLUSH_INTERVAL);
+
+			lock.unlock();
+			m_log->flush();
+			lock.relock();
+		}
+		lock.unlock();
+
+		// Write whatever was left
+		m_log->flush();
+	}
+
+private:
+	DbLog *m_log;
+};
+
 DbLog::DbLog(const QSqlDatabase &db)
-	: m_db(db)
+	: m_db(db), m_writer(nullptr), m_dropped(0), m_droppedReported(0), m_stopping(false)
+{
+}
+
+DbLog::~DbLog()
 {
+	if(m_writer) {
+		{
+			QMutexLocker lock(&m_queueMutex);
+			m_stopping = true;
+			m_queueCond.wakeAll();
+		}
+		m_writer->wait();
+		delete m_writer;
+	}
+
+	flush();
 }
 
 bool DbLog::initDb()
 {
-	QSqlQuery q(m_db);
-	return q.exec(
+	QSqlQuery q(threadConnection(m_db));
+	if(!q.exec(
 		"CREATE TABLE IF NOT EXISTS serverlog ("
 			"timestamp, level, topic, user, session, message"
 		");"
-	);
+	))
+		return false;
+
+	// Shared cache in-memory databases lock whole tables instead of using
+	// the write-ahead log, so a writer thread would only contend with the
+	// rest of the server. In that case, the entries are written by
+	// whichever thread fills up the queue.
+	if(!m_writer && !isMemoryDatabase(m_db)) {
+		m_writer = new Writer(this);
+		m_writer->start(QThread::LowPriority);
+	}
+
+	return true;
 }
 
 QList<Log> DbLog::getLogEntries(const QString &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const
 {
+	// Make sure the latest entries are included
+	flush();
+
 	QString sql = "SELECT timestamp, session, user, level, topic, message FROM serverlog WHERE 1=1";
 	QVariantList params;
 	if(!session.isEmpty()) {
@@ -69,7 +137,7 @@ QList<Log> DbLog::getLogEntries(const QString &session, const QDateTime &after,
 		params << offset;
 	}
 
-	QSqlQuery q(m_db);
+	QSqlQuery q(threadConnection(m_db));
 	q.prepare(sql);
 	for(int i=0;i<params.size();++i)
 		q.bindValue(i, params.at(i));
@@ -95,15 +163,72 @@ QList<Log> DbLog::getLogEntries(const QString &session, const QDateTime &after,
 
 void DbLog::storeMessage(const Log &entry)
 {
-	QSqlQuery q(m_db);
+	bool writeNow = false;
+	{
+		QMutexLocker lock(&m_queueMutex);
+		if(m_queue.size() >= MAX_BACKLOG) {
+			++m_dropped;
+			return;
+		}
+
+		m_queue.append(entry);
+		if(m_queue.size() >= BATCH_SIZE) {
+			if(m_writer)
+				m_queueCond.wakeOne();
+			else
+				writeNow = true;
+		}
+	}
+
+	if(writeNow)
+		flush();
+}
+
+void DbLog::flush() const
+{
+	QMutexLocker writeLock(&m_writeMutex);
+
+	QVector<Log> batch;
+	int dropped;
+	{
+		QMutexLocker lock(&m_queueMutex);
+		batch.swap(m_queue);
+		dropped = m_dropped - m_droppedReported;
+		m_droppedReported = m_dropped;
+	}
+
+	if(dropped > 0)
+		qWarning("Database log queue full: %d entries dropped", dropped);
+
+	if(batch.isEmpty())
+		return;
+
+	QSqlDatabase db = threadConnection(m_db);
+	db.transaction();
+
+	QSqlQuery q(db);
 	q.prepare("INSERT INTO serverlog (timestamp, level, topic, user, session, message) VALUES (?, ?, ?, ?, ?, ?)");
-	q.bindValue(0, entry.timestamp().toString(Qt::ISODate));
-	q.bindValue(1, int(entry.level()));
-	q.bindValue(2, QMetaEnum::fromType<Log::Topic>().valueToKey(int(entry.topic())));
-	q.bindValue(3, entry.user());
-	q.bindValue(4, entry.session());
-	q.bindValue(5, entry.message());
-	q.exec();
+
+	const QMetaEnum topics = QMetaEnum::fromType<Log::Topic>();
+	for(const Log &entry : batch) {
+		q.bindValue(0, entry.timestamp().toString(Qt::ISODate));
+		q.bindValue(1, int(entry.level()));
+		q.bindValue(2, topics.valueToKey(int(entry.topic())));
+		q.bindValue(3, entry.user());
+		q.bindValue(4, entry.session());
+		q.bindValue(5, entry.message());
+		if(!q.exec())
+			qWarning("Couldn't store log entry: %s", qPrintable(q.lastError().databaseText()));
+	}
+
+	if(!db.commit())
+		qWarning("Couldn't commit log entries: %s", qPrintable(db.lastError().databaseText()));
+}
+
+int DbLog::droppedEntries() const
+{
+	QMutexLocker lock(&m_queueMutex);
+	return m_dropped;
 }
 
 int DbLog::purgeLogs(int olderThanDays)
@@ -111,7 +236,9 @@ int DbLog::purgeLogs(int olderThanDays)
 	if(olderThanDays<=0)
 		return 0;
 
-	QSqlQuery q(m_db);
+	flush();
+
+	QSqlQuery q(threadConnection(m_db));
 	q.prepare("DELETE FROM serverlog WHERE timestamp < DATE('now', ?)");
 	q.bindValue(0, QStringLiteral("-%1 days").arg(olderThanDays));
 	if(!q.exec())
@@ -23,16 +23,42 @@
 #include "../libserver/serverlog.h"
 
 #include <QSqlDatabase>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QVector>
 
 namespace server {
 
+/**
+ * @brief A server log that stores the entries in the database
+ *
+ * Log entries are not written immediately, but queued and written
+ * in batches by a background thread. Entries still in the queue are
+ * written out before the log is queried.
+ */
 class DbLog : public ServerLog
 {
 public:
 	explicit DbLog(const QSqlDatabase &db);
+	~DbLog() override;
 
+	/**
+	 * @brief Create the log table and start the writer thread
+	 */
 	bool initDb();
 
+	/**
+	 * @brief Write all queued log entries to the database
+	 *
+	 * This is safe to call from any thread.
+	 */
+	void flush() const;
+
+	/**
+	 * @brief Get the number of entries dropped because the queue was full
+	 */
+	int droppedEntries() const;
+
 	QList<Log> getLogEntries(const QString &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const override;
 
 	/**
@@ -46,7 +72,20 @@ protected:
 	void storeMessage(const Log &entry) override;
 
 private:
+	class Writer;
+
 	QSqlDatabase m_db;
+	Writer *m_writer;
+
+	mutable QMutex m_queueMutex;
+	mutable QWaitCondition m_queueCond;
+	mutable QVector<Log> m_queue;
+	mutable int m_dropped;
+	mutable int m_droppedReported;
+	bool m_stopping;
+
+	// Held while writing a batch, so batches are written in order
+	mutable QMutex m_writeMutex;
 };
 
 }
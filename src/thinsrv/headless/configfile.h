@@ -21,10 +21,12 @@
 #define CONFIGFILE_H
 
 #include "../../libserver/serverconfig.h"
+#include "../../libserver/ipbanindex.h"
 
 #include <QDateTime>
 #include <QHostAddress>
 #include <QUrl>
+#include <QMutex>
 
 namespace server {
 
@@ -79,10 +81,11 @@ private:
 		QStringList flags;
 	};
 
-	// Cached settings:
+	// Cached settings (guarded by the mutex, since sessions may run in their own threads):
+	mutable QMutex m_mutex;
 	mutable QHash<QString, QString> m_config;
 	mutable QHash<QString, User> m_users;
-	mutable QList<QPair<QHostAddress, int>> m_banlist;
+	mutable IpBanIndex m_banlist;
 	mutable QList<QUrl> m_announcewhitelist;
 	mutable QDateTime m_lastmod;
 };
@@ -101,6 +101,10 @@ bool start() {
 	QCommandLineOption recordOption("record", "Record sessions", "path");
 	parser.addOption(recordOption);
 
+	// --session-threads <count>
+	QCommandLineOption sessionThreadsOption("session-threads", "Run sessions in a pool of worker threads (0 = use the main thread)", "count", "0");
+	parser.addOption(sessionThreadsOption);
+
 #ifndef NDEBUG
 	QCommandLineOption lagOption("random-lag", "Randomly sleep to simulate lag", "msecs", "0");
 	parser.addOption(lagOption);
@@ -233,6 +237,16 @@ bool start() {
 		}
 	}
 
+	{
+		bool ok;
+		const int threads = parser.value(sessionThreadsOption).toInt(&ok);
+		if(!ok || threads < 0) {
+			qCritical("Invalid session thread count: %s", qPrintable(parser.value(sessionThreadsOption)));
+			return false;
+		}
+		server->setSessionThreads(threads);
+	}
+
 	{
 		QString recordingPath = parser.value(recordOption);
 		if(!recordingPath.isEmpty()) {
@@ -28,6 +28,7 @@
 #include "../libserver/serverconfig.h"
 #include "../libserver/serverlog.h"
 #include "../libserver/sslserver.h"
+#include "../libserver/passwordcheck.h"
 #include "../libshared/util/whatismyip.h"
 
 #include <QTcpSocket>
@@ -51,7 +52,8 @@ MultiServer::MultiServer(ServerConfig *config, QObject *parent)
 	m_sessions = new SessionServer(config, this);
 	m_started = QDateTime::currentDateTimeUtc();
 
-	connect(m_sessions, &SessionServer::sessionCreated, this, &MultiServer::assignRecording);
+	// Sessions may live in worker threads: the recording must be set up in the session's own thread
+	connect(m_sessions, &SessionServer::sessionCreated, this, &MultiServer::assignRecording, Qt::DirectConnection);
 	connect(m_sessions, &SessionServer::sessionEnded, this, &MultiServer::tryAutoStop);
 	connect(m_sessions, &SessionServer::userCountChanged, [this](int users) {
 		printStatusUpdate();
@@ -103,6 +105,17 @@ void MultiServer::setTemplateDirectory(const QDir &dir)
 	delete old;
 }
 
+/**
+ * @brief Run sessions in a pool of worker threads
+ *
+ * This must be set before any sessions are loaded.
+ * @param threads number of threads (0 to run everything in the main thread)
+ */
+void MultiServer::setSessionThreads(int threads)
+{
+	m_sessions->setSessionThreads(threads);
+}
+
 bool MultiServer::createServer()
 {
 	if(!m_sslCertFile.isEmpty() && !m_sslKeyFile.isEmpty()) {
@@ -442,6 +455,7 @@ JsonApiResult MultiServer::statusJsonApi(JsonApiMethod method, const QStringList
 	result["sessions"] = m_sessions->sessionCount();
 	result["maxSessions"] = m_config->getConfigInt(config::SessionCountLimit);
 	result["users"] = m_sessions->totalUsers();
+	result["passwordChecks"] = PasswordCheck::queueDepth();
 	QString localhost = m_config->internalConfig().localHostname;
 	if(localhost.isEmpty())
 		localhost = WhatIsMyIp::guessLocalAddress();
@@ -49,6 +49,7 @@ public:
 	void setRecordingPath(const QString &path);
 	void setSessionDirectory(const QDir &dir);
 	void setTemplateDirectory(const QDir &dir);
+	void setSessionThreads(int threads);
 
 #ifndef NDEBUG
 	void setRandomLag(uint lag);
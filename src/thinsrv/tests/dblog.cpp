@@ -45,6 +45,55 @@ private slots:
 		QCOMPARE(logEntryCount(), 1);
 	}
 
+	void testQueuedEntries()
+	{
+		// File based database so the background writer is used
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		m_db.reset(new Database);
+		QVERIFY(m_db->openFile(dir.filePath("test.db")));
+		logger = dynamic_cast<DbLog*>(m_db->logger());
+		QVERIFY(logger);
+		logger->setSilent(true);
+
+		const QDateTime now = QDateTime::currentDateTimeUtc();
+		for(int i=0;i<1000;++i)
+			logger->logMessage(Log(now, QString(), "test", Log::Level::Info, Log::Topic::Status, QString::number(i)));
+
+		// Entries still in the queue are visible too, in order
+		const QList<Log> entries = logger->getLogEntries(QString(), QDateTime(), Log::Level::Debug, 0, 0);
+		QCOMPARE(entries.size(), 1000);
+		QCOMPARE(entries.first().message(), QStringLiteral("999"));
+		QCOMPARE(entries.last().message(), QStringLiteral("0"));
+		QCOMPARE(logger->droppedEntries(), 0);
+
+		m_db.reset();
+	}
+
+	void testInMemoryLogFromThread()
+	{
+		// Entries written by another thread must end up in the same in-memory database
+		class LogThread : public QThread {
+		public:
+			explicit LogThread(DbLog *log) : m_log(log) { }
+		protected:
+			void run() override {
+				const QDateTime now = QDateTime::currentDateTimeUtc();
+				for(int i=0;i<300;++i)
+					m_log->logMessage(Log(now, QString(), "test", Log::Level::Info, Log::Topic::Status, QString::number(i)));
+				m_log->flush();
+			}
+		private:
+			DbLog *m_log;
+		};
+
+		LogThread thread(logger);
+		thread.start();
+		QVERIFY(thread.wait(10000));
+
+		QCOMPARE(logEntryCount(), 300);
+	}
+
 private:
 	int logEntryCount()
 	{
@@ -55,39 +55,33 @@ bool printMessageFrequency(const QString &filename)
 	}
 
 	// Count message types
+	// Only the message envelopes are looked at, so the messages are not deserialized,
+	// except for the first valid message of each type, which is needed for the type name.
 	MessageCount counts[256];
-	unsigned int invalidCount = 0;
+	bool named[256] = {};
+	unsigned int unknownCount = 0;
 	unsigned int totalCount = 0;
 	unsigned int totalLength = 0;
 
-	bool notEof = true;
-	do {
-		MessageRecord mr = reader.readNext();
-		switch(mr.status) {
-		case MessageRecord::OK: {
-			MessageCount &mc = counts[int(mr.message->type())];
-			if(mc.name.isNull())
-				mc.name = mr.message->messageName();
-			mc.count++;
-			totalCount++;
-			mc.totalLength += mr.message->length();
-			totalLength += mr.message->length();
-			break;
+	MessageView view;
+	while(reader.readNextView(view)) {
+		MessageCount &mc = counts[int(view.type())];
+		if(!named[int(view.type())]) {
+			// A message that fails to deserialize doesn't tell us the name,
+			// so keep trying until one of this type can be decoded.
+			const protocol::NullableMessageRef msg = view.toMessage();
+			if(!msg.isNull()) {
+				mc.name = msg->messageName();
+				named[int(view.type())] = true;
 			}
-		case MessageRecord::INVALID: {
-			MessageCount &mc = counts[mr.invalid_type];
-			invalidCount++;
-			mc.count++;
-			totalCount++;
-			mc.totalLength += mr.invalid_len;
-			totalLength += mr.invalid_len;
-			break;
 		}
-		case MessageRecord::END_OF_RECORDING:
-			notEof = false;
-			break;
-		}
-	} while(notEof);
+		if(mc.name.isNull())
+			unknownCount++;
+		mc.count++;
+		totalCount++;
+		mc.totalLength += view.length;
+		totalLength += view.length;
+	}
 
 	// Print frequency table
 
@@ -104,7 +98,7 @@ bool printMessageFrequency(const QString &filename)
 		);
 	}
 	printf("Total count: %d\n", totalCount);
-	printf("Invalid messages: %d\n", invalidCount);
+	printf("Unknown messages: %d\n", unknownCount);
 	printf("Total length: %d (%.2f MB)\n", totalLength, totalLength/(1024.0*1024.0));
 
 	return true;